@@ -0,0 +1,94 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+// CPU sets for the router's threads
+//
+// with CURVE every message is boxed and unboxed on one of libzmq's I/O threads,
+// so a busy router spends most of its CPU there rather than in the forwarding
+// loop. the I/O threads, the forwarding loop and the ZAP workers can each be kept
+// to a set of CPUs, e.g. the I/O threads on one core per thread and the loop on
+// a core of its own, away from each other's caches. sets are written the way
+// taskset -c takes them, "0,2-3", and hold CPUs 0 to 63.
+
+typedef uint64_t CpuSet;
+
+#define CPU_SET_MAX 64
+
+// "0,2-3" into a set, false on anything else (an empty set included)
+static inline bool cpu_set_parse(const char *text, CpuSet *set)
+{
+    CpuSet parsed = 0;
+    const char *at = text;
+    while (*at) {
+        char *end = NULL;
+        long first = strtol(at, &end, 10);
+        if (end == at || first < 0 || first >= CPU_SET_MAX) return false;
+        long last = first;
+        if (*end == '-') {
+            at = end + 1;
+            last = strtol(at, &end, 10);
+            if (end == at || last < first || last >= CPU_SET_MAX) return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) parsed |= (CpuSet)1 << cpu;
+        if (*end == ',') end++;
+        else if (*end != '\0') return false;
+        at = end;
+    }
+    if (parsed == 0) return false;
+    *set = parsed;
+    return true;
+}
+
+// back into the "0,2-3" form, "-" for no set
+static inline void cpu_set_format(CpuSet set, char *out, size_t size)
+{
+    size_t used = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SET_MAX && used < size; cpu++) {
+        if (!(set & ((CpuSet)1 << cpu))) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SET_MAX && (set & ((CpuSet)1 << (last + 1)))) last++;
+        int written = last > cpu ? snprintf(out + used, size - used, "%s%d-%d", used ? "," : "", cpu, last)
+                                 : snprintf(out + used, size - used, "%s%d", used ? "," : "", cpu);
+        if (written < 0) break;
+        used += (size_t)written;
+        cpu = last;
+    }
+    if (used == 0) snprintf(out, size, "-");
+}
+
+// keeps the calling thread to set, nothing to do for an empty one
+static inline bool cpu_set_pin_thread(CpuSet set)
+{
+    if (set == 0) return true;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < CPU_SET_MAX; cpu++) {
+        if (set & ((CpuSet)1 << cpu)) CPU_SET(cpu, &cpus);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+// the CPUs libzmq's I/O threads run on. like zsys_set_io_threads it only takes
+// effect when called before the first socket is made
+static inline bool cpu_set_io_threads(CpuSet set)
+{
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    void *context = zsys_init();
+    for (int cpu = 0; cpu < CPU_SET_MAX; cpu++) {
+        if ((set & ((CpuSet)1 << cpu)) && zmq_ctx_set(context, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) != 0) return false;
+    }
+    return true;
+#else
+    // libzmq older than 4.3
+    return set == 0;
+#endif
+}
+
+#endif // AFFINITY_H_
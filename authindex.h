@@ -0,0 +1,686 @@
+#ifndef AUTHINDEX_H_
+#define AUTHINDEX_H_
+
+#include <czmq.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include "keystore.h"
+
+// authorization index
+//
+// the set of accepted public keys lives in an AuthIndex: an open addressing table
+// of 32 byte keys that is never modified once it has been published. a change to
+// the key directory builds a new table and swaps it in with a single atomic store,
+// RCU style:
+//
+// - readers announce the epoch they start in, load the pointer, look up, and
+//   announce they're done. no locks, no reference counts on the hot path.
+// - the writer swaps the pointer, bumps the epoch and parks the old table until
+//   every reader that could still be looking at it has moved on.
+//
+// auth_watcher keeps the index in sync with the directory through inotify, so a
+// new registration or a deleted .cert file takes effect as soon as the event is
+// read, without a restart.
+//
+// with a packed keystore (keystore.h) the bulk of the keys stays in the mapped
+// store file and the table only holds what was appended to its log since the last
+// import. every table keeps a reference to the store it was built against.
+// a user who registers again before the next import has a new key in the log
+// and the old one still in the store, so the table also finds its log entries
+// by name, and a store record whose name has another key there isn't valid any
+// more: the same as an overwritten .cert in a key directory.
+//
+// whatever follows the names the index authorizes (the key directory, see
+// keydirectory.h) doesn't compare tables: the watcher notes every name whose key
+// it changed or removed, and the follower takes the notes when it gets to it. an
+// event costs a note per file or log record, only a reload compares the old
+// table with the new one, on the watcher's thread.
+
+#define AUTH_KEY_SIZE     32
+#define AUTH_NAME_SIZE    64
+#define AUTH_MAX_READERS  16
+
+typedef struct {
+    uint8_t key[AUTH_KEY_SIZE];
+    char name[AUTH_NAME_SIZE];      // cert file name without .cert, usually the user
+    bool used;
+} AuthEntry;
+
+typedef struct {
+    AuthEntry *entries;
+    size_t capacity;                // power of two, at most half full
+    size_t count;
+    AuthEntry *names;               // the same entries by name, only with a store, capacity slots
+    uint64_t version;
+    Keystore *store;                // searched after the table, NULL without a keystore
+} AuthIndex;
+
+typedef struct AuthRetired {
+    AuthIndex *index;
+    uint64_t epoch;                 // safe to free once every reader is past this
+    struct AuthRetired *next;
+} AuthRetired;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t epoch;   // 0 while the reader is outside
+} AuthReader;
+
+typedef struct {
+    char name[AUTH_NAME_SIZE];
+    uint8_t key[AUTH_KEY_SIZE];
+    bool removed;                   // no longer authorized under any key
+} AuthChange;
+
+typedef struct {
+    _Atomic(AuthIndex *) current;
+    _Atomic uint64_t epoch;
+    AuthReader readers[AUTH_MAX_READERS];
+    _Atomic size_t reader_count;
+    AuthRetired *retired;           // writer side only
+    pthread_mutex_t writer_lock;    // serializes publishers, never taken by readers
+    const char *directory;
+    const char *store_path;         // packed keystore instead of the directory, or NULL
+    Keystore *store;                // writer side, what new tables are built against
+    KeystoreLog log;
+    pthread_mutex_t changes_lock;   // the watcher notes, the follower takes
+    AuthChange *changes;
+    size_t change_count;
+    size_t change_capacity;
+    _Atomic bool changed;           // there are notes to take, checked without the lock
+} AuthDomain;
+
+_Static_assert(AUTH_KEY_SIZE == KEYSTORE_KEY_SIZE, "keystore and index keys differ");
+
+static inline uint64_t auth_key_hash(const uint8_t *key)
+{
+    // curve keys are uniformly random, the first 8 bytes hash well enough
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static inline uint64_t auth_name_hash(const char *name)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 1099511628211ULL;
+    return hash;
+}
+
+static inline AuthIndex *auth_index_new(size_t expected, bool by_name)
+{
+    size_t capacity = 64;
+    while (capacity < expected * 2) capacity *= 2;
+
+    AuthIndex *index = calloc(1, sizeof(AuthIndex));
+    if (!index) return NULL;
+    index->entries = calloc(capacity, sizeof(AuthEntry));
+    index->names = by_name ? calloc(capacity, sizeof(AuthEntry)) : NULL;
+    if (!index->entries || (by_name && !index->names)) {
+        free(index->entries);
+        free(index->names);
+        free(index);
+        return NULL;
+    }
+    index->capacity = capacity;
+    return index;
+}
+
+static inline void auth_index_destroy(AuthIndex **index_p)
+{
+    AuthIndex *index = *index_p;
+    if (!index) return;
+    keystore_release(&index->store);
+    free(index->entries);
+    free(index->names);
+    free(index);
+    *index_p = NULL;
+}
+
+static inline AuthEntry *auth_index_find(const AuthIndex *index, const uint8_t *key)
+{
+    size_t mask = index->capacity - 1;
+    for (size_t i = auth_key_hash(key) & mask;; i = (i + 1) & mask) {
+        AuthEntry *entry = &index->entries[i];
+        if (!entry->used) return NULL;
+        if (memcmp(entry->key, key, AUTH_KEY_SIZE) == 0) return entry;
+    }
+}
+
+// the table's entry for name, NULL when there's none or no store to need it
+static inline const AuthEntry *auth_index_find_name(const AuthIndex *index, const char *name)
+{
+    if (!index->names) return NULL;
+    size_t mask = index->capacity - 1;
+    for (size_t i = auth_name_hash(name) & mask;; i = (i + 1) & mask) {
+        const AuthEntry *entry = &index->names[i];
+        if (!entry->used) return NULL;
+        if (strncmp(entry->name, name, AUTH_NAME_SIZE) == 0) return entry;
+    }
+}
+
+// name the key is authorized under, NULL if it isn't. a store record only
+// counts while the log has no newer key for its name
+static inline const char *auth_index_lookup(const AuthIndex *index, const uint8_t *key)
+{
+    AuthEntry *entry = auth_index_find(index, key);
+    if (entry) return entry->name;
+    const KeystoreRecord *record = keystore_find(index->store, key);
+    if (!record) return NULL;
+    const AuthEntry *newer = auth_index_find_name(index, record->name);
+    return newer && memcmp(newer->key, key, AUTH_KEY_SIZE) != 0 ? NULL : record->name;
+}
+
+static inline size_t auth_index_size(const AuthIndex *index)
+{
+    return index->count + (index->store ? index->store->count : 0);
+}
+
+// only for tables that haven't been published yet
+static inline void auth_index_put(AuthIndex *index, const uint8_t *key, const char *name)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = auth_key_hash(key) & mask;
+    while (index->entries[i].used && memcmp(index->entries[i].key, key, AUTH_KEY_SIZE) != 0) {
+        i = (i + 1) & mask;
+    }
+
+    AuthEntry *entry = &index->entries[i];
+    if (!entry->used) index->count++;
+    entry->used = true;
+    memcpy(entry->key, key, AUTH_KEY_SIZE);
+    snprintf(entry->name, sizeof(entry->name), "%s", name ? name : "");
+    if (!index->names || !entry->name[0]) return;
+
+    // a name is in the log once, the later record already replaced the earlier
+    i = auth_name_hash(entry->name) & mask;
+    while (index->names[i].used && strcmp(index->names[i].name, entry->name) != 0) i = (i + 1) & mask;
+    index->names[i] = *entry;
+}
+
+// the 40 character z85 form used in frames and .cert files
+static inline bool auth_key_decode(const char *z85, size_t len, uint8_t *key)
+{
+    char text[41];
+    if (len != 40) return false;
+    memcpy(text, z85, 40);
+    text[40] = '\0';
+    return zmq_z85_decode(key, text) != NULL;
+}
+
+static inline bool auth_index_contains_txt(const AuthIndex *index, const char *z85, size_t len)
+{
+    uint8_t key[AUTH_KEY_SIZE];
+    if (!index || !auth_key_decode(z85, len, key)) return false;
+    return auth_index_lookup(index, key) != NULL;
+}
+
+static inline void auth_domain_init(AuthDomain *domain, const char *directory, const char *store_path)
+{
+    memset(domain, 0, sizeof(*domain));
+    atomic_init(&domain->current, NULL);
+    atomic_init(&domain->epoch, 1);
+    pthread_mutex_init(&domain->writer_lock, NULL);
+    pthread_mutex_init(&domain->changes_lock, NULL);
+    atomic_init(&domain->changed, false);
+    domain->directory = directory;
+    domain->store_path = store_path;
+    if (store_path) keystore_log_init(&domain->log, store_path);
+}
+
+// once per thread that reads the index
+static inline AuthReader *auth_reader_register(AuthDomain *domain)
+{
+    size_t slot = atomic_fetch_add(&domain->reader_count, 1);
+    if (slot >= AUTH_MAX_READERS) return NULL;
+    atomic_store(&domain->readers[slot].epoch, 0);
+    return &domain->readers[slot];
+}
+
+static inline const AuthIndex *auth_read_begin(AuthDomain *domain, AuthReader *reader)
+{
+    atomic_store(&reader->epoch, atomic_load(&domain->epoch));
+    return atomic_load(&domain->current);
+}
+
+static inline void auth_read_end(AuthReader *reader)
+{
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+// one shot lookup for callers that don't need to hold on to the index
+static inline bool auth_domain_allows_txt(AuthDomain *domain, AuthReader *reader, const char *z85, size_t len)
+{
+    const AuthIndex *index = auth_read_begin(domain, reader);
+    bool allowed = auth_index_contains_txt(index, z85, len);
+    auth_read_end(reader);
+    return allowed;
+}
+
+// frees every retired table no reader can still see, writer side
+static inline void auth_domain_reclaim(AuthDomain *domain)
+{
+    uint64_t oldest = UINT64_MAX;
+    size_t readers = atomic_load(&domain->reader_count);
+    if (readers > AUTH_MAX_READERS) readers = AUTH_MAX_READERS;
+    for (size_t i = 0; i < readers; i++) {
+        uint64_t epoch = atomic_load(&domain->readers[i].epoch);
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+
+    AuthRetired **link = &domain->retired;
+    while (*link) {
+        AuthRetired *retired = *link;
+        if (retired->epoch <= oldest) {
+            *link = retired->next;
+            auth_index_destroy(&retired->index);
+            free(retired);
+        } else {
+            link = &retired->next;
+        }
+    }
+}
+
+// swap in a freshly built table, the old one is freed once readers have let go
+static inline void auth_domain_publish(AuthDomain *domain, AuthIndex *index)
+{
+    pthread_mutex_lock(&domain->writer_lock);
+
+    AuthIndex *old = atomic_load(&domain->current);
+    index->version = old ? old->version + 1 : 1;
+    atomic_store(&domain->current, index);
+    uint64_t epoch = atomic_fetch_add(&domain->epoch, 1) + 1;
+
+    if (old) {
+        AuthRetired *retired = malloc(sizeof(AuthRetired));
+        if (retired) {
+            retired->index = old;
+            retired->epoch = epoch;
+            retired->next = domain->retired;
+            domain->retired = retired;
+        }
+        // out of memory: leaking one table beats freeing it under a reader
+    }
+    auth_domain_reclaim(domain);
+
+    pthread_mutex_unlock(&domain->writer_lock);
+}
+
+static inline void auth_domain_destroy(AuthDomain *domain)
+{
+    // every reader has to be gone by now
+    AuthIndex *current = atomic_exchange(&domain->current, NULL);
+    auth_index_destroy(&current);
+    while (domain->retired) {
+        AuthRetired *retired = domain->retired;
+        domain->retired = retired->next;
+        auth_index_destroy(&retired->index);
+        free(retired);
+    }
+    keystore_release(&domain->store);
+    pthread_mutex_destroy(&domain->writer_lock);
+    free(domain->changes);
+    pthread_mutex_destroy(&domain->changes_lock);
+}
+
+// name is authorized under key from the next table on, or not at all when key is
+// NULL. writer side
+static inline void auth_domain_note(AuthDomain *domain, const char *name, const uint8_t *key)
+{
+    if (!name[0]) return;
+    pthread_mutex_lock(&domain->changes_lock);
+    if (domain->change_count == domain->change_capacity) {
+        size_t capacity = domain->change_capacity ? domain->change_capacity * 2 : 64;
+        AuthChange *changes = realloc(domain->changes, capacity * sizeof(AuthChange));
+        if (!changes) {
+            // the follower misses this one until the name changes again
+            pthread_mutex_unlock(&domain->changes_lock);
+            return;
+        }
+        domain->changes = changes;
+        domain->change_capacity = capacity;
+    }
+    AuthChange *change = &domain->changes[domain->change_count++];
+    snprintf(change->name, sizeof(change->name), "%s", name);
+    if (key) memcpy(change->key, key, AUTH_KEY_SIZE);
+    else memset(change->key, 0, AUTH_KEY_SIZE);
+    change->removed = key == NULL;
+    atomic_store(&domain->changed, true);
+    pthread_mutex_unlock(&domain->changes_lock);
+}
+
+// the notes since the last call in the order they were made, NULL when there are
+// none. the caller frees them
+static inline AuthChange *auth_domain_take_changes(AuthDomain *domain, size_t *count)
+{
+    *count = 0;
+    if (!atomic_load(&domain->changed)) return NULL;
+    pthread_mutex_lock(&domain->changes_lock);
+    AuthChange *changes = domain->changes;
+    *count = domain->change_count;
+    domain->changes = NULL;
+    domain->change_count = 0;
+    domain->change_capacity = 0;
+    atomic_store(&domain->changed, false);
+    pthread_mutex_unlock(&domain->changes_lock);
+    return changes;
+}
+
+// name -> key of everything index authorizes, a table entry beats a store record
+// of the same name. the keys point into index
+static inline zhash_t *auth_index_names(const AuthIndex *index)
+{
+    zhash_t *names = zhash_new();
+    if (!names || !index) return names;
+    for (size_t i = 0; i < index->capacity; i++) {
+        const AuthEntry *entry = &index->entries[i];
+        if (entry->used && entry->name[0]) zhash_insert(names, entry->name, (void *)entry->key);
+    }
+    for (size_t i = 0; index->store && i < index->store->count; i++) {
+        const KeystoreRecord *record = &index->store->records[i];
+        if (record->name[0]) zhash_insert(names, record->name, (void *)record->key);
+    }
+    return names;
+}
+
+// notes every name whose key differs between old and index, a reload's worth of
+// changes. old is still the published table, writer side
+static inline void auth_domain_note_diff(AuthDomain *domain, const AuthIndex *old, const AuthIndex *index)
+{
+    zhash_t *before = auth_index_names(old);
+    zhash_t *after = auth_index_names(index);
+    for (const uint8_t *key = after ? zhash_first(after) : NULL; before && key; key = zhash_next(after)) {
+        const uint8_t *had = (const uint8_t *)zhash_lookup(before, zhash_cursor(after));
+        if (!had || memcmp(had, key, AUTH_KEY_SIZE) != 0) auth_domain_note(domain, zhash_cursor(after), key);
+    }
+    for (const uint8_t *key = before ? zhash_first(before) : NULL; after && key; key = zhash_next(before)) {
+        if (!zhash_lookup(after, zhash_cursor(before))) auth_domain_note(domain, zhash_cursor(before), NULL);
+    }
+    zhash_destroy(&before);
+    zhash_destroy(&after);
+}
+
+// directory sync
+//
+// the watcher remembers which key came from which file (file name -> key), so an
+// event only costs re-reading the one file it names. a deleted file simply drops
+// out of the map and the next table is built without it.
+
+static inline bool auth_is_cert_file(const char *filename)
+{
+    size_t len = strlen(filename);
+    return len > 5 && strcmp(filename + len - 5, ".cert") == 0;
+}
+
+// reads the public key of directory/filename, false if it isn't a usable cert
+static inline bool auth_load_cert_key(const char *directory, const char *filename, uint8_t *key)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", directory, filename);
+    zcert_t *cert = zcert_load(path);
+    if (!cert) return false;
+    memcpy(key, zcert_public_key(cert), AUTH_KEY_SIZE);
+    zcert_destroy(&cert);
+    return true;
+}
+
+// builds a table from the file map, file names become the entry names
+static inline AuthIndex *auth_index_build(zhash_t *files, Keystore *store)
+{
+    AuthIndex *index = auth_index_new(zhash_size(files), store != NULL);
+    if (!index) return NULL;
+    index->store = keystore_retain(store);
+
+    for (uint8_t *key = zhash_first(files); key; key = zhash_next(files)) {
+        char name[AUTH_NAME_SIZE];
+        snprintf(name, sizeof(name), "%s", zhash_cursor(files));
+        size_t len = strlen(name);
+        if (len > 5 && strcmp(name + len - 5, ".cert") == 0) name[len - 5] = '\0';
+        auth_index_put(index, key, name);
+    }
+    return index;
+}
+
+// full scan of the directory into a fresh file map
+static inline zhash_t *auth_scan_directory(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (!dir) return NULL;
+
+    zhash_t *files = zhash_new();
+    struct dirent *ent;
+    while (files && (ent = readdir(dir)) != NULL) {
+        if (!auth_is_cert_file(ent->d_name)) continue;
+
+        uint8_t *key = malloc(AUTH_KEY_SIZE);
+        if (!key) break;
+        if (!auth_load_cert_key(directory, ent->d_name, key)) {
+            free(key);
+            continue;
+        }
+        zhash_update(files, ent->d_name, key);
+        zhash_freefn(files, ent->d_name, free);
+    }
+    closedir(dir);
+    return files;
+}
+
+// maps the store again and reads its log from the start into a fresh entry map.
+// a log an interrupted import left behind is read too, its records aren't in the
+// store yet
+static inline zhash_t *auth_load_store(AuthDomain *domain, Keystore **store_p)
+{
+    Keystore *store = keystore_open(domain->store_path);
+    if (!store) return NULL;
+    zhash_t *entries = zhash_new();
+    if (!entries) {
+        keystore_release(&store);
+        return NULL;
+    }
+
+    KeystoreLog leftover;
+    keystore_log_init(&leftover, domain->store_path);
+    keystore_log_path(domain->store_path, ".import", leftover.path, sizeof(leftover.path));
+    keystore_log_read(&leftover, entries);
+
+    keystore_log_init(&domain->log, domain->store_path);
+    keystore_log_read(&domain->log, entries);
+
+    *store_p = store;
+    return entries;
+}
+
+// startup and explicit reloads: rescan, publish, and replace the watcher's file map
+// (or with a keystore: remap the store and replace the map of logged entries).
+// the first table isn't noted, a follower starts out from the whole of it
+static inline bool auth_domain_load(AuthDomain *domain, zhash_t **files_p)
+{
+    Keystore *store = NULL;
+    zhash_t *files = domain->store_path ? auth_load_store(domain, &store)
+                                        : auth_scan_directory(domain->directory);
+    if (!files) return false;
+
+    AuthIndex *index = auth_index_build(files, store);
+    if (!index) {
+        keystore_release(&store);
+        zhash_destroy(&files);
+        return false;
+    }
+    AuthIndex *old = atomic_load(&domain->current);
+    if (old) auth_domain_note_diff(domain, old, index);
+    auth_domain_publish(domain, index);
+
+    keystore_release(&domain->store);
+    domain->store = store;
+    zhash_destroy(files_p);
+    *files_p = files;
+    return true;
+}
+
+#define AUTH_EVENT_BUFFER 4096
+
+// applies whatever inotify has queued to the file map, re-reading only the files
+// that changed, and publishes one new table for the whole batch
+static inline void auth_domain_sync(AuthDomain *domain, int inotify_fd, zhash_t *files)
+{
+    _Alignas(struct inotify_event) char buffer[AUTH_EVENT_BUFFER];
+    bool changed = false;
+
+    ssize_t len;
+    while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->len == 0 || !auth_is_cert_file(event->name)) continue;
+
+            // whatever the file held before is no longer authorized
+            zhash_delete(files, event->name);
+            changed = true;
+
+            // entries are named after the file without .cert
+            char name[AUTH_NAME_SIZE];
+            snprintf(name, sizeof(name), "%.*s", (int)strlen(event->name) - 5, event->name);
+            uint8_t *key = NULL;
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                key = malloc(AUTH_KEY_SIZE);
+                if (key && auth_load_cert_key(domain->directory, event->name, key)) {
+                    zhash_insert(files, event->name, key);
+                    zhash_freefn(files, event->name, free);
+                } else {
+                    free(key);
+                    key = NULL;
+                }
+            }
+            auth_domain_note(domain, name, key);
+        }
+    }
+
+    if (changed) {
+        AuthIndex *index = auth_index_build(files, domain->store);
+        if (index) auth_domain_publish(domain, index);
+    }
+}
+
+static inline const char *auth_base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// same for a keystore: a new store file means a full reload, a write to the log
+// only costs reading the records appended since last time
+static inline void auth_store_sync(AuthDomain *domain, int inotify_fd, zhash_t **files_p)
+{
+    _Alignas(struct inotify_event) char buffer[AUTH_EVENT_BUFFER];
+    const char *store_name = auth_base_name(domain->store_path);
+    const char *log_name = auth_base_name(domain->log.path);
+    bool reload = false;
+    bool appended = false;
+
+    ssize_t len;
+    while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->len == 0) continue;
+            if (strcmp(event->name, store_name) == 0) reload = true;
+            if (strcmp(event->name, log_name) == 0) appended = true;
+        }
+    }
+
+    if (reload) {
+        auth_domain_load(domain, files_p);
+        return;
+    }
+    // read on their own first, so they can be noted before they join the others
+    zhash_t *records = appended ? zhash_new() : NULL;
+    if (records && keystore_log_read(&domain->log, records) > 0) {
+        for (uint8_t *key = zhash_first(records); key; key = zhash_next(records)) {
+            const char *name = zhash_cursor(records);
+            auth_domain_note(domain, name, key);
+            zhash_freefn(records, name, NULL);
+            zhash_update(*files_p, name, key);
+            zhash_freefn(*files_p, name, free);
+        }
+        AuthIndex *index = auth_index_build(*files_p, domain->store);
+        if (index) auth_domain_publish(domain, index);
+    }
+    zhash_destroy(&records);
+}
+
+// actor keeping the index in sync with domain->directory, or the keystore when
+// domain->store_path is set (args: AuthDomain *)
+// commands on the pipe: "RELOAD" rescans the directory and replies "OK" or "ERROR"
+static inline void auth_watcher(zsock_t *pipe, void *args)
+{
+    AuthDomain *domain = (AuthDomain *)args;
+    zhash_t *files = NULL;
+
+    // the store and its log are replaced by rename, so it's their directory that's watched
+    char watched[KEYSTORE_PATH_MAX];
+    if (domain->store_path) {
+        const char *name = auth_base_name(domain->store_path);
+        snprintf(watched, sizeof(watched), "%.*s", (int)(name - domain->store_path), domain->store_path);
+        if (watched[0] == '\0') snprintf(watched, sizeof(watched), ".");
+    } else {
+        snprintf(watched, sizeof(watched), "%s", domain->directory);
+    }
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, watched,
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1) {
+        printf("[ERROR]: Unable to watch %s: %s\n", watched, strerror(errno));
+    }
+
+    bool loaded = auth_domain_load(domain, &files);
+    zsock_signal(pipe, loaded ? 0 : 1);
+
+    zmq_pollitem_t items[] = {
+        { zsock_resolve(pipe), 0, ZMQ_POLLIN, 0 },
+        { NULL, inotify_fd, ZMQ_POLLIN, 0 },
+    };
+    int item_count = inotify_fd == -1 ? 1 : 2;
+
+    while (true) {
+        // retired tables are retried every few ms until the readers let go
+        long timeout = domain->retired ? 5 : -1;
+        if (zmq_poll(items, item_count, timeout) == -1) break;
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            char *command = zstr_recv(pipe);
+            if (!command) break;
+            bool terminate = strcmp(command, "$TERM") == 0;
+            if (strcmp(command, "RELOAD") == 0) {
+                zstr_send(pipe, auth_domain_load(domain, &files) ? "OK" : "ERROR");
+            }
+            zstr_free(&command);
+            if (terminate) break;
+        }
+
+        if (item_count > 1 && files && (items[1].revents & ZMQ_POLLIN)) {
+            if (domain->store_path) {
+                auth_store_sync(domain, inotify_fd, &files);
+            } else {
+                auth_domain_sync(domain, inotify_fd, files);
+            }
+        }
+
+        if (domain->retired) {
+            pthread_mutex_lock(&domain->writer_lock);
+            auth_domain_reclaim(domain);
+            pthread_mutex_unlock(&domain->writer_lock);
+        }
+    }
+
+    if (inotify_fd != -1) close(inotify_fd);
+    zhash_destroy(&files);
+}
+
+#endif // AUTHINDEX_H_
@@ -0,0 +1,257 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "delivery.h"
+#include "bufferpool.h"
+
+// message batches
+//
+// a dealer sending a burst (a paste going out in parts, a bot, retransmits) puts
+// the data messages for one recipient that come up close together in a single
+// envelope instead of one message each:
+//
+//     [sender pub key][recipient][records][batch header]
+//     batch header   ['B'][count (uint32)]
+//     record         [content length (uint32)][header length (u8)][data header][content]
+//
+// so the sender key, recipient and framing are paid once per batch, and the
+// router reads, checks and forwards the batch as one message (with one CURVE box
+// each way) rather than count of them. every record is still checked on its own
+// there: duplicates and rate limited ones are taken out and the rest forwarded
+// to the recipient together, which takes the batch apart and handles each record
+// like a message of its own. acks, history and transfer traffic never go in one.
+//
+// a message for a recipient nothing went to in the last BATCH_LINGER_MS goes out
+// right away, interactive messages don't wait for anything. from then on the
+// recipient's messages are held until BATCH_LINGER_MS passed since the first one,
+// or there are BATCH_MESSAGES or BATCH_BYTES of them. a batch of one goes out as
+// a plain message.
+
+#define BATCH_HEADER        'B'
+#define BATCH_HEADER_SIZE   5
+#define BATCH_RECORD_SIZE   5                   // in front of each record's header and content
+#define BATCH_MESSAGES      DELIVERY_WINDOW     // a conversation can't have more in flight anyway
+#define BATCH_BYTES         (64 * 1024)
+#define BATCH_LINGER_MS     2
+
+static inline zframe_t *batch_header(uint32_t count)
+{
+    uint8_t header[BATCH_HEADER_SIZE];
+    header[0] = BATCH_HEADER;
+    delivery_put_u32(header + 1, count);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline bool batch_is_header(zframe_t *header)
+{
+    return header && zframe_size(header) == BATCH_HEADER_SIZE && zframe_data(header)[0] == BATCH_HEADER;
+}
+
+// records a batch header announces, 0 when it isn't one or announces too many
+static inline uint32_t batch_count(zframe_t *header)
+{
+    if (!batch_is_header(header)) return 0;
+    uint32_t count = delivery_get_u32(zframe_data(header) + 1);
+    return count <= BATCH_MESSAGES ? count : 0;
+}
+
+static inline size_t batch_record_size(size_t content_length, size_t header_length)
+{
+    return BATCH_RECORD_SIZE + header_length + content_length;
+}
+
+// writes a record at data, returns its size
+static inline size_t batch_put_record(uint8_t *data, const void *content, size_t content_length,
+                                      const void *header, size_t header_length)
+{
+    delivery_put_u32(data, (uint32_t)content_length);
+    data[4] = (uint8_t)header_length;
+    memcpy(data + BATCH_RECORD_SIZE, header, header_length);
+    memcpy(data + BATCH_RECORD_SIZE + header_length, content, content_length);
+    return batch_record_size(content_length, header_length);
+}
+
+typedef struct {
+    const uint8_t *header;
+    size_t header_length;
+    const uint8_t *content;
+    size_t content_length;
+} BatchRecord;
+
+// the record at *offset, moving it past. false at the end or on a record that
+// runs past it
+static inline bool batch_next(const uint8_t *data, size_t size, size_t *offset, BatchRecord *record)
+{
+    if (*offset > size || size - *offset < BATCH_RECORD_SIZE) return false;
+    const uint8_t *at = data + *offset;
+    size_t content_length = delivery_get_u32(at);
+    size_t header_length = at[4];
+    if (size - *offset - BATCH_RECORD_SIZE < header_length + content_length) return false;
+    record->header = at + BATCH_RECORD_SIZE;
+    record->header_length = header_length;
+    record->content = record->header + header_length;
+    record->content_length = content_length;
+    *offset += batch_record_size(content_length, header_length);
+    return true;
+}
+
+// dealer side
+
+typedef struct {
+    void *content;              // pooled buffer (see bufferpool.h), one reference
+    zframe_t *header;
+} BatchEntry;
+
+typedef struct {
+    char *peer;
+    BatchEntry entries[BATCH_MESSAGES];
+    size_t count;
+    size_t bytes;               // of the records frame the entries make
+    int64_t opened;             // zclock_mono() when the first entry came in
+    int64_t last_sent;          // zclock_mono() when anything last went to peer
+} PendingBatch;
+
+typedef struct {
+    zhash_t *pending;           // peer -> PendingBatch
+    BufferPool *buffers;        // what the records frame is built in
+    uint64_t batches;           // sent with more than one message in them
+    uint64_t batched;           // messages that went in those
+} Batcher;
+
+static inline void pending_batch_free(void *data)
+{
+    PendingBatch *batch = (PendingBatch *)data;
+    for (size_t i = 0; i < batch->count; i++) {
+        buffer_release(batch->entries[i].content);
+        zframe_destroy(&batch->entries[i].header);
+    }
+    free(batch->peer);
+    free(batch);
+}
+
+static inline Batcher *batcher_new(BufferPool *buffers)
+{
+    Batcher *self = calloc(1, sizeof(Batcher));
+    if (!self) return NULL;
+    self->pending = zhash_new();
+    if (!self->pending) {
+        free(self);
+        return NULL;
+    }
+    self->buffers = buffers;
+    return self;
+}
+
+// what's still held is dropped, the delivery window retransmits it if it matters
+static inline void batcher_destroy(Batcher **self_p)
+{
+    Batcher *self = *self_p;
+    if (!self) return;
+    zhash_destroy(&self->pending);
+    free(self);
+    *self_p = NULL;
+}
+
+static inline PendingBatch *batcher_peer(Batcher *self, const char *peer)
+{
+    PendingBatch *batch = (PendingBatch *)zhash_lookup(self->pending, peer);
+    if (batch) return batch;
+    batch = calloc(1, sizeof(PendingBatch));
+    if (!batch) return NULL;
+    batch->peer = strdup(peer);
+    if (!batch->peer) {
+        free(batch);
+        return NULL;
+    }
+    zhash_insert(self->pending, peer, batch);
+    zhash_freefn(self->pending, peer, pending_batch_free);
+    return batch;
+}
+
+// sends what batch holds, a batch of one as the message it is
+static inline void batcher_send(Batcher *self, PendingBatch *batch, DeliverySend send, void *context)
+{
+    if (batch->count == 0) return;
+    batch->last_sent = zclock_mono();
+    if (batch->count == 1) {
+        batch->count = 0;
+        batch->bytes = 0;
+        send(context, batch->peer, batch->entries[0].content, batch->entries[0].header);
+        return;
+    }
+
+    uint8_t *records = buffer_get(self->buffers, batch->bytes);
+    size_t used = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        BatchEntry *entry = &batch->entries[i];
+        if (records) {
+            used += batch_put_record(records + used, entry->content, buffer_length(entry->content),
+                                     zframe_data(entry->header), zframe_size(entry->header));
+        }
+        buffer_release(entry->content);
+        zframe_destroy(&entry->header);
+    }
+    // out of memory, they're all in the delivery window and go again from there
+    if (records) {
+        self->batches++;
+        self->batched += batch->count;
+        send(context, batch->peer, records, batch_header((uint32_t)batch->count));
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+// content (a pooled buffer) and header for peer, both taken. data messages are
+// held for a batch while peer's messages come in close together, anything else
+// is sent right away. same contract as a DeliverySend (see delivery.h)
+static inline bool batcher_add(Batcher *self, const char *peer, void *content, zframe_t *header,
+                               DeliverySend send, void *context)
+{
+    size_t record = content && delivery_is_data(header) ? batch_record_size(buffer_length(content), zframe_size(header)) : 0;
+    PendingBatch *batch = record > 0 && record <= BATCH_BYTES ? batcher_peer(self, peer) : NULL;
+    int64_t now = zclock_mono();
+    if (!batch || (batch->count == 0 && now - batch->last_sent >= BATCH_LINGER_MS)) {
+        if (batch) batch->last_sent = now;
+        return send(context, peer, content, header);
+    }
+
+    if (batch->bytes + record > BATCH_BYTES) batcher_send(self, batch, send, context);
+    if (batch->count == 0) batch->opened = now;
+    batch->entries[batch->count++] = (BatchEntry){ .content = content, .header = header };
+    batch->bytes += record;
+    if (batch->count == BATCH_MESSAGES) batcher_send(self, batch, send, context);
+    return true;
+}
+
+// sends the batches that waited BATCH_LINGER_MS, or all of them
+static inline void batcher_flush(Batcher *self, bool due_only, DeliverySend send, void *context)
+{
+    int64_t now = zclock_mono();
+    for (PendingBatch *batch = (PendingBatch *)zhash_first(self->pending); batch;
+         batch = (PendingBatch *)zhash_next(self->pending)) {
+        if (batch->count > 0 && (!due_only || now - batch->opened >= BATCH_LINGER_MS)) {
+            batcher_send(self, batch, send, context);
+        }
+    }
+}
+
+// ms until the oldest batch is due, -1 when nothing is held
+static inline int batcher_timeout(Batcher *self)
+{
+    int64_t now = zclock_mono();
+    int timeout = -1;
+    for (PendingBatch *batch = (PendingBatch *)zhash_first(self->pending); batch;
+         batch = (PendingBatch *)zhash_next(self->pending)) {
+        if (batch->count == 0) continue;
+        int64_t left = batch->opened + BATCH_LINGER_MS - now;
+        int due = left > 0 ? (int)left : 0;
+        if (timeout < 0 || due < timeout) timeout = due;
+    }
+    return timeout;
+}
+
+#endif // BATCH_H_
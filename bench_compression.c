@@ -0,0 +1,157 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "compression.h"
+
+// cc -O2 -o bench_compression bench_compression.c -lczmq -lzmq -llz4 -lcrypto
+//
+// what compressing ahead of the encryption buys on the wire and costs in CPU,
+// for the kind of text people paste at a range of sizes:
+//
+//     ./bench_compression [iterations]
+//
+// - wire is the ciphertext a message turns into, plain vs compressed first
+// - send is encrypting (plain) vs compressing and encrypting, receive is
+//   decrypting vs decrypting and decompressing, CPU time per message
+// - random text doesn't compress, it shows the cost of trying and giving up
+
+#define DEFAULT_ITERATIONS 2000
+
+static const unsigned char key[16] = "0123456789abcdef";
+static const unsigned char iv[12] = "fedcba987654";
+
+// AES-128-GCM like the dealer's, the tag after the ciphertext
+static size_t encrypt(EVP_CIPHER_CTX *ctx, const uint8_t *plaintext, size_t length, uint8_t *ciphertext)
+{
+    int len = 0, final = 0;
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv);
+    EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, (int)length);
+    EVP_EncryptFinal_ex(ctx, ciphertext + len, &final);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, ciphertext + len + final);
+    return (size_t)(len + final) + 16;
+}
+
+static size_t decrypt(EVP_CIPHER_CTX *ctx, const uint8_t *ciphertext, size_t length, uint8_t *plaintext)
+{
+    int len = 0, final = 0;
+    EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv);
+    EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, (int)length - 16);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *)(ciphertext + length - 16));
+    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &final) != 1) return 0;
+    return (size_t)(len + final);
+}
+
+static double cpu_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// length bytes of one kind of text
+static char *make_text(const char *kind, size_t length)
+{
+    static const char *words[] = {
+        "the", "router", "message", "just", "pushed", "a", "fix", "for", "queue", "can", "you", "check",
+        "build", "failing", "again", "on", "my", "machine", "works", "here", "tomorrow", "meeting", "ok",
+    };
+    static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+
+    char *text = malloc(length + 64);
+    assert(text);
+    size_t used = 0;
+    unsigned seed = 42;
+    while (used < length) {
+        seed = seed * 1103515245 + 12345;
+        if (strcmp(kind, "log") == 0) {
+            used += snprintf(text + used, 64, "2026-10-19 12:%02u:%02u %s worker-%u handled request %u in %ums\n",
+                             (seed >> 8) % 60, (seed >> 14) % 60, levels[(seed >> 4) % 6], (seed >> 20) % 8,
+                             seed % 100000, (seed >> 10) % 250);
+        } else if (strcmp(kind, "chat") == 0) {
+            used += snprintf(text + used, 64, "%s ", words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))]);
+        } else {
+            text[used++] = (char)('!' + (seed >> 16) % 94);
+        }
+    }
+    text[length] = '\0';
+    return text;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations < 1) {
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const char *kinds[] = { "log", "chat", "random" };
+    const size_t sizes[] = { 64, 256, 1024, 4096, 16 * 1024, 64 * 1024, 1024 * 1024 };
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    assert(ctx);
+
+    // the first use of the cipher pays for looking it up
+    uint8_t warmup[32];
+    encrypt(ctx, key, sizeof(key), warmup);
+
+    printf("%-7s %8s | %9s %9s %6s | %10s %10s | %10s %10s\n",
+           "text", "bytes", "wire", "wire lz4", "ratio", "send us", "send lz4", "recv us", "recv lz4");
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t length = sizes[s];
+            char *text = make_text(kinds[k], length);
+            uint8_t *ciphertext = malloc(length + COMPRESSION_HEADER_SIZE + LZ4_compressBound((int)length) + 32);
+            uint8_t *plaintext = malloc(length + COMPRESSION_HEADER_SIZE + LZ4_compressBound((int)length) + 32);
+            assert(ciphertext && plaintext);
+            // big payloads take long enough per message as it is
+            int rounds = length >= 64 * 1024 ? iterations / 16 + 1 : iterations;
+
+            // plain
+            size_t wire = 0;
+            double start = cpu_seconds();
+            for (int i = 0; i < rounds; i++) wire = encrypt(ctx, (const uint8_t *)text, length, ciphertext);
+            double send = (cpu_seconds() - start) / rounds;
+            start = cpu_seconds();
+            for (int i = 0; i < rounds; i++) decrypt(ctx, ciphertext, wire, plaintext);
+            double receive = (cpu_seconds() - start) / rounds;
+
+            // compressed first, when it's worth it
+            size_t wire_lz4 = 0;
+            uint8_t flags = 0;
+            start = cpu_seconds();
+            for (int i = 0; i < rounds; i++) {
+                size_t compressed_len = 0;
+                uint8_t *compressed = compress_message(text, length, &compressed_len);
+                flags = compressed ? DELIVERY_FLAG_COMPRESSED : 0;
+                wire_lz4 = compressed ? encrypt(ctx, compressed, compressed_len, ciphertext)
+                                      : encrypt(ctx, (const uint8_t *)text, length, ciphertext);
+                free(compressed);
+            }
+            double send_lz4 = (cpu_seconds() - start) / rounds;
+            start = cpu_seconds();
+            for (int i = 0; i < rounds; i++) {
+                size_t plaintext_len = decrypt(ctx, ciphertext, wire_lz4, plaintext);
+                if (flags & DELIVERY_FLAG_COMPRESSED) {
+                    char *original = decompress_message(plaintext, plaintext_len, length, NULL);
+                    assert(original && memcmp(original, text, length) == 0);
+                    free(original);
+                }
+            }
+            double receive_lz4 = (cpu_seconds() - start) / rounds;
+
+            printf("%-7s %8zu | %9zu %9zu %5.2fx | %10.2f %10.2f | %10.2f %10.2f\n",
+                   kinds[k], length, wire, wire_lz4, (double)wire / wire_lz4,
+                   send * 1e6, send_lz4 * 1e6, receive * 1e6, receive_lz4 * 1e6);
+            free(text);
+            free(ciphertext);
+            free(plaintext);
+        }
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// cc -o bench_failover bench_failover.c -lczmq -lzmq
+//
+// hot standby under load: starts ./router as a primary with a standby following
+// it, sends a steady stream of messages addressed to ourselves through it, and
+// kills the primary with SIGKILL halfway through.
+//
+//     ./bench_failover [msg/s] [router cert] [router key dir]
+//
+// - replication lag is the primary's own send to ack time of a batch, sampled
+//   from its admin socket while the load runs
+// - failover time is from the kill to the first message delivered again
+// - messages in flight at the kill either come back (replayed by the standby),
+//   come back twice (sent by the primary, replayed anyway) or are lost
+
+#define DEFAULT_RATE        2000
+#define DEFAULT_ROUTER_CERT "keys_client/router.cert"
+#define DEFAULT_KEY_DIR     "keys_router"
+
+#define PRIMARY_ENDPOINT    "tcp://localhost:5570"
+#define STANDBY_ENDPOINT    "tcp://localhost:5571"
+#define REPLICATION         "ipc://bench_failover_replication"
+#define PRIMARY_ADMIN       "ipc://bench_failover_primary"
+#define STANDBY_ADMIN       "ipc://bench_failover_standby"
+
+#define BEFORE_KILL_MS      3000
+#define AFTER_KILL_MS       4000
+#define LAG_SAMPLES         256
+
+static pid_t start_router(const char *bind, const char *admin, const char *stats, const char *role, const char *endpoint)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    execl("./router", "./router", "--bind", bind, "--admin", admin, "--stats", stats, role, endpoint, (char *)NULL);
+    _exit(127);
+}
+
+// one command on a router's admin socket, NULL if it didn't answer in time
+static char *admin(const char *endpoint, const char *command)
+{
+    zsock_t *req = zsock_new_req(endpoint);
+    if (!req) return NULL;
+    zsock_set_rcvtimeo(req, 500);
+    zstr_send(req, command);
+    char *reply = zstr_recv(req);
+    zsock_destroy(&req);
+    return reply;
+}
+
+static bool wait_for(const char *endpoint, const char *command, const char *expect, int timeout_ms)
+{
+    int64_t deadline = zclock_mono() + timeout_ms;
+    while (zclock_mono() < deadline) {
+        char *reply = admin(endpoint, command);
+        bool found = reply && strstr(reply, expect);
+        zstr_free(&reply);
+        if (found) return true;
+        zclock_sleep(50);
+    }
+    return false;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    int rate = argc > 1 ? atoi(argv[1]) : DEFAULT_RATE;
+    const char *router_cert_location = argc > 2 ? argv[2] : DEFAULT_ROUTER_CERT;
+    const char *key_dir = argc > 3 ? argv[3] : DEFAULT_KEY_DIR;
+    if (rate < 1) {
+        printf("Usage: %s [msg/s] [router cert] [router key dir]\n", argv[0]);
+        return 1;
+    }
+
+    zcert_t *router_cert = zcert_load(router_cert_location);
+    if (!router_cert) {
+        printf("Unable to load the router's certificate from %s\n", router_cert_location);
+        return 1;
+    }
+
+    // our own key, for both routers to index
+    zcert_t *cert = zcert_new();
+    char *cert_path = zsys_sprintf("%s/failover_bench.cert", key_dir);
+    zcert_save_public(cert, cert_path);
+
+    pid_t primary = start_router("tcp://*:5570", PRIMARY_ADMIN, "ipc://bench_failover_primary_stats", "--replication", REPLICATION);
+    if (!wait_for(PRIMARY_ADMIN, "config", "OK", 5000)) {
+        printf("primary didn't come up, is ./router built?\n");
+        kill(primary, SIGKILL);
+        return 1;
+    }
+    pid_t standby = start_router("tcp://*:5571", STANDBY_ADMIN, "ipc://bench_failover_standby_stats", "--standby", REPLICATION);
+    if (!wait_for(PRIMARY_ADMIN, "replication", "standby connected", 5000)) {
+        printf("standby didn't connect\n");
+        kill(primary, SIGKILL);
+        kill(standby, SIGKILL);
+        return 1;
+    }
+
+    zsock_t *dealer = zsock_new(ZMQ_DEALER);
+    assert(dealer);
+    zcert_apply(cert, dealer);
+    zsock_set_curve_serverkey(dealer, zcert_public_txt(router_cert));
+    zsock_set_identity(dealer, "failover_bench");
+    zsock_set_immediate(dealer, 1);
+    zsock_set_sndtimeo(dealer, 0);
+    zsock_connect(dealer, PRIMARY_ENDPOINT);
+    zsock_connect(dealer, STANDBY_ENDPOINT);
+
+    size_t capacity = (size_t)rate * (BEFORE_KILL_MS + AFTER_KILL_MS) / 1000 + 16;
+    int64_t *sent_at = calloc(capacity, sizeof(int64_t));
+    int *received = calloc(capacity, sizeof(int));
+    int64_t lag[LAG_SAMPLES];
+    size_t lag_count = 0;
+    assert(sent_at && received);
+
+    int64_t start = zclock_usecs();
+    int64_t kill_at = 0;
+    int64_t first_after_kill = 0;
+    int64_t next_sample = start;
+    size_t sent = 0, unsendable = 0, in_flight_at_kill = 0;
+    uint64_t seq = 0;
+
+    while (!zsys_interrupted) {
+        int64_t now = zclock_usecs();
+        int64_t elapsed_ms = (now - start) / 1000;
+        if (elapsed_ms > BEFORE_KILL_MS + AFTER_KILL_MS) break;
+
+        if (!kill_at && elapsed_ms >= BEFORE_KILL_MS) {
+            kill(primary, SIGKILL);
+            kill_at = zclock_usecs();
+            for (size_t i = 0; i < sent; i++) in_flight_at_kill += sent_at[i] && !received[i];
+        }
+
+        // lag samples while the primary is up
+        if (!kill_at && now >= next_sample && lag_count < LAG_SAMPLES) {
+            char *reply = admin(PRIMARY_ADMIN, "replication");
+            char *line = reply ? strstr(reply, "lag ") : NULL;
+            long long usec;
+            if (line && sscanf(line, "lag %lld", &usec) == 1) lag[lag_count++] = usec;
+            zstr_free(&reply);
+            next_sample = now + 20 * 1000;
+        }
+
+        // keep up with the rate
+        while (seq < (uint64_t)((now - start) * rate / 1000000) && seq < capacity) {
+            char content[64];
+            snprintf(content, sizeof(content), "%llu", (unsigned long long)seq);
+            zmsg_t *msg = zmsg_new();
+            zmsg_addstr(msg, zcert_public_txt(cert));
+            zmsg_addstr(msg, "failover_bench");
+            zmsg_addstr(msg, content);
+            if (zmsg_send(&msg, dealer) == 0) {
+                sent_at[seq] = zclock_usecs();
+                sent++;
+            } else {
+                // no router connected at all
+                zmsg_destroy(&msg);
+                unsendable++;
+            }
+            seq++;
+        }
+
+        zmq_pollitem_t items[] = { { zsock_resolve(dealer), 0, ZMQ_POLLIN, 0 } };
+        zmq_poll(items, 1, 1);
+        while (zsock_events(dealer) & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv(dealer);
+            if (!msg) break;
+            // [sender id][content][delivery header]
+            zmsg_first(msg);
+            char *content = zframe_strdup(zmsg_next(msg));
+            unsigned long long id = content ? strtoull(content, NULL, 10) : capacity;
+            if (id < capacity) {
+                received[id]++;
+                if (kill_at && !first_after_kill) first_after_kill = zclock_usecs();
+            }
+            free(content);
+            zmsg_destroy(&msg);
+        }
+    }
+
+    size_t delivered = 0, duplicates = 0, lost = 0;
+    for (size_t i = 0; i < seq && i < capacity; i++) {
+        if (!sent_at[i]) continue;
+        if (received[i] > 0) delivered++;
+        if (received[i] > 1) duplicates += received[i] - 1;
+        if (received[i] == 0) lost++;
+    }
+    qsort(lag, lag_count, sizeof(int64_t), compare_int64);
+
+    printf("rate:              %d msg/s, primary killed after %d ms\n", rate, BEFORE_KILL_MS);
+    if (lag_count > 0) {
+        printf("replication lag:   p50 %lld us, p99 %lld us (%zu samples)\n",
+               (long long)lag[lag_count / 2], (long long)lag[(size_t)((lag_count - 1) * 0.99)], lag_count);
+    }
+    if (first_after_kill) {
+        printf("failover:          %.1f ms until the first delivery after the kill\n", (first_after_kill - kill_at) / 1000.0);
+    } else {
+        printf("failover:          nothing delivered after the kill\n");
+    }
+    printf("in flight at kill: %zu\n", in_flight_at_kill);
+    printf("sent %zu, delivered %zu, duplicates %zu, lost %zu, not sent (no router up) %zu\n",
+           sent, delivered, duplicates, lost, unsendable);
+
+    kill(standby, SIGTERM);
+    waitpid(primary, NULL, 0);
+    waitpid(standby, NULL, 0);
+    zsock_destroy(&dealer);
+    remove(cert_path);
+    zstr_free(&cert_path);
+    zcert_destroy(&cert);
+    zcert_destroy(&router_cert);
+    free(sent_at);
+    free(received);
+    return 0;
+}
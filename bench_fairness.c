@@ -0,0 +1,166 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+// cc -o bench_fairness bench_fairness.c -lczmq
+//
+// replays the router's forwarding stage against a virtual link to compare the old
+// FIFO loop with deficit round robin. a set of light senders post small chat
+// messages at a steady pace while one heavy sender keeps a full pipe of bulk
+// messages (its sender queue's cap is what bounds its backlog in practice, see
+// SCHEDULER_SENDER_BYTES). the link
+// drains at LINK_BYTES_PER_USEC and the latency of the light senders' messages is
+// measured from arrival in the router to the end of their transmission.
+
+#define LINK_BYTES_PER_USEC 100         // ~100MB/s
+#define DURATION_USEC       (10 * 1000 * 1000)
+#define LIGHT_SENDERS       8
+#define LIGHT_SIZE          200
+#define LIGHT_PERIOD_USEC   10000
+#define HEAVY_SIZE          (64 * 1024)
+#define HEAVY_BACKLOG       32
+
+typedef struct {
+    int64_t *items;
+    size_t capacity;
+    size_t count;
+} Samples;
+
+static void samples_add(Samples *s, int64_t value)
+{
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 1024;
+        s->items = realloc(s->items, s->capacity * sizeof(*s->items));
+        assert(s->items != NULL);
+    }
+    s->items[s->count++] = value;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(Samples *s, double p)
+{
+    if (s->count == 0) return 0;
+    size_t index = (size_t)(p * (s->count - 1));
+    return s->items[index];
+}
+
+// [sender][arrival time][payload]
+static zmsg_t *make_message(const char *sender, int64_t arrival, size_t size)
+{
+    static char payload[HEAVY_SIZE];
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, sender);
+    zmsg_addmem(msg, &arrival, sizeof(arrival));
+    zmsg_addmem(msg, payload, size);
+    return msg;
+}
+
+typedef struct {
+    bool drr;
+    Scheduler *scheduler;
+    MessageRing fifo;
+    size_t heavy_queued;
+} Stage;
+
+static void stage_push(Stage *stage, const char *sender, zmsg_t *msg)
+{
+    if (stage->drr) {
+        scheduler_push(stage->scheduler, sender, msg);
+    } else {
+        ring_push(&stage->fifo, queued_message(msg));
+    }
+}
+
+static bool stage_next(Stage *stage, QueuedMessage *out)
+{
+    if (stage->drr) return scheduler_next(stage->scheduler, out);
+    if (stage->fifo.count == 0) return false;
+    *out = ring_pop(&stage->fifo);
+    return true;
+}
+
+static void run(bool drr, bool heavy, Samples *light)
+{
+    Stage stage = { .drr = drr, .scheduler = scheduler_new(SCHEDULER_QUANTUM) };
+    char names[LIGHT_SENDERS][16];
+    int64_t next_arrival[LIGHT_SENDERS];
+    for (int i = 0; i < LIGHT_SENDERS; i++) {
+        snprintf(names[i], sizeof(names[i]), "light%d", i);
+        next_arrival[i] = i * (LIGHT_PERIOD_USEC / LIGHT_SENDERS);
+    }
+
+    int64_t now = 0;
+    while (now < DURATION_USEC) {
+        int64_t earliest = DURATION_USEC;
+        for (int i = 0; i < LIGHT_SENDERS; i++) {
+            while (next_arrival[i] <= now) {
+                stage_push(&stage, names[i], make_message(names[i], next_arrival[i], LIGHT_SIZE));
+                next_arrival[i] += LIGHT_PERIOD_USEC;
+            }
+            if (next_arrival[i] < earliest) earliest = next_arrival[i];
+        }
+
+        // the heavy sender refills whatever the link has taken off its backlog
+        while (heavy && stage.heavy_queued < HEAVY_BACKLOG) {
+            stage_push(&stage, "heavy", make_message("heavy", now, HEAVY_SIZE));
+            stage.heavy_queued++;
+        }
+
+        QueuedMessage next;
+        if (!stage_next(&stage, &next)) {
+            now = earliest;
+            continue;
+        }
+
+        now += next.size / LINK_BYTES_PER_USEC;
+
+        char *sender = zmsg_popstr(next.msg);
+        zframe_t *arrival_frame = zmsg_pop(next.msg);
+        int64_t arrival;
+        memcpy(&arrival, zframe_data(arrival_frame), sizeof(arrival));
+
+        if (streq(sender, "heavy")) {
+            stage.heavy_queued--;
+        } else {
+            samples_add(light, now - arrival);
+        }
+
+        zstr_free(&sender);
+        zframe_destroy(&arrival_frame);
+        zmsg_destroy(&next.msg);
+    }
+
+    ring_free(&stage.fifo);
+    scheduler_destroy(&stage.scheduler);
+}
+
+int main(void)
+{
+    printf("%-6s %-8s %10s %10s %10s %10s\n", "mode", "heavy", "samples", "p50 (us)", "p99 (us)", "max (us)");
+
+    for (int drr = 0; drr <= 1; drr++) {
+        for (int heavy = 0; heavy <= 1; heavy++) {
+            Samples light = {0};
+            run(drr, heavy, &light);
+            qsort(light.items, light.count, sizeof(*light.items), compare_samples);
+            printf("%-6s %-8s %10zu %10ld %10ld %10ld\n",
+                   drr ? "drr" : "fifo",
+                   heavy ? "on" : "off",
+                   light.count,
+                   (long)percentile(&light, 0.50),
+                   (long)percentile(&light, 0.99),
+                   (long)percentile(&light, 1.0));
+            free(light.items);
+        }
+    }
+    return 0;
+}
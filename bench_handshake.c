@@ -0,0 +1,170 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "bundle.h"
+
+// cc -o bench_handshake bench_handshake.c -lczmq -lzmq
+//
+// connection storm against a running router: N dealers with fresh CURVE certs all
+// connect at once, the way they would after a router restart. each one sends a
+// message addressed to itself; it becomes "routable" when that message comes
+// back, which needs the handshake (ZAP included) plus one trip through the
+// forwarding loop.
+//
+//     ./bench_handshake <clients> [endpoint] [router cert] [router key dir] [bundle]
+//
+// the client certs are written into the router's key directory first so the
+// router's watcher indexes them, and removed again at the end. with a bundle
+// from key_gen (see bundle.h) the clients are its identities, mapped in one go,
+// instead of certs made up on the spot: ./key_gen 10000 first, then
+//
+//     ./bench_handshake 10000 tcp://localhost:5555 keys_client/router.cert keys_router keys/clients.bundle
+//
+// compare runs with
+// the router started as ./router --zap-workers 1 and --zap-workers 4 (or change
+// it live with the admin "workers" command).
+
+#define DEFAULT_ENDPOINT    "tcp://localhost:5555"
+#define DEFAULT_ROUTER_CERT "keys_client/router.cert"
+#define DEFAULT_KEY_DIR     "keys_router"
+#define TIMEOUT_MS          60000
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("Usage: %s <clients> [endpoint] [router cert] [router key dir] [bundle]\n", argv[0]);
+        return 1;
+    }
+
+    int clients = atoi(argv[1]);
+    const char *endpoint = argc > 2 ? argv[2] : DEFAULT_ENDPOINT;
+    const char *router_cert_location = argc > 3 ? argv[3] : DEFAULT_ROUTER_CERT;
+    const char *key_dir = argc > 4 ? argv[4] : DEFAULT_KEY_DIR;
+    Bundle *bundle = NULL;
+    if (argc > 5) {
+        bundle = bundle_open(argv[5]);
+        if (!bundle) {
+            printf("Unable to open the bundle %s\n", argv[5]);
+            return 1;
+        }
+        if ((size_t)clients > bundle->count) clients = (int)bundle->count;
+    }
+    if (clients < 1) return 1;
+
+    zsys_set_max_sockets(clients + 64);
+
+    zcert_t *router_cert = zcert_load(router_cert_location);
+    if (!router_cert) {
+        printf("Unable to load the router's certificate from %s\n", router_cert_location);
+        return 1;
+    }
+    const char *router_key = zcert_public_txt(router_cert);
+
+    zcert_t **certs = calloc(clients, sizeof(zcert_t *));
+    char **identities = calloc(clients, sizeof(char *));
+    zsock_t **dealers = calloc(clients, sizeof(zsock_t *));
+    zmq_pollitem_t *items = calloc(clients, sizeof(zmq_pollitem_t));
+    int64_t *routable = calloc(clients, sizeof(int64_t));
+    assert(certs && identities && dealers && items && routable);
+
+    // provision: the router learns about the keys through its key directory watcher
+    for (int i = 0; i < clients; i++) {
+        certs[i] = bundle ? bundle_cert(&bundle->records[i]) : zcert_new();
+        identities[i] = bundle ? strdup(bundle->records[i].name) : zsys_sprintf("storm%d", i);
+        assert(certs[i] && identities[i]);
+        char *path = zsys_sprintf("%s/storm%d.cert", key_dir, i);
+        zcert_save_public(certs[i], path);
+        zstr_free(&path);
+    }
+    printf("provisioned %d client keys in %s, waiting for the router to index them\n", clients, key_dir);
+    zclock_sleep(500);
+
+    for (int i = 0; i < clients; i++) {
+        dealers[i] = zsock_new(ZMQ_DEALER);
+        assert(dealers[i]);
+        zcert_apply(certs[i], dealers[i]);
+        zsock_set_curve_serverkey(dealers[i], router_key);
+        zsock_set_identity(dealers[i], identities[i]);
+        items[i] = (zmq_pollitem_t){ zsock_resolve(dealers[i]), 0, ZMQ_POLLIN, 0 };
+    }
+
+    // the storm: everyone connects and queues a message to themselves
+    int64_t start = zclock_usecs();
+    for (int i = 0; i < clients; i++) {
+        zsock_connect(dealers[i], "%s", endpoint);
+
+        zmsg_t *msg = zmsg_new();
+        zmsg_addstr(msg, zcert_public_txt(certs[i]));
+        zmsg_addstr(msg, identities[i]);
+        zmsg_addstr(msg, "ping");
+        zmsg_send(&msg, dealers[i]);
+    }
+    int64_t connected = zclock_usecs();
+
+    int done = 0;
+    while (done < clients && !zsys_interrupted) {
+        int64_t elapsed_ms = (zclock_usecs() - start) / 1000;
+        if (elapsed_ms > TIMEOUT_MS) break;
+
+        if (zmq_poll(items, clients, TIMEOUT_MS - elapsed_ms) <= 0) continue;
+
+        int64_t now = zclock_usecs();
+        for (int i = 0; i < clients; i++) {
+            if (!(items[i].revents & ZMQ_POLLIN)) continue;
+            zmsg_t *reply = zmsg_recv(dealers[i]);
+            zmsg_destroy(&reply);
+            if (routable[i] == 0) {
+                routable[i] = now - start;
+                done++;
+            }
+            // nothing else is coming on this one
+            items[i].events = 0;
+        }
+    }
+
+    int64_t total = 0;
+    int64_t *times = calloc(done > 0 ? done : 1, sizeof(int64_t));
+    int n = 0;
+    for (int i = 0; i < clients; i++) {
+        if (routable[i] == 0) continue;
+        times[n++] = routable[i];
+        if (routable[i] > total) total = routable[i];
+    }
+    qsort(times, n, sizeof(int64_t), compare_int64);
+
+    printf("clients:            %d (%d routable, %d timed out)\n", clients, done, clients - done);
+    printf("connect calls:      %.1f ms\n", (connected - start) / 1000.0);
+    if (n > 0) {
+        printf("all routable after: %.1f ms\n", total / 1000.0);
+        printf("handshakes/s:       %.0f\n", n / (total / 1e6));
+        printf("time to routable:   p50 %.1f ms, p99 %.1f ms\n",
+               times[n / 2] / 1000.0, times[(size_t)((n - 1) * 0.99)] / 1000.0);
+    }
+
+    for (int i = 0; i < clients; i++) {
+        zsock_destroy(&dealers[i]);
+        char *path = zsys_sprintf("%s/storm%d.cert", key_dir, i);
+        remove(path);
+        zstr_free(&path);
+        zcert_destroy(&certs[i]);
+        free(identities[i]);
+    }
+    bundle_close(&bundle);
+    zcert_destroy(&router_cert);
+    free(times);
+    free(routable);
+    free(items);
+    free(dealers);
+    free(identities);
+    free(certs);
+    return 0;
+}
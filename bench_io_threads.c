@@ -0,0 +1,232 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// cc -o bench_io_threads bench_io_threads.c -lczmq -lzmq
+//
+// encrypted throughput as the router gets more I/O threads: starts ./router with
+// --io-threads 1, 2, 4 and 8 and has a number of CURVE dealers send messages
+// addressed to themselves through it as fast as their windows allow. with
+// enough connections the CURVE boxing spreads over the router's I/O threads, and
+// msg/s should go up with them until the forwarding loop or the cores run out.
+//
+//     ./bench_io_threads [seconds per run] [connections] [content bytes] [router cert] [router key dir]
+//
+// - msg/s and MB/s are messages that made it back, each crossed the router twice
+// - cpu is the router process's user + system time over the run, 100% is one core
+// this process gets 4 I/O threads of its own so the dealers' CURVE work isn't
+// what holds the numbers back, on a small machine it still can be.
+
+#define DEFAULT_SECONDS     5
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_SIZE        1024
+#define DEFAULT_ROUTER_CERT "keys_client/router.cert"
+#define DEFAULT_KEY_DIR     "keys_router"
+#define WINDOW              64          // per connection, well under the router's HWM
+#define CLIENT_IO_THREADS   4
+
+#define BENCH_BIND          "tcp://*:5582"
+#define BENCH_ENDPOINT      "tcp://localhost:5582"
+#define BENCH_ADMIN         "ipc://bench_io_threads_admin"
+#define BENCH_STATS         "ipc://bench_io_threads_stats"
+
+static pid_t start_router(int io_threads)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%d", io_threads);
+    execl("./router", "./router", "--bind", BENCH_BIND, "--admin", BENCH_ADMIN, "--stats", BENCH_STATS,
+          "--io-threads", threads, (char *)NULL);
+    _exit(127);
+}
+
+static bool wait_for_router(int timeout_ms)
+{
+    int64_t deadline = zclock_mono() + timeout_ms;
+    while (zclock_mono() < deadline) {
+        zsock_t *req = zsock_new_req(BENCH_ADMIN);
+        char *reply = NULL;
+        if (req) {
+            zsock_set_rcvtimeo(req, 500);
+            zstr_send(req, "config");
+            reply = zstr_recv(req);
+            zsock_destroy(&req);
+        }
+        bool up = reply && strncmp(reply, "OK", 2) == 0;
+        zstr_free(&reply);
+        if (up) return true;
+        zclock_sleep(50);
+    }
+    return false;
+}
+
+// user + system seconds the process has used
+static double process_cpu(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    unsigned long utime = 0, stime = 0;
+    // the command name is in parentheses and may hold spaces, skip past it
+    int found = fscanf(file, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(file);
+    return found == 2 ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : 0;
+}
+
+typedef struct {
+    zsock_t *dealer;
+    char identity[32];
+    int in_flight;
+} Connection;
+
+static void send_to_self(Connection *connection, zcert_t *cert, const char *content)
+{
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, zcert_public_txt(cert));
+    zmsg_addstr(msg, connection->identity);
+    zmsg_addstr(msg, content);
+    if (zmsg_send(&msg, connection->dealer) != 0) {
+        zmsg_destroy(&msg);
+        return;
+    }
+    connection->in_flight++;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : DEFAULT_SECONDS;
+    int connections = argc > 2 ? atoi(argv[2]) : DEFAULT_CONNECTIONS;
+    int size = argc > 3 ? atoi(argv[3]) : DEFAULT_SIZE;
+    const char *router_cert_location = argc > 4 ? argv[4] : DEFAULT_ROUTER_CERT;
+    const char *key_dir = argc > 5 ? argv[5] : DEFAULT_KEY_DIR;
+    if (seconds < 1 || connections < 1 || size < 1) {
+        printf("Usage: %s [seconds per run] [connections] [content bytes] [router cert] [router key dir]\n", argv[0]);
+        return 1;
+    }
+
+    zsys_set_io_threads(CLIENT_IO_THREADS);
+    zsys_set_max_sockets(connections + 64);
+
+    zcert_t *router_cert = zcert_load(router_cert_location);
+    if (!router_cert) {
+        printf("Unable to load the router's certificate from %s\n", router_cert_location);
+        return 1;
+    }
+
+    // our own key, for the router to index
+    zcert_t *cert = zcert_new();
+    char *cert_path = zsys_sprintf("%s/io_threads_bench.cert", key_dir);
+    zcert_save_public(cert, cert_path);
+
+    char *content = malloc(size + 1);
+    Connection *pool = calloc(connections, sizeof(Connection));
+    zmq_pollitem_t *items = calloc(connections, sizeof(zmq_pollitem_t));
+    assert(content && pool && items);
+    memset(content, 'x', size);
+    content[size] = '\0';
+
+    const int io_threads[] = { 1, 2, 4, 8 };
+    printf("%-10s | %12s %10s | %7s\n", "io threads", "msg/s", "MB/s", "cpu");
+    for (size_t t = 0; t < sizeof(io_threads) / sizeof(io_threads[0]) && !zsys_interrupted; t++) {
+        pid_t router = start_router(io_threads[t]);
+        if (!wait_for_router(5000)) {
+            printf("router didn't come up, is ./router built?\n");
+            kill(router, SIGKILL);
+            waitpid(router, NULL, 0);
+            break;
+        }
+
+        for (int c = 0; c < connections; c++) {
+            Connection *connection = &pool[c];
+            snprintf(connection->identity, sizeof(connection->identity), "io_bench_%d", c);
+            connection->in_flight = 0;
+            connection->dealer = zsock_new(ZMQ_DEALER);
+            assert(connection->dealer);
+            zcert_apply(cert, connection->dealer);
+            zsock_set_curve_serverkey(connection->dealer, zcert_public_txt(router_cert));
+            zsock_set_identity(connection->dealer, connection->identity);
+            zsock_connect(connection->dealer, BENCH_ENDPOINT);
+            items[c] = (zmq_pollitem_t){ zsock_resolve(connection->dealer), 0, ZMQ_POLLIN, 0 };
+        }
+
+        // every connection through the handshake and our key indexed before timing starts
+        int ready = 0;
+        int64_t deadline = zclock_mono() + 10000;
+        for (int c = 0; c < connections; c++) send_to_self(&pool[c], cert, content);
+        while (ready < connections && zclock_mono() < deadline && !zsys_interrupted) {
+            if (zmq_poll(items, connections, 100) <= 0) {
+                // the first few may have gone out before the key was indexed
+                for (int c = 0; c < connections; c++) {
+                    if (pool[c].in_flight > 0) send_to_self(&pool[c], cert, content);
+                }
+                continue;
+            }
+            for (int c = 0; c < connections; c++) {
+                if (!(items[c].revents & ZMQ_POLLIN)) continue;
+                while (zsock_events(pool[c].dealer) & ZMQ_POLLIN) {
+                    zmsg_t *msg = zmsg_recv(pool[c].dealer);
+                    zmsg_destroy(&msg);
+                }
+                if (pool[c].in_flight > 0) ready++;
+                pool[c].in_flight = 0;
+            }
+        }
+
+        uint64_t received = 0;
+        double cpu = process_cpu(router);
+        int64_t start = zclock_usecs();
+        int64_t end = start + (int64_t)seconds * 1000000;
+        if (ready < connections) {
+            printf("%-10d only %d of %d connections got through\n", io_threads[t], ready, connections);
+            end = start;
+        }
+        while (zclock_usecs() < end && !zsys_interrupted) {
+            for (int c = 0; c < connections; c++) {
+                for (int n = pool[c].in_flight; n < WINDOW; n++) send_to_self(&pool[c], cert, content);
+            }
+            if (zmq_poll(items, connections, 10) <= 0) continue;
+            for (int c = 0; c < connections; c++) {
+                if (!(items[c].revents & ZMQ_POLLIN)) continue;
+                while (zsock_events(pool[c].dealer) & ZMQ_POLLIN) {
+                    zmsg_t *msg = zmsg_recv(pool[c].dealer);
+                    if (!msg) break;
+                    zmsg_destroy(&msg);
+                    pool[c].in_flight--;
+                    received++;
+                }
+            }
+        }
+        double elapsed = (zclock_usecs() - start) / 1e6;
+        double used = process_cpu(router) - cpu;
+        if (ready == connections && elapsed > 0) {
+            printf("%-10d | %12.0f %10.1f | %6.1f%%\n", io_threads[t], received / elapsed,
+                   received * (double)size / elapsed / 1e6, 100.0 * used / elapsed);
+        }
+
+        for (int c = 0; c < connections; c++) zsock_destroy(&pool[c].dealer);
+        kill(router, SIGTERM);
+        waitpid(router, NULL, 0);
+    }
+
+    remove(cert_path);
+    zstr_free(&cert_path);
+    zcert_destroy(&cert);
+    zcert_destroy(&router_cert);
+    free(content);
+    free(pool);
+    free(items);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "metrics.h"
+
+// cc -o bench_metrics bench_metrics.c -lczmq
+//
+// instrumentation overhead of metrics.h on the router's forwarding stage. the same
+// queue-and-forward work the router does per message (build the forwarded message,
+// push it to its sender queue, pull it out again) runs with and without recording,
+// and the difference is reported as nanoseconds per message. the socket I/O and
+// CURVE work a real router does per message is left out here, so the overhead is
+// compared against the router's real forwarding rate instead:
+//
+//     ./bench_metrics [router msg/s]       (defaults to DEFAULT_FORWARDING_RATE)
+
+#define MESSAGES (2 * 1000 * 1000)
+#define SENDERS  64
+#define BATCH    64
+#define ROUNDS   5
+
+// single router, CURVE on, one default I/O thread
+#define DEFAULT_FORWARDING_RATE 200000.0
+
+static double run(bool instrumented)
+{
+    Scheduler *scheduler = scheduler_new(SCHEDULER_QUANTUM);
+    char senders[SENDERS][16];
+    for (int i = 0; i < SENDERS; i++) snprintf(senders[i], sizeof(senders[i]), "user%d", i);
+
+    char payload[200] = {0};
+    int64_t start = zclock_usecs();
+
+    // same shape as the router loop: drain a batch into the queues, then forward it
+    for (int i = 0; i < MESSAGES; i += BATCH) {
+        for (int j = 0; j < BATCH; j++) {
+            const char *sender = senders[(i + j) % SENDERS];
+
+            zmsg_t *msg = zmsg_new();
+            zmsg_addstr(msg, "recipient");
+            zmsg_addstr(msg, sender);
+            zmsg_addmem(msg, payload, sizeof(payload));
+
+            if (instrumented) {
+                size_t size = zmsg_content_size(msg);
+                metrics_count(thread_metrics, COUNTER_MESSAGES_IN, 1);
+                metrics_count(thread_metrics, COUNTER_BYTES_IN, size);
+                metrics_message_size(thread_metrics, size);
+            }
+            scheduler_push(scheduler, sender, msg);
+        }
+
+        QueuedMessage next;
+        int64_t now = instrumented ? zclock_usecs() : 0;
+        while (scheduler_next(scheduler, &next)) {
+            if (instrumented) {
+                metrics_dwell(thread_metrics, now - next.enqueued);
+                metrics_count(thread_metrics, COUNTER_MESSAGES_OUT, 1);
+                metrics_count(thread_metrics, COUNTER_BYTES_OUT, next.size);
+            }
+            zmsg_destroy(&next.msg);
+        }
+    }
+
+    int64_t elapsed = zclock_usecs() - start;
+    scheduler_destroy(&scheduler);
+    return (double)MESSAGES / ((double)elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    double forwarding_rate = argc > 1 ? atof(argv[1]) : DEFAULT_FORWARDING_RATE;
+
+    metrics_register("bench");
+
+    // best of a few rounds each to keep scheduling noise out
+    double plain = 0, instrumented = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        double rate = run(false);
+        if (rate > plain) plain = rate;
+        rate = run(true);
+        if (rate > instrumented) instrumented = rate;
+    }
+
+    double cost_ns = (1e9 / instrumented) - (1e9 / plain);
+    double budget_ns = 0.01 * (1e9 / forwarding_rate);
+
+    printf("queue stage uninstrumented: %.0f msg/s\n", plain);
+    printf("queue stage instrumented:   %.0f msg/s\n", instrumented);
+    printf("instrumentation cost:       %.1f ns/msg\n", cost_ns);
+    printf("1%% budget at %.0f msg/s: %.1f ns/msg (%s)\n", forwarding_rate, budget_ns,
+           cost_ns <= budget_ns ? "ok" : "over budget");
+
+    char *text = metrics_render();
+    printf("\n%s", text);
+    free(text);
+    return 0;
+}
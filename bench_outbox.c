@@ -0,0 +1,155 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "outbox.h"
+
+// cc -o bench_outbox bench_outbox.c -lczmq -lzmq
+//
+// holds messages for a recipient at its HWM and flushes them again, in process
+// and without the router: a ROUTER set up like the router's socket (mandatory,
+// send timeout 0) sends through outbox_send to a DEALER that reads nothing until
+// every message was handed over, so most of them hit EAGAIN and are held.
+//
+//     ./bench_outbox [messages] [content bytes]
+//
+// - every held message must still be [recipient][seq][content], a send the
+//   socket refused mustn't have cost it a frame
+// - every message must then arrive whole and in order while the outbox flushes
+// prints how many were held and how long the flush took, exits 1 when a check
+// failed.
+
+#define DEFAULT_MESSAGES    100000
+#define DEFAULT_SIZE        256
+#define HWM                 100         // small, so the recipient's pipe fills early
+#define FLUSH_TIMEOUT_MS    10000
+
+#define BENCH_ENDPOINT      "inproc://bench_outbox"
+#define RECIPIENT           "outbox_bench_recipient"
+
+// [recipient][seq][content]
+static zmsg_t *numbered(uint64_t seq, const char *content)
+{
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, RECIPIENT);
+    zmsg_addmem(msg, &seq, sizeof(seq));
+    zmsg_addstr(msg, content);
+    return msg;
+}
+
+// every held message still has its recipient and both other frames
+static bool held_intact(Outbox *outbox, size_t size)
+{
+    HeldQueue *queue = (HeldQueue *)zhash_lookup(outbox->queues, RECIPIENT);
+    if (!queue) return outbox->held == 0;
+    uint64_t expected = 0;
+    bool first = true;
+    for (zmsg_t *msg = (zmsg_t *)zlist_first(queue->held); msg; msg = (zmsg_t *)zlist_next(queue->held)) {
+        zframe_t *to = zmsg_first(msg);
+        zframe_t *seq = zmsg_next(msg);
+        zframe_t *content = zmsg_next(msg);
+        if (zmsg_size(msg) != 3 || !zframe_streq(to, RECIPIENT) || zframe_size(seq) != sizeof(uint64_t) ||
+            zframe_size(content) != size) {
+            return false;
+        }
+        uint64_t number;
+        memcpy(&number, zframe_data(seq), sizeof(number));
+        if (!first && number != expected) return false;
+        expected = number + 1;
+        first = false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long messages = argc > 1 ? atol(argv[1]) : DEFAULT_MESSAGES;
+    int size = argc > 2 ? atoi(argv[2]) : DEFAULT_SIZE;
+    if (messages < 1 || size < 1) {
+        printf("Usage: %s [messages] [content bytes]\n", argv[0]);
+        return 1;
+    }
+
+    char *content = malloc(size + 1);
+    assert(content);
+    memset(content, 'x', size);
+    content[size] = '\0';
+
+    zsock_t *router = zsock_new(ZMQ_ROUTER);
+    assert(router);
+    zsock_set_router_mandatory(router, 1);
+    zsock_set_sndtimeo(router, 0);
+    zsock_set_sndhwm(router, HWM);
+    int rc = zsock_bind(router, BENCH_ENDPOINT);
+    assert(rc == 0);
+
+    zsock_t *recipient = zsock_new(ZMQ_DEALER);
+    assert(recipient);
+    zsock_set_rcvhwm(recipient, HWM);
+    zsock_set_identity(recipient, RECIPIENT);
+    zsock_connect(recipient, BENCH_ENDPOINT);
+    // the router only knows the recipient's identity once it heard from it
+    zstr_send(recipient, "hello");
+    zmsg_t *hello = zmsg_recv(router);
+    zmsg_destroy(&hello);
+
+    // limits high enough that the policy never drops one
+    Outbox *outbox = outbox_new((size_t)messages, SIZE_MAX, SLOW_DROP_OLDEST, NULL, NULL);
+    assert(outbox);
+
+    bool ok = true;
+    size_t sent = 0;
+    for (long i = 0; i < messages && ok; i++) {
+        zmsg_t *msg = numbered((uint64_t)i, content);
+        OutboxResult result = outbox_send(outbox, zsock_resolve(router), &msg);
+        if (result == OUTBOX_SENT) sent++;
+        if (result != OUTBOX_SENT && result != OUTBOX_HELD) {
+            printf("message %ld came back as %d instead of sent or held\n", i, (int)result);
+            zmsg_destroy(&msg);
+            ok = false;
+        }
+    }
+    size_t held_peak = outbox->held;
+    printf("%ld messages of %d bytes, %zu went straight out, %zu held\n", messages, size, sent, held_peak);
+    if (ok && held_peak == 0) printf("nothing was held, the recipient's HWM was never hit\n");
+
+    bool intact = held_intact(outbox, (size_t)size);
+    printf("held messages kept their recipient frame: %s\n", intact ? "ok" : "BROKEN");
+    ok = ok && intact && held_peak > 0;
+
+    // now the recipient reads, and the outbox flushes whatever its pipe takes
+    uint64_t expected = 0;
+    int64_t start = zclock_usecs();
+    int64_t deadline = zclock_mono() + FLUSH_TIMEOUT_MS;
+    zsock_set_rcvtimeo(recipient, 0);
+    while (ok && expected < (uint64_t)messages && zclock_mono() < deadline) {
+        size_t flushed = 0, bytes = 0;
+        outbox_flush(outbox, zsock_resolve(router), &flushed, &bytes);
+        zmsg_t *msg;
+        while ((msg = zmsg_recv(recipient))) {
+            zframe_t *seq = zmsg_first(msg);
+            uint64_t number = 0;
+            if (seq && zframe_size(seq) == sizeof(number)) memcpy(&number, zframe_data(seq), sizeof(number));
+            zframe_t *body = zmsg_next(msg);
+            if (zmsg_size(msg) != 2 || number != expected || !body || zframe_size(body) != (size_t)size) {
+                printf("message %llu arrived as %zu frames or out of order\n", (unsigned long long)expected,
+                       zmsg_size(msg));
+                ok = false;
+            }
+            zmsg_destroy(&msg);
+            expected++;
+        }
+    }
+    double elapsed = (zclock_usecs() - start) / 1e6;
+    printf("received %llu of %ld in order, %zu held ones flushed in %.3f s\n", (unsigned long long)expected, messages,
+           held_peak, elapsed);
+    if (expected != (uint64_t)messages) ok = false;
+    printf("%s\n", ok ? "ok" : "FAILED");
+
+    outbox_destroy(&outbox);
+    zsock_destroy(&recipient);
+    zsock_destroy(&router);
+    free(content);
+    return ok ? 0 : 1;
+}
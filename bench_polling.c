@@ -0,0 +1,248 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// cc -o bench_polling bench_polling.c -lczmq -lzmq
+//
+// the router's three poll modes (--poll block|poll|adaptive) at a range of
+// offered loads: starts ./router in each mode, sends messages addressed to
+// ourselves through it at a steady rate and reports the round trip latency and
+// how much CPU the router used meanwhile, idle included.
+//
+//     ./bench_polling [seconds per load] [router cert] [router key dir]
+//
+// - latency is from our send to the message coming back, p50 and p99
+// - cpu is the router process's user + system time over the run, 100% is one core
+// - spins/waits are the adaptive loop's router_poll_spin_hits_total and
+//   router_poll_waits_total over the run
+
+#define DEFAULT_SECONDS     2
+#define DEFAULT_ROUTER_CERT "keys_client/router.cert"
+#define DEFAULT_KEY_DIR     "keys_router"
+
+#define BENCH_BIND          "tcp://*:5580"
+#define BENCH_ENDPOINT      "tcp://localhost:5580"
+#define BENCH_ADMIN         "ipc://bench_polling_admin"
+#define BENCH_STATS         "ipc://bench_polling_stats"
+
+static pid_t start_router(const char *mode)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    execl("./router", "./router", "--bind", BENCH_BIND, "--admin", BENCH_ADMIN, "--stats", BENCH_STATS,
+          "--poll", mode, (char *)NULL);
+    _exit(127);
+}
+
+static char *request(const char *endpoint, const char *command)
+{
+    zsock_t *req = zsock_new_req(endpoint);
+    if (!req) return NULL;
+    zsock_set_rcvtimeo(req, 500);
+    zstr_send(req, command);
+    char *reply = zstr_recv(req);
+    zsock_destroy(&req);
+    return reply;
+}
+
+static bool wait_for_router(int timeout_ms)
+{
+    int64_t deadline = zclock_mono() + timeout_ms;
+    while (zclock_mono() < deadline) {
+        char *reply = request(BENCH_ADMIN, "config");
+        bool up = reply && strncmp(reply, "OK", 2) == 0;
+        zstr_free(&reply);
+        if (up) return true;
+        zclock_sleep(50);
+    }
+    return false;
+}
+
+// a counter off the router's stats socket, 0 when it isn't there
+static unsigned long long router_counter(const char *name)
+{
+    char *reply = request(BENCH_STATS, "");
+    char *line = reply ? strstr(reply, name) : NULL;
+    unsigned long long value = 0;
+    if (line) sscanf(line + strlen(name), " %llu", &value);
+    zstr_free(&reply);
+    return value;
+}
+
+// user + system seconds the process has used
+static double process_cpu(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    unsigned long utime = 0, stime = 0;
+    // the command name is in parentheses and may hold spaces, skip past it
+    int found = fscanf(file, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(file);
+    return found == 2 ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : 0;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void send_stamped(zsock_t *dealer, zcert_t *cert)
+{
+    char content[32];
+    snprintf(content, sizeof(content), "%lld", (long long)zclock_usecs());
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, zcert_public_txt(cert));
+    zmsg_addstr(msg, "polling_bench");
+    zmsg_addstr(msg, content);
+    if (zmsg_send(&msg, dealer) != 0) zmsg_destroy(&msg);
+}
+
+// round trip of a message that came back, -1 for anything else
+static int64_t receive_stamped(zsock_t *dealer)
+{
+    zmsg_t *msg = zmsg_recv(dealer);
+    if (!msg) return -1;
+    // [sender id][content][delivery header]
+    zmsg_first(msg);
+    char *content = zframe_strdup(zmsg_next(msg));
+    int64_t latency = content ? zclock_usecs() - strtoll(content, NULL, 10) : -1;
+    free(content);
+    zmsg_destroy(&msg);
+    return latency;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : DEFAULT_SECONDS;
+    const char *router_cert_location = argc > 2 ? argv[2] : DEFAULT_ROUTER_CERT;
+    const char *key_dir = argc > 3 ? argv[3] : DEFAULT_KEY_DIR;
+    if (seconds < 1) {
+        printf("Usage: %s [seconds per load] [router cert] [router key dir]\n", argv[0]);
+        return 1;
+    }
+
+    zcert_t *router_cert = zcert_load(router_cert_location);
+    if (!router_cert) {
+        printf("Unable to load the router's certificate from %s\n", router_cert_location);
+        return 1;
+    }
+
+    // our own key, for the router to index
+    zcert_t *cert = zcert_new();
+    char *cert_path = zsys_sprintf("%s/polling_bench.cert", key_dir);
+    zcert_save_public(cert, cert_path);
+
+    const char *modes[] = { "block", "poll", "adaptive" };
+    const int loads[] = { 0, 100, 1000, 10000, 50000 };
+    size_t capacity = (size_t)loads[sizeof(loads) / sizeof(loads[0]) - 1] * seconds + 16;
+    int64_t *latencies = calloc(capacity, sizeof(int64_t));
+    assert(latencies);
+
+    printf("%-9s %8s | %9s %9s %9s | %7s | %9s %9s\n",
+           "mode", "msg/s", "delivered", "p50 us", "p99 us", "cpu", "spins", "waits");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && !zsys_interrupted; m++) {
+        pid_t router = start_router(modes[m]);
+        if (!wait_for_router(5000)) {
+            printf("router didn't come up, is ./router built?\n");
+            kill(router, SIGKILL);
+            waitpid(router, NULL, 0);
+            break;
+        }
+
+        zsock_t *dealer = zsock_new(ZMQ_DEALER);
+        assert(dealer);
+        zcert_apply(cert, dealer);
+        zsock_set_curve_serverkey(dealer, zcert_public_txt(router_cert));
+        zsock_set_identity(dealer, "polling_bench");
+        zsock_set_rcvtimeo(dealer, 100);
+        zsock_connect(dealer, BENCH_ENDPOINT);
+
+        // handshake done and our key indexed once a message makes it back
+        bool through = false;
+        for (int i = 0; i < 50 && !through; i++) {
+            send_stamped(dealer, cert);
+            through = receive_stamped(dealer) >= 0;
+        }
+        if (!through) {
+            printf("%-9s nothing came back through the router\n", modes[m]);
+            zsock_destroy(&dealer);
+            kill(router, SIGTERM);
+            waitpid(router, NULL, 0);
+            continue;
+        }
+        while (zsock_events(dealer) & ZMQ_POLLIN) receive_stamped(dealer);
+
+        for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]) && !zsys_interrupted; l++) {
+            int rate = loads[l];
+            size_t count = 0;
+            unsigned long long spins = router_counter("router_poll_spin_hits_total");
+            unsigned long long waits = router_counter("router_poll_waits_total");
+            double cpu = process_cpu(router);
+            int64_t start = zclock_usecs();
+            int64_t end = start + (int64_t)seconds * 1000000;
+            uint64_t sent = 0;
+
+            for (int64_t now = start; now < end && !zsys_interrupted; now = zclock_usecs()) {
+                // keep up with the rate
+                while (sent < (uint64_t)((now - start) * rate / 1000000)) {
+                    send_stamped(dealer, cert);
+                    sent++;
+                }
+                zmq_pollitem_t items[] = { { zsock_resolve(dealer), 0, ZMQ_POLLIN, 0 } };
+                zmq_poll(items, 1, 1);
+                while (zsock_events(dealer) & ZMQ_POLLIN) {
+                    int64_t latency = receive_stamped(dealer);
+                    if (latency >= 0 && count < capacity) latencies[count++] = latency;
+                }
+            }
+            // stragglers
+            int64_t drain_until = zclock_usecs() + 200 * 1000;
+            while (count < sent && zclock_usecs() < drain_until) {
+                zmq_pollitem_t items[] = { { zsock_resolve(dealer), 0, ZMQ_POLLIN, 0 } };
+                if (zmq_poll(items, 1, 10) <= 0) continue;
+                int64_t latency = receive_stamped(dealer);
+                if (latency >= 0 && count < capacity) latencies[count++] = latency;
+            }
+            double used = process_cpu(router) - cpu;
+            double elapsed = (zclock_usecs() - start) / 1e6;
+            spins = router_counter("router_poll_spin_hits_total") - spins;
+            waits = router_counter("router_poll_waits_total") - waits;
+
+            qsort(latencies, count, sizeof(int64_t), compare_int64);
+            if (count > 0) {
+                printf("%-9s %8d | %9zu %9lld %9lld | %6.1f%% | %9llu %9llu\n", modes[m], rate, count,
+                       (long long)latencies[count / 2], (long long)latencies[(size_t)((count - 1) * 0.99)],
+                       100.0 * used / elapsed, spins, waits);
+            } else {
+                printf("%-9s %8d | %9zu %9s %9s | %6.1f%% | %9llu %9llu\n", modes[m], rate, count,
+                       "-", "-", 100.0 * used / elapsed, spins, waits);
+            }
+        }
+
+        zsock_destroy(&dealer);
+        kill(router, SIGTERM);
+        waitpid(router, NULL, 0);
+    }
+
+    remove(cert_path);
+    zstr_free(&cert_path);
+    zcert_destroy(&cert);
+    zcert_destroy(&router_cert);
+    free(latencies);
+    return 0;
+}
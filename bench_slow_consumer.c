@@ -0,0 +1,251 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// cc -o bench_slow_consumer bench_slow_consumer.c -lczmq -lzmq
+//
+// what a recipient that stopped reading costs the router: starts ./router with
+// --hold-mb, connects a recipient that reads nothing after its handshake and a
+// sender that sends it messages as fast as the router takes them. every half
+// second it reads router_held_bytes off the stats socket and the router's RSS
+// out of /proc, and at the end checks that neither grew past the cap.
+//
+//     ./bench_slow_consumer [seconds] [content bytes] [hold mb] [router cert] [router key dir]
+//
+// - held is what the router keeps for the recipient (see outbox.h), never more
+//   than --hold-mb
+// - rss is the router process's resident memory, it may grow by what's held plus
+//   RSS_SLACK_MB for libzmq's pipe to the recipient and the allocator
+// exits 1 when either bound was broken.
+
+#define DEFAULT_SECONDS     10
+#define DEFAULT_SIZE        4096
+#define DEFAULT_HOLD_MB     16
+#define DEFAULT_ROUTER_CERT "keys_client/router.cert"
+#define DEFAULT_KEY_DIR     "keys_router"
+#define SAMPLE_MS           500
+#define RSS_SLACK_MB        32
+#define RECIPIENT_RCVHWM    10          // so the router hits the HWM early
+
+#define BENCH_BIND          "tcp://*:5583"
+#define BENCH_ENDPOINT      "tcp://localhost:5583"
+#define BENCH_ADMIN         "ipc://bench_slow_consumer_admin"
+#define BENCH_STATS         "ipc://bench_slow_consumer_stats"
+#define SENDER              "slow_bench_sender"
+#define RECIPIENT           "slow_bench_recipient"
+
+static pid_t start_router(int hold_mb)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    char hold[16];
+    snprintf(hold, sizeof(hold), "%d", hold_mb);
+    execl("./router", "./router", "--bind", BENCH_BIND, "--admin", BENCH_ADMIN, "--stats", BENCH_STATS,
+          "--hold-mb", hold, "--slow-consumer", "drop-oldest", (char *)NULL);
+    _exit(127);
+}
+
+// one request and its reply, NULL when nothing answers
+static char *request(const char *endpoint, const char *command)
+{
+    zsock_t *req = zsock_new_req(endpoint);
+    if (!req) return NULL;
+    zsock_set_rcvtimeo(req, 500);
+    zstr_send(req, command);
+    char *reply = zstr_recv(req);
+    zsock_destroy(&req);
+    return reply;
+}
+
+static bool wait_for_router(int timeout_ms)
+{
+    int64_t deadline = zclock_mono() + timeout_ms;
+    while (zclock_mono() < deadline) {
+        char *reply = request(BENCH_ADMIN, "config");
+        bool up = reply && strncmp(reply, "OK", 2) == 0;
+        zstr_free(&reply);
+        if (up) return true;
+        zclock_sleep(50);
+    }
+    return false;
+}
+
+// a counter or gauge off the router's stats socket, 0 when it isn't there
+static unsigned long long router_counter(const char *name)
+{
+    char *reply = request(BENCH_STATS, "");
+    char *line = reply ? strstr(reply, name) : NULL;
+    unsigned long long value = 0;
+    if (line) sscanf(line + strlen(name), " %llu", &value);
+    zstr_free(&reply);
+    return value;
+}
+
+// resident bytes of the process, 0 when it can't be read
+static unsigned long long process_rss(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    unsigned long long size = 0, resident = 0;
+    int found = fscanf(file, "%llu %llu", &size, &resident);
+    fclose(file);
+    return found == 2 ? resident * (unsigned long long)sysconf(_SC_PAGESIZE) : 0;
+}
+
+static zsock_t *connect_dealer(zcert_t *cert, zcert_t *router_cert, const char *identity)
+{
+    zsock_t *dealer = zsock_new(ZMQ_DEALER);
+    assert(dealer);
+    zcert_apply(cert, dealer);
+    zsock_set_curve_serverkey(dealer, zcert_public_txt(router_cert));
+    zsock_set_identity(dealer, identity);
+    zsock_set_sndtimeo(dealer, 0);
+    return dealer;
+}
+
+// [our key][recipient][content], false when our own HWM is full
+static bool send_to(zsock_t *dealer, zcert_t *cert, const char *recipient, const char *content)
+{
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, zcert_public_txt(cert));
+    zmsg_addstr(msg, recipient);
+    zmsg_addstr(msg, content);
+    if (zmsg_send(&msg, dealer) != 0) {
+        zmsg_destroy(&msg);
+        return false;
+    }
+    return true;
+}
+
+// a message to itself and back, so the handshake is done and the key indexed
+static bool round_trip(zsock_t *dealer, zcert_t *cert, const char *identity, const char *content)
+{
+    int64_t deadline = zclock_mono() + 10000;
+    zsock_set_rcvtimeo(dealer, 200);
+    while (zclock_mono() < deadline && !zsys_interrupted) {
+        // the first few may go out before the key was indexed
+        send_to(dealer, cert, identity, content);
+        zmsg_t *msg = zmsg_recv(dealer);
+        if (msg) {
+            zmsg_destroy(&msg);
+            return true;
+        }
+    }
+    return false;
+}
+
+// stalls a recipient for seconds while the sender keeps sending to it, returns
+// whether what the router held and its RSS stayed within bounds
+static bool measure(pid_t router, zsock_t *sender, zcert_t *cert, const char *content, int size, int seconds, int hold_mb)
+{
+    unsigned long long rss_start = process_rss(router);
+    unsigned long long held_peak = 0, rss_peak = rss_start;
+    uint64_t sent = 0;
+    int64_t start = zclock_mono();
+    int64_t next_sample = start + SAMPLE_MS;
+    int64_t end = start + (int64_t)seconds * 1000;
+
+    printf("%6s | %10s | %10s %10s | %10s\n", "s", "sent MB", "held MB", "held msgs", "rss MB");
+    while (zclock_mono() < end && !zsys_interrupted) {
+        // as fast as the router takes them, a full pipe on our side waits a little
+        for (int i = 0; i < 256; i++) {
+            if (!send_to(sender, cert, RECIPIENT, content)) {
+                zclock_sleep(1);
+                break;
+            }
+            sent++;
+        }
+
+        if (zclock_mono() < next_sample) continue;
+        next_sample += SAMPLE_MS;
+        unsigned long long held = router_counter("router_held_bytes");
+        unsigned long long held_messages = router_counter("router_held_messages");
+        unsigned long long rss = process_rss(router);
+        if (held > held_peak) held_peak = held;
+        if (rss > rss_peak) rss_peak = rss;
+        printf("%6.1f | %10.1f | %10.1f %10llu | %10.1f\n", (zclock_mono() - start) / 1000.0,
+               sent * (double)size / 1e6, held / 1e6, held_messages, rss / 1e6);
+    }
+
+    unsigned long long cap = (unsigned long long)hold_mb * 1024 * 1024;
+    unsigned long long rss_limit = rss_start + cap + (unsigned long long)RSS_SLACK_MB * 1024 * 1024;
+    unsigned long long dropped = router_counter("router_drops_total{reason=\"slow_consumer\"}");
+    printf("\nsent %.1f MB to a recipient that read nothing, %llu dropped as slow_consumer\n",
+           sent * (double)size / 1e6, dropped);
+    printf("held peak %.1f MB, cap %d MB: %s\n", held_peak / 1e6, hold_mb, held_peak <= cap ? "ok" : "OVER");
+    printf("rss %.1f MB at the start, peak %.1f MB, limit %.1f MB: %s\n", rss_start / 1e6, rss_peak / 1e6,
+           rss_limit / 1e6, rss_peak <= rss_limit ? "ok" : "OVER");
+    return held_peak <= cap && rss_peak <= rss_limit;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : DEFAULT_SECONDS;
+    int size = argc > 2 ? atoi(argv[2]) : DEFAULT_SIZE;
+    int hold_mb = argc > 3 ? atoi(argv[3]) : DEFAULT_HOLD_MB;
+    const char *router_cert_location = argc > 4 ? argv[4] : DEFAULT_ROUTER_CERT;
+    const char *key_dir = argc > 5 ? argv[5] : DEFAULT_KEY_DIR;
+    if (seconds < 1 || size < 1 || hold_mb < 1) {
+        printf("Usage: %s [seconds] [content bytes] [hold mb] [router cert] [router key dir]\n", argv[0]);
+        return 1;
+    }
+
+    zcert_t *router_cert = zcert_load(router_cert_location);
+    if (!router_cert) {
+        printf("Unable to load the router's certificate from %s\n", router_cert_location);
+        return 1;
+    }
+
+    // our own key, for the router to index
+    zcert_t *cert = zcert_new();
+    char *cert_path = zsys_sprintf("%s/slow_consumer_bench.cert", key_dir);
+    zcert_save_public(cert, cert_path);
+
+    char *content = malloc(size + 1);
+    assert(content);
+    memset(content, 'x', size);
+    content[size] = '\0';
+
+    bool within = false;
+    pid_t router = start_router(hold_mb);
+    if (wait_for_router(5000)) {
+        zsock_t *recipient = connect_dealer(cert, router_cert, RECIPIENT);
+        zsock_set_rcvhwm(recipient, RECIPIENT_RCVHWM);
+        zsock_connect(recipient, BENCH_ENDPOINT);
+        zsock_t *sender = connect_dealer(cert, router_cert, SENDER);
+        zsock_connect(sender, BENCH_ENDPOINT);
+
+        // from the round trip on the recipient reads nothing
+        if (round_trip(recipient, cert, RECIPIENT, "hello") && round_trip(sender, cert, SENDER, "hello")) {
+            within = measure(router, sender, cert, content, size, seconds, hold_mb);
+        } else {
+            printf("the dealers didn't get through to the router\n");
+        }
+        zsock_destroy(&sender);
+        zsock_destroy(&recipient);
+    } else {
+        printf("router didn't come up, is ./router built?\n");
+    }
+
+    kill(router, SIGTERM);
+    waitpid(router, NULL, 0);
+    remove(cert_path);
+    zstr_free(&cert_path);
+    zcert_destroy(&cert);
+    zcert_destroy(&router_cert);
+    free(content);
+    return within ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timerwheel.h"
+
+// cc -o bench_timers bench_timers.c -lczmq
+//
+// what timerwheel.h costs with a lot of timers armed. it arms [timers] of them
+// at random delays of up to [spread] seconds, the way retransmits and idle
+// streams spread out, and reports:
+//
+//     ./bench_timers [timers] [spread seconds]
+//
+// - add and cancel, ns per timer
+// - an idle pass of a poll loop, the timeout and an advance to the current tick
+//   with nothing due, ns per pass
+// - expiry, ns per timer with all of them coming due over the spread
+// against a scan of every timer per pass, which is what checking deadlines
+// without a wheel costs
+
+#define DEFAULT_TIMERS      (1000 * 1000)
+#define DEFAULT_SPREAD      60
+#define IDLE_PASSES         (1000 * 1000)
+#define SCAN_PASSES         20
+
+typedef struct {
+    Timer timer;
+    int64_t at;
+} Deadline;
+
+static double elapsed_ns(int64_t start)
+{
+    return (double)(zclock_usecs() - start) * 1000.0;
+}
+
+static void expired(void *context, Timer *timer)
+{
+    (void)timer;
+    (*(size_t *)context)++;
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_TIMERS;
+    int spread = argc > 2 ? atoi(argv[2]) : DEFAULT_SPREAD;
+    if (count < 1 || spread < 1) {
+        printf("Usage: %s [timers] [spread seconds]\n", argv[0]);
+        return 1;
+    }
+
+    // too big for the stack
+    TimerWheel *wheel = malloc(sizeof(TimerWheel));
+    Deadline *deadlines = calloc(count, sizeof(Deadline));
+    if (!wheel || !deadlines) return 1;
+    srand(1);
+    for (int i = 0; i < count; i++) deadlines[i].at = 1 + (int64_t)rand() % ((int64_t)spread * 1000);
+
+    timer_wheel_init(wheel, 0);
+    int64_t start = zclock_usecs();
+    for (int i = 0; i < count; i++) timer_wheel_add(wheel, &deadlines[i].timer, deadlines[i].at, expired, NULL);
+    printf("add      %8.1f ns per timer\n", elapsed_ns(start) / count);
+
+    start = zclock_usecs();
+    for (int i = 0; i < count; i++) timer_wheel_cancel(wheel, &deadlines[i].timer);
+    printf("cancel   %8.1f ns per timer\n", elapsed_ns(start) / count);
+
+    // the idle passes all fall before the first timer is due
+    timer_wheel_init(wheel, 0);
+    for (int i = 0; i < count; i++) timer_wheel_add(wheel, &deadlines[i].timer, deadlines[i].at + 1000, expired, NULL);
+    size_t fired = 0;
+    long timeouts = 0;
+    start = zclock_usecs();
+    for (int pass = 0; pass < IDLE_PASSES; pass++) {
+        int64_t now = pass / 1000;
+        timeouts += timer_wheel_timeout(wheel, now);
+        timer_wheel_advance(wheel, now, &fired);
+    }
+    printf("idle     %8.1f ns per pass with %zu armed (%ld)\n", elapsed_ns(start) / IDLE_PASSES, wheel->count, timeouts);
+
+    start = zclock_usecs();
+    for (int64_t now = 0; now <= (int64_t)spread * 1000 + 1000; now += 10) timer_wheel_advance(wheel, now, &fired);
+    printf("expiry   %8.1f ns per timer, %zu came due\n", elapsed_ns(start) / count, fired);
+
+    // the same deadlines checked by walking all of them every pass
+    size_t due = 0;
+    start = zclock_usecs();
+    for (int pass = 0; pass < SCAN_PASSES; pass++) {
+        for (int i = 0; i < count; i++) due += deadlines[i].at <= pass;
+    }
+    printf("scan     %8.1f ns per pass (%zu)\n", elapsed_ns(start) / SCAN_PASSES, due);
+
+    free(deadlines);
+    free(wheel);
+    return 0;
+}
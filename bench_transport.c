@@ -0,0 +1,166 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "router.h"
+
+// cc -o bench_transport bench_transport.c router.c -DROUTER_EMBEDDED -lczmq -lzmq
+//
+// the same router over tcp, ipc and inproc: embeds one (see router.h) bound to
+// all three and sends messages addressed to ourselves through it over each in
+// turn.
+//
+//     ./bench_transport [messages] [content bytes] [router cert] [router key dir]
+//
+// - latency is one message at a time, send to coming back, p50 and p99
+// - throughput keeps up to WINDOW messages in flight and counts what came back
+//   per second
+
+#define DEFAULT_MESSAGES    100000
+#define DEFAULT_SIZE        64
+#define DEFAULT_ROUTER_CERT "keys_client/router.cert"
+#define DEFAULT_KEY_DIR     "keys_router"
+#define ROUND_TRIPS         2000
+#define WINDOW              500         // well under the router's HWM, nothing gets dropped
+#define TIMEOUT_MS          5000
+
+#define BENCH_BIND          "tcp://*:5581,ipc://bench_transport.sock,inproc://bench_transport"
+
+static const char *endpoints[][2] = {
+    { "tcp",    "tcp://localhost:5581" },
+    { "ipc",    "ipc://bench_transport.sock" },
+    { "inproc", "inproc://bench_transport" },
+};
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void send_to_self(zsock_t *dealer, zcert_t *cert, const char *identity, const char *content)
+{
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, zcert_public_txt(cert));
+    zmsg_addstr(msg, identity);
+    zmsg_addstr(msg, content);
+    if (zmsg_send(&msg, dealer) != 0) zmsg_destroy(&msg);
+}
+
+// [sender id][content][delivery header]
+static bool receive_one(zsock_t *dealer)
+{
+    zmsg_t *msg = zmsg_recv(dealer);
+    if (!msg) return false;
+    zmsg_destroy(&msg);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    int size = argc > 2 ? atoi(argv[2]) : DEFAULT_SIZE;
+    const char *router_cert_location = argc > 3 ? argv[3] : DEFAULT_ROUTER_CERT;
+    const char *key_dir = argc > 4 ? argv[4] : DEFAULT_KEY_DIR;
+    if (messages < 1 || size < 1) {
+        printf("Usage: %s [messages] [content bytes] [router cert] [router key dir]\n", argv[0]);
+        return 1;
+    }
+
+    zcert_t *router_cert = zcert_load(router_cert_location);
+    if (!router_cert) {
+        printf("Unable to load the router's certificate from %s\n", router_cert_location);
+        return 1;
+    }
+
+    // our own key, for the router to index
+    zcert_t *cert = zcert_new();
+    char *cert_path = zsys_sprintf("%s/transport_bench.cert", key_dir);
+    zcert_save_public(cert, cert_path);
+
+    char *router_args = zsys_sprintf("--bind %s --keys %s --router-cert %s --router-key %s "
+                                     "--admin ipc://bench_transport_admin --stats ipc://bench_transport_stats",
+                                     BENCH_BIND, key_dir, router_cert_location, zcert_public_txt(router_cert));
+    zactor_t *router = zactor_new(router_actor, router_args);
+    assert(router);
+
+    char *content = malloc(size + 1);
+    int64_t *latencies = calloc(ROUND_TRIPS, sizeof(int64_t));
+    assert(content && latencies);
+    memset(content, 'x', size);
+    content[size] = '\0';
+
+    printf("%-7s | %9s %9s | %12s %10s\n", "", "p50 us", "p99 us", "msg/s", "MB/s");
+    for (size_t e = 0; e < sizeof(endpoints) / sizeof(endpoints[0]) && !zsys_interrupted; e++) {
+        // an identity per transport, the last one may still be connected as far as the router knows
+        char identity[64];
+        snprintf(identity, sizeof(identity), "transport_bench_%s", endpoints[e][0]);
+
+        zsock_t *dealer = zsock_new(ZMQ_DEALER);
+        assert(dealer);
+        zcert_apply(cert, dealer);
+        zsock_set_curve_serverkey(dealer, zcert_public_txt(router_cert));
+        zsock_set_identity(dealer, identity);
+        zsock_set_rcvtimeo(dealer, 100);
+        zsock_set_sndhwm(dealer, WINDOW * 2);
+        zsock_set_rcvhwm(dealer, WINDOW * 2);
+        zsock_connect(dealer, "%s", endpoints[e][1]);
+
+        // handshake done and our key indexed once a message makes it back
+        bool through = false;
+        for (int i = 0; i < 50 && !through; i++) {
+            send_to_self(dealer, cert, identity, content);
+            through = receive_one(dealer);
+        }
+        if (!through) {
+            printf("%-7s nothing came back through the router\n", endpoints[e][0]);
+            zsock_destroy(&dealer);
+            continue;
+        }
+        while (zsock_events(dealer) & ZMQ_POLLIN) receive_one(dealer);
+        zsock_set_rcvtimeo(dealer, TIMEOUT_MS);
+
+        size_t trips = 0;
+        for (int i = 0; i < ROUND_TRIPS && !zsys_interrupted; i++) {
+            int64_t start = zclock_usecs();
+            send_to_self(dealer, cert, identity, content);
+            if (!receive_one(dealer)) break;
+            latencies[trips++] = zclock_usecs() - start;
+        }
+
+        int sent = 0, received = 0;
+        int64_t start = zclock_usecs();
+        while (received < messages && !zsys_interrupted) {
+            while (sent < messages && sent - received < WINDOW) {
+                send_to_self(dealer, cert, identity, content);
+                sent++;
+            }
+            if (!receive_one(dealer)) break;
+            received++;
+        }
+        double elapsed = (zclock_usecs() - start) / 1e6;
+
+        qsort(latencies, trips, sizeof(int64_t), compare_int64);
+        double rate = elapsed > 0 ? received / elapsed : 0;
+        if (trips > 0) {
+            printf("%-7s | %9lld %9lld | %12.0f %10.1f\n", endpoints[e][0],
+                   (long long)latencies[trips / 2], (long long)latencies[(size_t)((trips - 1) * 0.99)],
+                   rate, rate * size / 1e6);
+        }
+        if (received < messages) printf("%-7s only %d of %d messages came back\n", endpoints[e][0], received, messages);
+
+        zsock_destroy(&dealer);
+    }
+
+    zactor_destroy(&router);
+    remove(cert_path);
+    zstr_free(&cert_path);
+    zstr_free(&router_args);
+    zcert_destroy(&cert);
+    zcert_destroy(&router_cert);
+    free(content);
+    free(latencies);
+    return 0;
+}
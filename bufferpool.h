@@ -0,0 +1,198 @@
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// pooled message buffers
+//
+// ciphertext on the way out and plaintext on the way in are written to buffers
+// from a pool instead of fresh mallocs. buffers come in power of two size classes
+// from BUFFER_MIN_SIZE up to BUFFER_MAX_SIZE (a transfer chunk and its envelope
+// fit the biggest), and up to BUFFER_CACHED free ones of each class are kept for
+// reuse. anything bigger is malloc'd and freed as before.
+//
+// buffers are reference counted: the delivery window (see delivery.h) holds on
+// to the ciphertext it may have to retransmit while the same bytes are on their
+// way out, no copy. buffer_send hands one to libzmq as a zero-copy frame
+// (zmq_msg_init_data), and libzmq's free callback, on its I/O thread once the
+// frame is written, drops that reference again. so in steady state the payload
+// of a message is never allocated or copied into a frame.
+//
+// the pool outlives buffer_pool_destroy until the last buffer libzmq still holds
+// comes back.
+
+#define BUFFER_MIN_SHIFT    8                                   // 256 bytes
+#define BUFFER_CLASSES      10                                  // up to 128KB
+#define BUFFER_MIN_SIZE     ((size_t)1 << BUFFER_MIN_SHIFT)
+#define BUFFER_MAX_SIZE     (BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1))
+#define BUFFER_CACHED       64                                  // free buffers kept per class
+
+typedef struct BufferPool BufferPool;
+
+// in front of the data of every buffer
+typedef struct PooledBuffer {
+    _Alignas(16) BufferPool *pool;
+    struct PooledBuffer *next;          // free list
+    _Atomic uint32_t refs;
+    uint32_t size_class;                // BUFFER_CLASSES when it's too big to pool
+    size_t length;                      // bytes in use, what buffer_send puts on the wire
+} PooledBuffer;
+
+struct BufferPool {
+    pthread_mutex_t lock;
+    PooledBuffer *free[BUFFER_CLASSES];
+    size_t cached[BUFFER_CLASSES];
+    bool closed;
+    _Atomic size_t refs;                // the owner's, plus one per buffer out
+    _Atomic uint64_t allocated;         // buffers that had to be malloc'd
+    _Atomic uint64_t reused;
+};
+
+static inline PooledBuffer *buffer_header(const void *data)
+{
+    return (PooledBuffer *)((uint8_t *)data - sizeof(PooledBuffer));
+}
+
+static inline BufferPool *buffer_pool_new(void)
+{
+    BufferPool *pool = calloc(1, sizeof(BufferPool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    atomic_init(&pool->refs, 1);
+    return pool;
+}
+
+static inline void buffer_pool_unref(BufferPool *pool)
+{
+    if (atomic_fetch_sub(&pool->refs, 1) != 1) return;
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// frees the cached buffers, the ones still out are freed as they come back
+static inline void buffer_pool_destroy(BufferPool **pool_p)
+{
+    BufferPool *pool = *pool_p;
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = true;
+    for (size_t i = 0; i < BUFFER_CLASSES; i++) {
+        while (pool->free[i]) {
+            PooledBuffer *buffer = pool->free[i];
+            pool->free[i] = buffer->next;
+            free(buffer);
+        }
+        pool->cached[i] = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    buffer_pool_unref(pool);
+    *pool_p = NULL;
+}
+
+static inline uint32_t buffer_size_class(size_t size)
+{
+    uint32_t size_class = 0;
+    while (size_class < BUFFER_CLASSES && (BUFFER_MIN_SIZE << size_class) < size) size_class++;
+    return size_class;
+}
+
+// a buffer of at least size bytes with one reference, its length set to size
+static inline void *buffer_get(BufferPool *pool, size_t size)
+{
+    uint32_t size_class = buffer_size_class(size);
+    PooledBuffer *buffer = NULL;
+    if (size_class < BUFFER_CLASSES) {
+        pthread_mutex_lock(&pool->lock);
+        buffer = pool->free[size_class];
+        if (buffer) {
+            pool->free[size_class] = buffer->next;
+            pool->cached[size_class]--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (buffer) {
+        atomic_fetch_add(&pool->reused, 1);
+    } else {
+        size_t capacity = size_class < BUFFER_CLASSES ? BUFFER_MIN_SIZE << size_class : size;
+        buffer = malloc(sizeof(PooledBuffer) + capacity);
+        if (!buffer) return NULL;
+        buffer->pool = pool;
+        buffer->size_class = size_class;
+        atomic_fetch_add(&pool->allocated, 1);
+    }
+    buffer->next = NULL;
+    atomic_init(&buffer->refs, 1);
+    buffer->length = size;
+    atomic_fetch_add(&pool->refs, 1);
+    return (uint8_t *)buffer + sizeof(PooledBuffer);
+}
+
+static inline void *buffer_retain(void *data)
+{
+    if (data) atomic_fetch_add(&buffer_header(data)->refs, 1);
+    return data;
+}
+
+// drops a reference, the last one puts the buffer back on its free list
+static inline void buffer_release(void *data)
+{
+    if (!data) return;
+    PooledBuffer *buffer = buffer_header(data);
+    if (atomic_fetch_sub(&buffer->refs, 1) != 1) return;
+
+    BufferPool *pool = buffer->pool;
+    bool kept = false;
+    if (buffer->size_class < BUFFER_CLASSES) {
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->closed && pool->cached[buffer->size_class] < BUFFER_CACHED) {
+            buffer->next = pool->free[buffer->size_class];
+            pool->free[buffer->size_class] = buffer;
+            pool->cached[buffer->size_class]++;
+            kept = true;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!kept) free(buffer);
+    buffer_pool_unref(pool);
+}
+
+static inline size_t buffer_length(const void *data)
+{
+    return buffer_header(data)->length;
+}
+
+// after writing fewer bytes than were asked for
+static inline void buffer_set_length(void *data, size_t length)
+{
+    buffer_header(data)->length = length;
+}
+
+// libzmq is done with a frame built around a buffer
+static inline void buffer_zmq_free(void *data, void *hint)
+{
+    (void)hint;
+    buffer_release(data);
+}
+
+// sends the buffer as one frame without copying it, the caller keeps its reference
+static inline bool buffer_send(void *data, void *socket, int flags)
+{
+    zmq_msg_t msg;
+    if (zmq_msg_init_data(&msg, buffer_retain(data), buffer_length(data), buffer_zmq_free, NULL) != 0) {
+        buffer_release(data);
+        return false;
+    }
+    if (zmq_msg_send(&msg, socket, flags) == -1) {
+        // still ours, closing it runs the free callback
+        zmq_msg_close(&msg);
+        return false;
+    }
+    return true;
+}
+
+#endif // BUFFERPOOL_H_
@@ -14,6 +14,7 @@ int main(int argc, char** argv) {
         "-g",          
         "-I/usr/include",
         "-lczmq",
+        "-lzmq",
         "-Wall", 
         "-Wextra", 
         "-o", "router"                                    
@@ -31,12 +32,14 @@ int main(int argc, char** argv) {
         "-g",                                     
         "-I/usr/include",               //czmq
         "-lczmq", 
+        "-lzmq",                        // zero-copy sends, see bufferpool.h
         "-I/usr/local/include",         // raylib
         "-L/usr/local/lib",         
         "-lraylib", 
         "-lm",
         "-lssl",                        // ssl
         "-lcrypto",
+        "-llz4",                        // compression
         "-Wall", 
         "-Wextra",
         "-o", 
@@ -46,7 +49,69 @@ int main(int argc, char** argv) {
     if (!cmd_run_sync(cmd2)) {
         nob_log(NOB_ERROR, "Build 2 (dealer) failed");
         return 1;
+    }
+
+    Cmd cmd3 = {0};
+    cmd_append(&cmd3,
+        "cc",
+        "keystore_import.c",
+        "-g",
+        "-I/usr/include",
+        "-lczmq",
+        "-lzmq",
+        "-Wall",
+        "-Wextra",
+        "-o", "keystore_import"
+    );
+
+    if (!cmd_run_sync(cmd3)) {
+        nob_log(NOB_ERROR, "Build 3 (keystore_import) failed");
+        return 1;
     }    
 
+    // benchmarks are only built on request: ./build bench
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        // name and what it needs on top of czmq, libraries or the router itself.
+        // they go right after the bench's source, so with --as-needed an extra
+        // source still comes before the libraries it uses
+        const char *benches[][3] = {
+            { "bench_fairness", NULL, NULL },
+            { "bench_metrics", NULL, NULL },
+            { "bench_handshake", NULL, NULL },
+            { "bench_failover", NULL, NULL },
+            { "bench_compression", "-llz4", "-lcrypto" },
+            { "bench_polling", NULL, NULL },
+            { "bench_transport", "router.c", "-DROUTER_EMBEDDED" },
+            { "bench_io_threads", NULL, NULL },
+            { "bench_timers", NULL, NULL },
+            { "bench_slow_consumer", NULL, NULL },
+            { "bench_outbox", NULL, NULL },
+        };
+
+        for (size_t i = 0; i < ARRAY_LEN(benches); i++) {
+            Cmd bench = {0};
+            cmd_append(&bench,
+                "cc",
+                temp_sprintf("%s.c", benches[i][0])
+            );
+            for (size_t j = 1; j < 3 && benches[i][j]; j++) cmd_append(&bench, benches[i][j]);
+            cmd_append(&bench,
+                "-O2",
+                "-g",
+                "-I/usr/include",
+                "-lczmq",
+                "-lzmq",
+                "-Wall",
+                "-Wextra",
+                "-o", benches[i][0]
+            );
+
+            if (!cmd_run_sync(bench)) {
+                nob_log(NOB_ERROR, "Build of %s failed", benches[i][0]);
+                return 1;
+            }
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,132 @@
+#ifndef BUNDLE_H_
+#define BUNDLE_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// packed client bundle
+//
+// key_gen writes every generated client identity, secret key included, into one
+// file next to the .cert files, so a load generator can map 100k identities at
+// once instead of loading 200k files:
+//
+//     [header][record][record]...          in generation order, user1 first
+//
+// same layout idea as the router's keystore (keystore.h), but this one holds
+// secrets and belongs on the client side only.
+
+#define BUNDLE_MAGIC     "CHATCLNT"
+#define BUNDLE_VERSION   1
+#define BUNDLE_KEY_SIZE  32
+#define BUNDLE_NAME_SIZE 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t reserved;
+} BundleHeader;
+
+typedef struct {
+    uint8_t public_key[BUNDLE_KEY_SIZE];
+    uint8_t secret_key[BUNDLE_KEY_SIZE];
+    char name[BUNDLE_NAME_SIZE];        // nul terminated, the identity to connect as
+} BundleRecord;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    const BundleRecord *records;
+    size_t count;
+} Bundle;
+
+static inline Bundle *bundle_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(BundleHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const BundleHeader *header = map;
+    size_t available = ((size_t)st.st_size - sizeof(BundleHeader)) / sizeof(BundleRecord);
+    Bundle *bundle = calloc(1, sizeof(Bundle));
+    if (!bundle ||
+        memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BUNDLE_VERSION ||
+        header->record_size != sizeof(BundleRecord) ||
+        header->count > available) {
+        munmap(map, st.st_size);
+        free(bundle);
+        return NULL;
+    }
+
+    bundle->map = map;
+    bundle->map_size = st.st_size;
+    bundle->records = (const BundleRecord *)((const char *)map + sizeof(BundleHeader));
+    bundle->count = header->count;
+    return bundle;
+}
+
+static inline void bundle_close(Bundle **bundle_p)
+{
+    Bundle *bundle = *bundle_p;
+    if (!bundle) return;
+    munmap(bundle->map, bundle->map_size);
+    free(bundle);
+    *bundle_p = NULL;
+}
+
+// a cert to apply to a socket, the caller destroys it
+static inline zcert_t *bundle_cert(const BundleRecord *record)
+{
+    return zcert_new_from(record->public_key, record->secret_key);
+}
+
+// owner only, it's full of secret keys
+static inline bool bundle_write(const char *path, const BundleRecord *records, size_t count)
+{
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return false;
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        remove(tmp_path);
+        return false;
+    }
+
+    BundleHeader header = {
+        .version = BUNDLE_VERSION,
+        .record_size = sizeof(BundleRecord),
+        .count = count,
+    };
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              (count == 0 || fwrite(records, sizeof(BundleRecord), count, file) == count) &&
+              fflush(file) == 0;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, path) == -1) {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+#endif // BUNDLE_H_
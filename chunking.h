@@ -0,0 +1,254 @@
+#ifndef CHUNKING_H_
+#define CHUNKING_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "delivery.h"
+
+// long chat messages, sent in parts
+//
+// a message longer than CHUNK_SIZE is encrypted and sent as parts of CHUNK_SIZE
+// bytes, each one its own message with a part header (see delivery.h), so it's
+// acked and retransmitted like any other. the parts go out a few at a time from
+// the receive thread and never take more than CHUNK_WINDOW of the conversation's
+// delivery window: messages typed while a long paste is still going out have
+// room in the window and get in between its parts, on the socket and in the
+// router's queue, instead of waiting behind all of it.
+//
+// the recipient keeps every part as it arrives and puts the message together
+// once the last one is there. a message it hears nothing more of for
+// CHUNK_TIMEOUT_MS (the sender gave up on a part) is dropped.
+//
+// the part count comes from the sender, so it only reserves room: memory is
+// taken a part at a time. a sender can have CHUNK_PEER_GROUPS messages and
+// CHUNK_PEER_BYTES reserved at once and everyone together CHUNK_TOTAL_BYTES, the
+// first part of a message past that is dropped and the rest of it with it.
+
+#define CHUNK_SIZE          (16 * 1024)
+#define CHUNK_WINDOW        (DELIVERY_WINDOW / 2)   // parts in flight per conversation
+#define CHUNK_BURST         8                       // parts sent per pass before anything else gets a turn
+#define CHUNK_MESSAGE_MAX   (16 * 1024 * 1024)      // the longest message we put back together
+#define CHUNK_TIMEOUT_MS    (60 * 1000)
+#define CHUNK_PEER_GROUPS   4
+#define CHUNK_PEER_BYTES    (2 * CHUNK_MESSAGE_MAX)
+#define CHUNK_TOTAL_BYTES   (8 * CHUNK_MESSAGE_MAX)
+
+typedef struct {
+    char *peer;
+    char *text;
+    size_t length;
+    uint64_t group;             // set once the first part is tracked
+    uint32_t parts;
+    uint32_t next;              // first part not sent yet
+    uint8_t flags;              // the delivery header's, for every part
+} ChunkedSend;
+
+typedef struct {
+    size_t reserved;            // parts * CHUNK_SIZE of every message coming in
+    uint32_t groups;
+} ChunkedPeer;
+
+typedef struct Chunking Chunking;
+
+typedef struct {
+    Chunking *owner;            // whose reservations it's counted in
+    char *peer;
+    char **chunks;              // part i decrypted, NULL until it arrived
+    char *text;                 // the whole message once the last part is there
+    size_t length;              // known once the last part is there
+    uint32_t parts;
+    uint32_t received;
+    int64_t last_heard;         // zclock_mono()
+} ChunkedReceive;
+
+struct Chunking {
+    zlist_t *sending;           // ChunkedSend *, oldest first
+    zhash_t *receiving;         // peer/group -> ChunkedReceive
+    zhash_t *peers;             // peer -> ChunkedPeer, while anything comes in from it
+    size_t reserved;            // across all peers
+};
+
+static inline void chunked_send_free(ChunkedSend *send)
+{
+    free(send->peer);
+    free(send->text);
+    free(send);
+}
+
+static inline void chunked_receive_free(void *data)
+{
+    ChunkedReceive *receive = (ChunkedReceive *)data;
+    Chunking *owner = receive->owner;
+    ChunkedPeer *peer = owner && receive->peer ? (ChunkedPeer *)zhash_lookup(owner->peers, receive->peer) : NULL;
+    if (peer) {
+        size_t reserved = (size_t)receive->parts * CHUNK_SIZE;
+        peer->reserved -= reserved;
+        owner->reserved -= reserved;
+        if (--peer->groups == 0) zhash_delete(owner->peers, receive->peer);
+    }
+    for (uint32_t i = 0; receive->chunks && i < receive->parts; i++) free(receive->chunks[i]);
+    free(receive->chunks);
+    free(receive->peer);
+    free(receive->text);
+    free(receive);
+}
+
+static inline Chunking *chunking_new(void)
+{
+    Chunking *self = calloc(1, sizeof(Chunking));
+    if (!self) return NULL;
+    self->sending = zlist_new();
+    self->receiving = zhash_new();
+    self->peers = zhash_new();
+    if (!self->sending || !self->receiving || !self->peers) {
+        zlist_destroy(&self->sending);
+        zhash_destroy(&self->receiving);
+        zhash_destroy(&self->peers);
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+static inline void chunking_destroy(Chunking **self_p)
+{
+    Chunking *self = *self_p;
+    if (!self) return;
+    for (ChunkedSend *send = (ChunkedSend *)zlist_pop(self->sending); send; send = (ChunkedSend *)zlist_pop(self->sending)) {
+        chunked_send_free(send);
+    }
+    zlist_destroy(&self->sending);
+    zhash_destroy(&self->receiving);
+    zhash_destroy(&self->peers);
+    free(self);
+    *self_p = NULL;
+}
+
+// queues text (compressed already when flags say so) for peer to go out in parts,
+// false when it's short enough to go as is
+static inline bool chunking_queue(Chunking *self, const char *peer, const char *text, size_t length, uint8_t flags)
+{
+    if (length <= CHUNK_SIZE) return false;
+    ChunkedSend *send = calloc(1, sizeof(ChunkedSend));
+    if (!send) return false;
+    send->peer = strdup(peer);
+    send->text = malloc(length);
+    if (!send->peer || !send->text) {
+        chunked_send_free(send);
+        return false;
+    }
+    memcpy(send->text, text, length);
+    send->length = length;
+    send->flags = flags;
+    send->parts = (uint32_t)((length + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    zlist_append(self->sending, send);
+    return true;
+}
+
+static inline size_t chunk_length(size_t total, uint32_t part)
+{
+    size_t left = total - (size_t)part * CHUNK_SIZE;
+    return left < CHUNK_SIZE ? left : CHUNK_SIZE;
+}
+
+// part of a message from peer, decrypted. returns the reassembly once every
+// part is there, the caller takes the text and calls chunking_done
+static inline ChunkedReceive *chunking_add(Chunking *self, const char *peer, uint64_t group, uint32_t part,
+                                           uint32_t parts, const char *plaintext, size_t length)
+{
+    if (parts == 0 || part >= parts || parts > CHUNK_MESSAGE_MAX / CHUNK_SIZE || length > CHUNK_SIZE) return NULL;
+    // every part but the last one is full
+    if (part + 1 < parts && length != CHUNK_SIZE) return NULL;
+
+    char *key = zsys_sprintf("%s/%llu", peer, (unsigned long long)group);
+    if (!key) return NULL;
+    ChunkedReceive *receive = (ChunkedReceive *)zhash_lookup(self->receiving, key);
+    if (!receive) {
+        // room for it has to be there before anything is kept
+        size_t reserve = (size_t)parts * CHUNK_SIZE;
+        ChunkedPeer *from = (ChunkedPeer *)zhash_lookup(self->peers, peer);
+        if ((from && (from->groups >= CHUNK_PEER_GROUPS || from->reserved + reserve > CHUNK_PEER_BYTES)) ||
+            self->reserved + reserve > CHUNK_TOTAL_BYTES) {
+            printf("dropped a long message from %s, too many are coming in\n", peer);
+            zstr_free(&key);
+            return NULL;
+        }
+        if (!from) {
+            from = calloc(1, sizeof(ChunkedPeer));
+            if (!from) {
+                zstr_free(&key);
+                return NULL;
+            }
+            zhash_insert(self->peers, peer, from);
+            zhash_freefn(self->peers, peer, free);
+        }
+
+        receive = calloc(1, sizeof(ChunkedReceive));
+        if (receive) {
+            receive->peer = strdup(peer);
+            receive->chunks = calloc(parts, sizeof(char *));
+            receive->parts = parts;
+        }
+        if (!receive || !receive->peer || !receive->chunks) {
+            if (receive) chunked_receive_free(receive);
+            if (from->groups == 0) zhash_delete(self->peers, peer);
+            zstr_free(&key);
+            return NULL;
+        }
+        receive->owner = self;
+        from->groups++;
+        from->reserved += reserve;
+        self->reserved += reserve;
+        zhash_insert(self->receiving, key, receive);
+        zhash_freefn(self->receiving, key, chunked_receive_free);
+    }
+    zstr_free(&key);
+
+    receive->last_heard = zclock_mono();
+    if (receive->parts != parts || receive->chunks[part]) return NULL;
+    receive->chunks[part] = malloc(length ? length : 1);
+    if (!receive->chunks[part]) return NULL;
+    memcpy(receive->chunks[part], plaintext, length);
+    receive->received++;
+    if (part + 1 == parts) receive->length = (size_t)part * CHUNK_SIZE + length;
+    if (receive->received < receive->parts) return NULL;
+
+    // all there, into one piece
+    receive->text = malloc(receive->length + 1);
+    if (!receive->text) return NULL;
+    for (uint32_t i = 0; i < receive->parts; i++) {
+        memcpy(receive->text + (size_t)i * CHUNK_SIZE, receive->chunks[i], chunk_length(receive->length, i));
+        free(receive->chunks[i]);
+        receive->chunks[i] = NULL;
+    }
+    receive->text[receive->length] = '\0';
+    return receive;
+}
+
+static inline void chunking_done(Chunking *self, const char *peer, uint64_t group)
+{
+    char *key = zsys_sprintf("%s/%llu", peer, (unsigned long long)group);
+    if (key) zhash_delete(self->receiving, key);
+    zstr_free(&key);
+}
+
+// drops messages whose sender went quiet before the last part
+static inline void chunking_expire(Chunking *self)
+{
+    int64_t now = zclock_mono();
+    zlist_t *stale = zlist_new();
+    if (!stale) return;
+    for (ChunkedReceive *receive = (ChunkedReceive *)zhash_first(self->receiving);
+         receive; receive = (ChunkedReceive *)zhash_next(self->receiving)) {
+        if (now - receive->last_heard > CHUNK_TIMEOUT_MS) zlist_append(stale, (void *)zhash_cursor(self->receiving));
+    }
+    for (const char *key = (const char *)zlist_first(stale); key; key = (const char *)zlist_next(stale)) {
+        printf("gave up on a message from %s, parts stopped coming\n", ((ChunkedReceive *)zhash_lookup(self->receiving, key))->peer);
+        zhash_delete(self->receiving, key);
+    }
+    zlist_destroy(&stale);
+}
+
+#endif // CHUNKING_H_
@@ -0,0 +1,195 @@
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// router cluster
+//
+// several routers share the identity space through a consistent hash ring: each
+// node puts CLUSTER_VNODES points on the ring and owns the identities that hash
+// to the arcs ending in its points. every node and every dealer reads the same
+// membership file, so they all agree on who owns whom without talking about it:
+//
+//     # name   dealers connect to       routers connect to
+//     a        tcp://localhost:5555     tcp://127.0.0.1:6555
+//     b        tcp://localhost:5556     tcp://127.0.0.1:6556
+//
+// a dealer connects to the node owning its own identity. a node that gets a
+// message for an identity some other node owns hands it to that node over a
+// bridge (a DEALER connected to the owner's cluster ROUTER), which delivers it
+// locally. that's always one hop, a node never forwards what came off a bridge.
+//
+// bridges use CURVE with the router's own certificate on both ends (all nodes
+// share it, dealers only know the one router key), checked by the ZAP handler
+// under the CLUSTER_ZAP_DOMAIN domain.
+
+#define CLUSTER_MAX_NODES   16
+#define CLUSTER_VNODES      64
+#define CLUSTER_NAME_SIZE   32
+#define CLUSTER_ZAP_DOMAIN  "cluster"
+
+typedef struct {
+    char name[CLUSTER_NAME_SIZE];
+    char *client_endpoint;      // what dealers connect to
+    char *cluster_endpoint;     // where the node's cluster ROUTER is bound
+    zsock_t *bridge;            // DEALER to the node, NULL for this node
+    uint64_t routed;            // messages queued for it, forwarding thread only
+} ClusterNode;
+
+typedef struct {
+    uint64_t hash;
+    size_t node;
+} ClusterPoint;
+
+typedef struct {
+    ClusterNode nodes[CLUSTER_MAX_NODES];
+    size_t node_count;
+    ClusterNode *self;          // NULL on the dealer side
+    ClusterPoint ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+    size_t ring_size;
+    zsock_t *socket;            // ROUTER the other nodes' bridges connect to
+} Cluster;
+
+// fnv-1a with a final mix, identities are short and similar ("user1", "user2")
+static inline uint64_t cluster_hash(const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline int cluster_point_compare(const void *a, const void *b)
+{
+    const ClusterPoint *x = (const ClusterPoint *)a;
+    const ClusterPoint *y = (const ClusterPoint *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return (x->node > y->node) - (x->node < y->node);
+}
+
+static inline void cluster_build_ring(Cluster *self)
+{
+    self->ring_size = 0;
+    for (size_t n = 0; n < self->node_count; n++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            char point[CLUSTER_NAME_SIZE + 16];
+            int len = snprintf(point, sizeof(point), "%s#%d", self->nodes[n].name, v);
+            self->ring[self->ring_size++] = (ClusterPoint){ cluster_hash(point, len), n };
+        }
+    }
+    qsort(self->ring, self->ring_size, sizeof(ClusterPoint), cluster_point_compare);
+}
+
+static inline void cluster_destroy(Cluster **self_p)
+{
+    Cluster *self = *self_p;
+    if (!self) return;
+    for (size_t n = 0; n < self->node_count; n++) {
+        zsock_destroy(&self->nodes[n].bridge);
+        free(self->nodes[n].client_endpoint);
+        free(self->nodes[n].cluster_endpoint);
+    }
+    zsock_destroy(&self->socket);
+    free(self);
+    *self_p = NULL;
+}
+
+// reads the membership file, self_name picks this node out of it (NULL for dealers)
+static inline Cluster *cluster_load(const char *path, const char *self_name)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
+
+    Cluster *self = calloc(1, sizeof(Cluster));
+    char line[512];
+    while (self && fgets(line, sizeof(line), file)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char name[CLUSTER_NAME_SIZE], client[256], cluster[256];
+        int fields = sscanf(line, "%31s %255s %255s", name, client, cluster);
+        if (fields <= 0) continue;
+        if (fields != 3 || self->node_count == CLUSTER_MAX_NODES) {
+            cluster_destroy(&self);
+            break;
+        }
+
+        ClusterNode *node = &self->nodes[self->node_count++];
+        snprintf(node->name, sizeof(node->name), "%s", name);
+        node->client_endpoint = strdup(client);
+        node->cluster_endpoint = strdup(cluster);
+        if (self_name && strcmp(name, self_name) == 0) self->self = node;
+    }
+    fclose(file);
+
+    if (self && (self->node_count == 0 || (self_name && !self->self))) cluster_destroy(&self);
+    if (self) cluster_build_ring(self);
+    return self;
+}
+
+static inline ClusterNode *cluster_owner(Cluster *self, const void *identity, size_t len)
+{
+    uint64_t hash = cluster_hash(identity, len);
+
+    // first point at or after the hash, wrapping around the ring
+    size_t low = 0, high = self->ring_size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (self->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == self->ring_size) low = 0;
+    return &self->nodes[self->ring[low].node];
+}
+
+// share of the hash space a node owns, for the admin socket
+static inline double cluster_share(Cluster *self, const ClusterNode *node)
+{
+    size_t index = node - self->nodes;
+    double owned = 0;
+    for (size_t i = 0; i < self->ring_size; i++) {
+        if (self->ring[i].node != index) continue;
+        uint64_t previous = self->ring[i == 0 ? self->ring_size - 1 : i - 1].hash;
+        owned += (double)(uint64_t)(self->ring[i].hash - previous);
+    }
+    return owned / 18446744073709551616.0;
+}
+
+// binds this node's cluster socket and connects a bridge to every other node
+static inline bool cluster_start(Cluster *self, zcert_t *router_cert)
+{
+    self->socket = zsock_new(ZMQ_ROUTER);
+    if (!self->socket) return false;
+    zcert_apply(router_cert, self->socket);
+    zsock_set_curve_server(self->socket, 1);
+    zsock_set_zap_domain(self->socket, CLUSTER_ZAP_DOMAIN);
+    if (zsock_bind(self->socket, "%s", self->self->cluster_endpoint) == -1) return false;
+
+    for (size_t n = 0; n < self->node_count; n++) {
+        ClusterNode *node = &self->nodes[n];
+        if (node == self->self) continue;
+
+        node->bridge = zsock_new(ZMQ_DEALER);
+        if (!node->bridge) return false;
+        zcert_apply(router_cert, node->bridge);
+        zsock_set_curve_serverkey(node->bridge, zcert_public_txt(router_cert));
+        zsock_set_identity(node->bridge, self->self->name);
+        // a node that's down fills its queue up to the HWM, then sends fail instead of blocking
+        zsock_set_sndtimeo(node->bridge, 0);
+        if (zsock_connect(node->bridge, "%s", node->cluster_endpoint) == -1) return false;
+    }
+    return true;
+}
+
+#endif // CLUSTER_H_
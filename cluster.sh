@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# starts every node of a cluster file as a router on this machine, ctrl-c stops them all
+# usage: ./cluster.sh [cluster file]
+
+conf="${1:-cluster.conf}"
+pids=()
+
+while read -r name client cluster; do
+    # skip comments and empty lines
+    [[ -z "$name" || "$name" == \#* ]] && continue
+
+    port="${client##*:}"
+    ./router --bind "tcp://*:$port" \
+             --admin "ipc://router_admin_$name" \
+             --stats "ipc://router_stats_$name" \
+             --cluster "$conf" --node "$name" &
+    pids+=($!)
+done < "$conf"
+
+trap 'kill "${pids[@]}" 2>/dev/null' INT TERM
+wait
@@ -0,0 +1,97 @@
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <lz4.h>
+
+#include "delivery.h"
+
+// compressing messages before they're encrypted
+//
+// ciphertext doesn't compress, so it has to happen ahead of aes_encrypt. it's
+// opt in per conversation ("/compress on" in the chat): how long a compressed
+// message is says something about what's in it, which is enough for some people
+// to leave it off. only messages of COMPRESSION_THRESHOLD bytes and up are
+// compressed, and only kept when LZ4 made them smaller, the header of the ones
+// that were carries DELIVERY_FLAG_COMPRESSED (see delivery.h).
+//
+//     [original length (u32)][LZ4 block]
+//
+// the recipient undoes it after aes_decrypt whatever its own setting is, a long
+// message (see chunking.h) is compressed whole and then sent in parts.
+
+#define COMPRESSION_THRESHOLD   256
+#define COMPRESSION_HEADER_SIZE 4
+
+// conversations we compress for, peer -> anything
+typedef zhash_t CompressionPolicy;
+
+static inline bool compression_enabled(CompressionPolicy *policy, const char *peer)
+{
+    return policy && peer && zhash_lookup(policy, peer) != NULL;
+}
+
+static inline void compression_set(CompressionPolicy *policy, const char *peer, bool enabled)
+{
+    if (enabled) {
+        zhash_update(policy, peer, (void *)1);
+    } else {
+        zhash_delete(policy, peer);
+    }
+}
+
+// text compressed, NULL when it's too short or doesn't get any shorter
+static inline uint8_t *compress_message(const char *text, size_t length, size_t *compressed_length)
+{
+    if (length < COMPRESSION_THRESHOLD || length > LZ4_MAX_INPUT_SIZE) return NULL;
+    int bound = LZ4_compressBound((int)length);
+    uint8_t *compressed = malloc(COMPRESSION_HEADER_SIZE + (size_t)bound);
+    if (!compressed) return NULL;
+
+    int size = LZ4_compress_default(text, (char *)compressed + COMPRESSION_HEADER_SIZE, (int)length, bound);
+    if (size <= 0 || COMPRESSION_HEADER_SIZE + (size_t)size >= length) {
+        free(compressed);
+        return NULL;
+    }
+    delivery_put_u32(compressed, (uint32_t)length);
+    *compressed_length = COMPRESSION_HEADER_SIZE + (size_t)size;
+    return compressed;
+}
+
+// the length data decompresses to, 0 when it's corrupt or longer than max
+static inline size_t decompressed_length(const uint8_t *data, size_t length, size_t max)
+{
+    if (length < COMPRESSION_HEADER_SIZE) return 0;
+    uint32_t original = delivery_get_u32(data);
+    if (original > max || original > LZ4_MAX_INPUT_SIZE) return 0;
+    return original;
+}
+
+// decompresses into text, decompressed_length + 1 bytes of it, and nul terminates it
+static inline bool decompress_into(const uint8_t *data, size_t length, char *text, size_t original)
+{
+    int size = LZ4_decompress_safe((const char *)data + COMPRESSION_HEADER_SIZE, text,
+                                   (int)(length - COMPRESSION_HEADER_SIZE), (int)original);
+    if (size != (int)original) return false;
+    text[original] = '\0';
+    return true;
+}
+
+// the original text, nul terminated, NULL when it's corrupt or longer than max
+static inline char *decompress_message(const uint8_t *data, size_t length, size_t max, size_t *text_length)
+{
+    size_t original = decompressed_length(data, length, max);
+    if (original == 0) return NULL;
+    char *text = malloc(original + 1);
+    if (!text) return NULL;
+    if (!decompress_into(data, length, text, original)) {
+        free(text);
+        return NULL;
+    }
+    if (text_length) *text_length = original;
+    return text;
+}
+
+#endif // COMPRESSION_H_
@@ -18,10 +18,34 @@
 #undef LOG_WARNING
 #include <raylib.h>
 
+// NOB_STRIP_PREFIX turns rename into nob_rename, which returns a bool. the key
+// files below (keydirectory.h, keystore.h) want the one from stdio.h
+#undef rename
+
 // encryption
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 
+#include "cluster.h"
+#include "delivery.h"
+#include "transfer.h"
+#include "chunking.h"
+#include "compression.h"
+#include "sessionkeys.h"
+#include "keydirectory.h"
+#include "bufferpool.h"
+#include "batch.h"
+#include "transport.h"
+
+// ipc when the router runs on this machine, tcp otherwise (see transport.h)
+#define ROUTER_ENDPOINT "ipc://router.sock|tcp://localhost:5555"
+
+// how much of the conversation to catch up on from the router's journal when connecting
+#define HISTORY_MESSAGES 1000
+
+// credit given to the router for history records, topped up at half
+#define HISTORY_WINDOW 512
+
 typedef struct {
     char** items;
     size_t capacity;
@@ -51,18 +75,37 @@ typedef struct {
     char *recipient_id;    
 } MessageData;
 
+// catching up on the conversation from the router's journal, receive thread only
+typedef struct {
+    bool asked;                 // the first request, for what the journal holds, went out
+    bool streaming;
+    uint32_t credit;            // records the router may still send
+    uint64_t received;
+    zlist_t *backlog;           // Message *, the UI thread moves them to the chat log
+} HistorySync;
+
 typedef struct {
     MessageData message_data;   
     pthread_mutex_t mutex;    
     pthread_cond_t send_cond;
     pthread_cond_t user_name_cond;
     pthread_cond_t connected;
+    pthread_cond_t window_cond; // room in a conversation's delivery window
     char* user_name; 
     char* user_input;
     char* recipient;
-    unsigned char* iv;
-    unsigned char* key;
+    SessionKeys *keys;          // per conversation keys, see sessionkeys.h
+    KeyCache *key_cache;        // the router's key directory, opened once logged in
+    BufferPool *buffers;        // ciphertext and plaintext, see bufferpool.h
     zsock_t *dealer;  
+    Cluster *cluster;           // membership when the router is a cluster, else NULL
+    const char *endpoints;      // comma separated routers to fail over between
+    Delivery *delivery;         // receipts and retransmits, see delivery.h
+    HistorySync history;
+    Transfers *transfers;       // files we offered and files being fetched, see transfer.h
+    Chunking *chunking;         // long messages going out and coming in parts
+    Batcher *batcher;           // data messages held back to go out together, see batch.h
+    CompressionPolicy *compress; // conversations that opted in to compression
     bool running;
     bool is_there_a_msg_to_send;
     bool username_processed;
@@ -185,118 +228,710 @@ void send_user_input(const char* user_input, char* recipient_id, Receiver *args)
     pthread_mutex_unlock(&args->mutex);
 }
 
-// encrypt plaintext into ciphertext using aes
-void aes_encrypt(unsigned char* key, unsigned char* iv, unsigned char* plaintext, unsigned char* ciphertext, size_t *ciphertext_len, size_t plaintext_len)
+// one cipher context per thread, set up again with every message's key and iv
+// instead of allocated for each. they live as long as their threads do
+EVP_CIPHER_CTX *thread_cipher_context(void)
 {
-    // printf("plaintext len: %zu\n", plaintext_len);
-    // create encryption context
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    static _Thread_local EVP_CIPHER_CTX *ctx = NULL;
+    if (!ctx) ctx = EVP_CIPHER_CTX_new();
+    return ctx;
+}
+
+// encrypts plaintext with AES-128-GCM into ciphertext, which is as long as the
+// plaintext and followed by the SESSION_TAG_SIZE tag. aad is authenticated along
+// with it but not encrypted. false when it failed
+bool aes_encrypt(const unsigned char *key, const unsigned char *iv, const unsigned char *aad, size_t aad_len,
+                 const unsigned char *plaintext, size_t plaintext_len, unsigned char *ciphertext)
+{
+    // this thread's encryption context
+    EVP_CIPHER_CTX *ctx = thread_cipher_context();
     if (!ctx) {
         fprintf(stderr, "Failed to create a context for encryption.\n");
-        return;
+        return false;
     }
 
-    // turn on byte padding 
-    EVP_CIPHER_CTX_set_padding(ctx, 1);
-
-    // init aes encryption
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv) != 1) {
+    int len;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, SESSION_IV_SIZE, NULL) != 1 ||
+        EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv) != 1) {
         fprintf(stderr, "Failed to initialize encryption.\n");
-        EVP_CIPHER_CTX_free(ctx);
-        return;
+        return false;
     }
-   
-    int len;    
-     // encrypt 16 byte blocks
-    if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) != 1) {
+    if (EVP_EncryptUpdate(ctx, NULL, &len, aad, (int)aad_len) != 1 ||
+        EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, (int)plaintext_len) != 1) {
         fprintf(stderr, "Failed to encrypt data.\n");
-        EVP_CIPHER_CTX_free(ctx);
-        return;
+        return false;
     }
-    int total_len = len; 
+    // a stream cipher, nothing is left for the final call
+    if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SESSION_TAG_SIZE, ciphertext + plaintext_len) != 1) {
+        fprintf(stderr, "Failed to finalize encryption.\n");
+        return false;
+    }
+    return true;
+}
 
-    assert(EVP_CIPHER_CTX_get_block_size(ctx) == 16);    
-    // int iv_length = EVP_CIPHER_CTX_get_iv_length(ctx);
-    // printf("iv length: %d\n", iv_length);
-    // int key_length = EVP_CIPHER_CTX_get_key_length(ctx);
-    // printf("key length: %d\n", key_length);
+// decrypts what aes_encrypt made of a message with the same aad, returns the
+// plaintext's length (0 when it failed: the wrong key, or the ciphertext, the
+// tag or the aad aren't what was sent). ciphertext_len includes the tag
+size_t aes_decrypt(const unsigned char *key, const unsigned char *iv, const unsigned char *aad, size_t aad_len,
+                   const unsigned char *ciphertext, size_t ciphertext_len, unsigned char *plaintext)
+{
+    if (ciphertext_len < SESSION_TAG_SIZE) return 0;
+    size_t plaintext_len = ciphertext_len - SESSION_TAG_SIZE;
 
-    // finalize
-    if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) {
-        fprintf(stderr, "Failed to finalize encryption.\n");
-        EVP_CIPHER_CTX_free(ctx);
+    // this thread's decryption context
+    EVP_CIPHER_CTX *ctx = thread_cipher_context();
+    if (!ctx) {
+        fprintf(stderr, "Failed to create context for decryption.\n");
+        return 0;
+    }
+
+    int len;
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, SESSION_IV_SIZE, NULL) != 1 ||
+        EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv) != 1) {
+        fprintf(stderr, "Failed to initialize decryption.\n");
+        return 0;
+    }
+    if (EVP_DecryptUpdate(ctx, NULL, &len, aad, (int)aad_len) != 1 ||
+        EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, (int)plaintext_len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SESSION_TAG_SIZE, (void *)(ciphertext + plaintext_len)) != 1) {
+        fprintf(stderr, "Failed to decrypt data.\n");
+        return 0;
+    }
+    // checks the tag, nothing of a message that fails it is used
+    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) return 0;
+    // nul terminate plaintext
+    plaintext[plaintext_len] = '\0';
+    return plaintext_len;
+}
+
+// [sender pub key][recipient][content][delivery header], args->mutex held
+// everything the dealer sends goes through here, skipped while no router can take
+// it. content is a pooled buffer (or NULL for an empty frame) that goes out as is,
+// the reference passed in is dropped either way
+bool send_delivery_frames(void *context, const char *peer, void *content, zframe_t *header)
+{
+    Receiver *args = (Receiver *)context;
+    if (!(zsock_events(args->dealer) & ZMQ_POLLOUT)) {
+        buffer_release(content);
+        zframe_destroy(&header);
+        return false;
+    }
+
+    // straight to the libzmq socket, a zmsg would copy the content into a new frame
+    void *socket = zsock_resolve(args->dealer);
+    const char *public_key = zcert_public_txt(args->message_data.user_certificate);
+    int last = header ? ZMQ_SNDMORE : 0;
+    bool sent = zmq_send(socket, public_key, strlen(public_key), ZMQ_SNDMORE) != -1 &&
+                zmq_send(socket, peer, strlen(peer), ZMQ_SNDMORE) != -1 &&
+                (content ? buffer_send(content, socket, last) : zmq_send(socket, NULL, 0, last) != -1) &&
+                (!header || zmq_send(socket, zframe_data(header), zframe_size(header), 0) != -1);
+    buffer_release(content);
+    zframe_destroy(&header);
+    return sent;
+}
+
+// data messages in bursts go out in batches, everything else straight away (see
+// batch.h). args->mutex held
+bool queue_delivery_frames(void *context, const char *peer, void *content, zframe_t *header)
+{
+    Receiver *args = (Receiver *)context;
+    return batcher_add(args->batcher, peer, content, header, send_delivery_frames, args);
+}
+
+// a peer's public key from the key directory cache, or its certificate in
+// keys_client/. a peer neither has is looked up on the router, the answer lands
+// in the cache for the next message. args->mutex held
+bool lookup_public_key(void *context, const char *peer, uint8_t *public_key)
+{
+    Receiver *args = (Receiver *)context;
+    bool revoked = false;
+    if (keycache_lookup(args->key_cache, peer, public_key, &revoked)) return !revoked;
+
+    char *location = zsys_sprintf("keys_client/%s.cert", peer);
+    zcert_t *cert = location ? zcert_load(location) : NULL;
+    zstr_free(&location);
+    if (cert) {
+        memcpy(public_key, zcert_public_key(cert), 32);
+        zcert_destroy(&cert);
+        return true;
+    }
+    if (args->connection_established && args->message_data.user_certificate) {
+        send_delivery_frames(args, peer, NULL, keydir_lookup_header());
+    }
+    return false;
+}
+
+// a peer's key changed in the directory, args->mutex held
+void forget_session(void *context, const char *peer)
+{
+    Receiver *args = (Receiver *)context;
+    session_keys_forget(args->keys, peer);
+}
+
+// [name][entries][entry or delta header] from the router's key directory, args->mutex held
+void handle_key_directory(Receiver *args, zframe_t *content, zframe_t *header)
+{
+    if (!args->key_cache) return;
+    if (delivery_header_type(header) == KEYDIR_ENTRY) {
+        keycache_entry(args->key_cache, header, content, forget_session, args);
         return;
     }
-    total_len += len;
-    *ciphertext_len = total_len;
+    // more to come, or starting over for a new directory
+    if (keycache_delta(args->key_cache, header, content, forget_session, args) &&
+        send_delivery_frames(args, "", NULL, keydir_sync_header(args->key_cache->header->version))) {
+        args->key_cache->asked = zclock_mono();
+    }
+}
+
+// the session keys know who we are once logged in, args->mutex held
+bool session_ready(Receiver *args)
+{
+    return args->user_name && args->message_data.user_certificate &&
+           session_keys_identity(args->keys, args->user_name, zcert_secret_key(args->message_data.user_certificate));
+}
 
-    // printf("Encrypted message length: %zu\n", *ciphertext_len);
+// [epoch][iv][ciphertext][tag] of plaintext for peer under the conversation's
+// current session key in a pooled buffer, NULL when there is none (no public key
+// for peer yet). flags are the delivery header's and bound the header bytes the
+// tag covers as well, see session_aad. args->mutex held
+void *encrypt_content(Receiver *args, const char *peer, const void *plaintext, size_t plaintext_len, uint8_t flags,
+                      const uint8_t *bound, size_t bound_len)
+{
+    uint64_t epoch = 0;
+    uint8_t key[SESSION_KEY_SIZE];
+    if (!session_ready(args) || !session_send_key(args->keys, peer, &epoch, key)) {
+        printf("No public key for %s yet, asked the router's key directory\n", peer);
+        return NULL;
+    }
 
-    EVP_CIPHER_CTX_free(ctx);
+    size_t ciphertext_len = plaintext_len + SESSION_TAG_SIZE;
+    unsigned char *data = buffer_get(args->buffers, SESSION_ENVELOPE_SIZE + ciphertext_len);
+    uint8_t aad[SESSION_AAD_MAX];
+    size_t aad_len = 0;
+    if (!data) {
+        OPENSSL_cleanse(key, sizeof(key));
+        return NULL;
+    }
+    delivery_put_u64(data, epoch);
+    bool sealed = RAND_bytes(data + 8, SESSION_IV_SIZE) == 1 &&
+                  session_aad(aad, &aad_len, data, flags, args->user_name, peer, bound, bound_len) &&
+                  aes_encrypt(key, data + 8, aad, aad_len, plaintext, plaintext_len, data + SESSION_ENVELOPE_SIZE);
+    OPENSSL_cleanse(key, sizeof(key));
+    if (!sealed) {
+        buffer_release(data);
+        return NULL;
+    }
+    buffer_set_length(data, SESSION_ENVELOPE_SIZE + ciphertext_len);
+    return data;
 }
 
-// decrypt the ciphertext
-void aes_decrypt(unsigned char* key, unsigned char* iv, unsigned char* ciphertext, unsigned char* plaintext, size_t ciphertext_len)
+// plaintext of a frame sender encrypted for recipient in a pooled buffer, nul
+// terminated, the caller releases it. NULL when it doesn't decrypt or was changed
+// on the way, flags and bound included. args->mutex held
+unsigned char *decrypt_envelope(Receiver *args, const char *sender, const char *recipient, zframe_t *frame,
+                                uint8_t flags, const uint8_t *bound, size_t bound_len, size_t *length)
 {
-    // printf("Received ciphertext length: %zu\n", ciphertext_len);
+    if (!frame || zframe_size(frame) <= SESSION_ENVELOPE_SIZE + SESSION_TAG_SIZE) return NULL;
+    const unsigned char *data = zframe_data(frame);
+    uint8_t aad[SESSION_AAD_MAX];
+    size_t aad_len = 0;
+    if (!session_aad(aad, &aad_len, data, flags, sender, recipient, bound, bound_len)) return NULL;
+    uint8_t key[SESSION_KEY_SIZE];
+    if (!session_ready(args) || !session_key(args->keys, sender, recipient, delivery_get_u64(data), key)) return NULL;
+
+    size_t ciphertext_len = zframe_size(frame) - SESSION_ENVELOPE_SIZE;
+    unsigned char *plaintext = buffer_get(args->buffers, ciphertext_len + 1);
+    size_t plaintext_len = plaintext
+        ? aes_decrypt(key, data + 8, aad, aad_len, data + SESSION_ENVELOPE_SIZE, ciphertext_len, plaintext)
+        : 0;
+    OPENSSL_cleanse(key, sizeof(key));
+    // nothing we send is empty, 0 is the wrong key or a corrupt frame
+    if (plaintext_len == 0) {
+        buffer_release(plaintext);
+        return NULL;
+    }
+    buffer_set_length(plaintext, plaintext_len);
+    if (length) *length = plaintext_len;
+    return plaintext;
+}
 
-    // create decryption context
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();    
-    if (!ctx) {
-        fprintf(stderr, "Failed to create context for decryption.\n");
+// text in a pooled buffer, nul terminated and decompressed first when flags say
+// it was compressed (see compression.h). NULL when it doesn't decompress
+unsigned char *pooled_text(Receiver *args, const void *data, size_t length, uint8_t flags)
+{
+    bool compressed = flags & DELIVERY_FLAG_COMPRESSED;
+    size_t text_len = compressed ? decompressed_length(data, length, CHUNK_MESSAGE_MAX) : length;
+    if (compressed && text_len == 0) return NULL;
+    unsigned char *text = buffer_get(args->buffers, text_len + 1);
+    if (!text) return NULL;
+    if (compressed && !decompress_into(data, length, (char *)text, text_len)) {
+        buffer_release(text);
+        return NULL;
+    }
+    if (!compressed) {
+        memcpy(text, data, length);
+        text[length] = '\0';
+    }
+    buffer_set_length(text, text_len);
+    return text;
+}
+
+// plaintext of a content frame from sender to recipient, pooled, the caller
+// releases it. flags are the delivery header's, a compressed message comes back
+// decompressed. bound as for decrypt_envelope
+char *decrypt_frame(Receiver *args, const char *sender, const char *recipient, zframe_t *frame, uint8_t flags,
+                    const uint8_t *bound, size_t bound_len)
+{
+    size_t plaintext_len = 0;
+    unsigned char *plaintext = decrypt_envelope(args, sender, recipient, frame, flags, bound, bound_len, &plaintext_len);
+    if (!plaintext || !(flags & DELIVERY_FLAG_COMPRESSED)) return (char *)plaintext;
+
+    unsigned char *text = pooled_text(args, plaintext, plaintext_len, flags);
+    buffer_release(plaintext);
+    return (char *)text;
+}
+
+// [sender id][content][record or end header] from the router's journal, args->mutex held
+void handle_history(Receiver *args, zframe_t *sender_id, zframe_t *content, zframe_t *header)
+{
+    HistorySync *history = &args->history;
+
+    if (delivery_header_type(header) == HISTORY_END && zframe_size(header) == HISTORY_END_SIZE) {
+        uint64_t first = delivery_get_u64(zframe_data(header) + 1);
+        uint64_t next = delivery_get_u64(zframe_data(header) + 9);
+        if (history->streaming) {
+            history->streaming = false;
+            printf("caught up on %llu messages with %s\n", (unsigned long long)history->received, args->recipient);
+            return;
+        }
+
+        // the answer to the first request, now ask for the tail of it
+        uint64_t from = next - first > HISTORY_MESSAGES ? next - HISTORY_MESSAGES : first;
+        if (from >= next) return;
+        history->streaming = send_delivery_frames(args, args->recipient, NULL, history_request_header(from, next, HISTORY_WINDOW));
+        if (!history->streaming) {
+            history->asked = false;
+            return;
+        }
+        history->credit = HISTORY_WINDOW;
+        printf("catching up on %llu messages with %s\n", (unsigned long long)(next - from), args->recipient);
         return;
     }
 
-    // turn on byte padding / should be on by default
-    EVP_CIPHER_CTX_set_padding(ctx, 1);
+    if ((zframe_size(header) != HISTORY_RECORD_SIZE && zframe_size(header) != HISTORY_RECORD_SIZE + 1) || !content) return;
+    uint8_t flags = zframe_size(header) > HISTORY_RECORD_SIZE ? zframe_data(header)[HISTORY_RECORD_SIZE] : 0;
+    if (history->credit > 0) history->credit--;
+    history->received++;
+
+    char *sender = zframe_strdup(sender_id);
+    // the conversation is between us and args->recipient, either way round
+    bool ours = sender && args->user_name && strcmp(sender, args->user_name) == 0;
+    char *plaintext = sender ? decrypt_frame(args, sender, ours ? args->recipient : args->user_name, content, flags, NULL, 0) : NULL;
+    Message *msg = calloc(1, sizeof(Message));
+    if (sender && plaintext && msg) {
+        // "[user1]: bla-bla-bla", on our side of the log when we sent it
+        char *line = zsys_sprintf("[%s]: %s", sender, plaintext);
+        msg->timestamp = (time_t)(delivery_get_u64(zframe_data(header) + 9) / 1000);
+        if (args->user_name && strcmp(sender, args->user_name) == 0) {
+            msg->sent_msg = line;
+            msg->sent = true;
+        } else {
+            msg->received_msg = line;
+            msg->received = true;
+        }
+        zlist_append(history->backlog, msg);
+        msg = NULL;
+    }
+    free(msg);
+    buffer_release(plaintext);
+    free(sender);
+
+    // keep the router busy, top the credit up before it runs out
+    if (history->streaming && history->credit <= HISTORY_WINDOW / 2 &&
+        send_delivery_frames(args, args->recipient, NULL, history_credit_header(HISTORY_WINDOW - history->credit))) {
+        history->credit = HISTORY_WINDOW;
+    }
+}
 
-    // init aes decryption
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv) != 1) {
-        fprintf(stderr, "Failed to initialize decryption.\n");
-        EVP_CIPHER_CTX_free(ctx);
+// offers the file at path to peer, its chunks are encrypted when peer fetches them
+// args->mutex held
+void offer_file(Receiver *args, const char *peer, const char *path)
+{
+    TransferOut *transfer = transfer_offer(args->transfers, peer, path);
+    if (!transfer) {
+        printf("Unable to send %s: %s\n", path, strerror(errno));
         return;
     }
 
-    assert(EVP_CIPHER_CTX_get_block_size(ctx) == 16);
-    // int iv_length = EVP_CIPHER_CTX_get_iv_length(ctx);
-    // printf("iv length: %d\n", iv_length);
-    // int key_length = EVP_CIPHER_CTX_get_key_length(ctx);
-    // printf("key length: %d\n", key_length);
+    // the name only, the recipient picks the directory
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    // the offer's id and size are bound to the name
+    zframe_t *header = transfer_header(TRANSFER_OFFER, transfer->id, transfer->size);
+    void *content = header ? encrypt_content(args, peer, name, strlen(name), 0, zframe_data(header), zframe_size(header)) : NULL;
+    if (!content) {
+        zframe_destroy(&header);
+        transfer_forget(args->transfers, transfer);
+        return;
+    }
 
-    // printf("decrypt--cipher text len: %zu\n", ciphertext_len);
-    int len;
-    int plaintext_len;
-    
-    // processes the data in chunks during decryption
-    if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, (int)ciphertext_len) != 1) {
-        fprintf(stderr, "Failed to decrypt data.\n");
-        EVP_CIPHER_CTX_free(ctx);
+    // [sender pub key][recipient][file name][offer header]
+    if (!send_delivery_frames(args, peer, content, header)) {
+        printf("Unable to offer %s to %s\n", path, peer);
+        transfer_forget(args->transfers, transfer);
         return;
-    }     
-    plaintext_len = len;
-    // printf("decrypt--cipher text len after update: %d\n", plaintext_len);
-    // printf("decrypted so far: %s\n", plaintext);
-
-    // finalize decryption
-    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) {
-        fprintf(stderr, "Failed to finalize decryption.\n");
-        EVP_CIPHER_CTX_free(ctx);
+    }
+    printf("offered %s (%llu bytes) to %s\n", path, (unsigned long long)transfer->size, peer);
+}
+
+// a line about a file for the chat log, the UI thread moves it there along with
+// history. takes line, args->mutex held
+void note_transfer(Receiver *args, char *line)
+{
+    Message *msg = calloc(1, sizeof(Message));
+    if (msg && line) {
+        msg->timestamp = time(NULL);
+        msg->received_msg = line;
+        msg->received = true;
+        zlist_append(args->history.backlog, msg);
+    } else {
+        free(msg);
+        zstr_free(&line);
+    }
+}
+
+// a received file is done, or given up on: tells the sender and notes it in the chat log
+void finish_transfer(Receiver *args, TransferIn *transfer)
+{
+    uint32_t status = transfer->failed ? TRANSFER_STATUS_FAILED : TRANSFER_STATUS_COMPLETE;
+    send_delivery_frames(args, transfer->peer, NULL, transfer_done_header(transfer->id, status));
+
+    double seconds = (zclock_mono() - transfer->started) / 1000.0;
+    if (transfer->failed) {
+        printf("Unable to receive %s, giving up on it\n", transfer->path);
+        remove(transfer->path);
+        note_transfer(args, zsys_sprintf("[%s]: sent a file, it couldn't be received", transfer->peer));
+    } else {
+        printf("received %s from %s, %llu bytes in %.1f s\n", transfer->path, transfer->peer,
+               (unsigned long long)transfer->size, seconds);
+        note_transfer(args, zsys_sprintf("[%s]: sent you %s", transfer->peer, transfer->path));
+    }
+    transfer_finish(args->transfers, transfer);
+}
+
+// "/accept <n>" starts fetching the offer numbered n, "/decline <n>" tells its sender no
+// args->mutex held
+void answer_offer(Receiver *args, const char *number, bool accept)
+{
+    TransferOffer *offer = transfer_take_offer(args->transfers, (uint32_t)strtoul(number, NULL, 10));
+    if (!offer) {
+        printf("No file offered as %s\n", number);
+        return;
+    }
+    if (!accept) {
+        send_delivery_frames(args, offer->peer, NULL, transfer_done_header(offer->id, TRANSFER_STATUS_DECLINED));
+        printf("declined %s from %s\n", offer->name, offer->peer);
+        transfer_offer_free(offer);
         return;
     }
-    plaintext_len += len;    
-    // nul terminate plaintext
-    plaintext[plaintext_len] = '\0'; 
 
-    EVP_CIPHER_CTX_free(ctx);
+    TransferRefusal refusal;
+    TransferIn *transfer = transfer_accept(args->transfers, offer, &refusal);
+    if (!transfer) {
+        if (refusal == TRANSFER_TOO_MANY) {
+            // it stays on offer until one of the others is done
+            printf("Already receiving %d files, accept %s again once one is done\n", TRANSFER_INCOMING_MAX, offer->name);
+            zlist_push(args->transfers->offers, offer);
+            return;
+        }
+        printf(refusal == TRANSFER_NO_SPACE ? "Not enough disk space for %s (%llu bytes)\n"
+                                            : "Unable to save %s (%llu bytes)\n",
+               offer->name, (unsigned long long)offer->size);
+        send_delivery_frames(args, offer->peer, NULL, transfer_done_header(offer->id, TRANSFER_STATUS_DECLINED));
+    } else if (transfer->size == 0) {
+        finish_transfer(args, transfer);
+    } else {
+        printf("receiving %s (%llu bytes) from %s\n", transfer->path, (unsigned long long)transfer->size, offer->peer);
+        transfer_fetch(transfer, send_delivery_frames, args);
+    }
+    transfer_offer_free(offer);
 }
 
-size_t calculate_padding(size_t text_len)
-{   
-    size_t remainder = text_len % 16;
-    size_t padding = 0;
-    if (remainder != 0) padding = 16 - remainder;
+// [sender id][content][transfer header], args->mutex held
+void handle_transfer(Receiver *args, zframe_t *sender_id, zframe_t *content, zframe_t *header)
+{
+    char *peer = zframe_strdup(sender_id);
+    if (!peer) return;
+
+    switch (delivery_header_type(header)) {
+    case TRANSFER_OFFER: {
+        // nothing is fetched until the user says so
+        char *name = content && zframe_size(header) == TRANSFER_OFFER_SIZE
+                   ? decrypt_frame(args, peer, args->user_name, content, 0, zframe_data(header), zframe_size(header))
+                   : NULL;
+        TransferOffer *offer = name && delivery_get_u64(zframe_data(header) + 9) <= TRANSFER_MAX_SIZE
+                             ? transfer_offered(args->transfers, peer, header, name) : NULL;
+        if (!offer) {
+            printf("Declined a file from %s, it's too big or too many are waiting\n", peer);
+            if (zframe_size(header) == TRANSFER_OFFER_SIZE) {
+                send_delivery_frames(args, peer, NULL, transfer_done_header(delivery_get_u64(zframe_data(header) + 1),
+                                                                            TRANSFER_STATUS_DECLINED));
+            }
+        } else {
+            note_transfer(args, zsys_sprintf("[%s]: offers %s (%llu bytes), /accept %u or /decline %u", peer,
+                                             offer->name, (unsigned long long)offer->size, offer->number, offer->number));
+        }
+        buffer_release(name);
+        break;
+    }
+    case TRANSFER_FETCH: {
+        const uint8_t *data = NULL;
+        size_t length = 0;
+        uint64_t offset = 0;
+        TransferOut *transfer = transfer_fetched(args->transfers, peer, header, &data, &length, &offset);
+        if (!transfer || length == 0) break;
+        if (!data) {
+            // the recipient gives up once nothing more comes
+            printf("%s changed while it was being sent to %s, stopped sending it\n", transfer->path, peer);
+            transfer_forget(args->transfers, transfer);
+            break;
+        }
 
-    return padding;
+        // data is the chunk pread into the transfers' buffer, encrypting it into a
+        // pooled buffer that goes out as the frame is its only copy. the transfer
+        // id and offset are bound to it, so it's only ever written where it was
+        // read from
+        zframe_t *chunk_header = transfer_header(TRANSFER_CHUNK, transfer->id, offset);
+        void *chunk = chunk_header ? encrypt_content(args, peer, data, length, 0, zframe_data(chunk_header), zframe_size(chunk_header)) : NULL;
+        if (!chunk) {
+            zframe_destroy(&chunk_header);
+            break;
+        }
+        // when the socket is full the fetch times out and comes again
+        send_delivery_frames(args, peer, chunk, chunk_header);
+        break;
+    }
+    case TRANSFER_CHUNK: {
+        TransferIn *transfer = transfer_incoming(args->transfers, peer, header);
+        if (!transfer || !content) break;
+        size_t length = 0;
+        unsigned char *plaintext = decrypt_envelope(args, peer, args->user_name, content, 0,
+                                                    zframe_data(header), zframe_size(header), &length);
+        if (!plaintext) break;
+        bool written = transfer_write(transfer, header, plaintext, length);
+        buffer_release(plaintext);
+
+        if (transfer->failed || (written && transfer_complete(transfer))) {
+            finish_transfer(args, transfer);
+        } else if (written) {
+            // the credit it used goes to the next chunk
+            transfer_fetch(transfer, send_delivery_frames, args);
+        }
+        break;
+    }
+    case TRANSFER_DONE: {
+        TransferOut *transfer = transfer_done(args->transfers, peer, header);
+        if (!transfer) break;
+        uint32_t status = delivery_get_u32(zframe_data(header) + 9);
+        if (status == TRANSFER_STATUS_COMPLETE) {
+            printf("%s received %s\n", peer, transfer->path);
+        } else if (status == TRANSFER_STATUS_DECLINED) {
+            printf("%s declined %s\n", peer, transfer->path);
+        } else {
+            printf("%s couldn't save %s\n", peer, transfer->path);
+        }
+        transfer_forget(args->transfers, transfer);
+        break;
+    }
+    }
+    free(peer);
+}
+
+// the next parts of long messages, as many as CHUNK_BURST and their share of the
+// window allow, args->mutex held
+void send_message_parts(Receiver *args)
+{
+    ChunkedSend *send = (ChunkedSend *)zlist_first(args->chunking->sending);
+    while (send) {
+        for (int i = 0; i < CHUNK_BURST && send->next < send->parts; i++) {
+            if (delivery_in_flight(args->delivery, send->peer) >= CHUNK_WINDOW) break;
+
+            // the group, the part's index and the count are bound to its content
+            uint64_t group = send->next == 0 ? delivery_next_group(args->delivery) : send->group;
+            uint8_t bound[DELIVERY_PART_BOUND_SIZE];
+            size_t bound_len = delivery_part_bound(bound, group, send->next, send->parts);
+            size_t length = chunk_length(send->length, send->next);
+            void *content = encrypt_content(args, send->peer, send->text + (size_t)send->next * CHUNK_SIZE, length,
+                                            send->flags, bound, bound_len);
+            if (!content) {
+                // no key for peer, the rest can't go either
+                send->next = send->parts;
+                break;
+            }
+            zframe_t *header = delivery_track_part(args->delivery, send->peer, content, group, send->next,
+                                                   send->parts, send->flags);
+            if (!header) {
+                buffer_release(content);
+                break;
+            }
+            send->group = group;
+            // a part the socket didn't take is retransmitted from the window
+            queue_delivery_frames(args, send->peer, content, header);
+            send->next++;
+        }
+
+        ChunkedSend *done = send->next == send->parts ? send : NULL;
+        send = (ChunkedSend *)zlist_next(args->chunking->sending);
+        if (done) {
+            zlist_remove(args->chunking->sending, done);
+            chunked_send_free(done);
+        }
+    }
+}
+
+// owed acks once a batch of messages has been read, and retransmits that are due
+void service_delivery(Receiver *args, bool batch_done)
+{
+    pthread_mutex_lock(&args->mutex);
+
+    // first thing once logged in: how much the router has journaled with our partner
+    if (!args->history.asked && args->registered && args->connection_established && args->message_data.user_certificate) {
+        args->history.asked = send_delivery_frames(args, args->recipient, NULL, history_request_header(0, 0, 0));
+    }
+
+    // the key directory cache is per user, it's synced once logged in and kept up
+    // to date from then on (see keydirectory.h)
+    if (!args->key_cache && args->registered && args->user_name) {
+        char *path = zsys_sprintf("keys_client/%s.directory", args->user_name);
+        args->key_cache = path ? keycache_open(path) : NULL;
+        if (!args->key_cache) printf("Unable to open the key directory cache, keys only come from keys_client/\n");
+        zstr_free(&path);
+        // our partner's key ahead of the first message, looked up if it isn't there yet
+        uint8_t public_key[32];
+        if (args->key_cache) lookup_public_key(args, args->recipient, public_key);
+    }
+    if (args->connection_established && args->message_data.user_certificate && keycache_sync_due(args->key_cache) &&
+        send_delivery_frames(args, "", NULL, keydir_sync_header(args->key_cache->header->version))) {
+        args->key_cache->asked = zclock_mono();
+    }
+
+    if (args->message_data.user_certificate) {
+        if (batch_done) delivery_flush_acks(args->delivery, send_delivery_frames, args);
+        // fetches whose chunk never came, and transfers nothing came for at all
+        transfers_tick(args->transfers, send_delivery_frames, args);
+        for (TransferIn *failed = transfers_failed(args->transfers); failed; failed = transfers_failed(args->transfers)) {
+            finish_transfer(args, failed);
+        }
+        send_message_parts(args);
+        chunking_expire(args->chunking);
+        // messages given up on make room in the window too
+        if (delivery_retransmit(args->delivery, queue_delivery_frames, args)) {
+            pthread_cond_broadcast(&args->window_cond);
+        }
+        // whatever this pass queued is all there is going to be
+        batcher_flush(args->batcher, false, send_delivery_frames, args);
+    }
+    pthread_mutex_unlock(&args->mutex);
+}
+
+// a data message or an ack from the router, or an unnumbered message from a dealer
+// that predates receipts. last is false for all but the last message of a batch
+// (see batch.h), those go to the chat log through the backlog so none of them is
+// overwritten before the UI thread saw it
+void handle_delivery(Receiver *args, zframe_t *sender_id, zframe_t *message_content, zframe_t *header, bool last)
+{
+    // a receipt for something we sent, or a retransmit of something we already showed
+    bool show = true;
+    if (sender_id && header && zframe_size(header) > 0 && zframe_size(sender_id) < 256) {
+        // on the stack, every message and every ack comes through here
+        char peer[256];
+        memcpy(peer, zframe_data(sender_id), zframe_size(sender_id));
+        peer[zframe_size(sender_id)] = '\0';
+        pthread_mutex_lock(&args->mutex);
+        if (zframe_data(header)[0] == DELIVERY_ACK) {
+            if (delivery_on_ack(args->delivery, peer, header)) pthread_cond_broadcast(&args->window_cond);
+            show = false;
+        } else if (!delivery_on_data(args->delivery, peer, header)) {
+            show = false;
+        }
+        bool batch_done = (last && !(zsock_events(args->dealer) & ZMQ_POLLIN)) || delivery_ack_owed(args->delivery, peer, false);
+        pthread_mutex_unlock(&args->mutex);
+        service_delivery(args, batch_done);
+    }
+    // one part of a long message, it's shown once the rest is there
+    uint64_t group = 0;
+    uint32_t part = 0, parts = 0;
+    bool is_part = delivery_part(header, &group, &part, &parts);
+    uint8_t flags = delivery_flags(header);
+
+    if (message_content && sender_id && show) {
+        pthread_mutex_lock(&args->mutex);
+
+        // encrypted message received / zframe_strdup would truncate at \0 byte
+        // mostly from whoever sent the last one, that copy of the name is kept
+        char *sender = args->message_data.sender_id && zframe_streq(sender_id, args->message_data.sender_id)
+            ? args->message_data.sender_id
+            : zframe_strdup(sender_id);
+        assert(sender != NULL);
+
+        // decrypt the message with the session key the sender used
+        // a part's group, index and count as its sender bound them
+        uint8_t bound[DELIVERY_PART_BOUND_SIZE];
+        size_t bound_len = is_part ? delivery_part_bound(bound, group, part, parts) : 0;
+        size_t plaintext_len = 0;
+        unsigned char* plaintext = decrypt_envelope(args, sender, args->user_name, message_content, flags,
+                                                    is_part ? bound : NULL, bound_len, &plaintext_len);
+        if (!plaintext) printf("Unable to decrypt a message from %s\n", sender);
+
+        if (is_part && plaintext) {
+            ChunkedReceive *whole = chunking_add(args->chunking, sender, group, part, parts, (char *)plaintext, plaintext_len);
+            buffer_release(plaintext);
+            plaintext = NULL;
+            if (whole) {
+                // decompressed straight out of the reassembly when it was compressed
+                plaintext = pooled_text(args, whole->text, whole->length, flags);
+                if (!plaintext) printf("Unable to decompress a message from %s\n", sender);
+                chunking_done(args->chunking, sender, group);
+            }
+        } else if (plaintext && (flags & DELIVERY_FLAG_COMPRESSED)) {
+            // compressed before it was encrypted, see compression.h
+            unsigned char *text = pooled_text(args, plaintext, plaintext_len, flags);
+            if (!text) printf("Unable to decompress a message from %s\n", sender);
+            buffer_release(plaintext);
+            plaintext = text;
+        }
+        if (!plaintext || !last) {
+            Message *msg = plaintext ? calloc(1, sizeof(Message)) : NULL;
+            char *line = msg ? zsys_sprintf("[%s]: %s", sender, plaintext) : NULL;
+            if (line) {
+                msg->timestamp = time(NULL);
+                msg->received_msg = line;
+                msg->received = true;
+                zlist_append(args->history.backlog, msg);
+            } else {
+                free(msg);
+            }
+            buffer_release(plaintext);
+            if (sender != args->message_data.sender_id) free(sender);
+            pthread_mutex_unlock(&args->mutex);
+            return;
+        }
+
+        if (args->message_data.sender_id && args->message_data.sender_id != sender) {
+            free(args->message_data.sender_id);
+        }
+
+        // pooled, the UI thread reads it until the next one replaces it
+        buffer_release(args->message_data.most_recent_received_message);
+
+        args->message_data.sender_id = sender;
+        args->message_data.most_recent_received_message = (char *)plaintext;
+
+        pthread_mutex_unlock(&args->mutex);
+    }
 }
 
 /* 
@@ -306,11 +941,23 @@ this function will run concurrent with the raylib window and the send_messages f
 void *receive_messages(void *args_ptr)
 {
     Receiver *args = (Receiver *)args_ptr;
+    int waiting = DELIVERY_TICK_MS;
     
     while (args->running && !zsys_interrupted) { // zsys_interrupted CZMQ: "Global signal indicator, TRUE when user presses Ctrl-C"
-        // this blocks until a message is received
+        // no longer than until the next retransmit is due (see timerwheel.h)
+        pthread_mutex_lock(&args->mutex);
+        int wait = delivery_timeout(args->delivery);
+        pthread_mutex_unlock(&args->mutex);
+        if (wait < 0 || wait > DELIVERY_TICK_MS) wait = DELIVERY_TICK_MS;
+        if (wait != waiting) {
+            zsock_set_rcvtimeo(args->dealer, wait);
+            waiting = wait;
+        }
+
+        // this blocks until a message is received, or the wait passed
         zmsg_t *reply = zmsg_recv(args->dealer); 
         if (!reply) {
+            service_delivery(args, true);
             continue;
         }
 
@@ -328,66 +975,75 @@ void *receive_messages(void *args_ptr)
             continue;
         }
 
-        // reply format [sender id][message content]
+        // reply format [sender id][message content][delivery header]
         zframe_t *sender_id = zmsg_pop(reply);
         zframe_t *message_content = zmsg_pop(reply);      
+        zframe_t *header = zmsg_pop(reply);
 
-        if (message_content && sender_id) {  
-            // check for shutdown message
-            char* shutdown_msg = zframe_strdup(message_content);             
-            if (strcmp(shutdown_msg, "/shutdown") == 0){
-                printf("Shutting down...\n");
-                zframe_destroy(&message_content);
-                zframe_destroy(&sender_id);
-                zmsg_destroy(&reply);
-                free(shutdown_msg);
-                return NULL;
-            }
-
-            // encrypted message received / zframe_strdup would truncate at \0 byte           
-            unsigned char* ciphertext = zframe_data(message_content);
-            char *sender = zframe_strdup(sender_id);
-
-            assert(ciphertext != NULL);
-            assert(sender != NULL);
+        // records and the end of a history stream, from the router's journal
+        char type = delivery_header_type(header);
+        if (sender_id && (type == HISTORY_RECORD || type == HISTORY_END)) {
+            pthread_mutex_lock(&args->mutex);
+            handle_history(args, sender_id, message_content, header);
+            pthread_mutex_unlock(&args->mutex);
+            zframe_destroy(&header);
+            zframe_destroy(&message_content);
+            zframe_destroy(&sender_id);
+            zmsg_destroy(&reply);
+            continue;
+        }
 
+        // the router's key directory, into the cache
+        if (keydir_is_reply(header)) {
             pthread_mutex_lock(&args->mutex);
+            handle_key_directory(args, message_content, header);
+            pthread_mutex_unlock(&args->mutex);
+            zframe_destroy(&header);
+            zframe_destroy(&message_content);
+            zframe_destroy(&sender_id);
+            zmsg_destroy(&reply);
+            continue;
+        }
 
-            size_t ciphertext_len = zframe_size(message_content);
-
-            // the evp encryption already does the padding for you, but just in case add it manually           
-            size_t padding = calculate_padding(ciphertext_len);
-            size_t total = ciphertext_len + padding;
-
-            // allocate memory for the plaintext + a bonus 16
-            unsigned char* plaintext = (unsigned char*)malloc(total + 16);
-            if (!plaintext){
-                printf("ERROR: buy more Ram!\n");
-                // pthread_mutex_unlock(&args->mutex); 
-                // zframe_destroy(&message_content);
-                // zframe_destroy(&sender_id);
-                // zframe_destroy(&recipient_id);
-                // zframe_destroy(&sender_pub_key);
-                // zmsg_destroy(&reply);
-                return NULL;
-            }
-                    
-            // decrypt the message with aes  
-            aes_decrypt(args->key, args->iv, ciphertext, plaintext, total);
+        // a file being offered or fetched, none of it goes through the chat itself
+        if (sender_id && transfer_is_header(header)) {
+            pthread_mutex_lock(&args->mutex);
+            handle_transfer(args, sender_id, message_content, header);
+            pthread_mutex_unlock(&args->mutex);
+            zframe_destroy(&header);
+            zframe_destroy(&message_content);
+            zframe_destroy(&sender_id);
+            zmsg_destroy(&reply);
+            continue;
+        }
 
-            if (args->message_data.sender_id) {
-                free(args->message_data.sender_id);
-            }
+        // check for shutdown message, it's the only thing that comes without a header
+        if (sender_id && message_content && delivery_header_type(header) == 0 &&
+            zframe_streq(message_content, "/shutdown")) {
+            printf("Shutting down...\n");
+            zframe_destroy(&header);
+            zframe_destroy(&message_content);
+            zframe_destroy(&sender_id);
+            zmsg_destroy(&reply);
+            return NULL;
+        }
 
-            if (args->message_data.most_recent_received_message) {
-                free(args->message_data.most_recent_received_message);
+        // several messages from one sender, each handled like it came on its own
+        uint32_t count = batch_count(header);
+        if (sender_id && message_content && count > 0) {
+            size_t offset = 0;
+            BatchRecord record;
+            for (uint32_t i = 0; i < count && batch_next(zframe_data(message_content), zframe_size(message_content), &offset, &record); i++) {
+                zframe_t *content = zframe_new(record.content, record.content_length);
+                zframe_t *record_header = zframe_new(record.header, record.header_length);
+                handle_delivery(args, sender_id, content, record_header, i + 1 == count);
+                zframe_destroy(&record_header);
+                zframe_destroy(&content);
             }
-
-            args->message_data.sender_id = sender;
-            args->message_data.most_recent_received_message = (char *)plaintext;
-             
-            pthread_mutex_unlock(&args->mutex);
+        } else {
+            handle_delivery(args, sender_id, message_content, header, true);
         }
+        zframe_destroy(&header);
         zframe_destroy(&message_content);
         zframe_destroy(&sender_id);
         zmsg_destroy(&reply); 
@@ -404,7 +1060,20 @@ void *send_messages(void *args_ptr)
 
         while (!args->is_there_a_msg_to_send && args->running) {   
             // if there is no message to send, wait for the thread to be signalled (idle before then)
-            pthread_cond_wait(&args->send_cond, &args->mutex);
+            // a batch being held goes out once no more messages came in for it
+            int timeout = batcher_timeout(args->batcher);
+            if (timeout < 0) {
+                pthread_cond_wait(&args->send_cond, &args->mutex);
+            } else if (timeout == 0) {
+                batcher_flush(args->batcher, true, send_delivery_frames, args);
+            } else {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += (long)timeout * 1000000;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000;
+                deadline.tv_nsec %= 1000000000;
+                pthread_cond_timedwait(&args->send_cond, &args->mutex, &deadline);
+            }
         }
 
         // when thread gets woken up by a signal on shutdown, break out of the loop
@@ -465,55 +1134,90 @@ void *send_messages(void *args_ptr)
             continue;
         }
 
-        size_t plaintext_len = strlen(args->message_data.message_to_send);
-        size_t padding = calculate_padding(plaintext_len);  
-        size_t ciphertext_len = plaintext_len + padding; 
-       
-        unsigned char *plaintext = (unsigned char*)args->message_data.message_to_send;
-        unsigned char *ciphertext = (unsigned char *)malloc(ciphertext_len + 16);
-        if (!ciphertext) {
-            printf("ERROR: buy more Ram!\n");
+        // "/send <path>" offers a file instead, the recipient fetches it in chunks
+        if (strncmp(args->message_data.message_to_send, "/send ", 6) == 0) {
+            offer_file(args, args->message_data.recipient_id, args->message_data.message_to_send + 6);
+            args->is_there_a_msg_to_send = false;
             pthread_mutex_unlock(&args->mutex);
-            break;
-        }     
+            continue;
+        }
 
-        aes_encrypt(args->key, args->iv, plaintext, ciphertext, &ciphertext_len, plaintext_len);    
+        // "/accept <n>" or "/decline <n>" answers a file offer
+        if (strncmp(args->message_data.message_to_send, "/accept ", 8) == 0 ||
+            strncmp(args->message_data.message_to_send, "/decline ", 9) == 0) {
+            bool accept = args->message_data.message_to_send[1] == 'a';
+            answer_offer(args, args->message_data.message_to_send + (accept ? 8 : 9), accept);
+            args->is_there_a_msg_to_send = false;
+            pthread_mutex_unlock(&args->mutex);
+            continue;
+        }
 
-        zmsg_t *msg = zmsg_new();
+        // "/compress on" or "/compress off", for this conversation only
+        if (strncmp(args->message_data.message_to_send, "/compress ", 10) == 0) {
+            bool enabled = strcmp(args->message_data.message_to_send + 10, "on") == 0;
+            compression_set(args->compress, args->message_data.recipient_id, enabled);
+            printf("compression %s for %s\n", enabled ? "on" : "off", args->message_data.recipient_id);
+            args->is_there_a_msg_to_send = false;
+            pthread_mutex_unlock(&args->mutex);
+            continue;
+        }
 
-        // char* self_id = zsock_identity(args->dealer);      
+        // compressed ahead of the encryption when the conversation opted in, see compression.h
+        size_t plaintext_len = strlen(args->message_data.message_to_send);
+        unsigned char *plaintext = (unsigned char*)args->message_data.message_to_send;
+        uint8_t *compressed = NULL;
+        uint8_t flags = 0;
+        if (compression_enabled(args->compress, args->message_data.recipient_id)) {
+            size_t compressed_len = 0;
+            compressed = compress_message(args->message_data.message_to_send, plaintext_len, &compressed_len);
+            if (compressed) {
+                plaintext = compressed;
+                plaintext_len = compressed_len;
+                flags = DELIVERY_FLAG_COMPRESSED;
+            }
+        }
+
+        // a long message goes out in parts between everything else, see chunking.h
+        if (chunking_queue(args->chunking, args->message_data.recipient_id, (const char *)plaintext, plaintext_len, flags)) {
+            free(compressed);
+            send_message_parts(args);
+            args->is_there_a_msg_to_send = false;
+            pthread_mutex_unlock(&args->mutex);
+            continue;
+        }
 
-        // Return public part of key pair as 32-byte binary string 
-        // const byte *sender_pub_key = zcert_public_key(args->message_data.user_certificate);
+        // too much of this conversation is unacked, wait for receipts (or retransmits giving up)
+        while (args->running && delivery_window_full(args->delivery, args->message_data.recipient_id)) {
+            printf("waiting for %s to acknowledge earlier messages...\n", args->message_data.recipient_id);
+            pthread_cond_wait(&args->window_cond, &args->mutex);
+        }
+        if (!args->running) {
+            free(compressed);
+            pthread_mutex_unlock(&args->mutex);
+            break;
+        }
 
-        // z85 armored string
-        const char* sender_pub_key_str = zcert_public_txt(args->message_data.user_certificate);
+        // encrypted with this conversation's session key into a pooled buffer, see sessionkeys.h
+        void *content = encrypt_content(args, args->message_data.recipient_id, plaintext, plaintext_len, flags, NULL, 0);
+        free(compressed);
+        if (!content) {
+            args->is_there_a_msg_to_send = false;
+            pthread_mutex_unlock(&args->mutex);
+            continue;
+        }
 
         char* recipient_id = args->message_data.recipient_id;
         assert(recipient_id != NULL);
 
-        // char* sender_id = zsock_identity(args->dealer);
-        // assert(sender_id != NULL);
+        // the window holds on to the same buffer until the recipient acks it, no copy
+        zframe_t *header = delivery_track_part(args->delivery, recipient_id, content, 0, 0, 0, flags);
 
-        // not encrypted 
-        // zframe_t *recip_id = zframe_new(recipient_id, strlen(recipient_id));
-        // zframe_t *content = zframe_new(args->message_data.message_to_send, strlen(args->message_data.message_to_send));
+        // [sender pub key][recipient][message_content][delivery header]
+        printf("message size before sending: %zu\n", buffer_length(content));
 
-        // encrypted
-        zframe_t *sender_pub = zframe_new(sender_pub_key_str, strlen(sender_pub_key_str));
-        zframe_t *recip_id = zframe_new(recipient_id, strlen(recipient_id));
-        zframe_t *content = zframe_new(ciphertext, ciphertext_len);
-        
-        // [sender pub key][recipient][message_content]
-        zmsg_append(msg, &sender_pub);
-        zmsg_append(msg, &recip_id);
-        zmsg_append(msg, &content);
-        
-        zmsg_print(msg);
-        printf("message size before sending: %zu\n", zmsg_size(msg));
-        // send
-     
-        zmsg_send(&msg, args->dealer);
+        // a send that fails is retransmitted from the window. in a burst it waits
+        // BATCH_LINGER_MS for the messages after it, see batch.h
+        queue_delivery_frames(args, recipient_id, content, header);
         args->is_there_a_msg_to_send = false;
 
         pthread_mutex_unlock(&args->mutex);    
@@ -607,10 +1311,33 @@ void *process_user_input(void *args_ptr)
     // unlock mutex before trying to connect
     pthread_mutex_unlock(&args->mutex);
 
+    // in a cluster the node owning our identity is the one messages for us end up at
+    char *endpoints = strdup(args->endpoints ? args->endpoints : ROUTER_ENDPOINT);
+    if (args->cluster) {
+        ClusterNode *owner = cluster_owner(args->cluster, username, strlen(username));
+        free(endpoints);
+        endpoints = strdup(owner->client_endpoint);
+        printf("%s is owned by cluster node %s\n", username, owner->name);
+    }
+
+    // primary and standby: only one of them is bound at a time. with immediate set
+    // nothing gets queued for the one that isn't there, so messages go to whichever
+    // router is up and follow it when the standby takes over
+    zsock_set_immediate(args->dealer, 1);
+
     printf("Connecting to server...\n");
-    int rc = zsock_connect(args->dealer, "tcp://localhost:5555"); 
+    int rc = 0;
+    char *endpoint = NULL;
+    for (char *next = strtok_r(endpoints, ",", &endpoint); next && rc == 0; next = strtok_r(NULL, ",", &endpoint)) {
+        // one router, whichever way to it is fastest
+        char *chosen = transport_choose(next);
+        rc = chosen ? zsock_connect(args->dealer, "%s", chosen) : -1;
+        if (rc != 0) printf("Unable to connect to %s\n", next);
+        else if (strchr(next, '|')) printf("Using %s\n", chosen);
+        free(chosen);
+    }
+    free(endpoints);
     if (rc != 0) {
-        printf("Unable to connect to port 5555\n");
         free(username);
         zcert_destroy(&server_cert);
         // pthread_mutex_unlock(&args->mutex);
@@ -660,7 +1387,7 @@ void free_message_data(MessageData *data)
 {
     if (data) {
         if (data->most_recent_received_message) {
-            free(data->most_recent_received_message);
+            buffer_release(data->most_recent_received_message);
             data->most_recent_received_message = NULL;
         }
         if (data->message_to_send) {
@@ -704,15 +1431,20 @@ void add_to_chat_log(Receiver *args, ChatHistory *chat_log)
     assert(sender != NULL);
 
     // prefixing the message with a log "[user1]: bla-bla-bla"
-    size_t format_buffer = 5 + strlen(sender) + strlen(inc_msg); // 5: '[]: + " " + null terminator'
-    char msg_buffer[format_buffer];
-    snprintf(msg_buffer, sizeof(msg_buffer), "[%s]: %s", sender, inc_msg);
+    // (on the heap, a message put back together from parts can be megabytes)
+    char *msg_buffer = zsys_sprintf("[%s]: %s", sender, inc_msg);
+    if (!msg_buffer) {
+        printf("ERROR: buy more Ram! cannot format msg_buffer (add to chatlog)\n");
+        pthread_mutex_unlock(&args->mutex);
+        return;
+    }
 
     // if chat_log is not empty, check the last received message
     for (int i = chat_log->count - 1; i >= 0; i--) {
         if (chat_log->items[i].received) {       
             // compare to see if it's a fresh message or if it's already been seen, return in that case         
             if (strcmp(chat_log->items[i].received_msg, msg_buffer) == 0) {
+                zstr_free(&msg_buffer);
                 pthread_mutex_unlock(&args->mutex);
                 return;
             }
@@ -721,11 +1453,7 @@ void add_to_chat_log(Receiver *args, ChatHistory *chat_log)
     }        
 
     Message msg = {0};
-    msg.received_msg = strdup(msg_buffer);
-    if (!msg.received_msg) {
-        printf("ERROR: buy more Ram! cannot strdup msg_buffer (add to chatlog)\n");
-        return;
-    }
+    msg.received_msg = msg_buffer;
     msg.received = true;
     msg.timestamp = current_time;
     da_append(chat_log, msg);
@@ -751,13 +1479,9 @@ void add_sent_message_to_chat_log(Receiver *args, ChatHistory *chat_log)
     char *sender = zsock_identity(args->dealer);
     assert(sender != NULL);
 
-    size_t format_buffer = 5 + strlen(sender) + strlen(sent_message); // 5: '[]: + " " + null terminator'
-    char msg_buffer[format_buffer];
-    snprintf(msg_buffer, sizeof(msg_buffer), "[%s]: %s", sender, sent_message);
-
     Message msg = {0};
-    // allocate memory for sent_msg
-    msg.sent_msg = strdup(msg_buffer); 
+    // allocate memory for sent_msg (on the heap, a pasted message can be megabytes)
+    msg.sent_msg = zsys_sprintf("[%s]: %s", sender, sent_message);
     if (!msg.sent_msg) {
         printf("ERROR: buy more Ram, cannot strdup msg_buffer (sent)!\n");
         // free(sender);
@@ -808,13 +1532,13 @@ bool check_for_new_message(Receiver *args, ChatHistory *chat_log)
     char *inc_msg = args->message_data.most_recent_received_message;   
     assert(inc_msg != NULL);
 
-    size_t format_buffer = 5 + strlen(sender) + strlen(inc_msg); // 5: '[]: + " " + null terminator'
-    char msg_buffer[format_buffer];
-    snprintf(msg_buffer, sizeof(msg_buffer), "[%s]: %s", sender, inc_msg);
+    // on the heap, a message put back together from parts can be megabytes
+    char *msg_buffer = zsys_sprintf("[%s]: %s", sender, inc_msg);
     
     // compare the most recent received message with the final entry in chat log
     // if they differ, it's new and should be added to the chat log
-    bool new = (strcmp(msg_buffer, latest_received_message) != 0);
+    bool new = !msg_buffer || strcmp(msg_buffer, latest_received_message) != 0;
+    zstr_free(&msg_buffer);
     // printf("result of strcmp for new msg check: %d\n", new);
 
     pthread_mutex_unlock(&args->mutex);
@@ -822,6 +1546,18 @@ bool check_for_new_message(Receiver *args, ChatHistory *chat_log)
     return new;    
 }
 
+// messages caught up on from the router's journal, a bounded number per frame
+void add_history_to_chat_log(Receiver *args, ChatHistory *chat_log)
+{
+    pthread_mutex_lock(&args->mutex);
+    for (int i = 0; i < HISTORY_WINDOW && zlist_size(args->history.backlog) > 0; i++) {
+        Message *msg = (Message *)zlist_pop(args->history.backlog);
+        da_append(chat_log, *msg);
+        free(msg);
+    }
+    pthread_mutex_unlock(&args->mutex);
+}
+
 // TODO: add text wrapping somehow
 // use raylib’s MeasureText() for measuring pixel width.
 // split the string on spaces/newlines, 
@@ -1244,6 +1980,8 @@ void init_raylib(Receiver *args)
                 free_user_input(&input, &user_string);        
             }
             
+            add_history_to_chat_log(args, &chat_log);
+
             // set the message_received flag to true if there is a new message
             if (!new_message_received) {
                 new_message_received = check_for_new_message(args, &chat_log);
@@ -1264,6 +2002,7 @@ void init_raylib(Receiver *args)
     args->running = false;
     args->is_there_a_msg_to_send = true;
     pthread_cond_signal(&args->send_cond);
+    pthread_cond_broadcast(&args->window_cond);
     pthread_mutex_unlock(&args->mutex);
 
     // dummy message on shutdown to kill off the blocking receive thread
@@ -1292,7 +2031,6 @@ void init_raylib(Receiver *args)
 // change usage to use username instead of cl arg   
 // account creation / database?
 // emoji support?
-// file sharing?
 // gui needs a lot of tweaks obviously -- logout button
 
 /* 
@@ -1321,40 +2059,59 @@ send
 recipient:
 use recipient's private key to decrypt the aes session key
 use the session key to decrypt the message
+
+done without sending the session key at all: both ends derive it from their CURVE keys
+with X25519 + HKDF, see sessionkeys.h. message form: [epoch][iv][AES-encrypted message]
 */
 
 int main(int argc, char* argv[])
 {   
     // run program and add intended target
     if (argc < 2) {
-        printf("Usage: %s conversation-partner\n", argv[0]);
+        printf("Usage: %s conversation-partner [cluster file | endpoint,endpoint...]\n", argv[0]);
         return 1;
     }
 
     char* recipient = argv[1];
+
+    Cluster *cluster = NULL;
+    const char *endpoints = NULL;
+    if (argc > 2 && strstr(argv[2], "://")) {
+        endpoints = argv[2];
+    } else if (argc > 2) {
+        cluster = cluster_load(argv[2], NULL);
+        if (!cluster) {
+            printf("Unable to read the cluster file %s\n", argv[2]);
+            return 1;
+        }
+    }
     // printf("assign user and recipient\n");  
     
     // do i need a context? 
     zsock_t *dealer = zsock_new(ZMQ_DEALER);
 
-    // TODO: figure out a non-hardcoded solution
-    // aes + iv need to be the same for whoever is communicating with one another for decryption to work
-    // aes key
-    unsigned char key[16] = {
-        0x3f, 0x5a, 0x1c, 0x8e,
-        0x4b, 0x2d, 0x7a, 0x9f,
-        0x6e, 0x0b, 0x3d, 0x8a,
-        0x5c, 0x1f, 0x2e, 0x4a
-    };
+    // the receive thread wakes up at least this often to send acks and retransmits
+    zsock_set_rcvtimeo(dealer, DELIVERY_TICK_MS);
+
+    // a new session per run, so the other side doesn't take our seq 1 for an old one
+    uint64_t session = 0;
+    if (RAND_bytes((unsigned char *)&session, sizeof(session)) != 1) session = (uint64_t)zclock_time();
+    Delivery *delivery = delivery_new(session);
+    zlist_t *backlog = zlist_new();
+    Transfers *transfers = transfers_new(session);
+    Chunking *chunking = chunking_new();
+    CompressionPolicy *compress = zhash_new();
+    // no key ships with the dealer, each conversation derives its own. peers' public
+    // keys are looked up with args, it's set once that exists
+    SessionKeys *keys = session_keys_new(lookup_public_key, NULL);
+    // what messages are encrypted into and decrypted out of, see bufferpool.h
+    BufferPool *buffers = buffer_pool_new();
+    Batcher *batcher = buffers ? batcher_new(buffers) : NULL;
+    if (!dealer || !delivery || !backlog || !transfers || !chunking || !compress || !keys || !buffers || !batcher) {
+        printf("ERROR: buy more RAM!\n");
+        return 1;
+    }
 
-    // initialization value
-    unsigned char iv[16] = {
-        0xa1, 0x2b, 0x3c, 0x4d,
-        0x5e, 0x6f, 0x70, 0x81,
-        0x92, 0x03, 0x14, 0x25,
-        0x36, 0x47, 0x58, 0x69
-    }; 
-    
     // initialize arguments to be passed around where needed (not thread-safe)
     Receiver args = {
         .message_data = {
@@ -1363,9 +2120,17 @@ int main(int argc, char* argv[])
             .recipient_id = NULL,
             .sender_id = NULL
         },
-        .key = key,
-        .iv = iv,
+        .keys = keys,
+        .buffers = buffers,
         .dealer = dealer,
+        .cluster = cluster,
+        .endpoints = endpoints,
+        .delivery = delivery,
+        .history = { .backlog = backlog },
+        .transfers = transfers,
+        .chunking = chunking,
+        .batcher = batcher,
+        .compress = compress,
         .running = true,
         .is_there_a_msg_to_send = false,
         .user_input = NULL,
@@ -1378,6 +2143,8 @@ int main(int argc, char* argv[])
         .registered = false
     };   
 
+    keys->lookup_context = &args;
+
     // mutex to prevent race conditions between the threads
     pthread_mutex_init(&args.mutex, NULL);
 
@@ -1391,6 +2158,9 @@ int main(int argc, char* argv[])
     // cond for socket connection
     pthread_cond_init(&args.connected, NULL);
 
+    // cond for room in a delivery window
+    pthread_cond_init(&args.window_cond, NULL);
+
     pthread_t process_user_input_thread;
     pthread_t receive_messages_thread;
     pthread_t send_messages_thread;
@@ -1440,8 +2210,25 @@ int main(int argc, char* argv[])
     // destroy conditions + mutex
     pthread_cond_destroy(&args.user_name_cond);
     pthread_cond_destroy(&args.send_cond);
+    pthread_cond_destroy(&args.window_cond);
     pthread_mutex_destroy(&args.mutex);
 
+    printf("delivered %llu, retransmitted %llu, not delivered %llu, duplicates %llu, acks sent %llu\n",
+           (unsigned long long)delivery->delivered, (unsigned long long)delivery->retransmitted,
+           (unsigned long long)delivery->failed, (unsigned long long)delivery->duplicates,
+           (unsigned long long)delivery->acks_sent);
+    printf("session keys: %llu key agreements, %llu keys derived\n",
+           (unsigned long long)keys->agreements, (unsigned long long)keys->derivations);
+    printf("buffer pool: %llu buffers allocated, %llu reused\n",
+           (unsigned long long)buffers->allocated, (unsigned long long)buffers->reused);
+    printf("batches: %llu sent, %llu messages in them\n",
+           (unsigned long long)batcher->batches, (unsigned long long)batcher->batched);
+    if (args.key_cache) {
+        printf("key directory: version %llu, %llu names, %llu cache hits, %llu misses\n",
+               (unsigned long long)args.key_cache->header->version, (unsigned long long)args.key_cache->header->count,
+               (unsigned long long)args.key_cache->hits, (unsigned long long)args.key_cache->misses);
+    }
+
     free_message_data(&args.message_data);
 
     if (args.user_input) {
@@ -1455,6 +2242,23 @@ int main(int argc, char* argv[])
     }
 
     zsock_destroy(&dealer);      
+    cluster_destroy(&cluster);
+    delivery_destroy(&delivery);
+    transfers_destroy(&transfers);
+    chunking_destroy(&chunking);
+    batcher_destroy(&batcher);
+    zhash_destroy(&compress);
+    session_keys_destroy(&keys);
+    keycache_close(&args.key_cache);
+    // after the socket and the window, the last of the buffers they held are back
+    buffer_pool_destroy(&buffers);
+    while (zlist_size(backlog) > 0) {
+        Message *msg = (Message *)zlist_pop(backlog);
+        free(msg->sent_msg);
+        free(msg->received_msg);
+        free(msg);
+    }
+    zlist_destroy(&backlog);
 
     return 0;
 }
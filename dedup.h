@@ -0,0 +1,128 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// duplicate suppression on the router
+//
+// besides its per-conversation seq, every data header carries a message number
+// the dealer counts across all of its conversations (see delivery.h), the same
+// number again on every retransmit. the router keeps one window per sender:
+// the highest number it forwarded plus a bitmap of the DEDUP_WINDOW_BITS numbers
+// below it, indexed by number modulo the window, so checking and marking are a
+// couple of bit operations and the state never grows with traffic.
+//
+// numbers older than the window can't be told apart any more, those are let
+// through and the recipient's own window sorts them out. a new session (the
+// dealer restarted) starts the window over.
+//
+// a mark only means the message got as far as libzmq, which can still lose it
+// (the recipient reconnects before its pipe is drained), and a mark that stayed
+// would then drop every retransmit. so marks go into the current of two
+// bitmaps, which becomes the previous one every DEDUP_GENERATION_MS and is
+// cleared the time after: a mark suppresses retransmits for one to two
+// generations, long enough for the first retransmit of a message whose ack is
+// merely late (see DELIVERY_RTO_MS) and over before the sender gives up.
+
+#define DEDUP_WINDOW_BITS 1024
+#define DEDUP_WORDS (DEDUP_WINDOW_BITS / 64)
+#define DEDUP_GENERATION_MS 1000
+
+typedef struct {
+    uint64_t session;
+    uint64_t highest;                   // 0 before the first message
+    int64_t generation_start;           // zclock_mono() the current bitmap was started
+    uint64_t bits[DEDUP_WORDS];         // bit n % DEDUP_WINDOW_BITS set once n was forwarded
+    uint64_t previous[DEDUP_WORDS];     // what was marked the generation before
+} DedupWindow;
+
+// moves on to a new generation once the current one is old enough
+static inline void dedup_age(DedupWindow *self, int64_t now)
+{
+    int64_t age = now - self->generation_start;
+    if (age < DEDUP_GENERATION_MS) return;
+    if (age < 2 * DEDUP_GENERATION_MS) {
+        memcpy(self->previous, self->bits, sizeof(self->bits));
+    } else {
+        memset(self->previous, 0, sizeof(self->previous));
+    }
+    memset(self->bits, 0, sizeof(self->bits));
+    self->generation_start = now;
+}
+
+static inline bool dedup_bit(const DedupWindow *self, uint64_t number)
+{
+    uint64_t index = number % DEDUP_WINDOW_BITS;
+    return ((self->bits[index / 64] | self->previous[index / 64]) >> (index % 64)) & 1;
+}
+
+static inline void dedup_clear(DedupWindow *self, uint64_t number)
+{
+    uint64_t index = number % DEDUP_WINDOW_BITS;
+    self->bits[index / 64] &= ~(1ULL << (index % 64));
+    self->previous[index / 64] &= ~(1ULL << (index % 64));
+}
+
+// clears the numbers from first up to and including last, fewer than DEDUP_WINDOW_BITS of them
+static inline void dedup_clear_range(DedupWindow *self, uint64_t first, uint64_t last)
+{
+    while (first <= last) {
+        uint64_t index = first % DEDUP_WINDOW_BITS;
+        uint64_t word = index / 64, bit = index % 64;
+        uint64_t count = 64 - bit;
+        if (count > last - first + 1) count = last - first + 1;
+        uint64_t mask = count == 64 ? ~0ULL : ((1ULL << count) - 1) << bit;
+        self->bits[word] &= ~mask;
+        self->previous[word] &= ~mask;
+        first += count;
+    }
+}
+
+// whether number was forwarded in this session recently enough to still count
+static inline bool dedup_seen(DedupWindow *self, uint64_t session, uint64_t number, int64_t now)
+{
+    if (self->session != session || number == 0 || number > self->highest) return false;
+    if (self->highest - number >= DEDUP_WINDOW_BITS) return false;
+    dedup_age(self, now);
+    return dedup_bit(self, number);
+}
+
+// called once the message is actually queued, a dropped one may come back
+static inline void dedup_mark(DedupWindow *self, uint64_t session, uint64_t number, int64_t now)
+{
+    if (number == 0) return;
+    if (self->session != session) {
+        memset(self, 0, sizeof(*self));
+        self->session = session;
+        self->generation_start = now;
+    }
+    dedup_age(self, now);
+
+    if (number > self->highest) {
+        // the numbers skipped over are new again
+        if (number - self->highest >= DEDUP_WINDOW_BITS) {
+            memset(self->bits, 0, sizeof(self->bits));
+            memset(self->previous, 0, sizeof(self->previous));
+        } else if (number - self->highest > 1) {
+            dedup_clear_range(self, self->highest + 1, number - 1);
+        }
+        self->highest = number;
+    } else if (self->highest - number >= DEDUP_WINDOW_BITS) {
+        return;
+    }
+
+    uint64_t index = number % DEDUP_WINDOW_BITS;
+    self->bits[index / 64] |= 1ULL << (index % 64);
+}
+
+// a forwarded message was dropped on its way out after all, its retransmit is let through
+static inline void dedup_forget(DedupWindow *self, uint64_t session, uint64_t number)
+{
+    if (self->session != session || number == 0 || number > self->highest) return;
+    if (self->highest - number >= DEDUP_WINDOW_BITS) return;
+    dedup_clear(self, number);
+}
+
+#endif // DEDUP_H_
@@ -0,0 +1,516 @@
+#ifndef DELIVERY_H_
+#define DELIVERY_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bufferpool.h"
+#include "timerwheel.h"
+
+// end-to-end delivery receipts
+//
+// every message a dealer sends carries a delivery header as its last frame, the
+// router passes it through untouched:
+//
+//     data  ['D'][session][seq][message]             seq counts per conversation from 1
+//     part  ['D'][session][seq][message][group][part (u32)][parts (u32)]
+//     ack   ['A'][session][cumulative][bitmap]       content frame is empty
+//
+// a part is one piece of a long message (see chunking.h), tracked and acked like
+// any other message. `group` is the message number of its first part.
+//
+// a data or part header one byte longer ends in flags about the content,
+// DELIVERY_FLAG_COMPRESSED when it was compressed before it was encrypted (see
+// compression.h). headers without flags are the same as flags 0.
+//
+// `message` counts across all of the dealer's conversations and stays the same on
+// a retransmit, the router drops what it already forwarded by it (see dedup.h).
+//
+// the recipient acks what it got: every seq up to `cumulative`, plus bit i of
+// `bitmap` for cumulative + 1 + i. acks are coalesced, the receive thread only
+// sends them once the socket has nothing more to read (or DELIVERY_ACK_EVERY
+// messages arrived without one), so a busy conversation costs one ack per batch.
+//
+// the sender keeps up to DELIVERY_WINDOW unacked messages per conversation and
+// retransmits only the ones whose timer ran out, with the timeout doubling on
+// every retry. after DELIVERY_RETRIES it gives up on the message. each message
+// in flight has its timer on a timing wheel (see timerwheel.h), so checking for
+// retransmits costs nothing until one is due, however many are in flight.
+//
+// `session` is picked at random when the dealer starts, a restarted dealer counts
+// from 1 again and the recipient resets its side of the conversation on seeing a
+// new one. acks for another session are ignored.
+
+#define DELIVERY_DATA           'D'
+#define DELIVERY_ACK            'A'
+#define DELIVERY_DATA_SIZE      25
+#define DELIVERY_PART_SIZE      41
+#define DELIVERY_ACK_SIZE       25
+#define DELIVERY_FLAG_COMPRESSED 0x01
+
+#define DELIVERY_WINDOW         64      // unacked messages per conversation, fits the ack bitmap
+#define DELIVERY_RTO_MS         500     // first retransmit
+#define DELIVERY_RTO_MAX_MS     8000
+#define DELIVERY_RETRIES        6
+#define DELIVERY_ACK_EVERY      32      // arrivals before an ack goes out even mid batch
+#define DELIVERY_TICK_MS        50      // how long the receive thread waits at most when no timer is due sooner
+
+// history sync (see journal.h) uses the same header frame, the recipient frame
+// names the conversation partner and the content frame is empty unless noted:
+//
+//     history  ['H'][from][to][credit (uint32)]    dealer -> router, [from, to), to 0 is open
+//     credit   ['C'][credit (uint32)]              dealer -> router, more for the running stream
+//     record   ['J'][seq][time][flags]             router -> dealer, with the journaled content
+//     end      ['E'][first][next]                  router -> dealer, the seqs the journal holds
+//
+// a request with no credit only asks for the end frame. a record's flags are
+// the ones its data header had, left off when there were none.
+
+#define HISTORY_REQUEST         'H'
+#define HISTORY_CREDIT          'C'
+#define HISTORY_RECORD          'J'
+#define HISTORY_END             'E'
+#define HISTORY_REQUEST_SIZE    21
+#define HISTORY_CREDIT_SIZE     5
+#define HISTORY_RECORD_SIZE     17
+#define HISTORY_END_SIZE        17
+
+typedef struct {
+    uint64_t seq;               // 0 when the slot is free
+    uint64_t message;           // dealer wide number, the router's dedup key
+    uint64_t group;             // first part's message number, for parts only
+    uint32_t part;
+    uint32_t parts;             // 0 for a whole message
+    uint8_t flags;
+    void *content;              // ciphertext as first sent, a pooled buffer (see bufferpool.h)
+    Timer retransmit;           // armed while in flight, data is the Conversation
+    int retries;
+} DeliverySlot;
+
+typedef struct {
+    char *peer;
+
+    // what we sent them
+    uint64_t next_seq;
+    uint64_t acked;             // every seq up to here was delivered
+    size_t in_flight;
+    DeliverySlot window[DELIVERY_WINDOW];   // indexed by seq % DELIVERY_WINDOW
+
+    // what they sent us
+    uint64_t peer_session;
+    uint64_t received;          // every seq up to here arrived
+    uint64_t received_bits;     // bit i: received + 1 + i arrived
+    size_t unacked;             // arrivals since the last ack, 0 when none is owed
+} Conversation;
+
+typedef struct {
+    uint64_t session;
+    uint64_t next_message;
+    zhash_t *conversations;     // peer id -> Conversation
+    TimerWheel timers;          // every message in flight's retransmit
+    uint64_t delivered;
+    uint64_t retransmitted;
+    uint64_t failed;
+    uint64_t duplicates;
+    uint64_t acks_sent;
+} Delivery;
+
+static inline void delivery_put_u64(uint8_t *buffer, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--, value >>= 8) buffer[i] = (uint8_t)value;
+}
+
+static inline uint64_t delivery_get_u64(const uint8_t *buffer)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = (value << 8) | buffer[i];
+    return value;
+}
+
+static inline void delivery_put_u32(uint8_t *buffer, uint32_t value)
+{
+    for (int i = 3; i >= 0; i--, value >>= 8) buffer[i] = (uint8_t)value;
+}
+
+static inline uint32_t delivery_get_u32(const uint8_t *buffer)
+{
+    return (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3];
+}
+
+// type byte of a header frame, 0 for an empty or missing one
+static inline char delivery_header_type(zframe_t *header)
+{
+    return header && zframe_size(header) > 0 ? (char)zframe_data(header)[0] : 0;
+}
+
+static inline zframe_t *history_request_header(uint64_t from, uint64_t to, uint32_t credit)
+{
+    uint8_t header[HISTORY_REQUEST_SIZE];
+    header[0] = HISTORY_REQUEST;
+    delivery_put_u64(header + 1, from);
+    delivery_put_u64(header + 9, to);
+    delivery_put_u32(header + 17, credit);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline zframe_t *history_credit_header(uint32_t credit)
+{
+    uint8_t header[HISTORY_CREDIT_SIZE];
+    header[0] = HISTORY_CREDIT;
+    delivery_put_u32(header + 1, credit);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline zframe_t *history_pair_header(char type, uint64_t a, uint64_t b)
+{
+    uint8_t header[17];
+    header[0] = (uint8_t)type;
+    delivery_put_u64(header + 1, a);
+    delivery_put_u64(header + 9, b);
+    return zframe_new(header, sizeof(header));
+}
+
+// a record header, with the flags its data header had when there were any
+static inline zframe_t *history_record_header(uint64_t seq, int64_t time, uint8_t flags)
+{
+    uint8_t header[HISTORY_RECORD_SIZE + 1];
+    header[0] = HISTORY_RECORD;
+    delivery_put_u64(header + 1, seq);
+    delivery_put_u64(header + 9, (uint64_t)time);
+    header[HISTORY_RECORD_SIZE] = flags;
+    return zframe_new(header, flags ? sizeof(header) : HISTORY_RECORD_SIZE);
+}
+
+static inline void conversation_free(void *data)
+{
+    Conversation *conversation = (Conversation *)data;
+    for (size_t i = 0; i < DELIVERY_WINDOW; i++) buffer_release(conversation->window[i].content);
+    free(conversation->peer);
+    free(conversation);
+}
+
+static inline Delivery *delivery_new(uint64_t session)
+{
+    Delivery *self = calloc(1, sizeof(Delivery));
+    if (!self) return NULL;
+    self->session = session;
+    self->next_message = 1;
+    timer_wheel_init(&self->timers, zclock_mono());
+    self->conversations = zhash_new();
+    if (!self->conversations) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+static inline void delivery_destroy(Delivery **self_p)
+{
+    Delivery *self = *self_p;
+    if (!self) return;
+    zhash_destroy(&self->conversations);
+    free(self);
+    *self_p = NULL;
+}
+
+static inline Conversation *delivery_conversation(Delivery *self, const char *peer)
+{
+    Conversation *conversation = (Conversation *)zhash_lookup(self->conversations, peer);
+    if (conversation) return conversation;
+
+    conversation = calloc(1, sizeof(Conversation));
+    if (!conversation) return NULL;
+    conversation->peer = strdup(peer);
+    conversation->next_seq = 1;
+    zhash_insert(self->conversations, peer, conversation);
+    zhash_freefn(self->conversations, peer, conversation_free);
+    return conversation;
+}
+
+static inline bool delivery_window_full(Delivery *self, const char *peer)
+{
+    Conversation *conversation = (Conversation *)zhash_lookup(self->conversations, peer);
+    return conversation && conversation->next_seq - conversation->acked > DELIVERY_WINDOW;
+}
+
+static inline size_t delivery_in_flight(Delivery *self, const char *peer)
+{
+    Conversation *conversation = (Conversation *)zhash_lookup(self->conversations, peer);
+    return conversation ? conversation->in_flight : 0;
+}
+
+static inline zframe_t *delivery_data_header(Delivery *self, const DeliverySlot *slot)
+{
+    uint8_t header[DELIVERY_PART_SIZE + 1];
+    header[0] = DELIVERY_DATA;
+    delivery_put_u64(header + 1, self->session);
+    delivery_put_u64(header + 9, slot->seq);
+    delivery_put_u64(header + 17, slot->message);
+    size_t size = DELIVERY_DATA_SIZE;
+    if (slot->parts > 0) {
+        delivery_put_u64(header + 25, slot->group);
+        delivery_put_u32(header + 33, slot->part);
+        delivery_put_u32(header + 37, slot->parts);
+        size = DELIVERY_PART_SIZE;
+    }
+    if (slot->flags) header[size++] = slot->flags;
+    return zframe_new(header, size);
+}
+
+static inline bool delivery_is_data(zframe_t *header)
+{
+    size_t size = header ? zframe_size(header) : 0;
+    return (size == DELIVERY_DATA_SIZE || size == DELIVERY_DATA_SIZE + 1 ||
+            size == DELIVERY_PART_SIZE || size == DELIVERY_PART_SIZE + 1) && zframe_data(header)[0] == DELIVERY_DATA;
+}
+
+// flags of a data header, 0 when it has none
+static inline uint8_t delivery_flags(zframe_t *header)
+{
+    if (!delivery_is_data(header)) return 0;
+    size_t size = zframe_size(header);
+    return size == DELIVERY_DATA_SIZE + 1 || size == DELIVERY_PART_SIZE + 1 ? zframe_data(header)[size - 1] : 0;
+}
+
+// session and message number of a data header, false for anything else
+static inline bool delivery_message_number(zframe_t *header, uint64_t *session, uint64_t *message)
+{
+    if (!delivery_is_data(header)) return false;
+    *session = delivery_get_u64(zframe_data(header) + 1);
+    *message = delivery_get_u64(zframe_data(header) + 17);
+    return true;
+}
+
+// group, index and count of a part, false for a whole message
+static inline bool delivery_part(zframe_t *header, uint64_t *group, uint32_t *part, uint32_t *parts)
+{
+    if (!delivery_is_data(header) || zframe_size(header) < DELIVERY_PART_SIZE) return false;
+    *group = delivery_get_u64(zframe_data(header) + 25);
+    *part = delivery_get_u32(zframe_data(header) + 33);
+    *parts = delivery_get_u32(zframe_data(header) + 37);
+    return true;
+}
+
+#define DELIVERY_PART_BOUND_SIZE 17
+
+// what a part's tag covers of its header, see session_aad: ['D'][group][part]
+// [parts]. parts are never journaled, so these don't change on the way and a
+// router can't reorder the parts or move one into another message
+static inline size_t delivery_part_bound(uint8_t *bound, uint64_t group, uint32_t part, uint32_t parts)
+{
+    bound[0] = DELIVERY_DATA;
+    delivery_put_u64(bound + 1, group);
+    delivery_put_u32(bound + 9, part);
+    delivery_put_u32(bound + 13, parts);
+    return DELIVERY_PART_BOUND_SIZE;
+}
+
+static inline void delivery_retransmit_due(void *context, Timer *timer);
+
+// puts a new part in the window, a whole message when parts is 0. group 0 makes
+// it the first part of a new group. returns its header frame or NULL when the
+// window is full, the window keeps a reference to the content for retransmits
+static inline zframe_t *delivery_track_part(Delivery *self, const char *peer, void *content,
+                                            uint64_t group, uint32_t part, uint32_t parts, uint8_t flags)
+{
+    Conversation *conversation = delivery_conversation(self, peer);
+    if (!conversation || conversation->next_seq - conversation->acked > DELIVERY_WINDOW) return NULL;
+
+    uint64_t seq = conversation->next_seq++;
+    DeliverySlot *slot = &conversation->window[seq % DELIVERY_WINDOW];
+    buffer_release(slot->content);
+    *slot = (DeliverySlot){
+        .seq = seq,
+        .message = self->next_message++,
+        .part = part,
+        .parts = parts,
+        .flags = flags,
+        .content = buffer_retain(content),
+    };
+    slot->group = parts > 0 && group == 0 ? slot->message : group;
+    timer_wheel_add(&self->timers, &slot->retransmit, zclock_mono() + DELIVERY_RTO_MS, delivery_retransmit_due, conversation);
+    conversation->in_flight++;
+    return delivery_data_header(self, slot);
+}
+
+// the group of a first part tracked next, its message number
+static inline uint64_t delivery_next_group(const Delivery *self)
+{
+    return self->next_message;
+}
+
+static inline zframe_t *delivery_track(Delivery *self, const char *peer, void *content)
+{
+    return delivery_track_part(self, peer, content, 0, 0, 0, 0);
+}
+
+static inline void delivery_release(Delivery *self, Conversation *conversation, DeliverySlot *slot, bool delivered)
+{
+    buffer_release(slot->content);
+    slot->content = NULL;
+    slot->seq = 0;
+    timer_wheel_cancel(&self->timers, &slot->retransmit);
+    conversation->in_flight--;
+    if (delivered) {
+        self->delivered++;
+    } else {
+        self->failed++;
+    }
+}
+
+// moves `acked` up past every slot that's no longer in flight
+static inline void delivery_advance(Conversation *conversation)
+{
+    while (conversation->acked + 1 < conversation->next_seq &&
+           conversation->window[(conversation->acked + 1) % DELIVERY_WINDOW].seq != conversation->acked + 1) {
+        conversation->acked++;
+    }
+}
+
+// an ack frame from peer, returns true when it freed room in the window
+static inline bool delivery_on_ack(Delivery *self, const char *peer, zframe_t *header)
+{
+    if (!header || zframe_size(header) != DELIVERY_ACK_SIZE || zframe_data(header)[0] != DELIVERY_ACK) return false;
+    const uint8_t *data = zframe_data(header);
+    if (delivery_get_u64(data + 1) != self->session) return false;
+
+    Conversation *conversation = (Conversation *)zhash_lookup(self->conversations, peer);
+    if (!conversation) return false;
+    uint64_t cumulative = delivery_get_u64(data + 9);
+    uint64_t bitmap = delivery_get_u64(data + 17);
+    size_t before = conversation->in_flight;
+
+    for (size_t i = 0; i < DELIVERY_WINDOW; i++) {
+        DeliverySlot *slot = &conversation->window[i];
+        if (slot->seq == 0) continue;
+        bool acked = slot->seq <= cumulative ||
+                     (slot->seq - cumulative - 1 < 64 && (bitmap >> (slot->seq - cumulative - 1)) & 1);
+        if (acked) delivery_release(self, conversation, slot, true);
+    }
+    delivery_advance(conversation);
+    return conversation->in_flight < before;
+}
+
+// a data header from peer, returns false for a message that already arrived
+static inline bool delivery_on_data(Delivery *self, const char *peer, zframe_t *header)
+{
+    if (!delivery_is_data(header)) return true;
+    const uint8_t *data = zframe_data(header);
+    uint64_t session = delivery_get_u64(data + 1);
+    uint64_t seq = delivery_get_u64(data + 9);
+
+    Conversation *conversation = delivery_conversation(self, peer);
+    if (!conversation || seq == 0) return true;
+
+    if (conversation->peer_session != session) {
+        conversation->peer_session = session;
+        conversation->received = 0;
+        conversation->received_bits = 0;
+    }
+
+    // already acked or beyond what the sender's window allows, ack again either way
+    conversation->unacked++;
+    if (seq <= conversation->received) {
+        self->duplicates++;
+        return false;
+    }
+    // past what the bitmap can record: showing it now would show its retransmit
+    // again, so it isn't, and the sender sends it once the window has moved on
+    uint64_t offset = seq - conversation->received - 1;
+    if (offset >= 64) return false;
+    if ((conversation->received_bits >> offset) & 1) {
+        self->duplicates++;
+        return false;
+    }
+
+    conversation->received_bits |= 1ULL << offset;
+    while (conversation->received_bits & 1) {
+        conversation->received++;
+        conversation->received_bits >>= 1;
+    }
+    return true;
+}
+
+static inline zframe_t *delivery_ack_header(Conversation *conversation)
+{
+    uint8_t header[DELIVERY_ACK_SIZE];
+    header[0] = DELIVERY_ACK;
+    delivery_put_u64(header + 1, conversation->peer_session);
+    delivery_put_u64(header + 9, conversation->received);
+    delivery_put_u64(header + 17, conversation->received_bits);
+    return zframe_new(header, sizeof(header));
+}
+
+// does peer's side of the conversation owe an ack right now, mid batch included
+static inline bool delivery_ack_owed(Delivery *self, const char *peer, bool batch_done)
+{
+    Conversation *conversation = (Conversation *)zhash_lookup(self->conversations, peer);
+    if (!conversation || conversation->unacked == 0) return false;
+    return batch_done || conversation->unacked >= DELIVERY_ACK_EVERY;
+}
+
+// takes the header frame and a reference to content, a pooled buffer or NULL for
+// an ack. returns false when the socket couldn't take the message right now
+typedef bool (*DeliverySend)(void *context, const char *peer, void *content, zframe_t *header);
+
+// sends every ack that's owed, one per conversation, an ack that didn't go out stays owed
+static inline void delivery_flush_acks(Delivery *self, DeliverySend send, void *context)
+{
+    for (Conversation *conversation = (Conversation *)zhash_first(self->conversations);
+         conversation; conversation = (Conversation *)zhash_next(self->conversations)) {
+        if (conversation->unacked == 0) continue;
+        if (!send(context, conversation->peer, NULL, delivery_ack_header(conversation))) continue;
+        conversation->unacked = 0;
+        self->acks_sent++;
+    }
+}
+
+// what a retransmit pass sends with, for the timers that come due in it
+typedef struct {
+    Delivery *delivery;
+    DeliverySend send;
+    void *context;
+    bool freed;
+} DeliveryRetransmit;
+
+// a message whose timer ran out goes again, or is given up on after DELIVERY_RETRIES
+static inline void delivery_retransmit_due(void *context, Timer *timer)
+{
+    DeliveryRetransmit *pass = (DeliveryRetransmit *)context;
+    Delivery *self = pass->delivery;
+    Conversation *conversation = (Conversation *)timer->data;
+    DeliverySlot *slot = timer_owner(timer, DeliverySlot, retransmit);
+
+    if (slot->retries == DELIVERY_RETRIES) {
+        printf("message %llu to %s was not delivered\n", (unsigned long long)slot->seq, conversation->peer);
+        delivery_release(self, conversation, slot, false);
+        delivery_advance(conversation);
+        pass->freed = true;
+        return;
+    }
+    slot->retries++;
+    int64_t timeout = (int64_t)DELIVERY_RTO_MS << slot->retries;
+    timer_wheel_add(&self->timers, timer, zclock_mono() + (timeout < DELIVERY_RTO_MAX_MS ? timeout : DELIVERY_RTO_MAX_MS),
+                    delivery_retransmit_due, conversation);
+    if (pass->send(pass->context, conversation->peer, buffer_retain(slot->content), delivery_data_header(self, slot))) {
+        self->retransmitted++;
+    }
+}
+
+// retransmits whatever timed out and gives up on what ran out of retries,
+// returns true when a message was given up on (which frees room in the window)
+static inline bool delivery_retransmit(Delivery *self, DeliverySend send, void *context)
+{
+    DeliveryRetransmit pass = { .delivery = self, .send = send, .context = context };
+    timer_wheel_advance(&self->timers, zclock_mono(), &pass);
+    return pass.freed;
+}
+
+// ms until the next retransmit is due, -1 with nothing in flight
+static inline int delivery_timeout(Delivery *self)
+{
+    return timer_wheel_timeout(&self->timers, zclock_mono());
+}
+
+#endif // DELIVERY_H_
@@ -0,0 +1,481 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// message journal
+//
+// the router appends every message it forwards to a journal of the conversation
+// it belongs to, so a dealer that was offline (or a second device of the same
+// user) can ask for what it missed by sequence number. the content is stored as
+// it arrived, encrypted by the dealers, the router never sees more than before.
+//
+// a conversation is the pair of identities, whoever sent the message. it gets
+// its own directory, named after both identities in hex, holding segment files
+// named after the first seq in them:
+//
+//     journal/7573657231-7573657232/00000000000000000001.seg
+//
+//     [record header][content][record header][content]...
+//
+// seqs count from 1 per conversation and are assigned here. a segment is closed
+// at JOURNAL_SEGMENT_BYTES and only the last JOURNAL_SEGMENTS are kept, so a
+// conversation never takes more than about 64MB on disk.
+//
+// the sparse index keeps the offset of every JOURNAL_INDEX_EVERY-th record per
+// segment, a read seeks to the closest one and scans forward from there. only the
+// JOURNAL_OPEN_MAX conversations used last are kept open and indexed in memory.
+
+#define JOURNAL_SEGMENT_BYTES   (4 * 1024 * 1024)
+#define JOURNAL_SEGMENTS        16
+#define JOURNAL_INDEX_EVERY     64
+#define JOURNAL_OPEN_MAX        256
+#define JOURNAL_MAX_CONTENT     (1024 * 1024)
+
+typedef struct {
+    uint64_t seq;
+    int64_t time;               // zclock_time() when it was journaled
+    uint32_t size;              // content bytes following the header
+    uint8_t from_second;        // sent by the second identity of the pair
+    uint8_t flags;              // the delivery header's flags (see delivery.h)
+    uint8_t reserved[2];
+} JournalRecordHeader;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t offset;
+} JournalIndexEntry;
+
+typedef struct {
+    uint64_t first_seq;
+    uint64_t size;              // bytes of complete records
+    size_t records;
+    JournalIndexEntry *index;
+    size_t index_count;
+    size_t index_capacity;
+} JournalSegment;
+
+typedef struct {
+    char *key;                  // directory name, also the key in Journal.open
+    char *path;
+    char *first;                // the pair, first < second
+    char *second;
+    JournalSegment segments[JOURNAL_SEGMENTS + 1];
+    size_t segment_count;
+    uint64_t next_seq;
+    int fd;                     // appending to the last segment, -1 until the first append
+    int64_t last_used;          // zclock_mono()
+} JournalConversation;
+
+typedef struct {
+    char *directory;
+    zhash_t *open;              // key -> JournalConversation
+    uint64_t appended;
+    uint64_t bytes;
+} Journal;
+
+// where a reader is in a conversation, survives the conversation being closed
+typedef struct {
+    char *key;
+    char *first;
+    char *second;
+    uint64_t next_seq;
+    uint64_t to_seq;            // exclusive, 0 reads up to whatever is there
+    FILE *file;
+    uint64_t segment_first;     // first seq of the segment file is open on
+} JournalCursor;
+
+static inline char *journal_hex(const char *identity)
+{
+    size_t len = strlen(identity);
+    char *hex = malloc(len * 2 + 1);
+    if (!hex) return NULL;
+    for (size_t i = 0; i < len; i++) sprintf(hex + i * 2, "%02x", (unsigned char)identity[i]);
+    hex[len * 2] = '\0';
+    return hex;
+}
+
+// the directory name of a conversation, identities in order so both ends agree
+static inline char *journal_key(const char *a, const char *b)
+{
+    if (strcmp(a, b) > 0) {
+        const char *swap = a;
+        a = b;
+        b = swap;
+    }
+    char *first = journal_hex(a);
+    char *second = journal_hex(b);
+    char *key = first && second ? zsys_sprintf("%s-%s", first, second) : NULL;
+    free(first);
+    free(second);
+    return key;
+}
+
+static inline void journal_segment_free(JournalSegment *segment)
+{
+    free(segment->index);
+    memset(segment, 0, sizeof(*segment));
+}
+
+static inline void journal_index_add(JournalSegment *segment, uint64_t seq, uint64_t offset)
+{
+    if (segment->records++ % JOURNAL_INDEX_EVERY != 0) return;
+    if (segment->index_count == segment->index_capacity) {
+        size_t capacity = segment->index_capacity ? segment->index_capacity * 2 : 64;
+        JournalIndexEntry *index = realloc(segment->index, capacity * sizeof(JournalIndexEntry));
+        if (!index) return;
+        segment->index = index;
+        segment->index_capacity = capacity;
+    }
+    segment->index[segment->index_count++] = (JournalIndexEntry){ seq, offset };
+}
+
+static inline char *journal_segment_path(const JournalConversation *conversation, uint64_t first_seq)
+{
+    return zsys_sprintf("%s/%020llu.seg", conversation->path, (unsigned long long)first_seq);
+}
+
+// indexes a segment, cutting off a record a crash left half written
+static inline bool journal_scan_segment(JournalConversation *conversation, JournalSegment *segment)
+{
+    char *path = journal_segment_path(conversation, segment->first_seq);
+    FILE *file = path ? fopen(path, "r+b") : NULL;
+    if (!file) {
+        zstr_free(&path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(file), &st) == -1) {
+        fclose(file);
+        zstr_free(&path);
+        return false;
+    }
+
+    JournalRecordHeader header;
+    uint64_t offset = 0;
+    while (offset + sizeof(header) <= (uint64_t)st.st_size &&
+           fread(&header, sizeof(header), 1, file) == 1 &&
+           header.size <= JOURNAL_MAX_CONTENT &&
+           offset + sizeof(header) + header.size <= (uint64_t)st.st_size &&
+           fseek(file, header.size, SEEK_CUR) == 0) {
+        journal_index_add(segment, header.seq, offset);
+        offset += sizeof(header) + header.size;
+        conversation->next_seq = header.seq + 1;
+    }
+    segment->size = offset;
+
+    if ((uint64_t)st.st_size > offset) {
+        if (ftruncate(fileno(file), offset) == -1) {
+            fclose(file);
+            zstr_free(&path);
+            return false;
+        }
+    }
+    fclose(file);
+    zstr_free(&path);
+    return true;
+}
+
+static inline int journal_compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static inline void journal_conversation_free(void *data)
+{
+    JournalConversation *conversation = (JournalConversation *)data;
+    if (conversation->fd != -1) close(conversation->fd);
+    for (size_t i = 0; i < conversation->segment_count; i++) journal_segment_free(&conversation->segments[i]);
+    free(conversation->key);
+    free(conversation->path);
+    free(conversation->first);
+    free(conversation->second);
+    free(conversation);
+}
+
+// reads the segments of a conversation from disk
+static inline JournalConversation *journal_load(Journal *self, const char *key, const char *a, const char *b)
+{
+    JournalConversation *conversation = calloc(1, sizeof(JournalConversation));
+    if (!conversation) return NULL;
+    conversation->fd = -1;
+    conversation->next_seq = 1;
+    conversation->key = strdup(key);
+    conversation->path = zsys_sprintf("%s/%s", self->directory, key);
+    conversation->first = strdup(strcmp(a, b) <= 0 ? a : b);
+    conversation->second = strdup(strcmp(a, b) <= 0 ? b : a);
+    if (!conversation->key || !conversation->path || !conversation->first || !conversation->second) {
+        journal_conversation_free(conversation);
+        return NULL;
+    }
+
+    uint64_t firsts[JOURNAL_SEGMENTS * 2];
+    size_t count = 0;
+    DIR *dir = opendir(conversation->path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            unsigned long long first;
+            char suffix[8];
+            if (sscanf(entry->d_name, "%20llu.%3s", &first, suffix) != 2 || strcmp(suffix, "seg") != 0) continue;
+            if (count < sizeof(firsts) / sizeof(firsts[0])) firsts[count++] = first;
+        }
+        closedir(dir);
+    } else if (errno != ENOENT) {
+        journal_conversation_free(conversation);
+        return NULL;
+    }
+
+    // newest JOURNAL_SEGMENTS only
+    qsort(firsts, count, sizeof(uint64_t), journal_compare_u64);
+    size_t skip = count > JOURNAL_SEGMENTS ? count - JOURNAL_SEGMENTS : 0;
+    for (size_t i = skip; i < count; i++) {
+        JournalSegment *segment = &conversation->segments[conversation->segment_count];
+        segment->first_seq = firsts[i];
+        if (journal_scan_segment(conversation, segment)) {
+            conversation->segment_count++;
+        } else {
+            journal_segment_free(segment);
+        }
+    }
+    return conversation;
+}
+
+static inline Journal *journal_new(const char *directory)
+{
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) return NULL;
+    Journal *self = calloc(1, sizeof(Journal));
+    if (!self) return NULL;
+    self->directory = strdup(directory);
+    self->open = zhash_new();
+    if (!self->directory || !self->open) {
+        free(self->directory);
+        zhash_destroy(&self->open);
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+static inline void journal_destroy(Journal **self_p)
+{
+    Journal *self = *self_p;
+    if (!self) return;
+    zhash_destroy(&self->open);
+    free(self->directory);
+    free(self);
+    *self_p = NULL;
+}
+
+// the open conversation between a and b, loading it (and closing the one used
+// longest ago) when it isn't
+static inline JournalConversation *journal_conversation(Journal *self, const char *a, const char *b)
+{
+    char *key = journal_key(a, b);
+    if (!key) return NULL;
+    JournalConversation *conversation = (JournalConversation *)zhash_lookup(self->open, key);
+    if (!conversation) {
+        if (zhash_size(self->open) >= JOURNAL_OPEN_MAX) {
+            JournalConversation *oldest = NULL;
+            for (JournalConversation *open = (JournalConversation *)zhash_first(self->open);
+                 open; open = (JournalConversation *)zhash_next(self->open)) {
+                if (!oldest || open->last_used < oldest->last_used) oldest = open;
+            }
+            if (oldest) zhash_delete(self->open, oldest->key);
+        }
+        conversation = journal_load(self, key, a, b);
+        if (conversation) {
+            zhash_insert(self->open, key, conversation);
+            zhash_freefn(self->open, key, journal_conversation_free);
+        }
+    }
+    free(key);
+    if (conversation) conversation->last_used = zclock_mono();
+    return conversation;
+}
+
+static inline uint64_t journal_first_seq(const JournalConversation *conversation)
+{
+    return conversation->segment_count ? conversation->segments[0].first_seq : conversation->next_seq;
+}
+
+// starts a new segment at next_seq, dropping the oldest past JOURNAL_SEGMENTS
+static inline bool journal_roll(JournalConversation *conversation)
+{
+    if (conversation->fd != -1) close(conversation->fd);
+    conversation->fd = -1;
+
+    // the directory is only made for a conversation that has something in it,
+    // asking for the history of one that doesn't leaves nothing behind
+    if (conversation->segment_count == 0 && mkdir(conversation->path, 0700) == -1 && errno != EEXIST) return false;
+
+    JournalSegment *segment = &conversation->segments[conversation->segment_count];
+    memset(segment, 0, sizeof(*segment));
+    segment->first_seq = conversation->next_seq;
+    char *path = journal_segment_path(conversation, segment->first_seq);
+    conversation->fd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600) : -1;
+    zstr_free(&path);
+    if (conversation->fd == -1) return false;
+    conversation->segment_count++;
+
+    if (conversation->segment_count > JOURNAL_SEGMENTS) {
+        char *oldest = journal_segment_path(conversation, conversation->segments[0].first_seq);
+        if (oldest) remove(oldest);
+        zstr_free(&oldest);
+        journal_segment_free(&conversation->segments[0]);
+        memmove(&conversation->segments[0], &conversation->segments[1],
+                (conversation->segment_count - 1) * sizeof(JournalSegment));
+        conversation->segment_count--;
+        memset(&conversation->segments[conversation->segment_count], 0, sizeof(JournalSegment));
+    }
+    return true;
+}
+
+// journals one message from sender to recipient, returns its seq or 0 on failure
+static inline uint64_t journal_append(Journal *self, const char *sender, const char *recipient,
+                                      const void *content, size_t size, uint8_t flags)
+{
+    if (size > JOURNAL_MAX_CONTENT) return 0;
+    JournalConversation *conversation = journal_conversation(self, sender, recipient);
+    if (!conversation) return 0;
+
+    JournalSegment *last = conversation->segment_count ? &conversation->segments[conversation->segment_count - 1] : NULL;
+    if (!last || (last->size > 0 && last->size + sizeof(JournalRecordHeader) + size > JOURNAL_SEGMENT_BYTES)) {
+        if (!journal_roll(conversation)) return 0;
+        last = &conversation->segments[conversation->segment_count - 1];
+    } else if (conversation->fd == -1) {
+        char *path = journal_segment_path(conversation, last->first_seq);
+        conversation->fd = path ? open(path, O_WRONLY | O_APPEND | O_CLOEXEC) : -1;
+        zstr_free(&path);
+        if (conversation->fd == -1) return 0;
+    }
+
+    JournalRecordHeader header = {
+        .seq = conversation->next_seq,
+        .time = zclock_time(),
+        .size = (uint32_t)size,
+        .from_second = strcmp(sender, conversation->second) == 0 && strcmp(sender, conversation->first) != 0,
+        .flags = flags,
+    };
+    struct iovec parts[2] = {
+        { &header, sizeof(header) },
+        { (void *)content, size },
+    };
+    ssize_t written = writev(conversation->fd, parts, 2);
+    if (written != (ssize_t)(sizeof(header) + size)) {
+        // cut off whatever made it, the next append starts clean
+        if (written > 0 && ftruncate(conversation->fd, last->size) == -1) {
+            close(conversation->fd);
+            conversation->fd = -1;
+        }
+        return 0;
+    }
+
+    journal_index_add(last, header.seq, last->size);
+    last->size += written;
+    conversation->next_seq++;
+    self->appended++;
+    self->bytes += written;
+    return header.seq;
+}
+
+static inline bool journal_cursor_init(JournalCursor *cursor, const char *a, const char *b,
+                                       uint64_t from_seq, uint64_t to_seq)
+{
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->key = journal_key(a, b);
+    cursor->first = strdup(strcmp(a, b) <= 0 ? a : b);
+    cursor->second = strdup(strcmp(a, b) <= 0 ? b : a);
+    cursor->next_seq = from_seq;
+    cursor->to_seq = to_seq;
+    return cursor->key && cursor->first && cursor->second;
+}
+
+static inline void journal_cursor_close(JournalCursor *cursor)
+{
+    if (cursor->file) fclose(cursor->file);
+    free(cursor->key);
+    free(cursor->first);
+    free(cursor->second);
+    memset(cursor, 0, sizeof(*cursor));
+}
+
+// opens the segment holding next_seq at the closest indexed record before it
+static inline bool journal_cursor_seek(JournalCursor *cursor, JournalConversation *conversation)
+{
+    size_t index = 0;
+    while (index + 1 < conversation->segment_count && conversation->segments[index + 1].first_seq <= cursor->next_seq) {
+        index++;
+    }
+    JournalSegment *segment = &conversation->segments[index];
+
+    uint64_t offset = 0;
+    size_t low = 0, high = segment->index_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (segment->index[mid].seq <= cursor->next_seq) {
+            offset = segment->index[mid].offset;
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (cursor->file) fclose(cursor->file);
+    char *path = journal_segment_path(conversation, segment->first_seq);
+    cursor->file = path ? fopen(path, "rb") : NULL;
+    zstr_free(&path);
+    cursor->segment_first = segment->first_seq;
+    return cursor->file && fseek(cursor->file, (long)offset, SEEK_SET) == 0;
+}
+
+// the next record in range, content is the caller's. false once the range (or
+// the journal so far) is exhausted
+static inline bool journal_cursor_next(Journal *self, JournalCursor *cursor, JournalRecordHeader *header, zframe_t **content)
+{
+    JournalConversation *conversation = journal_conversation(self, cursor->first, cursor->second);
+    if (!conversation || conversation->segment_count == 0) return false;
+
+    // what has rolled off is gone, carry on from the oldest that's left
+    if (cursor->next_seq < journal_first_seq(conversation)) cursor->next_seq = journal_first_seq(conversation);
+    if (cursor->next_seq >= conversation->next_seq) return false;
+    if (cursor->to_seq && cursor->next_seq >= cursor->to_seq) return false;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!cursor->file && !journal_cursor_seek(cursor, conversation)) return false;
+
+        // scan forward from wherever the index put us
+        while (fread(header, sizeof(*header), 1, cursor->file) == 1) {
+            if (header->size > JOURNAL_MAX_CONTENT) break;
+            if (header->seq < cursor->next_seq) {
+                if (fseek(cursor->file, header->size, SEEK_CUR) != 0) break;
+                continue;
+            }
+            *content = zframe_new(NULL, header->size);
+            if (!*content || (header->size && fread(zframe_data(*content), header->size, 1, cursor->file) != 1)) {
+                zframe_destroy(content);
+                break;
+            }
+            cursor->next_seq = header->seq + 1;
+            return true;
+        }
+
+        // end of the segment, the next one starts at next_seq
+        fclose(cursor->file);
+        cursor->file = NULL;
+    }
+    return false;
+}
+
+#endif // JOURNAL_H_
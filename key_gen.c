@@ -1,27 +1,113 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <czmq.h>
 
-int main(void)
+#include "bundle.h"
+
+// ./key_gen                        router, user1 and user2
+// ./key_gen <users> [threads]      router and user1..user<users>, plus keys/clients.bundle
+//
+// for load tests: keypairs are generated and saved on several threads, each one
+// taking its own slice of the users, and the bundle is written once they're done
+
+#define BUNDLE_PATH "keys/clients.bundle"
+
+typedef struct {
+    BundleRecord *records;
+    size_t first;                   // user numbers are index + 1
+    size_t last;
+    size_t failed;
+} KeyGenJob;
+
+static void *generate(void *args)
+{
+    KeyGenJob *job = (KeyGenJob *)args;
+    char path[128];
+
+    for (size_t i = job->first; i < job->last; i++) {
+        BundleRecord *record = &job->records[i];
+        zcert_t *cert = zcert_new();
+        if (!cert) {
+            job->failed++;
+            continue;
+        }
+        snprintf(record->name, sizeof(record->name), "user%zu", i + 1);
+        memcpy(record->public_key, zcert_public_key(cert), BUNDLE_KEY_SIZE);
+        memcpy(record->secret_key, zcert_secret_key(cert), BUNDLE_KEY_SIZE);
+
+        snprintf(path, sizeof(path), "keys/%s.cert", record->name);
+        if (zcert_save(cert, path) != 0) job->failed++;
+        zcert_destroy(&cert);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
 {
+    long users = argc > 1 ? atol(argv[1]) : 2;
+    long threads = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (users < 1 || threads < 1) {
+        printf("Usage: %s [users] [threads]\n", argv[0]);
+        return 1;
+    }
+    if (threads > users) threads = users;
+    int64_t start = zclock_usecs();
+
     zsys_dir_create("keys");
 
     // server certificate
     zcert_t *server_cert = zcert_new();
     zcert_save(server_cert, "keys/router.cert");
+    zcert_destroy(&server_cert);
 
     // client certificates
-    zcert_t *client_cert = zcert_new();
-    zcert_save(client_cert, "keys/user1.cert");
+    BundleRecord *records = calloc(users, sizeof(BundleRecord));
+    KeyGenJob *jobs = calloc(threads, sizeof(KeyGenJob));
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (!records || !jobs || !workers) {
+        printf("Out of memory for %ld users\n", users);
+        return 1;
+    }
 
-    zcert_t *client_cert2 = zcert_new();
-    zcert_save(client_cert2, "keys/user2.cert");
+    for (long t = 0; t < threads; t++) {
+        jobs[t] = (KeyGenJob){
+            .records = records,
+            .first = (size_t)(users * t / threads),
+            .last = (size_t)(users * (t + 1) / threads),
+        };
+        if (pthread_create(&workers[t], NULL, generate, &jobs[t]) != 0) {
+            // do this slice here instead
+            generate(&jobs[t]);
+            workers[t] = 0;
+        }
+    }
 
-    zcert_destroy(&server_cert);
-    zcert_destroy(&client_cert);
-    zcert_destroy(&client_cert2);
+    size_t failed = 0;
+    for (long t = 0; t < threads; t++) {
+        if (workers[t]) pthread_join(workers[t], NULL);
+        failed += jobs[t].failed;
+    }
 
+    // the default three certs are all anyone needed before, no bundle for those
+    if (argc > 1 && !bundle_write(BUNDLE_PATH, records, users)) {
+        printf("Unable to write %s\n", BUNDLE_PATH);
+        failed++;
+    }
+
+    free(workers);
+    free(jobs);
+    free(records);
+
+    if (failed > 0) {
+        printf("%zu certificates failed\n", failed);
+        return 1;
+    }
     printf("Certificates generated.\n");
+    if (argc > 1) {
+        printf("%ld users on %ld threads in %.1f ms, bundle in %s\n", users, threads,
+               (zclock_usecs() - start) / 1000.0, BUNDLE_PATH);
+    }
     return 0;
 }
-
-
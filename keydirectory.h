@@ -0,0 +1,602 @@
+#ifndef KEYDIRECTORY_H_
+#define KEYDIRECTORY_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "authindex.h"
+#include "delivery.h"
+
+// public key directory
+//
+// the router serves the keys it accepts (see authindex.h) by name, so a dealer
+// gets a peer's public key for its session keys (see sessionkeys.h) without a
+// copy of their .cert. every change to a name, a registration or a revocation,
+// gets the next directory version, and the router keeps its entries in version
+// order. the requests use the delivery header frame like history sync does:
+//
+//     lookup  ['L']                              dealer -> router, the recipient frame names the user
+//     sync    ['V'][since]                       dealer -> router, the changes after since
+//     entry   ['N'][directory]                   router -> dealer, the answer to a lookup
+//     delta   ['W'][directory][version][more]    router -> dealer, the changes up to version
+//
+// the content frame of an entry or a delta is the entries one after the other,
+// a lookup of a name the router doesn't know gets none:
+//
+//     [version][revoked (u8)][key (32)][name length (u8)][name]
+//
+// a delta holds up to KEYDIR_BATCH entries, more (u8) is 1 when there are newer
+// ones to ask for. `directory` is picked when the router starts and versions
+// count from 1 again with every new one.
+//
+// the dealer keeps what it learned in a file it maps (KeyCache below), asks for
+// the changes since its version once logged in and every KEYCACHE_REFRESH_MS
+// after, and looks keys up in the mapped table. only a name the cache has never
+// heard of is looked up on the router, in the background.
+
+#define KEYDIR_LOOKUP           'L'
+#define KEYDIR_SYNC             'V'
+#define KEYDIR_ENTRY            'N'
+#define KEYDIR_DELTA            'W'
+#define KEYDIR_LOOKUP_SIZE      1
+#define KEYDIR_SYNC_SIZE        9
+#define KEYDIR_ENTRY_SIZE       9
+#define KEYDIR_DELTA_SIZE       18
+#define KEYDIR_KEY_SIZE         32
+#define KEYDIR_NAME_SIZE        64
+#define KEYDIR_RECORD_MAX       (8 + 1 + KEYDIR_KEY_SIZE + 1 + KEYDIR_NAME_SIZE)
+#define KEYDIR_BATCH            512     // entries per delta
+
+_Static_assert(KEYDIR_NAME_SIZE == AUTH_NAME_SIZE && KEYDIR_KEY_SIZE == AUTH_KEY_SIZE, "directory and index entries differ");
+
+static inline zframe_t *keydir_lookup_header(void)
+{
+    uint8_t header[KEYDIR_LOOKUP_SIZE] = { KEYDIR_LOOKUP };
+    return zframe_new(header, sizeof(header));
+}
+
+static inline zframe_t *keydir_sync_header(uint64_t since)
+{
+    uint8_t header[KEYDIR_SYNC_SIZE];
+    header[0] = KEYDIR_SYNC;
+    delivery_put_u64(header + 1, since);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline zframe_t *keydir_entry_header(uint64_t directory)
+{
+    uint8_t header[KEYDIR_ENTRY_SIZE];
+    header[0] = KEYDIR_ENTRY;
+    delivery_put_u64(header + 1, directory);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline zframe_t *keydir_delta_header(uint64_t directory, uint64_t version, bool more)
+{
+    uint8_t header[KEYDIR_DELTA_SIZE];
+    header[0] = KEYDIR_DELTA;
+    delivery_put_u64(header + 1, directory);
+    delivery_put_u64(header + 9, version);
+    header[17] = more ? 1 : 0;
+    return zframe_new(header, sizeof(header));
+}
+
+static inline bool keydir_is_request(zframe_t *header)
+{
+    char type = delivery_header_type(header);
+    return type == KEYDIR_LOOKUP || type == KEYDIR_SYNC;
+}
+
+static inline bool keydir_is_reply(zframe_t *header)
+{
+    char type = delivery_header_type(header);
+    return (type == KEYDIR_ENTRY && zframe_size(header) == KEYDIR_ENTRY_SIZE) ||
+           (type == KEYDIR_DELTA && zframe_size(header) == KEYDIR_DELTA_SIZE);
+}
+
+// one entry of a content frame
+typedef struct {
+    uint64_t version;
+    bool revoked;
+    uint8_t key[KEYDIR_KEY_SIZE];
+    char name[KEYDIR_NAME_SIZE];
+} KeyDirectoryRecord;
+
+static inline size_t keydir_record_size(const char *name)
+{
+    return 8 + 1 + KEYDIR_KEY_SIZE + 1 + strnlen(name, KEYDIR_NAME_SIZE - 1);
+}
+
+static inline size_t keydir_put_record(uint8_t *buffer, uint64_t version, bool revoked, const uint8_t *key, const char *name)
+{
+    size_t name_len = strnlen(name, KEYDIR_NAME_SIZE - 1);
+    delivery_put_u64(buffer, version);
+    buffer[8] = revoked ? 1 : 0;
+    memcpy(buffer + 9, key, KEYDIR_KEY_SIZE);
+    buffer[9 + KEYDIR_KEY_SIZE] = (uint8_t)name_len;
+    memcpy(buffer + 10 + KEYDIR_KEY_SIZE, name, name_len);
+    return 10 + KEYDIR_KEY_SIZE + name_len;
+}
+
+// the entry at *offset, false at the end of the frame or on a truncated one
+static inline bool keydir_next_record(const uint8_t *data, size_t size, size_t *offset, KeyDirectoryRecord *record)
+{
+    if (!data || *offset > size || size - *offset < 10 + KEYDIR_KEY_SIZE) return false;
+    const uint8_t *ptr = data + *offset;
+    size_t name_len = ptr[9 + KEYDIR_KEY_SIZE];
+    if (name_len == 0 || name_len >= KEYDIR_NAME_SIZE || size - *offset - 10 - KEYDIR_KEY_SIZE < name_len) return false;
+
+    record->version = delivery_get_u64(ptr);
+    record->revoked = ptr[8] != 0;
+    memcpy(record->key, ptr + 9, KEYDIR_KEY_SIZE);
+    memcpy(record->name, ptr + 10 + KEYDIR_KEY_SIZE, name_len);
+    record->name[name_len] = '\0';
+    *offset += 10 + KEYDIR_KEY_SIZE + name_len;
+    return true;
+}
+
+// router side
+//
+// the directory follows the auth index: it's loaded from the whole index once at
+// startup, and after that takes the changes the watcher noted (see authindex.h),
+// so a registration or a revocation costs the router one entry, however many
+// names there are. a name that's new, got another key, or is gone gets a new
+// version. revoked names stay as tombstones so a dealer syncing later still
+// hears about them.
+
+typedef struct KeyDirectoryEntry {
+    char name[KEYDIR_NAME_SIZE];
+    uint8_t key[KEYDIR_KEY_SIZE];
+    uint64_t version;                       // of its last change
+    bool revoked;
+    struct KeyDirectoryEntry *older;        // version order
+    struct KeyDirectoryEntry *newer;
+} KeyDirectoryEntry;
+
+typedef struct {
+    uint64_t id;
+    uint64_t version;
+    zhash_t *names;                         // name -> KeyDirectoryEntry
+    KeyDirectoryEntry *oldest;
+    KeyDirectoryEntry *newest;
+    size_t revoked;
+} KeyDirectory;
+
+static inline KeyDirectory *key_directory_new(void)
+{
+    KeyDirectory *self = calloc(1, sizeof(KeyDirectory));
+    if (!self) return NULL;
+    self->names = zhash_new();
+    if (!self->names) {
+        free(self);
+        return NULL;
+    }
+    // only has to differ from the last run's, the start time and pid do that
+    self->id = (uint64_t)zclock_time() << 20 ^ (uint64_t)getpid();
+    return self;
+}
+
+static inline void key_directory_destroy(KeyDirectory **self_p)
+{
+    KeyDirectory *self = *self_p;
+    if (!self) return;
+    zhash_destroy(&self->names);
+    free(self);
+    *self_p = NULL;
+}
+
+// entry changed, it gets the next version and moves to the newest end
+static inline void key_directory_touch(KeyDirectory *self, KeyDirectoryEntry *entry)
+{
+    if (entry->older) entry->older->newer = entry->newer;
+    if (entry->newer) entry->newer->older = entry->older;
+    if (self->oldest == entry) self->oldest = entry->newer;
+    if (self->newest == entry) self->newest = entry->older;
+
+    entry->version = ++self->version;
+    entry->older = self->newest;
+    entry->newer = NULL;
+    if (self->newest) self->newest->newer = entry;
+    self->newest = entry;
+    if (!self->oldest) self->oldest = entry;
+}
+
+static inline void key_directory_put(KeyDirectory *self, const char *name, const uint8_t *key)
+{
+    if (!name[0]) return;
+    KeyDirectoryEntry *entry = (KeyDirectoryEntry *)zhash_lookup(self->names, name);
+    if (!entry) {
+        entry = calloc(1, sizeof(KeyDirectoryEntry));
+        if (!entry) return;
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        zhash_insert(self->names, entry->name, entry);
+        zhash_freefn(self->names, entry->name, free);
+    } else if (!entry->revoked && memcmp(entry->key, key, KEYDIR_KEY_SIZE) == 0) {
+        return;
+    } else if (entry->revoked) {
+        self->revoked--;
+    }
+    memcpy(entry->key, key, KEYDIR_KEY_SIZE);
+    entry->revoked = false;
+    key_directory_touch(self, entry);
+}
+
+static inline void key_directory_revoke(KeyDirectory *self, const char *name)
+{
+    KeyDirectoryEntry *entry = (KeyDirectoryEntry *)zhash_lookup(self->names, name);
+    if (!entry || entry->revoked) return;
+    entry->revoked = true;
+    self->revoked++;
+    key_directory_touch(self, entry);
+}
+
+// every name index authorizes, for a directory that's still empty. the table's
+// entry for a name beats the store's
+static inline void key_directory_load(KeyDirectory *self, const AuthIndex *index)
+{
+    if (!index) return;
+    for (size_t i = 0; i < index->capacity; i++) {
+        const AuthEntry *entry = &index->entries[i];
+        if (entry->used) key_directory_put(self, entry->name, entry->key);
+    }
+    const Keystore *store = index->store;
+    for (size_t i = 0; store && i < store->count; i++) {
+        if (!zhash_lookup(self->names, store->records[i].name)) {
+            key_directory_put(self, store->records[i].name, store->records[i].key);
+        }
+    }
+}
+
+// the changes the watcher noted, in order. returns how many names changed
+static inline size_t key_directory_apply(KeyDirectory *self, const AuthChange *changes, size_t count)
+{
+    uint64_t start = self->version;
+    for (size_t i = 0; i < count; i++) {
+        if (changes[i].removed) {
+            key_directory_revoke(self, changes[i].name);
+        } else {
+            key_directory_put(self, changes[i].name, changes[i].key);
+        }
+    }
+    return (size_t)(self->version - start);
+}
+
+// the content of an entry frame for name, empty when it isn't known
+static inline zframe_t *key_directory_lookup(KeyDirectory *self, const char *name)
+{
+    KeyDirectoryEntry *entry = (KeyDirectoryEntry *)zhash_lookup(self->names, name);
+    if (!entry) return zframe_new_empty();
+    uint8_t record[KEYDIR_RECORD_MAX];
+    size_t size = keydir_put_record(record, entry->version, entry->revoked, entry->key, entry->name);
+    return zframe_new(record, size);
+}
+
+// the content of a delta frame: the oldest KEYDIR_BATCH changes after since.
+// *version is the newest one in it, *more whether there are newer ones
+static inline zframe_t *key_directory_delta(KeyDirectory *self, uint64_t since, uint64_t *version, bool *more)
+{
+    // dealers are mostly close to the newest end, so the walk starts there
+    KeyDirectoryEntry *first = self->newest;
+    while (first && first->older && first->older->version > since) first = first->older;
+    if (first && first->version <= since) first = NULL;
+
+    size_t size = 0, count = 0;
+    KeyDirectoryEntry *entry = first;
+    for (; entry && count < KEYDIR_BATCH; entry = entry->newer, count++) size += keydir_record_size(entry->name);
+    *more = entry != NULL;
+    *version = self->version;
+
+    zframe_t *content = zframe_new(NULL, size);
+    if (!content) return NULL;
+    uint8_t *ptr = zframe_data(content);
+    entry = first;
+    for (size_t i = 0; i < count; i++, entry = entry->newer) {
+        ptr += keydir_put_record(ptr, entry->version, entry->revoked, entry->key, entry->name);
+        *version = entry->version;
+    }
+    return content;
+}
+
+// dealer side
+//
+// the cache is a file holding an open addressing table of names, mapped shared
+// and written in place, so a restarted dealer starts out with everything it knew
+// and only asks for what changed since. it never leaves the machine, numbers are
+// in host order:
+//
+//     [header][slot][slot]...      capacity slots, at most half of them used
+//
+// a cache from another directory (the router restarted) keeps answering lookups
+// while it's synced again from 0, and whatever that full sync didn't bring back
+// is marked revoked at the end of it.
+
+#define KEYCACHE_MAGIC          "CHATKDIR"
+#define KEYCACHE_FORMAT         1
+#define KEYCACHE_MIN_SLOTS      256
+#define KEYCACHE_REFRESH_MS     (30 * 1000)
+#define KEYCACHE_RETRY_MS       (5 * 1000)  // a sync that got no answer is asked again
+
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t slot_size;
+    uint64_t directory;                     // the versions are this directory's
+    uint64_t version;                       // every change up to here is in
+    uint64_t count;
+    uint64_t capacity;                      // power of two
+    uint64_t resyncing;                     // 1 during the full sync after a directory change
+} KeyCacheHeader;
+
+typedef struct {
+    char name[KEYDIR_NAME_SIZE];
+    uint8_t key[KEYDIR_KEY_SIZE];
+    uint64_t version;
+    uint8_t used;
+    uint8_t revoked;
+    uint8_t current;                        // heard of from the header's directory
+    uint8_t reserved[5];
+} KeyCacheSlot;
+
+// name's key changed or was revoked, whatever was derived from the old one goes
+typedef void (*KeyCacheChanged)(void *context, const char *name);
+
+typedef struct {
+    char *path;
+    int fd;
+    void *map;
+    size_t map_size;
+    KeyCacheHeader *header;
+    KeyCacheSlot *slots;
+    int64_t asked;                          // zclock_mono() of the sync in flight, 0 when none
+    int64_t synced;                         // zclock_mono() of the last complete one
+    uint64_t hits;
+    uint64_t misses;
+} KeyCache;
+
+static inline uint64_t keycache_hash(const char *name)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 1099511628211ULL;
+    return hash;
+}
+
+static inline size_t keycache_file_size(uint64_t capacity)
+{
+    return sizeof(KeyCacheHeader) + capacity * sizeof(KeyCacheSlot);
+}
+
+static inline KeyCacheSlot *keycache_probe(KeyCacheSlot *slots, uint64_t capacity, const char *name)
+{
+    uint64_t mask = capacity - 1;
+    for (uint64_t i = keycache_hash(name) & mask;; i = (i + 1) & mask) {
+        KeyCacheSlot *slot = &slots[i];
+        if (!slot->used || strncmp(slot->name, name, KEYDIR_NAME_SIZE) == 0) return slot;
+    }
+}
+
+static inline void keycache_unmap(KeyCache *self)
+{
+    if (self->map) munmap(self->map, self->map_size);
+    if (self->fd != -1) close(self->fd);
+    self->map = NULL;
+    self->fd = -1;
+}
+
+// a mapping of a fresh file of capacity slots at path, with header copied in
+static inline bool keycache_create(KeyCache *self, const char *path, uint64_t capacity, const KeyCacheHeader *header)
+{
+    size_t size = keycache_file_size(capacity);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return false;
+    void *map = ftruncate(fd, (off_t)size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    KeyCacheHeader *new_header = (KeyCacheHeader *)map;
+    if (header) *new_header = *header;
+    memcpy(new_header->magic, KEYCACHE_MAGIC, sizeof(new_header->magic));
+    new_header->format = KEYCACHE_FORMAT;
+    new_header->slot_size = sizeof(KeyCacheSlot);
+    new_header->count = 0;
+    new_header->capacity = capacity;
+
+    self->fd = fd;
+    self->map = map;
+    self->map_size = size;
+    self->header = new_header;
+    self->slots = (KeyCacheSlot *)((uint8_t *)map + sizeof(KeyCacheHeader));
+    return true;
+}
+
+// maps the cache at path, a missing or unusable one is started over
+static inline KeyCache *keycache_open(const char *path)
+{
+    KeyCache *self = calloc(1, sizeof(KeyCache));
+    if (!self) return NULL;
+    self->fd = -1;
+    self->path = strdup(path);
+    if (!self->path) {
+        free(self);
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(KeyCacheHeader)) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        KeyCacheHeader *header = map != MAP_FAILED ? (KeyCacheHeader *)map : NULL;
+        if (header && memcmp(header->magic, KEYCACHE_MAGIC, sizeof(header->magic)) == 0 &&
+            header->format == KEYCACHE_FORMAT && header->slot_size == sizeof(KeyCacheSlot) &&
+            header->capacity >= KEYCACHE_MIN_SLOTS && (header->capacity & (header->capacity - 1)) == 0 &&
+            (size_t)st.st_size == keycache_file_size(header->capacity) && header->count < header->capacity) {
+            self->fd = fd;
+            self->map = map;
+            self->map_size = (size_t)st.st_size;
+            self->header = header;
+            self->slots = (KeyCacheSlot *)((uint8_t *)map + sizeof(KeyCacheHeader));
+            return self;
+        }
+        if (header) munmap(map, (size_t)st.st_size);
+    }
+    if (fd != -1) close(fd);
+
+    if (!keycache_create(self, path, KEYCACHE_MIN_SLOTS, NULL)) {
+        free(self->path);
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+static inline void keycache_close(KeyCache **self_p)
+{
+    KeyCache *self = *self_p;
+    if (!self) return;
+    keycache_unmap(self);
+    free(self->path);
+    free(self);
+    *self_p = NULL;
+}
+
+// twice the slots: written to a new file that's renamed over the old one
+static inline bool keycache_grow(KeyCache *self)
+{
+    char *tmp = zsys_sprintf("%s.tmp", self->path);
+    if (!tmp) return false;
+    KeyCache grown = { .fd = -1 };
+    if (!keycache_create(&grown, tmp, self->header->capacity * 2, self->header)) {
+        zstr_free(&tmp);
+        return false;
+    }
+    for (uint64_t i = 0; i < self->header->capacity; i++) {
+        if (!self->slots[i].used) continue;
+        *keycache_probe(grown.slots, grown.header->capacity, self->slots[i].name) = self->slots[i];
+        grown.header->count++;
+    }
+    if (rename(tmp, self->path) != 0) {
+        keycache_unmap(&grown);
+        unlink(tmp);
+        zstr_free(&tmp);
+        return false;
+    }
+    zstr_free(&tmp);
+
+    keycache_unmap(self);
+    self->fd = grown.fd;
+    self->map = grown.map;
+    self->map_size = grown.map_size;
+    self->header = grown.header;
+    self->slots = grown.slots;
+    return true;
+}
+
+// true when the cache has an entry for name, the key is only there when it
+// isn't revoked as well
+static inline bool keycache_lookup(KeyCache *self, const char *name, uint8_t *key, bool *revoked)
+{
+    if (!self) return false;
+    KeyCacheSlot *slot = keycache_probe(self->slots, self->header->capacity, name);
+    if (!slot->used) {
+        self->misses++;
+        return false;
+    }
+    self->hits++;
+    *revoked = slot->revoked != 0;
+    if (!slot->revoked) memcpy(key, slot->key, KEYDIR_KEY_SIZE);
+    return true;
+}
+
+static inline void keycache_put(KeyCache *self, const KeyDirectoryRecord *record, bool current,
+                                KeyCacheChanged changed, void *context)
+{
+    if (self->header->count + 1 > self->header->capacity / 2 && !keycache_grow(self)) return;
+    KeyCacheSlot *slot = keycache_probe(self->slots, self->header->capacity, record->name);
+    if (slot->used && (slot->revoked != record->revoked || memcmp(slot->key, record->key, KEYDIR_KEY_SIZE) != 0) && changed) {
+        changed(context, record->name);
+    }
+    if (!slot->used) {
+        memset(slot, 0, sizeof(*slot));
+        snprintf(slot->name, sizeof(slot->name), "%s", record->name);
+        slot->used = 1;
+        self->header->count++;
+    }
+    memcpy(slot->key, record->key, KEYDIR_KEY_SIZE);
+    slot->version = record->version;
+    slot->revoked = record->revoked ? 1 : 0;
+    if (current) slot->current = 1;
+}
+
+static inline void keycache_put_all(KeyCache *self, zframe_t *content, bool current, KeyCacheChanged changed, void *context)
+{
+    if (!content) return;
+    KeyDirectoryRecord record;
+    size_t offset = 0;
+    while (keydir_next_record(zframe_data(content), zframe_size(content), &offset, &record)) {
+        keycache_put(self, &record, current, changed, context);
+    }
+}
+
+// a sync is due once logged in, every KEYCACHE_REFRESH_MS after, or when the last
+// request went unanswered
+static inline bool keycache_sync_due(KeyCache *self)
+{
+    if (!self) return false;
+    int64_t now = zclock_mono();
+    if (self->asked) return now - self->asked > KEYCACHE_RETRY_MS;
+    return self->synced == 0 || now - self->synced > KEYCACHE_REFRESH_MS;
+}
+
+// the answer to a lookup
+static inline void keycache_entry(KeyCache *self, zframe_t *header, zframe_t *content, KeyCacheChanged changed, void *context)
+{
+    bool current = delivery_get_u64(zframe_data(header) + 1) == self->header->directory;
+    keycache_put_all(self, content, current, changed, context);
+}
+
+// a delta from the router, returns true when the next one should be asked for
+// right away: there's more, or the directory changed and it starts over from 0
+static inline bool keycache_delta(KeyCache *self, zframe_t *header, zframe_t *content, KeyCacheChanged changed, void *context)
+{
+    const uint8_t *data = zframe_data(header);
+    uint64_t directory = delivery_get_u64(data + 1);
+    uint64_t version = delivery_get_u64(data + 9);
+    bool more = data[17] != 0;
+    self->asked = 0;
+
+    // versions from another directory mean nothing here, the entries stay for
+    // lookups until the full sync has been through them
+    if (directory != self->header->directory) {
+        self->header->directory = directory;
+        self->header->version = 0;
+        self->header->resyncing = 1;
+        for (uint64_t i = 0; i < self->header->capacity; i++) self->slots[i].current = 0;
+        return true;
+    }
+
+    keycache_put_all(self, content, true, changed, context);
+    self->header->version = version;
+    if (more) return true;
+
+    if (self->header->resyncing) {
+        for (uint64_t i = 0; i < self->header->capacity; i++) {
+            KeyCacheSlot *slot = &self->slots[i];
+            if (!slot->used || slot->current || slot->revoked) continue;
+            slot->revoked = 1;
+            if (changed) changed(context, slot->name);
+        }
+        self->header->resyncing = 0;
+    }
+    self->synced = zclock_mono();
+    return false;
+}
+
+#endif // KEYDIRECTORY_H_
@@ -0,0 +1,259 @@
+#ifndef KEYSTORE_H_
+#define KEYSTORE_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// packed keystore
+//
+// keys_router keeps one text .cert per user, which is fine for a handful of users
+// but at 10^5-10^6 every startup parses that many files (and uses that many
+// inodes). the packed store is a single binary file the router maps and searches
+// in place:
+//
+//     [header][record][record]...          records sorted by key
+//
+// registrations don't rewrite it, they're appended to <store>.log as records of
+// the same shape, in arrival order. keystore_import folds a key directory and the
+// log into a fresh store and swaps it in with a rename.
+
+#define KEYSTORE_MAGIC      "CHATKEYS"
+#define KEYSTORE_VERSION    1
+#define KEYSTORE_KEY_SIZE   32
+#define KEYSTORE_NAME_SIZE  64
+#define KEYSTORE_PATH_MAX   512
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t reserved;
+} KeystoreHeader;
+
+typedef struct {
+    uint8_t key[KEYSTORE_KEY_SIZE];
+    char name[KEYSTORE_NAME_SIZE];      // nul terminated, usually the user
+} KeystoreRecord;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    const KeystoreRecord *records;
+    size_t count;
+    size_t refs;                        // only touched by the thread that publishes
+} Keystore;
+
+// read position in the append log, the log is replaced (new inode) when it gets imported
+typedef struct {
+    char path[KEYSTORE_PATH_MAX];
+    ino_t inode;
+    off_t offset;
+} KeystoreLog;
+
+static inline int keystore_record_compare(const void *a, const void *b)
+{
+    return memcmp(((const KeystoreRecord *)a)->key, ((const KeystoreRecord *)b)->key, KEYSTORE_KEY_SIZE);
+}
+
+static inline void keystore_log_path(const char *store_path, const char *suffix, char *path, size_t size)
+{
+    snprintf(path, size, "%s.log%s", store_path, suffix);
+}
+
+// maps the store at path, a missing file is an empty store. NULL if the file is
+// there but isn't a store this version understands
+static inline Keystore *keystore_open(const char *path)
+{
+    Keystore *store = calloc(1, sizeof(Keystore));
+    if (!store) return NULL;
+    store->refs = 1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) return store;
+        free(store);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(KeystoreHeader)) {
+        close(fd);
+        free(store);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(store);
+        return NULL;
+    }
+
+    const KeystoreHeader *header = map;
+    size_t available = ((size_t)st.st_size - sizeof(KeystoreHeader)) / sizeof(KeystoreRecord);
+    if (memcmp(header->magic, KEYSTORE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != KEYSTORE_VERSION ||
+        header->record_size != sizeof(KeystoreRecord) ||
+        header->count > available) {
+        munmap(map, st.st_size);
+        free(store);
+        return NULL;
+    }
+
+    // lookups touch a handful of pages scattered over the file, no point reading ahead
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    store->map = map;
+    store->map_size = st.st_size;
+    store->records = (const KeystoreRecord *)((const char *)map + sizeof(KeystoreHeader));
+    store->count = header->count;
+    return store;
+}
+
+static inline Keystore *keystore_retain(Keystore *store)
+{
+    if (store) store->refs++;
+    return store;
+}
+
+static inline void keystore_release(Keystore **store_p)
+{
+    Keystore *store = *store_p;
+    if (!store) return;
+    *store_p = NULL;
+    if (--store->refs > 0) return;
+    if (store->map) munmap(store->map, store->map_size);
+    free(store);
+}
+
+static inline const KeystoreRecord *keystore_find(const Keystore *store, const uint8_t *key)
+{
+    size_t low = 0;
+    size_t high = store ? store->count : 0;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = memcmp(store->records[mid].key, key, KEYSTORE_KEY_SIZE);
+        if (cmp == 0) return &store->records[mid];
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+// one registration, a single O_APPEND write so concurrent appenders don't interleave.
+// a name that doesn't fit a record is refused (ENAMETOOLONG), cut short it would
+// be someone else's
+static inline bool keystore_append(const char *store_path, const uint8_t *key, const char *name)
+{
+    if (strlen(name) >= KEYSTORE_NAME_SIZE) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    char path[KEYSTORE_PATH_MAX];
+    keystore_log_path(store_path, "", path, sizeof(path));
+
+    KeystoreRecord record = {0};
+    memcpy(record.key, key, KEYSTORE_KEY_SIZE);
+    snprintf(record.name, sizeof(record.name), "%s", name);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return false;
+    bool ok = write(fd, &record, sizeof(record)) == (ssize_t)sizeof(record);
+    // closing is what the router's watcher waits for (IN_CLOSE_WRITE)
+    return close(fd) == 0 && ok;
+}
+
+static inline void keystore_log_init(KeystoreLog *log, const char *store_path)
+{
+    keystore_log_path(store_path, "", log->path, sizeof(log->path));
+    log->inode = 0;
+    log->offset = 0;
+}
+
+// adds the records appended since the last call to entries (name -> 32 byte key,
+// a later record for the same name replaces the earlier one). returns how many
+// were read, the last partial record of a write in progress is left for next time
+static inline size_t keystore_log_read(KeystoreLog *log, zhash_t *entries)
+{
+    int fd = open(log->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+    // imported and started over
+    if (st.st_ino != log->inode) {
+        log->inode = st.st_ino;
+        log->offset = 0;
+    }
+
+    size_t read_count = 0;
+    KeystoreRecord records[64];
+    ssize_t len;
+    while ((len = pread(fd, records, sizeof(records), log->offset)) >= (ssize_t)sizeof(KeystoreRecord)) {
+        size_t count = (size_t)len / sizeof(KeystoreRecord);
+        for (size_t i = 0; i < count; i++) {
+            uint8_t *key = malloc(KEYSTORE_KEY_SIZE);
+            if (!key) break;
+            records[i].name[KEYSTORE_NAME_SIZE - 1] = '\0';
+            memcpy(key, records[i].key, KEYSTORE_KEY_SIZE);
+            zhash_update(entries, records[i].name, key);
+            zhash_freefn(entries, records[i].name, free);
+        }
+        log->offset += count * sizeof(KeystoreRecord);
+        read_count += count;
+    }
+    close(fd);
+    return read_count;
+}
+
+// writes records (sorted in place) to a new store and renames it over path, so a
+// reader only ever maps a complete file
+static inline bool keystore_write(const char *path, KeystoreRecord *records, size_t count)
+{
+    qsort(records, count, sizeof(KeystoreRecord), keystore_record_compare);
+
+    // the same key under two names is kept once
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && keystore_record_compare(&records[unique - 1], &records[i]) == 0) continue;
+        records[unique++] = records[i];
+    }
+
+    char tmp_path[KEYSTORE_PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) return false;
+
+    KeystoreHeader header = {
+        .version = KEYSTORE_VERSION,
+        .record_size = sizeof(KeystoreRecord),
+        .count = unique,
+    };
+    memcpy(header.magic, KEYSTORE_MAGIC, sizeof(header.magic));
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              (unique == 0 || fwrite(records, sizeof(KeystoreRecord), unique, file) == unique) &&
+              fflush(file) == 0 &&
+              fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, path) == -1) {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+#endif // KEYSTORE_H_
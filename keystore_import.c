@@ -0,0 +1,114 @@
+#include <czmq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "keystore.h"
+#include "authindex.h"
+
+// cc -o keystore_import keystore_import.c -lczmq -lzmq
+//
+// converts a key directory of .cert files into a packed keystore (keystore.h), or
+// folds new registrations into an existing one:
+//
+//     ./keystore_import <key directory> <store>
+//
+// the new store is built from the old store, then the directory, then the store's
+// log, a later source winning when a name shows up twice. the log is moved aside
+// to <store>.log.import first so a running router keeps appending to a fresh one,
+// and only removed once the new store has been renamed into place. the router's
+// watcher remaps the store as soon as the rename happens.
+
+static void add_record(zhash_t *records, const uint8_t *key, const char *name)
+{
+    KeystoreRecord *record = calloc(1, sizeof(KeystoreRecord));
+    assert(record);
+    memcpy(record->key, key, KEYSTORE_KEY_SIZE);
+    snprintf(record->name, sizeof(record->name), "%s", name);
+    zhash_update(records, record->name, record);
+    zhash_freefn(records, record->name, free);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("Usage: %s <key directory> <store>\n", argv[0]);
+        return 1;
+    }
+    const char *directory = argv[1];
+    const char *store_path = argv[2];
+    int64_t start = zclock_usecs();
+
+    char log_path[KEYSTORE_PATH_MAX];
+    char import_path[KEYSTORE_PATH_MAX];
+    keystore_log_path(store_path, "", log_path, sizeof(log_path));
+    keystore_log_path(store_path, ".import", import_path, sizeof(import_path));
+
+    // a leftover from an import that didn't finish is picked up as is
+    if (access(import_path, F_OK) == -1 && rename(log_path, import_path) == -1 && errno != ENOENT) {
+        printf("Unable to move %s aside: %s\n", log_path, strerror(errno));
+        return 1;
+    }
+
+    zhash_t *records = zhash_new();
+    assert(records);
+
+    Keystore *store = keystore_open(store_path);
+    if (!store) {
+        printf("%s is not a keystore\n", store_path);
+        return 1;
+    }
+    for (size_t i = 0; i < store->count; i++) {
+        add_record(records, store->records[i].key, store->records[i].name);
+    }
+    size_t from_store = store->count;
+    keystore_release(&store);
+
+    size_t from_directory = 0;
+    zhash_t *files = auth_scan_directory(directory);
+    if (files) {
+        for (uint8_t *key = zhash_first(files); key; key = zhash_next(files)) {
+            char name[KEYSTORE_NAME_SIZE];
+            snprintf(name, sizeof(name), "%s", zhash_cursor(files));
+            size_t len = strlen(name);
+            if (len > 5 && strcmp(name + len - 5, ".cert") == 0) name[len - 5] = '\0';
+            add_record(records, key, name);
+            from_directory++;
+        }
+        zhash_destroy(&files);
+    } else {
+        printf("Unable to read %s, importing the store and its log only\n", directory);
+    }
+
+    zhash_t *logged = zhash_new();
+    assert(logged);
+    KeystoreLog log;
+    keystore_log_init(&log, store_path);
+    snprintf(log.path, sizeof(log.path), "%s", import_path);
+    size_t from_log = keystore_log_read(&log, logged);
+    for (uint8_t *key = zhash_first(logged); key; key = zhash_next(logged)) {
+        add_record(records, key, zhash_cursor(logged));
+    }
+    zhash_destroy(&logged);
+
+    size_t count = zhash_size(records);
+    KeystoreRecord *packed = malloc((count > 0 ? count : 1) * sizeof(KeystoreRecord));
+    assert(packed);
+    size_t n = 0;
+    for (KeystoreRecord *record = zhash_first(records); record; record = zhash_next(records)) {
+        packed[n++] = *record;
+    }
+    zhash_destroy(&records);
+
+    if (!keystore_write(store_path, packed, n)) {
+        printf("Unable to write %s: %s\n", store_path, strerror(errno));
+        free(packed);
+        return 1;
+    }
+    free(packed);
+    remove(import_path);
+
+    printf("%zu from the old store, %zu from %s, %zu from the log\n", from_store, from_directory, directory, from_log);
+    printf("wrote %zu keys to %s in %.1f ms\n", n, store_path, (zclock_usecs() - start) / 1000.0);
+    return 0;
+}
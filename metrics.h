@@ -0,0 +1,383 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <czmq.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// router metrics
+//
+// every thread that touches the forwarding path registers its own Metrics slot and
+// is the only writer to it, so recording is a relaxed atomic add on a cache line
+// nobody else writes to. readers (the stats socket) sum all slots on demand.
+//
+// histograms are log-linear like HdrHistogram: every power of two is split into
+// HIST_SUB_BUCKETS linear buckets, which keeps the relative error around 1.5%
+// from 1 up to 2^HIST_MAX_BITS.
+
+#define METRICS_MAX_THREADS 16
+#define HIST_SUB_BITS       6
+#define HIST_SUB_BUCKETS    (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS       40
+#define HIST_BUCKETS        ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+typedef enum {
+    COUNTER_MESSAGES_IN,
+    COUNTER_MESSAGES_OUT,
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+    COUNTER_REGISTRATIONS,
+    COUNTER_AUTH_FAILURES,
+    COUNTER_CLUSTER_IN,
+    COUNTER_CLUSTER_OUT,
+    COUNTER_HISTORY_OUT,
+    COUNTER_KEY_REQUESTS,
+    COUNTER_BATCHES_IN,
+    COUNTER_BATCHED_MESSAGES,
+    COUNTER_POLL_SPINS,
+    COUNTER_POLL_WAITS,
+    COUNTER_DRAIN_BATCHES,
+    COUNTER_COUNT
+} Counter;
+
+typedef enum {
+    DROP_MALFORMED,
+    DROP_UNKNOWN_SENDER,
+    DROP_BAD_REGISTRATION,
+    DROP_QUEUE_FAILED,
+    DROP_SEND_FAILED,
+    DROP_RATE_LIMITED,
+    DROP_DUPLICATE,
+    DROP_NOT_CONNECTED,
+    DROP_SLOW_CONSUMER,
+    DROP_DIVERTED,
+    DROP_DETACHED,
+    DROP_SENDER_BACKLOG,
+    DROP_UNAUTHORIZED,
+    DROP_COUNT
+} DropReason;
+
+// current values rather than totals, set by whichever thread owns them
+typedef enum {
+    GAUGE_QUEUED_MESSAGES,
+    GAUGE_HELD_MESSAGES,
+    GAUGE_HELD_BYTES,
+    GAUGE_HELD_RECIPIENTS,
+    GAUGE_DEEPEST_HELD,
+    GAUGE_TIMERS,
+    GAUGE_COUNT
+} Gauge;
+
+static const char *counter_names[COUNTER_COUNT] = {
+    [COUNTER_MESSAGES_IN]   = "router_messages_in_total",
+    [COUNTER_MESSAGES_OUT]  = "router_messages_out_total",
+    [COUNTER_BYTES_IN]      = "router_bytes_in_total",
+    [COUNTER_BYTES_OUT]     = "router_bytes_out_total",
+    [COUNTER_REGISTRATIONS] = "router_registrations_total",
+    [COUNTER_AUTH_FAILURES] = "router_auth_failures_total",
+    [COUNTER_CLUSTER_IN]    = "router_cluster_in_total",
+    [COUNTER_CLUSTER_OUT]   = "router_cluster_out_total",
+    [COUNTER_HISTORY_OUT]   = "router_history_out_total",
+    [COUNTER_KEY_REQUESTS]  = "router_key_requests_total",
+    [COUNTER_BATCHES_IN]    = "router_batches_in_total",
+    [COUNTER_BATCHED_MESSAGES] = "router_batched_messages_total",
+    [COUNTER_POLL_SPINS]    = "router_poll_spin_hits_total",
+    [COUNTER_POLL_WAITS]    = "router_poll_waits_total",
+    [COUNTER_DRAIN_BATCHES] = "router_drain_batches_total",
+};
+
+static const char *drop_reason_names[DROP_COUNT] = {
+    [DROP_MALFORMED]        = "malformed",
+    [DROP_UNKNOWN_SENDER]   = "unknown_sender",
+    [DROP_BAD_REGISTRATION] = "bad_registration",
+    [DROP_QUEUE_FAILED]     = "queue_failed",
+    [DROP_SEND_FAILED]      = "send_failed",
+    [DROP_RATE_LIMITED]     = "rate_limited",
+    [DROP_DUPLICATE]        = "duplicate",
+    [DROP_NOT_CONNECTED]    = "not_connected",
+    [DROP_SLOW_CONSUMER]    = "slow_consumer",
+    [DROP_DIVERTED]         = "diverted",
+    [DROP_DETACHED]         = "detached",
+    [DROP_SENDER_BACKLOG]   = "sender_backlog",
+    [DROP_UNAUTHORIZED]     = "unauthorized",
+};
+
+static const char *gauge_names[GAUGE_COUNT] = {
+    [GAUGE_QUEUED_MESSAGES] = "router_queued_messages",
+    [GAUGE_HELD_MESSAGES]   = "router_held_messages",
+    [GAUGE_HELD_BYTES]      = "router_held_bytes",
+    [GAUGE_HELD_RECIPIENTS] = "router_held_recipients",
+    [GAUGE_DEEPEST_HELD]    = "router_deepest_held_queue",
+    [GAUGE_TIMERS]          = "router_timers",
+};
+
+typedef struct {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} Histogram;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t counters[COUNTER_COUNT];
+    _Atomic uint64_t drops[DROP_COUNT];
+    _Atomic uint64_t gauges[GAUGE_COUNT];
+    Histogram dwell_usec;
+    Histogram message_bytes;
+    const char *thread_name;
+} Metrics;
+
+typedef struct {
+    Metrics *slots[METRICS_MAX_THREADS];
+    _Atomic size_t count;
+    pthread_mutex_t register_lock;
+} MetricsRegistry;
+
+static MetricsRegistry metrics_registry = {
+    .register_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// slot of the calling thread, NULL (recording is a no-op) until metrics_register()
+static _Thread_local Metrics *thread_metrics = NULL;
+
+// once per thread, the returned slot lives until the process exits
+static inline Metrics *metrics_register(const char *thread_name)
+{
+    Metrics *metrics = aligned_alloc(64, sizeof(Metrics));
+    if (!metrics) return NULL;
+    memset(metrics, 0, sizeof(Metrics));
+    metrics->thread_name = thread_name;
+
+    pthread_mutex_lock(&metrics_registry.register_lock);
+    size_t index = atomic_load(&metrics_registry.count);
+    if (index == METRICS_MAX_THREADS) {
+        pthread_mutex_unlock(&metrics_registry.register_lock);
+        free(metrics);
+        return NULL;
+    }
+    metrics_registry.slots[index] = metrics;
+    // publish the slot only after it has been written
+    atomic_store_explicit(&metrics_registry.count, index + 1, memory_order_release);
+    pthread_mutex_unlock(&metrics_registry.register_lock);
+
+    thread_metrics = metrics;
+    return metrics;
+}
+
+// single writer per slot, so a relaxed load + store is enough and avoids a locked add
+static inline void metrics_add(_Atomic uint64_t *value, uint64_t delta)
+{
+    uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+    atomic_store_explicit(value, current + delta, memory_order_relaxed);
+}
+
+static inline void metrics_count(Metrics *metrics, Counter counter, uint64_t delta)
+{
+    if (metrics) metrics_add(&metrics->counters[counter], delta);
+}
+
+static inline void metrics_drop(Metrics *metrics, DropReason reason)
+{
+    if (metrics) metrics_add(&metrics->drops[reason], 1);
+}
+
+static inline void metrics_gauge(Metrics *metrics, Gauge gauge, uint64_t value)
+{
+    if (metrics) atomic_store_explicit(&metrics->gauges[gauge], value, memory_order_relaxed);
+}
+
+static inline size_t histogram_index(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS) return (size_t)value;
+
+    int msb = 63 - __builtin_clzll(value);
+    if (msb > HIST_MAX_BITS) return HIST_BUCKETS - 1;
+
+    int shift = msb - HIST_SUB_BITS;
+    size_t sub = (size_t)(value >> shift) - HIST_SUB_BUCKETS;
+    return (size_t)(shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// highest value that lands in bucket index
+static inline uint64_t histogram_bucket_value(size_t index)
+{
+    if (index < HIST_SUB_BUCKETS) return index;
+
+    int shift = (int)(index / HIST_SUB_BUCKETS) - 1;
+    uint64_t sub = index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void histogram_record(Histogram *hist, uint64_t value)
+{
+    metrics_add(&hist->counts[histogram_index(value)], 1);
+    metrics_add(&hist->total, 1);
+    metrics_add(&hist->sum, value);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+static inline void metrics_dwell(Metrics *metrics, uint64_t usecs)
+{
+    if (metrics) histogram_record(&metrics->dwell_usec, usecs);
+}
+
+static inline void metrics_message_size(Metrics *metrics, uint64_t bytes)
+{
+    if (metrics) histogram_record(&metrics->message_bytes, bytes);
+}
+
+// plain snapshot of all thread slots summed together
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} HistogramSnapshot;
+
+typedef struct {
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t drops[DROP_COUNT];
+    uint64_t gauges[GAUGE_COUNT];
+    HistogramSnapshot dwell_usec;
+    HistogramSnapshot message_bytes;
+} MetricsSnapshot;
+
+static inline void histogram_merge(HistogramSnapshot *into, Histogram *hist)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    }
+    into->total += atomic_load_explicit(&hist->total, memory_order_relaxed);
+    into->sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    if (max > into->max) into->max = max;
+}
+
+static inline void metrics_aggregate(MetricsSnapshot *snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    size_t count = atomic_load_explicit(&metrics_registry.count, memory_order_acquire);
+    for (size_t t = 0; t < count; t++) {
+        Metrics *metrics = metrics_registry.slots[t];
+        for (size_t i = 0; i < COUNTER_COUNT; i++) {
+            snapshot->counters[i] += atomic_load_explicit(&metrics->counters[i], memory_order_relaxed);
+        }
+        for (size_t i = 0; i < DROP_COUNT; i++) {
+            snapshot->drops[i] += atomic_load_explicit(&metrics->drops[i], memory_order_relaxed);
+        }
+        for (size_t i = 0; i < GAUGE_COUNT; i++) {
+            snapshot->gauges[i] += atomic_load_explicit(&metrics->gauges[i], memory_order_relaxed);
+        }
+        histogram_merge(&snapshot->dwell_usec, &metrics->dwell_usec);
+        histogram_merge(&snapshot->message_bytes, &metrics->message_bytes);
+    }
+}
+
+static inline uint64_t histogram_percentile(HistogramSnapshot *hist, double percentile)
+{
+    if (hist->total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile * (double)hist->total + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static inline void histogram_print(FILE *out, const char *name, HistogramSnapshot *hist)
+{
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s{quantile=\"%g\"} %llu\n", name, quantiles[i],
+                (unsigned long long)histogram_percentile(hist, quantiles[i]));
+    }
+    fprintf(out, "%s_max %llu\n", name, (unsigned long long)hist->max);
+    fprintf(out, "%s_sum %llu\n", name, (unsigned long long)hist->sum);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)hist->total);
+}
+
+// prometheus style text exposition, caller frees the result
+static inline char *metrics_render(void)
+{
+    MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+    if (!snapshot) return NULL;
+    metrics_aggregate(snapshot);
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if (!out) {
+        free(snapshot);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long)snapshot->counters[i]);
+    }
+    for (size_t i = 0; i < DROP_COUNT; i++) {
+        fprintf(out, "router_drops_total{reason=\"%s\"} %llu\n", drop_reason_names[i],
+                (unsigned long long)snapshot->drops[i]);
+    }
+    for (size_t i = 0; i < GAUGE_COUNT; i++) {
+        fprintf(out, "%s %llu\n", gauge_names[i], (unsigned long long)snapshot->gauges[i]);
+    }
+    histogram_print(out, "router_dwell_usec", &snapshot->dwell_usec);
+    histogram_print(out, "router_message_bytes", &snapshot->message_bytes);
+    fprintf(out, "router_metrics_threads %zu\n",
+            atomic_load_explicit(&metrics_registry.count, memory_order_acquire));
+
+    fclose(out);
+    free(snapshot);
+    return text;
+}
+
+// answers every request on a REP socket bound to endpoint (args) with metrics_render()
+static inline void metrics_actor(zsock_t *pipe, void *args)
+{
+    const char *endpoint = (const char *)args;
+
+    zsock_t *stats = zsock_new(ZMQ_REP);
+    if (!stats || zsock_bind(stats, "%s", endpoint) == -1) {
+        printf("[ERROR]: Unable to bind stats socket to %s\n", endpoint);
+        zsock_destroy(&stats);
+        zsock_signal(pipe, 1);
+        return;
+    }
+    zsock_signal(pipe, 0);
+
+    zpoller_t *poller = zpoller_new(pipe, stats, NULL);
+    while (!zsys_interrupted) {
+        void *which = zpoller_wait(poller, -1);
+        if (!which) break;
+
+        if (which == pipe) {
+            // $TERM from zactor_destroy
+            zmsg_t *command = zmsg_recv(pipe);
+            zmsg_destroy(&command);
+            break;
+        }
+
+        zmsg_t *request = zmsg_recv(stats);
+        zmsg_destroy(&request);
+
+        char *text = metrics_render();
+        zstr_send(stats, text ? text : "");
+        free(text);
+    }
+    zpoller_destroy(&poller);
+    zsock_destroy(&stats);
+}
+
+#endif // METRICS_H_
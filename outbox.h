@@ -0,0 +1,330 @@
+#ifndef OUTBOX_H_
+#define OUTBOX_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// per recipient hold queues
+//
+// the router socket is ROUTER_MANDATORY with a send timeout of 0, so a send to a
+// recipient whose pipe is at its HWM fails right away instead of libzmq dropping
+// it without a word. the router holds such a message here, in a queue of that
+// recipient's, tries the queue again every pass, and anything else for the
+// recipient goes in behind it, so nothing overtakes what's held. a recipient may
+// have up to depth_limit messages held, and all of them together up to
+// bytes_limit. past that the slow-consumer policy decides:
+//
+// drop-oldest  the recipient's oldest held message makes room for the new one
+// divert       the new one isn't held. it's in the journal (see journal.h), the
+//              recipient reads it from there when it catches up
+// disconnect   everything held for the recipient is dropped, and so is whatever
+//              comes for it until it's heard from again
+//
+// every message given up on goes through the drop callback first. a sender's
+// delivery window (see delivery.h) retransmits what was never acked, so the
+// router lets the retransmit through the dedup window again there.
+
+typedef enum {
+    SLOW_DROP_OLDEST,
+    SLOW_DIVERT,
+    SLOW_DISCONNECT
+} SlowConsumerPolicy;
+
+static const char *slow_policy_names[] = {
+    [SLOW_DROP_OLDEST] = "drop-oldest",
+    [SLOW_DIVERT]      = "divert",
+    [SLOW_DISCONNECT]  = "disconnect",
+};
+
+typedef enum {
+    OUTBOX_SENT,
+    OUTBOX_HELD,
+    OUTBOX_DROPPED,             // the policy took it, through the drop callback
+    OUTBOX_UNREACHABLE,         // nobody connected by that identity, the caller keeps it
+    OUTBOX_FAILED               // the caller keeps it
+} OutboxResult;
+
+typedef enum {
+    OUTBOX_DROP_OLDEST,
+    OUTBOX_DROP_DIVERTED,
+    OUTBOX_DROP_DETACHED,
+    OUTBOX_DROP_GONE            // was held for a recipient that disconnected
+} OutboxDrop;
+
+// a message the outbox gives up on, destroyed once this returns
+typedef void (*OutboxDropFn)(void *context, zmsg_t *msg, OutboxDrop reason);
+
+typedef struct {
+    char *identity;
+    zlist_t *held;              // zmsg_t, oldest first
+    size_t bytes;
+    uint64_t dropped;           // by the policy
+    int64_t stalled_since;      // zclock_mono() since when something's been held, 0 while nothing is
+    bool backlogged;            // in Outbox.backlogged
+    bool detached;              // the disconnect policy gave up on it
+} HeldQueue;
+
+typedef struct {
+    zhash_t *queues;            // identity -> HeldQueue, only while something's held or detached
+    zlist_t *backlogged;        // HeldQueues with messages held, retried in this order
+    size_t depth_limit;
+    size_t bytes_limit;
+    SlowConsumerPolicy policy;
+    size_t held;                // messages, all queues together
+    size_t held_bytes;
+    OutboxDropFn drop;
+    void *context;
+} Outbox;
+
+static inline void held_queue_free(void *data)
+{
+    HeldQueue *queue = (HeldQueue *)data;
+    while (queue->held && zlist_size(queue->held) > 0) {
+        zmsg_t *msg = (zmsg_t *)zlist_pop(queue->held);
+        zmsg_destroy(&msg);
+    }
+    zlist_destroy(&queue->held);
+    free(queue->identity);
+    free(queue);
+}
+
+static inline Outbox *outbox_new(size_t depth_limit, size_t bytes_limit, SlowConsumerPolicy policy,
+                                 OutboxDropFn drop, void *context)
+{
+    Outbox *self = calloc(1, sizeof(Outbox));
+    if (!self) return NULL;
+    self->queues = zhash_new();
+    self->backlogged = zlist_new();
+    if (!self->queues || !self->backlogged) {
+        zhash_destroy(&self->queues);
+        zlist_destroy(&self->backlogged);
+        free(self);
+        return NULL;
+    }
+    self->depth_limit = depth_limit;
+    self->bytes_limit = bytes_limit;
+    self->policy = policy;
+    self->drop = drop;
+    self->context = context;
+    return self;
+}
+
+static inline void outbox_destroy(Outbox **self_p)
+{
+    Outbox *self = *self_p;
+    if (!self) return;
+    zlist_destroy(&self->backlogged);
+    zhash_destroy(&self->queues);
+    free(self);
+    *self_p = NULL;
+}
+
+static inline bool outbox_pending(Outbox *self)
+{
+    return self->held > 0;
+}
+
+// the routing id of msg as a string, identities are at most 255 bytes
+static inline bool outbox_identity(zmsg_t *msg, char *identity)
+{
+    zframe_t *to = zmsg_first(msg);
+    if (!to || zframe_size(to) == 0 || zframe_size(to) > 255) return false;
+    memcpy(identity, zframe_data(to), zframe_size(to));
+    identity[zframe_size(to)] = '\0';
+    return true;
+}
+
+// sends *msg_p frame by frame and destroys it once the last frame went. czmq
+// doesn't say what's left of a message zmsg_send failed on, it may have lost
+// the recipient frame already. here each frame goes out as a copy, so a message
+// the socket refused is still whole and can be held and sent again. 0 when sent,
+// -1 with zmq_errno() set otherwise, *msg_p untouched
+static inline int outbox_send_frames(zmsg_t **msg_p, void *socket)
+{
+    zmsg_t *msg = *msg_p;
+    size_t frames = zmsg_size(msg);
+    size_t i = 0;
+    for (zframe_t *frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        int more = ++i < frames ? ZFRAME_MORE : 0;
+        if (zframe_send(&frame, socket, ZFRAME_REUSE | more) != 0) return -1;
+    }
+    zmsg_destroy(msg_p);
+    return 0;
+}
+
+static inline void outbox_give_up(Outbox *self, HeldQueue *queue, zmsg_t *msg, OutboxDrop reason)
+{
+    if (queue) queue->dropped++;
+    if (self->drop) self->drop(self->context, msg, reason);
+    zmsg_destroy(&msg);
+}
+
+static inline zmsg_t *outbox_pop(Outbox *self, HeldQueue *queue)
+{
+    zmsg_t *msg = (zmsg_t *)zlist_pop(queue->held);
+    if (!msg) return NULL;
+    size_t size = zmsg_content_size(msg);
+    queue->bytes -= size;
+    self->held--;
+    self->held_bytes -= size;
+    if (zlist_size(queue->held) == 0) queue->stalled_since = 0;
+    return msg;
+}
+
+// the queue goes once nothing's held and nothing needs remembering about it
+static inline void outbox_release(Outbox *self, HeldQueue *queue)
+{
+    if (zlist_size(queue->held) > 0) return;
+    if (queue->backlogged) {
+        zlist_remove(self->backlogged, queue);
+        queue->backlogged = false;
+    }
+    if (!queue->detached) zhash_delete(self->queues, queue->identity);
+}
+
+static inline HeldQueue *outbox_queue(Outbox *self, const char *identity)
+{
+    HeldQueue *queue = (HeldQueue *)zhash_lookup(self->queues, identity);
+    if (queue) return queue;
+    queue = calloc(1, sizeof(HeldQueue));
+    if (!queue) return NULL;
+    queue->identity = strdup(identity);
+    queue->held = zlist_new();
+    if (!queue->identity || !queue->held) {
+        held_queue_free(queue);
+        return NULL;
+    }
+    zhash_insert(self->queues, identity, queue);
+    zhash_freefn(self->queues, identity, held_queue_free);
+    return queue;
+}
+
+static inline OutboxResult outbox_hold(Outbox *self, const char *identity, zmsg_t **msg_p)
+{
+    HeldQueue *queue = outbox_queue(self, identity);
+    if (!queue) return OUTBOX_FAILED;
+    zmsg_t *msg = *msg_p;
+    size_t size = zmsg_content_size(msg);
+
+    if (zlist_size(queue->held) >= self->depth_limit || self->held_bytes + size > self->bytes_limit) {
+        *msg_p = NULL;
+        if (self->policy == SLOW_DIVERT) {
+            outbox_give_up(self, queue, msg, OUTBOX_DROP_DIVERTED);
+            outbox_release(self, queue);
+            return OUTBOX_DROPPED;
+        }
+        if (self->policy == SLOW_DISCONNECT) {
+            while (zlist_size(queue->held) > 0) outbox_give_up(self, queue, outbox_pop(self, queue), OUTBOX_DROP_DETACHED);
+            queue->detached = true;
+            outbox_give_up(self, queue, msg, OUTBOX_DROP_DETACHED);
+            outbox_release(self, queue);
+            return OUTBOX_DROPPED;
+        }
+        while (zlist_size(queue->held) > 0 &&
+               (zlist_size(queue->held) >= self->depth_limit || self->held_bytes + size > self->bytes_limit)) {
+            outbox_give_up(self, queue, outbox_pop(self, queue), OUTBOX_DROP_OLDEST);
+        }
+        // the bytes are held for others, this one has nothing left to make room with
+        if (self->held_bytes + size > self->bytes_limit) {
+            outbox_give_up(self, queue, msg, OUTBOX_DROP_OLDEST);
+            outbox_release(self, queue);
+            return OUTBOX_DROPPED;
+        }
+        *msg_p = msg;
+    }
+
+    if (zlist_append(queue->held, msg) != 0) return OUTBOX_FAILED;
+    *msg_p = NULL;
+    if (zlist_size(queue->held) == 1) queue->stalled_since = zclock_mono();
+    queue->bytes += size;
+    self->held++;
+    self->held_bytes += size;
+    if (!queue->backlogged) {
+        queue->backlogged = true;
+        zlist_append(self->backlogged, queue);
+    }
+    return OUTBOX_HELD;
+}
+
+// sends *msg_p ([recipient][frames...]) on socket, or holds it behind what's
+// already held for the recipient. takes the message unless the result says the
+// caller keeps it
+static inline OutboxResult outbox_send(Outbox *self, zsock_t *socket, zmsg_t **msg_p)
+{
+    char identity[256];
+    if (!outbox_identity(*msg_p, identity)) return OUTBOX_FAILED;
+
+    HeldQueue *queue = (HeldQueue *)zhash_lookup(self->queues, identity);
+    if (queue && queue->detached) {
+        zmsg_t *msg = *msg_p;
+        *msg_p = NULL;
+        outbox_give_up(self, queue, msg, OUTBOX_DROP_DETACHED);
+        return OUTBOX_DROPPED;
+    }
+    if (queue && zlist_size(queue->held) > 0) return outbox_hold(self, identity, msg_p);
+
+    if (outbox_send_frames(msg_p, socket) == 0) return OUTBOX_SENT;
+    if (zmq_errno() == EAGAIN) return outbox_hold(self, identity, msg_p);
+    return zmq_errno() == EHOSTUNREACH ? OUTBOX_UNREACHABLE : OUTBOX_FAILED;
+}
+
+// sends what's held for as long as the recipients take it, adds the messages and
+// bytes that went out to *sent and *bytes
+static inline void outbox_flush(Outbox *self, zsock_t *socket, size_t *sent, size_t *bytes)
+{
+    for (size_t i = zlist_size(self->backlogged); i > 0; i--) {
+        HeldQueue *queue = (HeldQueue *)zlist_pop(self->backlogged);
+        while (zlist_size(queue->held) > 0) {
+            int64_t stalled_since = queue->stalled_since;
+            zmsg_t *msg = outbox_pop(self, queue);
+            size_t size = zmsg_content_size(msg);
+            if (outbox_send_frames(&msg, socket) == 0) {
+                (*sent)++;
+                *bytes += size;
+                continue;
+            }
+            if (zmq_errno() == EAGAIN) {
+                // still full, back to the front where it was
+                zlist_push(queue->held, msg);
+                queue->bytes += size;
+                self->held++;
+                self->held_bytes += size;
+                queue->stalled_since = stalled_since;
+                break;
+            }
+            // gone, or something worse: nothing held for it gets through any more
+            outbox_give_up(self, queue, msg, OUTBOX_DROP_GONE);
+            while (zlist_size(queue->held) > 0) outbox_give_up(self, queue, outbox_pop(self, queue), OUTBOX_DROP_GONE);
+        }
+        if (zlist_size(queue->held) > 0) {
+            zlist_append(self->backlogged, queue);
+        } else {
+            // already off the list
+            queue->backlogged = false;
+            outbox_release(self, queue);
+        }
+    }
+}
+
+// identity sent something, a consumer the disconnect policy gave up on is served again
+static inline void outbox_heard(Outbox *self, const char *identity)
+{
+    HeldQueue *queue = (HeldQueue *)zhash_lookup(self->queues, identity);
+    if (!queue || !queue->detached) return;
+    queue->detached = false;
+    outbox_release(self, queue);
+}
+
+// held messages of the recipient with the most of them
+static inline size_t outbox_deepest(Outbox *self)
+{
+    size_t deepest = 0;
+    for (HeldQueue *queue = (HeldQueue *)zlist_first(self->backlogged); queue;
+         queue = (HeldQueue *)zlist_next(self->backlogged)) {
+        if (zlist_size(queue->held) > deepest) deepest = zlist_size(queue->held);
+    }
+    return deepest;
+}
+
+#endif // OUTBOX_H_
@@ -0,0 +1,409 @@
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// hot standby replication
+//
+// the primary binds a ROUTER for its standby. the standby connects a DEALER and
+// says HELLO, the primary answers with a snapshot of its peer table and from then
+// on streams whatever changes in batches: one multipart message per pass of the
+// forwarding loop, sent without waiting for the previous one to be acknowledged.
+//
+//     [standby id]["BATCH"][seq][record frames...]       primary -> standby
+//     ["ACK"][seq]                                        standby -> primary
+//     ["HELLO"]                                           standby -> primary
+//     [standby id]["RESYNC"]                              primary -> standby
+//
+// records are a type frame followed by a fixed number of frames:
+//
+//     R [key (32 bytes)][name]                                              registration
+//     P [identity][public key][first, last seen, messages, bytes (4 x int64)]
+//     M [id (uint64)][sender][recipient id][sender id][content][header]     queued message
+//     D [ids (n x uint64)]                                                  forwarded (or dropped) messages
+//
+// up to REPLICA_WINDOW batches can be unacknowledged, past that records pile up
+// in the current batch until acks come back, the forwarding loop never waits.
+// once REPLICA_BACKLOG_BYTES have piled up the primary throws them away and
+// stops recording, and tells the standby to say hello again: it gets a fresh
+// snapshot, which replaces whatever it kept from the old stream. an empty batch every REPLICA_HEARTBEAT_MS tells the standby the primary is alive;
+// after REPLICA_TIMEOUT_MS without one it takes over.
+//
+// a message the primary sent but died before reporting is sent again by the
+// standby, delivery is at least once.
+
+#define REPLICA_HEARTBEAT_MS 100
+#define REPLICA_TIMEOUT_MS   1000
+#define REPLICA_HELLO_MS     250
+#define REPLICA_WINDOW       64
+#define REPLICA_REPLAY_DELAY_MS 500
+
+// records waiting for the window, twice what the scheduler holds so a snapshot fits
+#define REPLICA_BACKLOG_BYTES   (128 * 1024 * 1024)
+
+typedef struct {
+    zsock_t *socket;                // ROUTER the standby connects to
+    zframe_t *standby;              // its routing id, NULL until it said hello
+    zmsg_t *batch;                  // records since the last flush
+    uint64_t *done;                 // ids for the D record of the current batch
+    size_t done_count;
+    size_t done_capacity;
+    uint64_t seq;                   // last batch sent
+    uint64_t acked;                 // last batch the standby confirmed
+    int64_t sent_at[REPLICA_WINDOW];  // zclock_usecs() by seq % REPLICA_WINDOW
+    int64_t last_send;              // zclock_mono()
+    int64_t lag_usec;               // send to ack of the last acknowledged batch
+    int64_t max_lag_usec;
+    uint64_t batches;
+    uint64_t bytes;
+    bool resync;                    // records were dropped, waiting for the standby's hello
+    uint64_t resyncs;
+} ReplicaPrimary;
+
+typedef struct {
+    zsock_t *socket;                // DEALER to the primary
+    int64_t last_heard;             // zclock_mono() of the last batch
+    int64_t last_hello;
+    uint64_t seq;                   // last batch applied
+    bool synced;                    // has heard from a primary at all
+    bool resync;                    // told to start over, until the new snapshot's first batch
+    bool restarted;                 // the batch just received is that one
+} ReplicaStandby;
+
+typedef enum {
+    REPLICA_NOTHING,
+    REPLICA_HELLO,                  // a (new) standby wants a snapshot
+} ReplicaEvent;
+
+static inline void replica_put_u64(uint8_t *buffer, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) buffer[i] = (uint8_t)(value >> (56 - 8 * i));
+}
+
+static inline uint64_t replica_get_u64(const uint8_t *buffer)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = (value << 8) | buffer[i];
+    return value;
+}
+
+static inline void replica_add_u64(zmsg_t *msg, uint64_t value)
+{
+    uint8_t buffer[8];
+    replica_put_u64(buffer, value);
+    zmsg_addmem(msg, buffer, sizeof(buffer));
+}
+
+static inline ReplicaPrimary *replica_primary_new(const char *endpoint)
+{
+    ReplicaPrimary *self = calloc(1, sizeof(ReplicaPrimary));
+    if (!self) return NULL;
+    self->socket = zsock_new(ZMQ_ROUTER);
+    self->batch = zmsg_new();
+    if (!self->socket || !self->batch || zsock_bind(self->socket, "%s", endpoint) == -1) {
+        zsock_destroy(&self->socket);
+        zmsg_destroy(&self->batch);
+        free(self);
+        return NULL;
+    }
+    // a standby that went away shows up as a failed send instead of a silent drop
+    zsock_set_router_mandatory(self->socket, 1);
+    zsock_set_sndtimeo(self->socket, 0);
+    self->last_send = zclock_mono();
+    return self;
+}
+
+static inline void replica_primary_destroy(ReplicaPrimary **self_p)
+{
+    ReplicaPrimary *self = *self_p;
+    if (!self) return;
+    zsock_destroy(&self->socket);
+    zframe_destroy(&self->standby);
+    zmsg_destroy(&self->batch);
+    free(self->done);
+    free(self);
+    *self_p = NULL;
+}
+
+// whether changes are recorded for the standby
+static inline bool replica_active(const ReplicaPrimary *self)
+{
+    return self && self->standby && !self->resync;
+}
+
+static inline void replica_add_register(ReplicaPrimary *self, const uint8_t *key, const char *name)
+{
+    if (!replica_active(self)) return;
+    zmsg_addstr(self->batch, "R");
+    zmsg_addmem(self->batch, key, 32);
+    zmsg_addstr(self->batch, name);
+}
+
+static inline void replica_add_peer(ReplicaPrimary *self, const char *identity, const char *public_key,
+                                    int64_t first_seen, int64_t last_seen, uint64_t messages, uint64_t bytes)
+{
+    if (!replica_active(self)) return;
+    uint8_t stats[32];
+    replica_put_u64(stats, (uint64_t)first_seen);
+    replica_put_u64(stats + 8, (uint64_t)last_seen);
+    replica_put_u64(stats + 16, messages);
+    replica_put_u64(stats + 24, bytes);
+
+    zmsg_addstr(self->batch, "P");
+    zmsg_addstr(self->batch, identity);
+    zmsg_addstr(self->batch, public_key ? public_key : "");
+    zmsg_addmem(self->batch, stats, sizeof(stats));
+}
+
+// msg is the queued [recipient id][sender id][content][delivery header], it's copied
+static inline void replica_add_message(ReplicaPrimary *self, uint64_t id, const char *sender, zmsg_t *msg)
+{
+    if (!replica_active(self) || zmsg_size(msg) != 4) return;
+    zmsg_addstr(self->batch, "M");
+    replica_add_u64(self->batch, id);
+    zmsg_addstr(self->batch, sender);
+    for (zframe_t *frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        zframe_t *copy = zframe_dup(frame);
+        zmsg_append(self->batch, &copy);
+    }
+}
+
+static inline void replica_add_done(ReplicaPrimary *self, uint64_t id)
+{
+    if (!replica_active(self) || id == 0) return;
+    if (self->done_count == self->done_capacity) {
+        size_t capacity = self->done_capacity ? self->done_capacity * 2 : 256;
+        uint64_t *done = realloc(self->done, capacity * sizeof(uint64_t));
+        if (!done) return;
+        self->done = done;
+        self->done_capacity = capacity;
+    }
+    self->done[self->done_count++] = id;
+}
+
+static inline void replica_reset(ReplicaPrimary *self)
+{
+    zmsg_destroy(&self->batch);
+    self->batch = zmsg_new();
+    self->done_count = 0;
+}
+
+// a standby that fell this far behind gets nothing more until it starts over
+static inline bool replica_overflow(ReplicaPrimary *self)
+{
+    if (zmsg_content_size(self->batch) + self->done_count * 8 <= REPLICA_BACKLOG_BYTES) return false;
+    replica_reset(self);
+    self->resync = true;
+    self->resyncs++;
+    return true;
+}
+
+// until the standby says hello again, in place of the heartbeat
+static inline void replica_send_resync(ReplicaPrimary *self, int64_t now)
+{
+    if (now - self->last_send < REPLICA_HEARTBEAT_MS) return;
+    zmsg_t *out = zmsg_new();
+    zframe_t *to = zframe_dup(self->standby);
+    zmsg_append(out, &to);
+    zmsg_addstr(out, "RESYNC");
+    if (zmsg_send(&out, self->socket) != 0) {
+        if (errno == EHOSTUNREACH) zframe_destroy(&self->standby);
+        zmsg_destroy(&out);
+        return;
+    }
+    self->last_send = now;
+}
+
+// sends the current batch if there is anything in it (or a heartbeat is due) and
+// the window has room. called once per pass of the forwarding loop
+static inline void replica_flush(ReplicaPrimary *self)
+{
+    if (!self) return;
+    if (!self->standby) {
+        replica_reset(self);
+        return;
+    }
+
+    int64_t now = zclock_mono();
+    if (self->resync) {
+        replica_send_resync(self, now);
+        return;
+    }
+    bool empty = zmsg_size(self->batch) == 0 && self->done_count == 0;
+    if (empty && now - self->last_send < REPLICA_HEARTBEAT_MS) return;
+    if (self->seq - self->acked >= REPLICA_WINDOW) {
+        replica_overflow(self);
+        return;
+    }
+
+    if (self->done_count > 0) {
+        zmsg_addstr(self->batch, "D");
+        uint8_t *ids = malloc(self->done_count * 8);
+        if (!ids) return;
+        for (size_t i = 0; i < self->done_count; i++) replica_put_u64(ids + 8 * i, self->done[i]);
+        zmsg_addmem(self->batch, ids, self->done_count * 8);
+        free(ids);
+        self->done_count = 0;
+    }
+
+    uint64_t seq = self->seq + 1;
+    zmsg_t *out = self->batch;
+    size_t size = zmsg_content_size(out);
+    uint8_t seq_buffer[8];
+    replica_put_u64(seq_buffer, seq);
+    zmsg_pushmem(out, seq_buffer, sizeof(seq_buffer));
+    zmsg_pushstr(out, "BATCH");
+    zframe_t *to = zframe_dup(self->standby);
+    zmsg_prepend(out, &to);
+
+    if (zmsg_send(&out, self->socket) != 0) {
+        // full or gone. a gone standby has to say hello again and gets a new snapshot
+        if (errno == EHOSTUNREACH) {
+            zframe_destroy(&self->standby);
+            zmsg_destroy(&out);
+            self->batch = zmsg_new();
+            return;
+        }
+        // keep the records for the next try, minus the envelope
+        zframe_t *frame = zmsg_pop(out);
+        zframe_destroy(&frame);
+        frame = zmsg_pop(out);
+        zframe_destroy(&frame);
+        frame = zmsg_pop(out);
+        zframe_destroy(&frame);
+        self->batch = out;
+        replica_overflow(self);
+        return;
+    }
+
+    self->batch = zmsg_new();
+    self->seq = seq;
+    self->sent_at[seq % REPLICA_WINDOW] = zclock_usecs();
+    self->last_send = now;
+    self->batches++;
+    self->bytes += size;
+}
+
+// one message off the replication socket: a hello or an ack
+static inline ReplicaEvent replica_handle(ReplicaPrimary *self)
+{
+    zmsg_t *msg = zmsg_recv(self->socket);
+    if (!msg) return REPLICA_NOTHING;
+
+    ReplicaEvent event = REPLICA_NOTHING;
+    zframe_t *from = zmsg_pop(msg);
+    char *command = zmsg_popstr(msg);
+
+    if (command && streq(command, "HELLO")) {
+        zframe_destroy(&self->standby);
+        self->standby = from;
+        from = NULL;
+        self->seq = 0;
+        self->acked = 0;
+        self->resync = false;
+        replica_reset(self);
+        event = REPLICA_HELLO;
+    } else if (command && streq(command, "ACK") && self->standby && zframe_eq(from, self->standby)) {
+        zframe_t *seq_frame = zmsg_pop(msg);
+        if (seq_frame && zframe_size(seq_frame) == 8) {
+            uint64_t seq = replica_get_u64(zframe_data(seq_frame));
+            if (seq > self->acked && seq <= self->seq) {
+                self->acked = seq;
+                self->lag_usec = zclock_usecs() - self->sent_at[seq % REPLICA_WINDOW];
+                if (self->lag_usec > self->max_lag_usec) self->max_lag_usec = self->lag_usec;
+            }
+        }
+        zframe_destroy(&seq_frame);
+    }
+
+    zstr_free(&command);
+    zframe_destroy(&from);
+    zmsg_destroy(&msg);
+    return event;
+}
+
+static inline ReplicaStandby *replica_standby_new(const char *endpoint)
+{
+    ReplicaStandby *self = calloc(1, sizeof(ReplicaStandby));
+    if (!self) return NULL;
+    self->socket = zsock_new(ZMQ_DEALER);
+    if (!self->socket || zsock_connect(self->socket, "%s", endpoint) == -1) {
+        zsock_destroy(&self->socket);
+        free(self);
+        return NULL;
+    }
+    zsock_set_sndtimeo(self->socket, 0);
+    self->last_hello = zclock_mono() - REPLICA_HELLO_MS;
+    return self;
+}
+
+static inline void replica_standby_destroy(ReplicaStandby **self_p)
+{
+    ReplicaStandby *self = *self_p;
+    if (!self) return;
+    zsock_destroy(&self->socket);
+    free(self);
+    *self_p = NULL;
+}
+
+// says hello until the primary answers, and again when it goes quiet: a primary
+// that restarted within the timeout doesn't know about us anymore
+static inline void replica_standby_hello(ReplicaStandby *self)
+{
+    int64_t now = zclock_mono();
+    bool quiet = !self->synced || self->resync || now - self->last_heard > 2 * REPLICA_HEARTBEAT_MS;
+    if (!quiet || now - self->last_hello < REPLICA_HELLO_MS) return;
+    zstr_send(self->socket, "HELLO");
+    self->last_hello = now;
+}
+
+// the next batch's records, acknowledged right away. NULL for anything else
+static inline zmsg_t *replica_standby_recv(ReplicaStandby *self)
+{
+    zmsg_t *msg = zmsg_recv(self->socket);
+    if (!msg) return NULL;
+    self->restarted = false;
+
+    char *command = zmsg_popstr(msg);
+    if (command && streq(command, "RESYNC")) {
+        // the primary is still there, it just dropped what we missed
+        self->last_heard = zclock_mono();
+        self->synced = true;
+        self->resync = true;
+        zstr_free(&command);
+        zmsg_destroy(&msg);
+        return NULL;
+    }
+    zframe_t *seq_frame = zmsg_pop(msg);
+    bool valid = command && streq(command, "BATCH") && seq_frame && zframe_size(seq_frame) == 8;
+    zstr_free(&command);
+    if (!valid) {
+        zframe_destroy(&seq_frame);
+        zmsg_destroy(&msg);
+        return NULL;
+    }
+
+    self->seq = replica_get_u64(zframe_data(seq_frame));
+    self->last_heard = zclock_mono();
+    self->synced = true;
+    if (self->resync && self->seq == 1) {
+        self->resync = false;
+        self->restarted = true;
+    }
+
+    zmsg_t *ack = zmsg_new();
+    zmsg_addstr(ack, "ACK");
+    zmsg_append(ack, &seq_frame);
+    if (zmsg_send(&ack, self->socket) != 0) zmsg_destroy(&ack);
+    return msg;
+}
+
+// the primary has been heard from and then went quiet
+static inline bool replica_primary_lost(const ReplicaStandby *self)
+{
+    return self->synced && zclock_mono() - self->last_heard > REPLICA_TIMEOUT_MS;
+}
+
+#endif // REPLICATION_H_
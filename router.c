@@ -1,238 +1,2302 @@
+#define _GNU_SOURCE
 #include <czmq.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <assert.h>
 
+#include "scheduler.h"
+#include "metrics.h"
+#include "keystore.h"
+#include "authindex.h"
+#include "zap.h"
+#include "cluster.h"
+#include "replication.h"
+#include "delivery.h"
+#include "dedup.h"
+#include "journal.h"
+#include "keydirectory.h"
+#include "batch.h"
+#include "router.h"
+#include "affinity.h"
+#include "outbox.h"
+#include "timerwheel.h"
+
 // TODO: add curvezmq authentication
 // both the router and dealer need a set of public and secret keys
 
-// ROUTER:	server identity; stays constant.
-// DEALER:	ephemeral or long-term identity.
+// ROUTER:	server identity; stays constant.
+// DEALER:	ephemeral or long-term identity.
+
+// dealers use the router's public key to authenticate it
+// router uses the dealer's public kye to authorize or deny access
+
+// upper bound of messages read off the socket before the queues get serviced
+#define DRAIN_MAX 256
+
+// bytes forwarded per loop iteration before going back to drain the socket
+#define SERVICE_BUDGET (256 * 1024)
+
+// scrape with a REQ socket, any request is answered with the current metrics
+#define STATS_ENDPOINT "ipc://router_stats"
+
+// messages read off the cluster socket per loop iteration
+#define CLUSTER_DRAIN_MAX 256
+
+// history records sent per stream per loop iteration, and the most credit a dealer can hold
+#define HISTORY_BATCH 256
+#define HISTORY_CREDIT_MAX 4096
+
+// a history stream nobody gave credit to in this long is dropped
+#define HISTORY_IDLE_MS (30 * 1000)
+
+// history streams one requester can have open at once, a request past that is answered with the end marker
+#define HISTORY_STREAMS_MAX 4
+
+// a user counts as present when the router has heard from them this recently
+#define PRESENCE_TIMEOUT_MS (30 * 1000)
+
+// how long the adaptive loop keeps spinning after the last traffic before it blocks
+#define DEFAULT_SPIN_US 200
+
+// messages held for one recipient that isn't keeping up, and for all of them (see outbox.h)
+#define DEFAULT_HOLD_DEPTH 1000
+#define DEFAULT_HOLD_MB 64
+
+// how soon a held message is tried again when there's nothing else to wake up for
+#define HOLD_RETRY_MS 5
+
+// acks have a bucket of their own, this many times the rate limit: a peer acks
+// what everyone sends it, not just what it sends
+#define ACK_RATE_MULTIPLE 4
+
+// raylib/syslog already claim LOG_*, so the router's levels get their own names
+typedef enum {
+    LEVEL_ERROR,
+    LEVEL_INFO,
+    LEVEL_DEBUG
+} LogLevel;
+
+static const char *log_level_names[] = {
+    [LEVEL_ERROR] = "error",
+    [LEVEL_INFO]  = "info",
+    [LEVEL_DEBUG] = "debug",
+};
+
+// how the forwarding loop waits for the next message
+//
+// block     sleeps in zpoller_wait until something is ready, no CPU while idle
+//           but every message after a quiet moment pays for the wakeup
+// poll      wakes up every millisecond whether there's anything or not, the old
+//           non-blocking loop
+// adaptive  spins on the sockets' ZMQ_EVENTS for spin_us after the last traffic,
+//           so a message arriving mid-burst is picked up without a wakeup, and
+//           blocks like block once it's been quiet for that long
+typedef enum {
+    POLL_BLOCK,
+    POLL_TIMED,
+    POLL_ADAPTIVE
+} PollMode;
+
+static const char *poll_mode_names[] = {
+    [POLL_BLOCK]    = "block",
+    [POLL_TIMED]    = "poll",
+    [POLL_ADAPTIVE] = "adaptive",
+};
+
+// written by the admin socket, read on every log call
+static _Atomic int log_level = LEVEL_INFO;
+
+#define log_enabled(level) (atomic_load_explicit(&log_level, memory_order_relaxed) >= (int)(level))
+
+static void router_log(LogLevel level, const char *format, ...)
+{
+    if (!log_enabled(level)) return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(level == LEVEL_ERROR ? stderr : stdout, format, args);
+    va_end(args);
+}
+
+typedef struct {
+    const char *bind_endpoint;  // comma separated, e.g. tcp for everyone and ipc for this host
+    const char *key_directory;
+    const char *keystore;       // packed keystore to use instead of key_directory, or NULL
+    const char *router_cert;    // router's cert file, saves scanning key_directory for it
+    const char *router_public_key;
+    const char *admin_endpoint;
+    const char *stats_endpoint;
+    const char *cluster_file;   // membership of the cluster, NULL for a single router
+    const char *node_name;      // this router's entry in cluster_file
+    const char *replication_endpoint;   // where a standby can follow this router, or NULL
+    const char *standby_of;     // primary's replication endpoint when started as its standby
+    const char *journal_directory;  // where conversations are journaled, NULL keeps nothing
+    int rate_limit;             // messages per second per sender, 0 is unlimited
+    int rate_burst;             // bucket size of the rate limiter
+    int sndhwm;
+    int rcvhwm;
+    int zap_workers;            // threads answering CURVE handshakes
+    int io_threads;             // libzmq's, they do the CURVE boxing of every message
+    CpuSet io_cpus;             // where those run, 0 for anywhere (see affinity.h)
+    CpuSet loop_cpus;           // the forwarding loop
+    CpuSet zap_cpus;            // the handshake workers
+    int sndbuf;                 // SO_SNDBUF/SO_RCVBUF of the client connections, 0 keeps the OS's
+    int rcvbuf;
+    int backlog;                // pending tcp/ipc connections, a reconnect storm needs room
+    int hold_depth;             // messages held per recipient past its HWM
+    int hold_mb;                // all held messages together
+    SlowConsumerPolicy slow_policy;
+    PollMode poll_mode;
+    int spin_us;                // adaptive mode's spin budget
+} RouterConfig;
+
+// per identity bookkeeping, doubles as the connection and presence table
+typedef struct {
+    char *identity;
+    char *public_key;
+    int64_t first_seen;         // zclock_time()
+    int64_t last_seen;
+    uint64_t messages;
+    uint64_t bytes;
+    double tokens;              // rate limiter bucket
+    int64_t last_refill;        // zclock_mono()
+    double ack_tokens;          // and the one for its acks
+    int64_t ack_refill;
+    uint64_t replicated_in;     // replication batch it was last sent in
+    DedupWindow dedup;          // message numbers already forwarded
+} Peer;
+
+typedef struct {
+    RouterConfig config;
+    zsock_t *socket;
+    zsock_t *admin;
+    ZapHandler *zap;            // answers CURVE handshakes from auth_domain
+    zactor_t *watcher;          // keeps auth_domain in sync with key_directory or the keystore
+    bool reload_pending;        // the watcher is rescanning for the admin, who gets the reply after
+    AuthDomain auth_domain;     // accepted keys, read lock-free on the forwarding path
+    AuthReader *auth_reader;    // forwarding loop's reader slot
+    Scheduler *scheduler;
+    Outbox *outbox;             // what recipients at their HWM couldn't take yet
+    zhash_t *peers;             // identity -> Peer
+    Cluster *cluster;           // NULL unless started with --cluster
+    ReplicaPrimary *replica;    // NULL unless started with --replication
+    ReplicaStandby *standby;    // set while standing by for a primary
+    uint64_t next_message_id;   // ids for replicated messages
+    Journal *journal;           // NULL unless started with --journal
+    zlist_t *histories;         // HistoryStreams being sent, in service order
+    KeyDirectory *keys;         // public keys served to dealers, follows auth_domain
+    const AuthIndex *auth_index;    // held while a drained batch is handled, NULL otherwise
+    uint8_t allowed_key[40];    // z85 key auth_index last accepted, valid while it's held
+    bool allowed_cached;
+    int64_t now;                // zclock_time() at the start of the pass
+    int64_t now_mono;           // zclock_mono() and zclock_usecs() along with it
+    int64_t now_usecs;
+    TimerWheel timers;          // history streams going idle, replica heartbeats
+    Timer heartbeat;            // armed while replicating
+} Router;
+
+// one clock read per pass of the loop, every message of a batch gets the same time
+static void router_tick(Router *self)
+{
+    self->now = zclock_time();
+    self->now_mono = zclock_mono();
+    self->now_usecs = zclock_usecs();
+}
+
+static void peer_free(void *data)
+{
+    Peer *peer = (Peer *)data;
+    free(peer->identity);
+    free(peer->public_key);
+    free(peer);
+}
+
+static Peer *router_peer(Router *self, const char *identity, const char *public_key)
+{
+    Peer *peer = (Peer *)zhash_lookup(self->peers, identity);
+    if (!peer) {
+        peer = calloc(1, sizeof(Peer));
+        if (!peer) return NULL;
+        peer->identity = strdup(identity);
+        peer->first_seen = self->now;
+        peer->tokens = self->config.rate_burst;
+        peer->last_refill = self->now_mono;
+        peer->ack_tokens = (double)self->config.rate_burst * ACK_RATE_MULTIPLE;
+        peer->ack_refill = self->now_mono;
+        zhash_insert(self->peers, identity, peer);
+        zhash_freefn(self->peers, identity, peer_free);
+    }
+
+    // a re-registered user comes back with a different key
+    if (public_key && (!peer->public_key || strcmp(peer->public_key, public_key) != 0)) {
+        free(peer->public_key);
+        peer->public_key = strdup(public_key);
+    }
+    peer->last_seen = self->now;
+    return peer;
+}
+
+// mirrored to the standby at most once per batch, however many messages it sent
+static void router_replicate_peer(Router *self, Peer *peer)
+{
+    if (!peer || !replica_active(self->replica)) return;
+    uint64_t batch = self->replica->seq + 1;
+    if (peer->replicated_in == batch) return;
+    peer->replicated_in = batch;
+    replica_add_peer(self->replica, peer->identity, peer->public_key,
+                     peer->first_seen, peer->last_seen, peer->messages, peer->bytes);
+}
+
+// queues a message for forwarding and mirrors it to the standby until it's sent.
+// counts the drop when it can't, the caller still owns msg then
+static bool router_queue(Router *self, const char *sender, zmsg_t *msg, void *destination)
+{
+    QueuedMessage item = queued_message(msg);
+    item.enqueued = self->now_usecs;
+    item.destination = destination;
+    // a sender that's this far ahead of its recipients retransmits what it loses here
+    if (scheduler_sender_full(self->scheduler, sender, item.size)) {
+        metrics_drop(thread_metrics, DROP_SENDER_BACKLOG);
+        return false;
+    }
+    if (replica_active(self->replica)) {
+        item.id = ++self->next_message_id;
+        replica_add_message(self->replica, item.id, sender, msg);
+    }
+    if (!scheduler_push_item(self->scheduler, sender, item)) {
+        router_log(LEVEL_ERROR, "Failed to queue message\n");
+        metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+        replica_add_done(self->replica, item.id);
+        return false;
+    }
+    return true;
+}
+
+// token bucket, refilled lazily when the sender shows up
+static bool bucket_take(double *tokens, int64_t *last_refill, int64_t now, int rate, int burst)
+{
+    *tokens += (double)(now - *last_refill) * rate / 1000.0;
+    *last_refill = now;
+    if (*tokens > burst) *tokens = burst;
+
+    if (*tokens < 1.0) return false;
+    *tokens -= 1.0;
+    return true;
+}
+
+static bool peer_allow(Router *self, Peer *peer, bool ack)
+{
+    int rate = self->config.rate_limit;
+    if (rate <= 0) return true;
+    if (ack) {
+        return bucket_take(&peer->ack_tokens, &peer->ack_refill, self->now_mono,
+                           rate * ACK_RATE_MULTIPLE, self->config.rate_burst * ACK_RATE_MULTIPLE);
+    }
+    return bucket_take(&peer->tokens, &peer->last_refill, self->now_mono, rate, self->config.rate_burst);
+}
+
+// an ack skips the sender queues, so it has to look like one: no content, and
+// the session the recipient has been numbering its messages in through here.
+// anything else with an ack header is forwarded like any other message
+static bool router_is_ack(Router *self, zmsg_t *msg, zframe_t *header)
+{
+    if (!header || zframe_size(header) != DELIVERY_ACK_SIZE || zframe_data(header)[0] != DELIVERY_ACK) return false;
+    zframe_t *recipient = zmsg_first(msg);
+    zframe_t *content = zmsg_next(msg);
+    if (!recipient || !content || zframe_size(content) != 0) return false;
+
+    char *identity = zframe_strdup(recipient);
+    Peer *to = identity ? (Peer *)zhash_lookup(self->peers, identity) : NULL;
+    free(identity);
+    return to && to->dedup.session != 0 && to->dedup.session == delivery_get_u64(zframe_data(header) + 1);
+}
+
+// a forwarded message that never made it to the recipient after all: the sender's
+// retransmit of it is let through the dedup window again
+static void router_forget(Router *self, zmsg_t *msg)
+{
+    // [recipient id][sender id][message content or records][delivery or batch header]
+    if (zmsg_size(msg) != 4) return;
+    zmsg_first(msg);
+    zframe_t *sender_id = zmsg_next(msg);
+    zframe_t *content = zmsg_next(msg);
+    zframe_t *header = zmsg_next(msg);
+    char *sender = zframe_strdup(sender_id);
+    Peer *peer = sender ? (Peer *)zhash_lookup(self->peers, sender) : NULL;
+    free(sender);
+    if (!peer) return;
+
+    uint64_t session = 0, number = 0;
+    if (delivery_message_number(header, &session, &number)) {
+        dedup_forget(&peer->dedup, session, number);
+        return;
+    }
+    if (!batch_is_header(header)) return;
+    size_t offset = 0;
+    BatchRecord record;
+    while (batch_next(zframe_data(content), zframe_size(content), &offset, &record)) {
+        zframe_t *record_header = zframe_new(record.header, record.header_length);
+        if (record_header && delivery_message_number(record_header, &session, &number)) {
+            dedup_forget(&peer->dedup, session, number);
+        }
+        zframe_destroy(&record_header);
+    }
+}
+
+// the outbox gave up on a message for a slow or departed recipient
+static void router_outbox_drop(void *context, zmsg_t *msg, OutboxDrop reason)
+{
+    Router *self = (Router *)context;
+    static const DropReason reasons[] = {
+        [OUTBOX_DROP_OLDEST]   = DROP_SLOW_CONSUMER,
+        [OUTBOX_DROP_DIVERTED] = DROP_DIVERTED,
+        [OUTBOX_DROP_DETACHED] = DROP_DETACHED,
+        [OUTBOX_DROP_GONE]     = DROP_NOT_CONNECTED,
+    };
+    metrics_drop(thread_metrics, reasons[reason]);
+    // a diverted message is in the journal, a retransmit would only put it there twice
+    if (reason != OUTBOX_DROP_DIVERTED || !self->journal) router_forget(self, msg);
+}
+
+// saves a registered user's key where the watcher picks it up
+static void router_store_key(Router *self, const uint8_t *user_key, const char *username)
+{
+    if (self->config.keystore) {
+        // one record on the keystore's log, the watcher indexes it once it's written
+        if (!keystore_append(self->config.keystore, user_key, username)) {
+            router_log(LEVEL_ERROR, "Unable to append %s to the keystore log: %s\n", username, strerror(errno));
+        }
+        return;
+    }
+
+    // make a new certificate for the router to store as an accepted user, public half only
+    uint8_t no_secret[AUTH_KEY_SIZE] = {0};
+    zcert_t *user_cert_pub = zcert_new_from(user_key, no_secret);
+
+    // format where to store the cert
+    size_t cert_buffer = strlen(self->config.key_directory) + strlen(username) + 8; // '/' + ".cert" + '\0'
+    char* certificate_location = malloc(cert_buffer);
+    snprintf(certificate_location, cert_buffer, "%s/%s.cert", self->config.key_directory, username);
+
+    // save the cert to disc, the watcher indexes it as soon as the file is closed
+    zcert_save_public(user_cert_pub, certificate_location);
+    free(certificate_location);
+    zcert_destroy(&user_cert_pub);
+}
+
+// history sync
+//
+// with --journal every message the router forwards is appended to the journal
+// of its conversation as well (see journal.h). a dealer asks for a range of it
+// with a history header (see delivery.h) and gets the records streamed back, no
+// more than it gave credit for and HISTORY_BATCH per loop iteration, so a dealer
+// catching up on 100k messages never has more than its credit in the router's
+// send queue and the journal is read off disk as it goes.
+
+typedef struct {
+    char *requester;
+    char *partner;
+    JournalCursor cursor;
+    uint32_t credit;
+    Timer idle;                 // HISTORY_IDLE_MS after the request or the last credit
+    zmsg_t *blocked;            // the record the requester's connection had no room for, sent first next time
+} HistoryStream;
+
+static void history_stream_destroy(HistoryStream **stream_p)
+{
+    HistoryStream *stream = *stream_p;
+    if (!stream) return;
+    journal_cursor_close(&stream->cursor);
+    zmsg_destroy(&stream->blocked);
+    free(stream->requester);
+    free(stream->partner);
+    free(stream);
+    *stream_p = NULL;
+}
+
+// an idle primary still tells the standby it's alive
+static void router_heartbeat(void *context, Timer *timer)
+{
+    Router *self = (Router *)context;
+    replica_flush(self->replica);
+    timer_wheel_add(&self->timers, timer, self->now_mono + REPLICA_HEARTBEAT_MS, router_heartbeat, NULL);
+}
+
+static void router_history_close(Router *self, HistoryStream **stream_p)
+{
+    if (*stream_p) timer_wheel_cancel(&self->timers, &(*stream_p)->idle);
+    history_stream_destroy(stream_p);
+}
+
+// no credit since the request or the last top up, the requester is likely gone
+static void router_history_idle(void *context, Timer *timer)
+{
+    Router *self = (Router *)context;
+    HistoryStream *stream = (HistoryStream *)timer->data;
+    if (stream->credit > 0) {
+        timer_wheel_add(&self->timers, timer, self->now_mono + HISTORY_IDLE_MS, router_history_idle, stream);
+        return;
+    }
+    router_log(LEVEL_INFO, "Dropped the history stream of %s, no credit in %d s\n",
+               stream->requester, HISTORY_IDLE_MS / 1000);
+    zlist_remove(self->histories, stream);
+    router_history_close(self, &stream);
+}
+
+// a message for recipient into its conversation's journal, whole chat messages
+// only: receipts, file transfers (see transfer.h) and the parts of a long
+// message (see chunking.h) would each come back from history on their own
+static void router_journal(Router *self, const char *sender, zframe_t *recipient, zframe_t *content, zframe_t *header)
+{
+    char type = delivery_header_type(header);
+    if (!self->journal || !recipient || !content || (type != 0 && type != DELIVERY_DATA)) return;
+    uint64_t group;
+    uint32_t part, parts;
+    if (delivery_part(header, &group, &part, &parts)) return;
+    char *name = zframe_strdup(recipient);
+    if (name && !journal_append(self->journal, sender, name, zframe_data(content), zframe_size(content), delivery_flags(header))) {
+        router_log(LEVEL_ERROR, "Unable to journal a message from %s to %s\n", sender, name);
+    }
+    free(name);
+}
+
+// every message of a batch (see batch.h), records is the frame they're in
+static void router_journal_batch(Router *self, const char *sender, zframe_t *recipient, zframe_t *records)
+{
+    if (!self->journal || !records) return;
+    size_t offset = 0;
+    BatchRecord record;
+    while (batch_next(zframe_data(records), zframe_size(records), &offset, &record)) {
+        zframe_t *content = zframe_new(record.content, record.content_length);
+        zframe_t *header = zframe_new(record.header, record.header_length);
+        router_journal(self, sender, recipient, content, header);
+        zframe_destroy(&header);
+        zframe_destroy(&content);
+    }
+}
+
+// [requester][partner][][end header], the seqs there are to ask for
+static void router_history_end(Router *self, const char *requester, const char *partner)
+{
+    JournalConversation *conversation = self->journal ? journal_conversation(self->journal, requester, partner) : NULL;
+    uint64_t first = conversation ? journal_first_seq(conversation) : 1;
+    uint64_t next = conversation ? conversation->next_seq : 1;
+
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, requester);
+    zmsg_addstr(msg, partner);
+    zmsg_addmem(msg, NULL, 0);
+    zframe_t *header = history_pair_header(HISTORY_END, first, next);
+    zmsg_append(msg, &header);
+    if (!scheduler_push_control(self->scheduler, msg)) {
+        metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+        zmsg_destroy(&msg);
+    }
+}
+
+static HistoryStream *router_history_stream(Router *self, const char *requester, const char *partner)
+{
+    for (HistoryStream *stream = (HistoryStream *)zlist_first(self->histories);
+         stream; stream = (HistoryStream *)zlist_next(self->histories)) {
+        if (streq(stream->requester, requester) && streq(stream->partner, partner)) return stream;
+    }
+    return NULL;
+}
+
+static size_t router_history_streams(Router *self, const char *requester)
+{
+    size_t count = 0;
+    for (HistoryStream *stream = (HistoryStream *)zlist_first(self->histories);
+         stream; stream = (HistoryStream *)zlist_next(self->histories)) {
+        if (streq(stream->requester, requester)) count++;
+    }
+    return count;
+}
+
+// whether the connection routing_id came in on authenticated as identity. the
+// routing id and the key frame are only what the dealer says, the ZAP handler's
+// User-Id (see zap.h) is the name its CURVE key is registered under
+static bool router_authenticated_as(zframe_t *routing_id, const char *identity)
+{
+    const char *user_id = routing_id ? zframe_meta(routing_id, "User-Id") : NULL;
+    return user_id && identity && streq(user_id, identity);
+}
+
+// a history request or more credit for one, from an authenticated requester
+static void router_history(Router *self, const char *requester, zframe_t *partner_frame, zframe_t *header)
+{
+    char *partner = partner_frame ? zframe_strdup(partner_frame) : NULL;
+    if (!partner) {
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        return;
+    }
+    HistoryStream *stream = self->histories ? router_history_stream(self, requester, partner) : NULL;
+    const uint8_t *data = zframe_data(header);
+
+    if (data[0] == HISTORY_CREDIT && zframe_size(header) == HISTORY_CREDIT_SIZE) {
+        if (stream) {
+            uint64_t credit = (uint64_t)stream->credit + delivery_get_u32(data + 1);
+            stream->credit = credit > HISTORY_CREDIT_MAX ? HISTORY_CREDIT_MAX : (uint32_t)credit;
+            timer_wheel_add(&self->timers, &stream->idle, self->now_mono + HISTORY_IDLE_MS, router_history_idle, stream);
+        }
+        free(partner);
+        return;
+    }
+    if (data[0] != HISTORY_REQUEST || zframe_size(header) != HISTORY_REQUEST_SIZE) {
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        free(partner);
+        return;
+    }
+
+    // a new request replaces whatever the requester was still getting
+    if (stream) {
+        zlist_remove(self->histories, stream);
+        router_history_close(self, &stream);
+    }
+    uint32_t credit = delivery_get_u32(data + 17);
+    if (!self->journal || credit == 0 || router_history_streams(self, requester) >= HISTORY_STREAMS_MAX) {
+        router_history_end(self, requester, partner);
+        free(partner);
+        return;
+    }
+
+    stream = calloc(1, sizeof(HistoryStream));
+    if (!stream || !journal_cursor_init(&stream->cursor, requester, partner,
+                                        delivery_get_u64(data + 1), delivery_get_u64(data + 9))) {
+        history_stream_destroy(&stream);
+        free(partner);
+        return;
+    }
+    stream->requester = strdup(requester);
+    stream->partner = partner;
+    stream->credit = credit > HISTORY_CREDIT_MAX ? HISTORY_CREDIT_MAX : credit;
+    timer_wheel_add(&self->timers, &stream->idle, self->now_mono + HISTORY_IDLE_MS, router_history_idle, stream);
+    zlist_append(self->histories, stream);
+    router_log(LEVEL_DEBUG, "%s catching up with %s from %llu\n", requester, partner,
+               (unsigned long long)stream->cursor.next_seq);
+}
+
+// sends every stream up to HISTORY_BATCH records of what its credit covers,
+// returns true while a stream could send more right away. a requester whose
+// connection is at its HWM keeps its stream and the record that didn't go, and
+// *blocked is set so the loop comes back for it like for held messages
+static bool router_serve_history(Router *self, bool *blocked)
+{
+    bool more = false;
+    *blocked = false;
+    size_t count = zlist_size(self->histories);
+
+    for (size_t i = 0; i < count; i++) {
+        HistoryStream *stream = (HistoryStream *)zlist_pop(self->histories);
+        bool finished = false;
+        int sent = 0;
+
+        while (stream->credit > 0 && sent < HISTORY_BATCH) {
+            zmsg_t *msg = stream->blocked;
+            stream->blocked = NULL;
+            if (!msg) {
+                JournalRecordHeader record;
+                zframe_t *content = NULL;
+                if (!journal_cursor_next(self->journal, &stream->cursor, &record, &content)) {
+                    finished = true;
+                    break;
+                }
+
+                // [requester][original sender][content][record header]
+                msg = zmsg_new();
+                zmsg_addstr(msg, stream->requester);
+                zmsg_addstr(msg, record.from_second ? stream->cursor.second : stream->cursor.first);
+                zmsg_append(msg, &content);
+                zframe_t *header = history_record_header(record.seq, record.time, record.flags);
+                zmsg_append(msg, &header);
+            }
+            size_t size = zmsg_content_size(msg);
+            if (outbox_send_frames(&msg, self->socket) != 0) {
+                // the record is still whole. a full connection isn't the end
+                // of the history, a gone one is
+                if (zmq_errno() == EAGAIN) {
+                    stream->blocked = msg;
+                    *blocked = true;
+                    break;
+                }
+                metrics_drop(thread_metrics, DROP_SEND_FAILED);
+                zmsg_destroy(&msg);
+                finished = true;
+                break;
+            }
+            metrics_count(thread_metrics, COUNTER_HISTORY_OUT, 1);
+            metrics_count(thread_metrics, COUNTER_BYTES_OUT, size);
+            stream->credit--;
+            sent++;
+        }
+
+        if (finished) {
+            router_history_end(self, stream->requester, stream->partner);
+            router_history_close(self, &stream);
+        } else {
+            more = more || (stream->credit > 0 && !stream->blocked);
+            zlist_append(self->histories, stream);
+        }
+    }
+    return more;
+}
+
+// key directory
+//
+// dealers look peers' public keys up by name and keep a cache of the whole
+// directory in sync with versioned deltas (see keydirectory.h). both are answered
+// straight from the directory, a delta is at most KEYDIR_BATCH entries and the
+// dealer asks for the next one when it has this one.
+
+// the whole index once at startup, the watcher notes changes from then on
+static void router_load_directory(Router *self)
+{
+    const AuthIndex *index = auth_read_begin(&self->auth_domain, self->auth_reader);
+    key_directory_load(self->keys, index);
+    auth_read_end(self->auth_reader);
+}
+
+// takes the registrations and revocations the watcher noted, nothing to do while
+// there are none. the names were compared on the watcher's thread
+static void router_sync_directory(Router *self)
+{
+    size_t count = 0;
+    AuthChange *changes = auth_domain_take_changes(&self->auth_domain, &count);
+    if (!changes) return;
+    size_t changed = key_directory_apply(self->keys, changes, count);
+    free(changes);
+    if (changed > 0) {
+        router_log(LEVEL_DEBUG, "Key directory at version %llu, %zu names changed\n",
+                   (unsigned long long)self->keys->version, changed);
+    }
+}
+
+// a lookup or a sync from an authenticated requester
+// [requester][looked up name or empty][entries][entry or delta header]
+static void router_key_directory(Router *self, const char *requester, zframe_t *name_frame, zframe_t *header)
+{
+    char *name = name_frame ? zframe_strdup(name_frame) : NULL;
+    zframe_t *content = NULL;
+    zframe_t *reply_header = NULL;
+
+    if (name && name[0] && delivery_header_type(header) == KEYDIR_LOOKUP && zframe_size(header) == KEYDIR_LOOKUP_SIZE) {
+        content = key_directory_lookup(self->keys, name);
+        reply_header = keydir_entry_header(self->keys->id);
+    } else if (delivery_header_type(header) == KEYDIR_SYNC && zframe_size(header) == KEYDIR_SYNC_SIZE) {
+        uint64_t version = 0;
+        bool more = false;
+        content = key_directory_delta(self->keys, delivery_get_u64(zframe_data(header) + 1), &version, &more);
+        reply_header = keydir_delta_header(self->keys->id, version, more);
+    }
+    if (!content || !reply_header) {
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        zframe_destroy(&content);
+        zframe_destroy(&reply_header);
+        free(name);
+        return;
+    }
+
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, requester);
+    zmsg_addstr(msg, name ? name : "");
+    zmsg_append(msg, &content);
+    zmsg_append(msg, &reply_header);
+    // sent with the rest of the pass's replies, ahead of the sender queues
+    if (!scheduler_push_control(self->scheduler, msg)) {
+        metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+        zmsg_destroy(&msg);
+    } else {
+        metrics_count(thread_metrics, COUNTER_KEY_REQUESTS, 1);
+    }
+    free(name);
+}
+
+// whether a z85 key is in the accepted set. inside a batch the index it holds is
+// asked directly, a burst from one sender decodes and looks its key up once
+static bool router_allows(Router *self, const uint8_t *z85, size_t len)
+{
+    if (!self->auth_index) {
+        return auth_domain_allows_txt(&self->auth_domain, self->auth_reader, (const char *)z85, len);
+    }
+    if (self->allowed_cached && len == sizeof(self->allowed_key) && memcmp(self->allowed_key, z85, len) == 0) return true;
+    if (!auth_index_contains_txt(self->auth_index, (const char *)z85, len)) return false;
+    memcpy(self->allowed_key, z85, sizeof(self->allowed_key));
+    self->allowed_cached = true;
+    return true;
+}
+
+// [sender id][registration key][user cert]
+// one with an invalid registration key is counted as an auth failure and
+// dropped, like any other bad message it doesn't stop the router
+void handle_registration(Router *self, zmsg_t *msg)
+{
+    // registration sender id
+    zframe_t *reg_id = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(reg_id, "registration id: ");
+
+    // registering user cert
+    zframe_t *reg_cert = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(reg_cert, "registration key: ");
+
+    // check if the user provided the correct registration key
+    bool known = router_allows(self, zframe_data(reg_cert), zframe_size(reg_cert));
+    zframe_destroy(&reg_cert);
+    if (!known) {
+        router_log(LEVEL_ERROR, "false registration certificate\n");
+        metrics_count(thread_metrics, COUNTER_AUTH_FAILURES, 1);
+        metrics_drop(thread_metrics, DROP_BAD_REGISTRATION);
+        zframe_destroy(&reg_id);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    // add user's pub key to certstore
+    zframe_t *user_cert = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(user_cert, "user's actual cert: ");
+
+    char *user_cert_str = zframe_strdup(user_cert);
+    zframe_destroy(&user_cert);
+    zmsg_destroy(&msg);
+    if (!user_cert_str) {
+        router_log(LEVEL_INFO, "no key received\n");
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        zframe_destroy(&reg_id);
+        return;
+    }
+
+    // the frame carries the z85 text, the key is stored as the 32 raw bytes
+    uint8_t user_key[AUTH_KEY_SIZE];
+    if (!auth_key_decode(user_cert_str, strlen(user_cert_str), user_key)) {
+        router_log(LEVEL_INFO, "malformed user key\n");
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        free(user_cert_str);
+        zframe_destroy(&reg_id);
+        return;
+    }
+    // index entries, keystore records and the ZAP User-Id hold AUTH_NAME_SIZE - 1
+    // bytes. a longer routing id would be indexed under a name it never matches
+    if (zframe_size(reg_id) >= AUTH_NAME_SIZE || memchr(zframe_data(reg_id), '\0', zframe_size(reg_id))) {
+        router_log(LEVEL_INFO, "registration name too long\n");
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        free(user_cert_str);
+        zframe_destroy(&reg_id);
+        return;
+    }
+    char* username = zframe_strdup(reg_id);
+
+    router_store_key(self, user_key, username);
+    replica_add_register(self->replica, user_key, username);
+    router_replicate_peer(self, router_peer(self, username, user_cert_str));
+
+    // free when no longer needed
+    free(username);
+    free(user_cert_str);
+    metrics_count(thread_metrics, COUNTER_REGISTRATIONS, 1);
+
+    // everything should be ok, queue the signal on the priority lane
+    // [registration id][signal]
+    zmsg_t *reply = zmsg_new_signal(0);
+    zmsg_prepend(reply, &reg_id);
+    if (!scheduler_push_control(self->scheduler, reply)) {
+        router_log(LEVEL_ERROR, "Unable to queue the registration signal\n");
+        metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+        zmsg_destroy(&reply);
+    }
+}
+
+// in a cluster the recipient may be connected to the node that owns it instead,
+// NULL when that's this one
+static void *router_destination(Router *self, zframe_t *recipient)
+{
+    if (!self->cluster || !recipient) return NULL;
+    ClusterNode *owner = cluster_owner(self->cluster, zframe_data(recipient), zframe_size(recipient));
+    if (owner == self->cluster->self) return NULL;
+    owner->routed++;
+    return owner->bridge;
+}
+
+// [recipient id][records][batch header] from sender, see batch.h. every record is
+// checked like a message of its own, the ones that pass go on to the recipient
+// in one batch, copied into a new one only when some didn't. takes sender_id and msg
+static void router_batch(Router *self, Peer *peer, const char *sender, zframe_t *sender_id, zmsg_t *msg)
+{
+    zframe_t *recipient = zmsg_pop(msg);
+    zframe_t *records = zmsg_pop(msg);
+    zframe_t *header = zmsg_pop(msg);
+    zmsg_destroy(&msg);
+    uint32_t count = batch_count(header);
+    if (!recipient || !records || count == 0) {
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        zframe_destroy(&recipient);
+        zframe_destroy(&records);
+        zframe_destroy(&header);
+        zframe_destroy(&sender_id);
+        return;
+    }
+    metrics_count(thread_metrics, COUNTER_BATCHES_IN, 1);
+    metrics_count(thread_metrics, COUNTER_BATCHED_MESSAGES, count);
+
+    // the header frames of the records, for the dedup window and the journal
+    zframe_t *headers[BATCH_MESSAGES] = {0};
+    BatchRecord kept[BATCH_MESSAGES];
+    uint32_t found = 0, passed = 0;
+    size_t offset = 0, kept_bytes = 0;
+    BatchRecord record;
+    while (found < count && batch_next(zframe_data(records), zframe_size(records), &offset, &record)) {
+        found++;
+        zframe_t *record_header = zframe_new(record.header, record.header_length);
+        uint64_t session = 0, number = 0;
+        if (!record_header || !delivery_message_number(record_header, &session, &number)) {
+            // nothing but numbered data goes in a batch
+            metrics_drop(thread_metrics, DROP_MALFORMED);
+            zframe_destroy(&record_header);
+            continue;
+        }
+        if (peer && dedup_seen(&peer->dedup, session, number, self->now_mono)) {
+            router_log(LEVEL_DEBUG, "Duplicate %llu from %s\n", (unsigned long long)number, sender);
+            metrics_drop(thread_metrics, DROP_DUPLICATE);
+            zframe_destroy(&record_header);
+            continue;
+        }
+        if (peer && !peer_allow(self, peer, false)) {
+            router_log(LEVEL_DEBUG, "Rate limited %s\n", sender);
+            metrics_drop(thread_metrics, DROP_RATE_LIMITED);
+            zframe_destroy(&record_header);
+            continue;
+        }
+        headers[passed] = record_header;
+        kept[passed++] = record;
+        kept_bytes += batch_record_size(record.content_length, record.header_length);
+        if (peer) {
+            peer->messages++;
+            peer->bytes += record.content_length;
+        }
+    }
+    if (found < count) metrics_drop(thread_metrics, DROP_MALFORMED);
+
+    // as it came when every record passed
+    zframe_t *forward = NULL;
+    if (passed == count) {
+        forward = records;
+        records = NULL;
+    } else if (passed > 0) {
+        forward = zframe_new(NULL, kept_bytes);
+        size_t used = 0;
+        for (uint32_t i = 0; forward && i < passed; i++) {
+            used += batch_put_record(zframe_data(forward) + used, kept[i].content, kept[i].content_length,
+                                     kept[i].header, kept[i].header_length);
+        }
+    }
+    if (peer && passed > 0) router_replicate_peer(self, peer);
+
+    void *destination = router_destination(self, recipient);
+    // the frames are still there until the loop sends the message
+    zframe_t *forwarded = forward;
+    zmsg_t *reply = NULL;
+    if (forward && sender) {
+        zframe_t *routing = zframe_dup(recipient);
+        zframe_t *batch = batch_header(passed);
+        reply = zmsg_new();
+        zmsg_append(reply, &routing);           // ROUTING: destination frame
+        zmsg_append(reply, &sender_id);         // CONTENT: original sender ID (as body)
+        zmsg_append(reply, &forward);           // CONTENT: the records
+        zmsg_append(reply, &batch);             // CONTENT: batch header
+    }
+    if (reply && !router_queue(self, sender, reply, destination)) {
+        zmsg_destroy(&reply);
+    } else if (reply) {
+        for (uint32_t i = 0; i < passed && peer; i++) {
+            uint64_t session = 0, number = 0;
+            delivery_message_number(headers[i], &session, &number);
+            dedup_mark(&peer->dedup, session, number, self->now_mono);
+        }
+        router_journal_batch(self, sender, recipient, forwarded);
+    }
+
+    for (uint32_t i = 0; i < passed; i++) zframe_destroy(&headers[i]);
+    zframe_destroy(&sender_id);
+    zframe_destroy(&forward);
+    zframe_destroy(&recipient);
+    zframe_destroy(&records);
+    zframe_destroy(&header);
+}
+
+// [sender id][sender pub key][recipient id][message content][delivery header]
+// the header is passed through as is (see delivery.h), dealers that predate it
+// leave it out and get an empty one forwarded
+void handle_message(Router *self, zmsg_t *msg)
+{
+    // pop sender id
+    zframe_t *sender_id = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(sender_id, "sender id: ");
+
+    // add sender's public key's message frame
+    zframe_t *sender_pub_key = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(sender_pub_key, "sender pub key:");
+
+    // if sender_pub_key is not known by the router, stop here
+    bool known = router_allows(self, zframe_data(sender_pub_key), zframe_size(sender_pub_key));
+    char* sender_key_string = zframe_strdup(sender_pub_key);
+    zframe_destroy(&sender_pub_key);
+    if (!known){
+        // not in the index (never registered or revoked)
+        router_log(LEVEL_INFO, "Unknown sender\n");
+        metrics_count(thread_metrics, COUNTER_AUTH_FAILURES, 1);
+        metrics_drop(thread_metrics, DROP_UNKNOWN_SENDER);
+        free(sender_key_string);
+        zframe_destroy(&sender_id);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    // the sender's queue and peer entry are keyed by its routing id
+    char *sender = zframe_strdup(sender_id);
+    Peer *peer = router_peer(self, sender, sender_key_string);
+    free(sender_key_string);
+    // still there, if it was given up on as a slow consumer it gets messages again
+    if (sender) outbox_heard(self->outbox, sender);
+
+    // receipts are limited apart from messages, dropping them only causes retransmits
+    zframe_t *header = zmsg_size(msg) == 3 ? zmsg_last(msg) : NULL;
+    bool ack = router_is_ack(self, msg, header);
+
+    // history requests are answered here instead of being forwarded, only ever
+    // for the conversations of the user the connection authenticated as. a new
+    // request counts against the rate limit, credit for one that's running doesn't
+    if (header && (delivery_header_type(header) == HISTORY_REQUEST || delivery_header_type(header) == HISTORY_CREDIT)) {
+        if (!router_authenticated_as(sender_id, sender)) {
+            router_log(LEVEL_INFO, "History request from %s, which isn't who it authenticated as\n", sender);
+            metrics_drop(thread_metrics, DROP_UNAUTHORIZED);
+        } else if (delivery_header_type(header) == HISTORY_REQUEST && peer && !peer_allow(self, peer, false)) {
+            metrics_drop(thread_metrics, DROP_RATE_LIMITED);
+        } else {
+            router_history(self, sender, zmsg_first(msg), header);
+        }
+        free(sender);
+        zframe_destroy(&sender_id);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    // several messages for one recipient, checked one by one and forwarded together
+    if (header && batch_is_header(header)) {
+        router_batch(self, peer, sender, sender_id, msg);
+        free(sender);
+        return;
+    }
+
+    // a retransmit of something already forwarded, the recipient's ack is on its way
+    uint64_t session = 0, number = 0;
+    bool numbered = delivery_message_number(header, &session, &number);
+    if (peer && numbered && dedup_seen(&peer->dedup, session, number, self->now_mono)) {
+        router_log(LEVEL_DEBUG, "Duplicate %llu from %s\n", (unsigned long long)number, sender);
+        metrics_drop(thread_metrics, DROP_DUPLICATE);
+        free(sender);
+        zframe_destroy(&sender_id);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    if (peer && !peer_allow(self, peer, ack)) {
+        router_log(LEVEL_DEBUG, "Rate limited %s\n", sender);
+        metrics_drop(thread_metrics, DROP_RATE_LIMITED);
+        free(sender);
+        zframe_destroy(&sender_id);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    // key lookups and directory syncs are answered by the router, once they're
+    // within the sender's rate like everything else it sends
+    if (header && keydir_is_request(header)) {
+        router_key_directory(self, sender, zmsg_first(msg), header);
+        free(sender);
+        zframe_destroy(&sender_id);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    // pop recipient id
+    zframe_t *rec_id = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(rec_id, "recipient id: ");
+
+    // pop msg content
+    zframe_t *message_data = zmsg_pop(msg);
+    if (log_enabled(LEVEL_DEBUG)) zframe_print(message_data, "cipher: ");
+
+    // pop delivery header
+    header = zmsg_pop(msg);
+    if (!header) header = zframe_new_empty();
+    zmsg_destroy(&msg);
+
+    // in a cluster the recipient may be connected to the node that owns it instead
+    void *destination = router_destination(self, rec_id);
+
+    if (peer) {
+        peer->messages++;
+        peer->bytes += zframe_size(message_data);
+        router_replicate_peer(self, peer);
+    }
+
+    // the frames are still there until the loop sends the message
+    zframe_t *recipient = rec_id;
+    zframe_t *content = message_data;
+    zframe_t *delivery = header;
+
+    // reply ... forward to recipient
+    zmsg_t *reply = zmsg_new();
+    zmsg_append(reply, &rec_id);                // ROUTING: destination frame
+    zmsg_append(reply, &sender_id);             // CONTENT: original sender ID (as body)
+    zmsg_append(reply, &message_data);          // CONTENT: message
+    zmsg_append(reply, &header);                // CONTENT: delivery header
+
+    // local acks skip the sender queues like the other control traffic
+    if (ack && !destination && sender) {
+        if (!scheduler_push_control(self->scheduler, reply)) {
+            router_log(LEVEL_ERROR, "Failed to queue ack\n");
+            metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+            zmsg_destroy(&reply);
+        }
+    } else if (!sender) {
+        router_log(LEVEL_ERROR, "Failed to queue message\n");
+        metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+        zmsg_destroy(&reply);
+    } else if (!router_queue(self, sender, reply, destination)) {
+        zmsg_destroy(&reply);
+    } else {
+        if (peer && numbered) dedup_mark(&peer->dedup, session, number, self->now_mono);
+        router_journal(self, sender, recipient, content, delivery);
+    }
+    free(sender);
+}
+
+// handles what one pass drained off the socket, in the order it came in. the
+// auth index is held across all of them instead of being taken per message, the
+// pass's clock reads stand in for per message ones, and whatever they produce is
+// only queued: the loop sends it all back to back once the batch is through.
+// a bad message costs only itself, nothing in a batch stops the router
+static void router_handle_batch(Router *self, zmsg_t **msgs, size_t count)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) bytes += zmsg_content_size(msgs[i]);
+    metrics_count(thread_metrics, COUNTER_MESSAGES_IN, count);
+    metrics_count(thread_metrics, COUNTER_BYTES_IN, bytes);
+
+    self->auth_index = auth_read_begin(&self->auth_domain, self->auth_reader);
+    self->allowed_cached = false;
+    for (size_t i = 0; i < count; i++) {
+        zmsg_t *msg = msgs[i];
+        msgs[i] = NULL;
+
+        // messages must adhere to certain shape and size
+        size_t msg_size = zmsg_size(msg);
+        metrics_message_size(thread_metrics, zmsg_content_size(msg));
+
+        // [sender id][registration key][user cert]
+        if (msg_size == 3) {
+            handle_registration(self, msg);
+            continue;
+        }
+
+        // [sender id][sender pub key][recipient id][message content][delivery header]
+        if (msg_size == 4 || msg_size == 5) {
+            handle_message(self, msg);
+            continue;
+        }
+
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        zmsg_destroy(&msg);
+    }
+    self->allowed_cached = false;
+    self->auth_index = NULL;
+    auth_read_end(self->auth_reader);
+}
+
+// [bridge id][recipient id][sender id][message content][delivery header]
+// a message another node of the cluster already checked, for a recipient this node
+// owns. it's delivered here whatever the ring says, so a disagreement about the
+// membership can't bounce it around
+static void handle_cluster(Router *self, zmsg_t *msg)
+{
+    zframe_t *bridge_id = zmsg_pop(msg);
+    zframe_destroy(&bridge_id);
+    if (zmsg_size(msg) != 4) {
+        metrics_drop(thread_metrics, DROP_MALFORMED);
+        zmsg_destroy(&msg);
+        return;
+    }
+    metrics_count(thread_metrics, COUNTER_CLUSTER_IN, 1);
+
+    // queued under the original sender, it competes with local senders as itself
+    zframe_t *recipient = zmsg_first(msg);
+    zframe_t *sender_id = zmsg_next(msg);
+    zframe_t *content = zmsg_next(msg);
+    zframe_t *header = zmsg_next(msg);
+    char *sender = sender_id ? zframe_strdup(sender_id) : NULL;
+    if (!sender) {
+        router_log(LEVEL_ERROR, "Failed to queue message from the cluster\n");
+        metrics_drop(thread_metrics, DROP_QUEUE_FAILED);
+        zmsg_destroy(&msg);
+    } else if (!router_queue(self, sender, msg, NULL)) {
+        zmsg_destroy(&msg);
+    } else {
+        // the recipient's node journals it too, history is asked for there
+        if (batch_is_header(header)) {
+            router_journal_batch(self, sender, recipient, content);
+        } else {
+            router_journal(self, sender, recipient, content, header);
+        }
+    }
+    free(sender);
+}
+
+// hot standby
+//
+// the primary mirrors registrations, its peer table and every queued message to
+// the standby (see replication.h). the standby keeps the messages the primary
+// hasn't reported as sent, and when the primary goes quiet it binds the router
+// endpoint itself and forwards those first.
+
+typedef struct {
+    uint64_t id;
+    char *sender;
+    zmsg_t *msg;                // [recipient id][sender id][content][delivery header]
+} PendingMessage;
+
+static void pending_free(void *data)
+{
+    PendingMessage *pending = (PendingMessage *)data;
+    free(pending->sender);
+    zmsg_destroy(&pending->msg);
+    free(pending);
+}
+
+static int pending_compare(const void *a, const void *b)
+{
+    const PendingMessage *x = *(PendingMessage *const *)a;
+    const PendingMessage *y = *(PendingMessage *const *)b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// a message queued before the standby was there (or while it resynced) gets its
+// id now, so that it's reported done once sent like any other
+static void router_replicate_queued(void *context, const char *sender, QueuedMessage *item)
+{
+    Router *self = (Router *)context;
+    if (item->id == 0) item->id = ++self->next_message_id;
+    replica_add_message(self->replica, item->id, sender, item->msg);
+}
+
+// everything a new standby needs that isn't already on disk
+static void router_replica_snapshot(Router *self)
+{
+    for (Peer *peer = zhash_first(self->peers); peer; peer = zhash_next(self->peers)) {
+        router_replicate_peer(self, peer);
+    }
+    scheduler_each(self->scheduler, router_replicate_queued, self);
+    router_log(LEVEL_INFO, "standby connected, sent %zu peers and %zu queued messages\n",
+               zhash_size(self->peers), self->scheduler->pending - self->scheduler->control.count);
+}
 
-// dealers use the router's public key to authenticate it
-// router uses the dealer's public kye to authorize or deny access
+// applies one batch of records from the primary, pending is id -> PendingMessage
+static void router_apply_batch(Router *self, zmsg_t *batch, zhash_t *pending)
+{
+    char *type;
+    while ((type = zmsg_popstr(batch)) != NULL) {
+        char key[24];
 
-// kill router if perpetually blocked: ps aux | grep router ----- kill -9 with associated ./router pid
-int main()
-{
-    // load certs from certificate directory
-    const char* directory = "keys_router";
-    printf("Making a certificate store of the %s directory...\n", directory);
-    zcertstore_t *cert_store = zcertstore_new(directory);
-    if (!cert_store){
-        fprintf(stderr, "Failed to create certificate store\n");
-        return -1;
-    }    
+        if (streq(type, "R")) {
+            zframe_t *user_key = zmsg_pop(batch);
+            char *name = zmsg_popstr(batch);
+            if (user_key && name && zframe_size(user_key) == AUTH_KEY_SIZE) {
+                router_store_key(self, zframe_data(user_key), name);
+            }
+            zframe_destroy(&user_key);
+            zstr_free(&name);
+        } else if (streq(type, "P")) {
+            char *identity = zmsg_popstr(batch);
+            char *public_key = zmsg_popstr(batch);
+            zframe_t *stats = zmsg_pop(batch);
+            Peer *peer = identity ? router_peer(self, identity, public_key && *public_key ? public_key : NULL) : NULL;
+            if (peer && stats && zframe_size(stats) == 32) {
+                const uint8_t *data = zframe_data(stats);
+                peer->first_seen = (int64_t)replica_get_u64(data);
+                peer->last_seen = (int64_t)replica_get_u64(data + 8);
+                peer->messages = replica_get_u64(data + 16);
+                peer->bytes = replica_get_u64(data + 24);
+            }
+            zstr_free(&identity);
+            zstr_free(&public_key);
+            zframe_destroy(&stats);
+        } else if (streq(type, "M")) {
+            zframe_t *id = zmsg_pop(batch);
+            PendingMessage *message = calloc(1, sizeof(PendingMessage));
+            if (message) {
+                message->sender = zmsg_popstr(batch);
+                message->msg = zmsg_new();
+            }
+            for (int i = 0; i < 4; i++) {
+                zframe_t *frame = zmsg_pop(batch);
+                if (message && frame) {
+                    zmsg_append(message->msg, &frame);
+                } else {
+                    zframe_destroy(&frame);
+                }
+            }
+            if (message && id && zframe_size(id) == 8 && message->sender && zmsg_size(message->msg) == 4) {
+                message->id = replica_get_u64(zframe_data(id));
+                snprintf(key, sizeof(key), "%llu", (unsigned long long)message->id);
+                zhash_update(pending, key, message);
+                zhash_freefn(pending, key, pending_free);
+            } else if (message) {
+                pending_free(message);
+            }
+            zframe_destroy(&id);
+        } else if (streq(type, "D")) {
+            zframe_t *ids = zmsg_pop(batch);
+            size_t count = ids ? zframe_size(ids) / 8 : 0;
+            for (size_t i = 0; i < count; i++) {
+                snprintf(key, sizeof(key), "%llu", (unsigned long long)replica_get_u64(zframe_data(ids) + 8 * i));
+                zhash_delete(pending, key);
+            }
+            zframe_destroy(&ids);
+        }
+        zstr_free(&type);
+    }
+    zmsg_destroy(&batch);
+}
+
+static void handle_admin(Router *self);
+static void router_reload_done(Router *self);
+
+// binds every endpoint in the list, dealers pick whichever suits them (see transport.h)
+static bool router_bind(Router *self)
+{
+    char *endpoints = strdup(self->config.bind_endpoint);
+    if (!endpoints) return false;
+
+    bool bound = true;
+    char *saveptr = NULL;
+    for (char *next = strtok_r(endpoints, ",", &saveptr); next && bound; next = strtok_r(NULL, ",", &saveptr)) {
+        int rc = zsock_bind(self->socket, "%s", next);
+        if (rc == -1) {
+            printf("[ERROR]: Unable to bind socket to %s\n", next);
+            bound = false;
+        } else if (rc > 0) {
+            printf("router started successfully on port %d...\n", rc);
+        } else {
+            printf("router started successfully on %s...\n", next);
+        }
+    }
+    free(endpoints);
+    return bound;
+}
+
+// follows the primary until it goes quiet, false when interrupted before that (or
+// the endpoint can't be had). on takeover the router endpoint is bound, and after
+// REPLICA_REPLAY_DELAY_MS for the dealers to reconnect, whatever the primary never
+// got to send is queued again, oldest first. sooner than that the router socket
+// would drop it for not knowing the recipients yet
+static bool router_standby(Router *self)
+{
+    ReplicaStandby *standby = self->standby;
+    zhash_t *pending = zhash_new();
+    zpoller_t *poller = zpoller_new(standby->socket, NULL);
+    if (!pending || !poller) {
+        zhash_destroy(&pending);
+        zpoller_destroy(&poller);
+        return false;
+    }
+    if (self->admin) zpoller_add(poller, self->admin);
+    zpoller_add(poller, self->watcher);
+
+    bool takeover = false;
+    while (!zsys_interrupted) {
+        replica_standby_hello(standby);
+        void *which = zpoller_wait(poller, REPLICA_HEARTBEAT_MS);
+        if (zpoller_terminated(poller)) break;
+
+        if (which == self->admin) handle_admin(self);
+        if (which == self->watcher) router_reload_done(self);
+        while (zsock_events(standby->socket) & ZMQ_POLLIN) {
+            zmsg_t *batch = replica_standby_recv(standby);
+            router_tick(self);
+            // a snapshot after a resync has everything that's still queued, what
+            // the old stream left here was either sent since or is in it again
+            if (batch && standby->restarted) zhash_purge(pending);
+            if (batch) router_apply_batch(self, batch, pending);
+        }
+
+        if (replica_primary_lost(standby)) {
+            takeover = true;
+            break;
+        }
+    }
+
+    takeover = takeover && router_bind(self);
+    if (takeover) {
+        int64_t replay_at = zclock_mono() + REPLICA_REPLAY_DELAY_MS;
+        while (!zsys_interrupted && zclock_mono() < replay_at) {
+            void *which = zpoller_wait(poller, (int)(replay_at - zclock_mono()));
+            if (which == self->admin) handle_admin(self);
+            if (which == self->watcher) router_reload_done(self);
+        }
+
+        size_t count = zhash_size(pending);
+        PendingMessage **messages = calloc(count ? count : 1, sizeof(PendingMessage *));
+        size_t n = 0;
+        for (PendingMessage *message = zhash_first(pending); messages && message; message = zhash_next(pending)) {
+            messages[n++] = message;
+        }
+        if (messages) qsort(messages, n, sizeof(PendingMessage *), pending_compare);
+        router_tick(self);
+
+        for (size_t i = 0; i < n; i++) {
+            zmsg_t *msg = messages[i]->msg;
+            messages[i]->msg = NULL;
+            if (!router_queue(self, messages[i]->sender, msg, NULL)) zmsg_destroy(&msg);
+        }
+        free(messages);
+        router_log(LEVEL_INFO, "primary lost after batch %llu, taking over with %zu unsent messages and %zu peers\n",
+                   (unsigned long long)standby->seq, n, zhash_size(self->peers));
+    }
+
+    zpoller_destroy(&poller);
+    zhash_destroy(&pending);
+    replica_standby_destroy(&self->standby);
+    return takeover;
+}
+
+// where the accepted keys come from, for messages
+static const char *router_key_source(const RouterConfig *config)
+{
+    return config->keystore ? config->keystore : config->key_directory;
+}
+
+// rescan keys_router (or remap the keystore) into the auth index, handshakes and
+// the forwarding path both read from it. the watcher picks up single file changes
+// and log appends on its own. a full rescan takes as long as the directory is big,
+// so the watcher does it while the loop goes on forwarding, and
+// router_reload_done answers the admin once the watcher replies
+static void router_reload_certs(Router *self)
+{
+    zstr_send(self->watcher, "RELOAD");
+    self->reload_pending = true;
+}
+
+// the watcher's reply to RELOAD, the admin request it belongs to is still open
+// (a REP socket takes nothing new until it's answered)
+static void router_reload_done(Router *self)
+{
+    char *reply = zstr_recv(self->watcher);
+    bool ok = reply && strcmp(reply, "OK") == 0;
+    zstr_free(&reply);
+    if (!self->reload_pending) return;
+    self->reload_pending = false;
+    if (!ok) {
+        router_log(LEVEL_ERROR, "Failed to rescan %s\n", router_key_source(&self->config));
+        zstr_send(self->admin, "ERROR reload failed, keeping the previous certificates\n");
+        return;
+    }
+    zstr_sendf(self->admin, "OK reloaded %s\n", router_key_source(&self->config));
+}
+
+static void router_destroy(Router *self)
+{
+    zsock_destroy(&self->admin);
+    zsock_destroy(&self->socket);
+    zap_handler_destroy(&self->zap);
+    // the watcher publishes into auth_domain, it has to stop first
+    zactor_destroy(&self->watcher);
+    auth_domain_destroy(&self->auth_domain);
+    cluster_destroy(&self->cluster);
+    replica_primary_destroy(&self->replica);
+    replica_standby_destroy(&self->standby);
+    scheduler_destroy(&self->scheduler);
+    outbox_destroy(&self->outbox);
+    zhash_destroy(&self->peers);
+    while (self->histories && zlist_size(self->histories) > 0) {
+        HistoryStream *stream = (HistoryStream *)zlist_pop(self->histories);
+        router_history_close(self, &stream);
+    }
+    zlist_destroy(&self->histories);
+    journal_destroy(&self->journal);
+    key_directory_destroy(&self->keys);
+}
+
+// admin control socket
+//
+// one command per request, words separated by spaces, answered with text that
+// starts with "OK" or "ERROR". the socket is polled by the forwarding loop itself
+// so commands land between two batches: nothing has to be locked and the loop
+// never stops for longer than it takes to run a single command.
+
+typedef char *(*AdminHandler)(Router *self, int argc, char **argv, FILE *out);
+
+typedef struct {
+    const char *name;
+    const char *usage;
+    AdminHandler run;
+} AdminCommand;
+
+static bool parse_int(const char *text, int *value)
+{
+    char *end = NULL;
+    long parsed = strtol(text, &end, 10);
+    if (!text[0] || *end != '\0' || parsed < 0 || parsed > INT32_MAX) return false;
+    *value = (int)parsed;
+    return true;
+}
+
+static char *admin_loglevel(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)self;
+    if (argc < 2) {
+        fprintf(out, "OK %s\n", log_level_names[atomic_load(&log_level)]);
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]); i++) {
+        if (strcmp(argv[1], log_level_names[i]) == 0) {
+            atomic_store(&log_level, (int)i);
+            fprintf(out, "OK log level %s\n", log_level_names[i]);
+            return NULL;
+        }
+    }
+    return "unknown log level, use error, info or debug";
+}
+
+static char *admin_ratelimit(Router *self, int argc, char **argv, FILE *out)
+{
+    int rate = 0;
+    int burst = self->config.rate_burst;
+    if (argc < 2 || !parse_int(argv[1], &rate)) return "usage: ratelimit <msgs per second> [burst]";
+    if (argc > 2 && !parse_int(argv[2], &burst)) return "usage: ratelimit <msgs per second> [burst]";
+
+    self->config.rate_limit = rate;
+    self->config.rate_burst = burst > 0 ? burst : 1;
+    fprintf(out, "OK rate limit %d/s burst %d%s\n", rate, self->config.rate_burst, rate == 0 ? " (off)" : "");
+    return NULL;
+}
+
+static char *admin_hwm(Router *self, int argc, char **argv, FILE *out)
+{
+    int value = 0;
+    if (argc < 3 || !parse_int(argv[2], &value)) return "usage: hwm <snd|rcv> <messages>";
+
+    if (strcmp(argv[1], "snd") == 0) {
+        self->config.sndhwm = value;
+        zsock_set_sndhwm(self->socket, value);
+    } else if (strcmp(argv[1], "rcv") == 0) {
+        self->config.rcvhwm = value;
+        zsock_set_rcvhwm(self->socket, value);
+    } else {
+        return "usage: hwm <snd|rcv> <messages>";
+    }
+
+    // libzmq sizes a pipe when the peer connects
+    fprintf(out, "OK %shwm %d, applies to connections made from now on\n", argv[1], value);
+    return NULL;
+}
+
+static bool parse_slow_policy(const char *text, SlowConsumerPolicy *policy)
+{
+    for (size_t i = 0; i < sizeof(slow_policy_names) / sizeof(slow_policy_names[0]); i++) {
+        if (strcmp(text, slow_policy_names[i]) == 0) {
+            *policy = (SlowConsumerPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// recipients with messages held, and what happens when one of them is full
+static char *admin_queues(Router *self, int argc, char **argv, FILE *out)
+{
+    Outbox *outbox = self->outbox;
+    if (argc > 1) {
+        if (!parse_slow_policy(argv[1], &self->config.slow_policy)) return "usage: queues [drop-oldest|divert|disconnect]";
+        outbox->policy = self->config.slow_policy;
+    }
+
+    int64_t now = zclock_mono();
+    fprintf(out, "OK %zu messages, %zu bytes held for %zu recipients, %s past %zu\n",
+            outbox->held, outbox->held_bytes, zlist_size(outbox->backlogged),
+            slow_policy_names[outbox->policy], outbox->depth_limit);
+    for (HeldQueue *queue = zlist_first(outbox->backlogged); queue; queue = zlist_next(outbox->backlogged)) {
+        fprintf(out, "%-20s %6zu held %8zu bytes %6lld ms behind %llu dropped\n", queue->identity,
+                zlist_size(queue->held), queue->bytes,
+                queue->stalled_since ? (long long)(now - queue->stalled_since) : 0LL,
+                (unsigned long long)queue->dropped);
+    }
+    for (HeldQueue *queue = zhash_first(outbox->queues); queue; queue = zhash_next(outbox->queues)) {
+        if (queue->detached) fprintf(out, "%-20s detached until heard from\n", queue->identity);
+    }
+    return NULL;
+}
+
+static bool parse_poll_mode(const char *text, PollMode *mode)
+{
+    for (size_t i = 0; i < sizeof(poll_mode_names) / sizeof(poll_mode_names[0]); i++) {
+        if (strcmp(text, poll_mode_names[i]) == 0) {
+            *mode = (PollMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static char *admin_poll(Router *self, int argc, char **argv, FILE *out)
+{
+    PollMode mode = self->config.poll_mode;
+    int spin_us = self->config.spin_us;
+    if (argc > 1 && !parse_poll_mode(argv[1], &mode)) return "usage: poll [block|poll|adaptive] [spin us]";
+    if (argc > 2 && (!parse_int(argv[2], &spin_us) || spin_us < 0)) return "usage: poll [block|poll|adaptive] [spin us]";
+
+    self->config.poll_mode = mode;
+    self->config.spin_us = spin_us;
+    fprintf(out, "OK poll %s, spin %d us\n", poll_mode_names[mode], spin_us);
+    return NULL;
+}
+
+static char *admin_workers(Router *self, int argc, char **argv, FILE *out)
+{
+    int count = 0;
+    if (argc < 2) {
+        fprintf(out, "OK %zu handshake workers\n", self->zap->worker_count);
+        return NULL;
+    }
+    if (!parse_int(argv[1], &count) || count < 1) return "usage: workers <count>";
+
+    self->config.zap_workers = (int)zap_set_workers(self->zap, (size_t)count);
+    fprintf(out, "OK %d handshake workers%s\n", self->config.zap_workers,
+            self->config.zap_workers != count ? " (capped)" : "");
+    return NULL;
+}
+
+static char *admin_connections(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv;
+    fprintf(out, "OK %zu connections\n", zhash_size(self->peers));
+    fprintf(out, "%-20s %-42s %-14s %-14s %10s %12s\n", "identity", "public key", "first seen", "last seen", "messages", "bytes");
+
+    int64_t now = zclock_time();
+    for (Peer *peer = zhash_first(self->peers); peer; peer = zhash_next(self->peers)) {
+        fprintf(out, "%-20s %-42s %-14lld %-14lld %10llu %12llu\n",
+                peer->identity,
+                peer->public_key ? peer->public_key : "-",
+                (long long)(now - peer->first_seen) / 1000,
+                (long long)(now - peer->last_seen) / 1000,
+                (unsigned long long)peer->messages,
+                (unsigned long long)peer->bytes);
+    }
+    fprintf(out, "(first/last seen in seconds ago)\n");
+    return NULL;
+}
+
+static char *admin_presence(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv;
+    int64_t now = zclock_time();
+    size_t online = 0;
+    for (Peer *peer = zhash_first(self->peers); peer; peer = zhash_next(self->peers)) {
+        if (now - peer->last_seen < PRESENCE_TIMEOUT_MS) online++;
+    }
+
+    fprintf(out, "OK %zu online\n", online);
+    for (Peer *peer = zhash_first(self->peers); peer; peer = zhash_next(self->peers)) {
+        bool is_online = now - peer->last_seen < PRESENCE_TIMEOUT_MS;
+        fprintf(out, "%-20s %s\n", peer->identity, is_online ? "online" : "away");
+    }
+    return NULL;
+}
+
+// answered by router_reload_done once the rescan is through
+static char *admin_reload(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv; (void)out;
+    router_reload_certs(self);
+    return NULL;
+}
+
+static char *admin_config(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv;
+    RouterConfig *config = &self->config;
+    fprintf(out, "OK\n");
+    fprintf(out, "bind %s\n", config->bind_endpoint);
+    fprintf(out, "keys %s\n", config->key_directory);
+    fprintf(out, "keystore %s\n", config->keystore ? config->keystore : "-");
+    fprintf(out, "router_key %s\n", config->router_public_key);
+    fprintf(out, "admin %s\n", config->admin_endpoint);
+    fprintf(out, "stats %s\n", config->stats_endpoint);
+    if (self->cluster) fprintf(out, "cluster %s node %s\n", config->cluster_file, config->node_name);
+
+    const AuthIndex *index = auth_read_begin(&self->auth_domain, self->auth_reader);
+    fprintf(out, "authorized keys %zu (index version %llu)\n",
+            index ? auth_index_size(index) : 0, index ? (unsigned long long)index->version : 0ULL);
+    auth_read_end(self->auth_reader);
+    fprintf(out, "loglevel %s\n", log_level_names[atomic_load(&log_level)]);
+    fprintf(out, "ratelimit %d burst %d\n", config->rate_limit, config->rate_burst);
+    fprintf(out, "sndhwm %d rcvhwm %d\n", config->sndhwm, config->rcvhwm);
+    fprintf(out, "workers %d\n", config->zap_workers);
+    char io_cpus[128], loop_cpus[128], zap_cpus[128];
+    cpu_set_format(config->io_cpus, io_cpus, sizeof(io_cpus));
+    cpu_set_format(config->loop_cpus, loop_cpus, sizeof(loop_cpus));
+    cpu_set_format(config->zap_cpus, zap_cpus, sizeof(zap_cpus));
+    fprintf(out, "io_threads %d cpus %s\n", config->io_threads, io_cpus);
+    fprintf(out, "loop cpus %s zap cpus %s\n", loop_cpus, zap_cpus);
+    fprintf(out, "sndbuf %d rcvbuf %d backlog %d\n", config->sndbuf, config->rcvbuf, config->backlog);
+    fprintf(out, "hold %d per recipient %d MB total, %s\n", config->hold_depth, config->hold_mb,
+            slow_policy_names[config->slow_policy]);
+    fprintf(out, "poll %s spin %d us\n", poll_mode_names[config->poll_mode], config->spin_us);
+    return NULL;
+}
+
+static char *admin_cluster(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv;
+    Cluster *cluster = self->cluster;
+    if (!cluster) return "not running as part of a cluster";
+
+    fprintf(out, "OK %zu nodes, this is %s\n", cluster->node_count, cluster->self->name);
+    fprintf(out, "%-12s %-28s %-28s %7s %12s\n", "node", "dealers", "cluster", "share", "routed");
+    for (size_t n = 0; n < cluster->node_count; n++) {
+        ClusterNode *node = &cluster->nodes[n];
+        fprintf(out, "%-12s %-28s %-28s %6.1f%% %12llu\n",
+                node->name, node->client_endpoint, node->cluster_endpoint,
+                100.0 * cluster_share(cluster, node),
+                node == cluster->self ? 0ULL : (unsigned long long)node->routed);
+    }
+    return NULL;
+}
+
+static char *admin_replication(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv;
+    if (self->standby) {
+        ReplicaStandby *standby = self->standby;
+        fprintf(out, "OK standby of %s\n", self->config.standby_of);
+        fprintf(out, "batch %llu, last heard %lld ms ago\n", (unsigned long long)standby->seq,
+                standby->synced ? (long long)(zclock_mono() - standby->last_heard) : -1LL);
+        return NULL;
+    }
+
+    ReplicaPrimary *replica = self->replica;
+    if (!replica) return "not replicating, start with --replication";
+    fprintf(out, "OK primary on %s, standby %s\n", self->config.replication_endpoint,
+            !replica->standby ? "not connected" : replica->resync ? "resyncing" : "connected");
+    fprintf(out, "batches %llu sent, %llu in flight, %llu bytes\n",
+            (unsigned long long)replica->batches, (unsigned long long)(replica->seq - replica->acked),
+            (unsigned long long)replica->bytes);
+    fprintf(out, "lag %lld us, max %lld us, %llu resyncs\n", (long long)replica->lag_usec,
+            (long long)replica->max_lag_usec, (unsigned long long)replica->resyncs);
+    return NULL;
+}
+
+static char *admin_journal(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)argc; (void)argv;
+    if (!self->journal) return "not journaling, start with --journal";
+    fprintf(out, "OK journal in %s\n", self->journal->directory);
+    fprintf(out, "appended %llu messages, %llu bytes\n",
+            (unsigned long long)self->journal->appended, (unsigned long long)self->journal->bytes);
+    fprintf(out, "conversations open %zu of %d\n", zhash_size(self->journal->open), JOURNAL_OPEN_MAX);
+    for (HistoryStream *stream = (HistoryStream *)zlist_first(self->histories);
+         stream; stream = (HistoryStream *)zlist_next(self->histories)) {
+        fprintf(out, "stream %s with %s at %llu, credit %u\n", stream->requester, stream->partner,
+                (unsigned long long)stream->cursor.next_seq, stream->credit);
+    }
+    return NULL;
+}
+
+static char *admin_help(Router *self, int argc, char **argv, FILE *out);
+
+static AdminCommand admin_commands[] = {
+    { "loglevel",    "loglevel [error|info|debug]",       admin_loglevel },
+    { "ratelimit",   "ratelimit <msgs per second> [burst]", admin_ratelimit },
+    { "hwm",         "hwm <snd|rcv> <messages>",          admin_hwm },
+    { "workers",     "workers [count]",                   admin_workers },
+    { "poll",        "poll [block|poll|adaptive] [spin us]", admin_poll },
+    { "queues",      "queues [drop-oldest|divert|disconnect]", admin_queues },
+    { "connections", "connections",                       admin_connections },
+    { "presence",    "presence",                          admin_presence },
+    { "reload",      "reload",                            admin_reload },
+    { "cluster",     "cluster",                           admin_cluster },
+    { "replication", "replication",                       admin_replication },
+    { "journal",     "journal",                           admin_journal },
+    { "config",      "config",                            admin_config },
+    { "help",        "help",                              admin_help },
+};
+
+static char *admin_help(Router *self, int argc, char **argv, FILE *out)
+{
+    (void)self; (void)argc; (void)argv;
+    fprintf(out, "OK\n");
+    for (size_t i = 0; i < sizeof(admin_commands) / sizeof(admin_commands[0]); i++) {
+        fprintf(out, "%s\n", admin_commands[i].usage);
+    }
+    return NULL;
+}
+
+#define ADMIN_MAX_ARGS 8
+
+static void handle_admin(Router *self)
+{
+    char *request = zstr_recv(self->admin);
+    if (!request) return;
+
+    // split on spaces, the words point into request
+    char *argv[ADMIN_MAX_ARGS];
+    int argc = 0;
+    for (char *word = strtok(request, " \t\n"); word && argc < ADMIN_MAX_ARGS; word = strtok(NULL, " \t\n")) {
+        argv[argc++] = word;
+    }
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+
+    const char *error = "unknown command, try help";
+    if (argc == 0) error = "empty command, try help";
+    for (size_t i = 0; argc > 0 && out && i < sizeof(admin_commands) / sizeof(admin_commands[0]); i++) {
+        if (strcmp(argv[0], admin_commands[i].name) == 0) {
+            error = admin_commands[i].run(self, argc, argv, out);
+            break;
+        }
+    }
+    if (out) fclose(out);
+
+    if (error) {
+        zstr_sendf(self->admin, "ERROR %s\n", error);
+    } else if (self->reload_pending) {
+        // the reply goes out from router_reload_done
+    } else {
+        zstr_send(self->admin, text ? text : "OK\n");
+    }
+    router_log(LEVEL_INFO, "admin: %s -> %s\n", argc > 0 ? argv[0] : "", error ? "error" : "ok");
+
+    free(text);
+    zstr_free(&request);
+}
+
+// adaptive polling: busy checks the sockets until spin_us after last_traffic,
+// true as soon as one of them has something. ZMQ_EVENTS takes nothing off the
+// socket, the drain loop receives it as usual
+static bool router_spin(Router *self, int64_t last_traffic)
+{
+    int64_t deadline = last_traffic + self->config.spin_us;
+    while (!zsys_interrupted && zclock_usecs() < deadline) {
+        if (zsock_events(self->socket) & ZMQ_POLLIN) return true;
+        if (self->cluster && (zsock_events(self->cluster->socket) & ZMQ_POLLIN)) return true;
+        if (self->admin && (zsock_events(self->admin) & ZMQ_POLLIN)) return true;
+        if (self->replica && (zsock_events(self->replica->socket) & ZMQ_POLLIN)) return true;
+    }
+    return false;
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [--bind endpoint[,endpoint...]] [--keys directory] [--keystore file] [--router-cert file] [--router-key public key] [--admin endpoint] [--stats endpoint] [--zap-workers n] [--io-threads n] [--io-cpus list] [--loop-cpus list] [--zap-cpus list] [--sndbuf bytes] [--rcvbuf bytes] [--backlog n] [--hold-depth messages] [--hold-mb MB] [--slow-consumer drop-oldest|divert|disconnect] [--poll block|poll|adaptive] [--spin-us us] [--cluster file --node name] [--replication endpoint] [--standby primary's replication endpoint] [--journal directory]\n", program);
+}
+
+// the whole router, run by main or on an embedding process's actor thread. pipe
+// is the actor's end of its pipe and NULL for ./router, *started is set once the
+// router is bound and forwarding
+static int router_run(int argc, char **argv, zsock_t *pipe, bool *started)
+{
+    Router self = {
+        .config = {
+            .bind_endpoint = "tcp://*:5555,ipc://router.sock",
+            .key_directory = "keys_router",
+            .router_public_key = "A9Iz>yq^pr*w=I1.vTE)NDguZ0[#>GXl-hZ=B>&0",
+            .admin_endpoint = "ipc://router_admin",
+            .stats_endpoint = STATS_ENDPOINT,
+            .rate_limit = 0,
+            .rate_burst = 50,
+            .sndhwm = 1000,
+            .rcvhwm = 1000,
+            .zap_workers = 4,
+            .io_threads = 1,
+            .backlog = 100,
+            .hold_depth = DEFAULT_HOLD_DEPTH,
+            .hold_mb = DEFAULT_HOLD_MB,
+            .slow_policy = SLOW_DROP_OLDEST,
+            .poll_mode = POLL_BLOCK,
+            .spin_us = DEFAULT_SPIN_US
+        }
+    };
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--bind") == 0 && has_value) {
+            self.config.bind_endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--keys") == 0 && has_value) {
+            self.config.key_directory = argv[++i];
+        } else if (strcmp(argv[i], "--keystore") == 0 && has_value) {
+            self.config.keystore = argv[++i];
+        } else if (strcmp(argv[i], "--router-cert") == 0 && has_value) {
+            self.config.router_cert = argv[++i];
+        } else if (strcmp(argv[i], "--router-key") == 0 && has_value) {
+            self.config.router_public_key = argv[++i];
+        } else if (strcmp(argv[i], "--admin") == 0 && has_value) {
+            self.config.admin_endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && has_value) {
+            self.config.stats_endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--cluster") == 0 && has_value) {
+            self.config.cluster_file = argv[++i];
+        } else if (strcmp(argv[i], "--node") == 0 && has_value) {
+            self.config.node_name = argv[++i];
+        } else if (strcmp(argv[i], "--replication") == 0 && has_value) {
+            self.config.replication_endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--standby") == 0 && has_value) {
+            self.config.standby_of = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && has_value) {
+            self.config.journal_directory = argv[++i];
+        } else if (strcmp(argv[i], "--zap-workers") == 0 && has_value) {
+            self.config.zap_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-threads") == 0 && has_value) {
+            self.config.io_threads = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--io-cpus") == 0 || strcmp(argv[i], "--loop-cpus") == 0 ||
+                    strcmp(argv[i], "--zap-cpus") == 0) && has_value) {
+            CpuSet *set = argv[i][2] == 'i' ? &self.config.io_cpus :
+                          argv[i][2] == 'l' ? &self.config.loop_cpus : &self.config.zap_cpus;
+            if (!cpu_set_parse(argv[++i], set)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--sndbuf") == 0 && has_value) {
+            self.config.sndbuf = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rcvbuf") == 0 && has_value) {
+            self.config.rcvbuf = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backlog") == 0 && has_value) {
+            self.config.backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hold-depth") == 0 && has_value) {
+            self.config.hold_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hold-mb") == 0 && has_value) {
+            self.config.hold_mb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slow-consumer") == 0 && has_value) {
+            if (!parse_slow_policy(argv[++i], &self.config.slow_policy)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--poll") == 0 && has_value) {
+            if (!parse_poll_mode(argv[++i], &self.config.poll_mode)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--spin-us") == 0 && has_value) {
+            self.config.spin_us = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // libzmq's threads start with the first socket and have to be set up before it.
+    // an embedding process has its sockets by now and does this itself (see router.h)
+    if (!pipe) {
+        if (self.config.io_threads > 0) zsys_set_io_threads((size_t)self.config.io_threads);
+        if (!cpu_set_io_threads(self.config.io_cpus)) {
+            printf("Unable to pin the I/O threads, continuing without (needs libzmq 4.3)\n");
+        }
+    }
+
+    // a standby of a cluster node would need its own cluster endpoint, not there yet
+    if (self.config.standby_of && self.config.cluster_file) {
+        printf("--standby and --cluster can't be combined\n");
+        return 1;
+    }
+
+    if (self.config.cluster_file) {
+        self.cluster = cluster_load(self.config.cluster_file, self.config.node_name);
+        if (!self.cluster) {
+            printf("No node %s in the cluster file %s\n",
+                   self.config.node_name ? self.config.node_name : "(--node missing)", self.config.cluster_file);
+            return 1;
+        }
+    }
 
-    // zcertstore_print(certstore);
+    zcert_t *router_cert = NULL;
+    if (self.config.router_cert) {
+        // straight from its file, a key directory of a million users takes a while to scan
+        router_cert = zcert_load(self.config.router_cert);
+        if (!router_cert || strcmp(zcert_public_txt(router_cert), self.config.router_public_key) != 0) {
+            printf("%s is not the router's certificate\n", self.config.router_cert);
+            zcert_destroy(&router_cert);
+            cluster_destroy(&self.cluster);
+            return -1;
+        }
+    } else {
+        // load certs from certificate directory, only needed once to find the router's own cert
+        printf("Making a certificate store of the %s directory...\n", self.config.key_directory);
+        zcertstore_t *cert_store = zcertstore_new(self.config.key_directory);
+        if (!cert_store){
+            fprintf(stderr, "Failed to create certificate store\n");
+            cluster_destroy(&self.cluster);
+            return -1;
+        }
 
-    // look up router public key
-    const char* router_pub_key = "A9Iz>yq^pr*w=I1.vTE)NDguZ0[#>GXl-hZ=B>&0";
-    printf("Looking up the router's certificate\n");
-    zcert_t *router_cert = zcertstore_lookup(cert_store, router_pub_key);
-    if (!router_cert) {
-        printf("Certificate does not match the store lookup\n");
+        // look up router public key
+        printf("Looking up the router's certificate\n");
+        router_cert = zcertstore_lookup(cert_store, self.config.router_public_key);
+        if (!router_cert) {
+            printf("Certificate does not match the store lookup\n");
+            zcertstore_destroy(&cert_store);
+            cluster_destroy(&self.cluster);
+            return -1;
+        }
+        router_cert = zcert_dup(router_cert);
         zcertstore_destroy(&cert_store);
-        return -1;
     }
 
-    // TODO:
-    // registration keys
-    // only allow the registration cert for registering, not for messaging
+    // accepted keys for the forwarding path, kept up to date by the watcher
+    int64_t index_start = zclock_usecs();
+    auth_domain_init(&self.auth_domain, self.config.key_directory, self.config.keystore);
+    self.auth_reader = auth_reader_register(&self.auth_domain);
+    self.watcher = zactor_new(auth_watcher, &self.auth_domain);
+    if (!self.watcher || !atomic_load(&self.auth_domain.current)) {
+        printf("Unable to index %s\n", router_key_source(&self.config));
+        zcert_destroy(&router_cert);
+        router_destroy(&self);
+        return -1;
+    }
+    printf("Indexed %zu keys from %s in %.1f ms\n", auth_index_size(atomic_load(&self.auth_domain.current)),
+           router_key_source(&self.config), (zclock_usecs() - index_start) / 1000.0);
 
-    // zauth actor instance (NULL: default) configurations needed?
-    // runs concurrently with the rest of the program (async authentication?)
-    zactor_t *auth = zactor_new(zauth, NULL);
-    if (!auth){
-        printf("Unable to create authentication actor\n");
+    // ZAP handler pool in place of the zauth actor, it has to be bound before the
+    // CURVE socket is, and answers handshakes from the same index
+    self.zap = zap_handler_new(&self.auth_domain, self.config.zap_workers, self.config.zap_cpus);
+    if (!self.zap){
+        printf("Unable to create authentication handler\n");
         zcert_destroy(&router_cert);
-        zcertstore_destroy(&cert_store);
+        router_destroy(&self);
         return 3;
     }
 
-    int send_ok = zstr_sendx(auth, "CURVE", directory, NULL);
-    if (send_ok == -1) {
-        printf("[ERROR]: Could not send strings\n");
+    printf("CURVE authentication configured (%zu handler threads)\n", self.zap->worker_count);
+
+    // the other nodes' bridges authenticate with the router's own key
+    if (self.cluster) {
+        zap_allow_cluster(self.zap, zcert_public_key(router_cert));
+        if (!cluster_start(self.cluster, router_cert)) {
+            printf("Unable to join the cluster as %s on %s\n", self.cluster->self->name, self.cluster->self->cluster_endpoint);
+            zcert_destroy(&router_cert);
+            router_destroy(&self);
+            return 5;
+        }
+        printf("Node %s of a %zu node cluster\n", self.cluster->self->name, self.cluster->node_count);
     }
-    zsock_wait(auth);
 
-    printf("CURVE authentication configured\n");
-    
-    zsock_t *router = zsock_new(ZMQ_ROUTER);
-    if (!router){
+    // TODO:
+    // registration keys
+    // only allow the registration cert for registering, not for messaging
+
+    self.socket = zsock_new(ZMQ_ROUTER);
+    if (!self.socket){
         printf("Failed to create router socket\n");
-        zactor_destroy(&auth);        
         zcert_destroy(&router_cert);
-        zcertstore_destroy(&cert_store);   
+        router_destroy(&self);
         return 2;
     }
 
     // apply the router's certificate to the socket
-    zcert_apply(router_cert, router);
+    zcert_apply(router_cert, self.socket);
+    zcert_destroy(&router_cert);
     printf("Applied router's certificate to its socket\n");
 
     // set to act as CURVE server
-    zsock_set_curve_server(router, 1);
+    zsock_set_curve_server(self.socket, 1);
     printf("Set socket option to: CURVE\n");
 
-    int rc = zsock_bind(router, "tcp://*:5555");
-    if (rc == -1){
-        zactor_destroy(&auth);        
-        zcert_destroy(&router_cert);
-        zcertstore_destroy(&cert_store);   
-        printf("[ERROR]: Unable to bind socket to formatted endpoint");
-        return 1;
+    zsock_set_sndhwm(self.socket, self.config.sndhwm);
+    zsock_set_rcvhwm(self.socket, self.config.rcvhwm);
+    if (self.config.sndbuf > 0) zsock_set_sndbuf(self.socket, self.config.sndbuf);
+    if (self.config.rcvbuf > 0) zsock_set_rcvbuf(self.socket, self.config.rcvbuf);
+    if (self.config.backlog > 0) zsock_set_backlog(self.socket, self.config.backlog);
+
+    // a recipient at its HWM fails the send right away instead of libzmq dropping
+    // the message without a word, and the outbox holds it (see outbox.h)
+    zsock_set_router_mandatory(self.socket, 1);
+    zsock_set_sndtimeo(self.socket, 0);
+
+    self.admin = zsock_new(ZMQ_REP);
+    if (!self.admin || zsock_bind(self.admin, "%s", self.config.admin_endpoint) == -1) {
+        printf("Unable to bind the admin socket to %s, continuing without it\n", self.config.admin_endpoint);
+        zsock_destroy(&self.admin);
     }
-    printf("router started successfully on port %d...\n", rc);        
 
-    // non-blocking:
-    // zpoller_t *poller = zpoller_new(router, NULL);
+    // the forwarding loop records into its own slot, the stats actor only reads
+    metrics_register("forwarding");
+    zactor_t *stats = zactor_new(metrics_actor, (void *)self.config.stats_endpoint);
+    if (!stats) {
+        printf("Unable to start the stats socket, continuing without it\n");
+    }
 
-    // while (!zsys_interrupted) {
-    //     void *signaled_socket = zpoller_wait(poller, 1); // 1ms timeout
-    //     if (!signaled_socket)
-    //         continue;
+    timer_wheel_init(&self.timers, zclock_mono());
+    self.scheduler = scheduler_new(SCHEDULER_QUANTUM);
+    self.outbox = outbox_new(self.config.hold_depth > 0 ? (size_t)self.config.hold_depth : 1,
+                             (size_t)(self.config.hold_mb > 0 ? self.config.hold_mb : 1) * 1024 * 1024,
+                             self.config.slow_policy, router_outbox_drop, &self);
+    self.peers = zhash_new();
+    self.histories = zlist_new();
+    self.keys = key_directory_new();
+    if (!self.scheduler || !self.outbox || !self.peers || !self.histories || !self.keys) {
+        printf("Failed to set up the forwarding loop\n");
+        zactor_destroy(&stats);
+        router_destroy(&self);
+        return 4;
+    }
+    router_load_directory(&self);
 
-    //     if (signaled_socket == router) {
-    //         // message framing is as follows dealer > router > dealer: [sender_id][recipient_id][message_content] ???
-    //         zmsg_t *msg = zmsg_recv(router);
-    //         if (!msg) {
-    //             printf("Interrupted or error receiving message\n");
-    //             break;
-    //         }
+    // a standby only binds the router endpoint once the primary is gone, dealers
+    // that list both endpoints connect to whichever one is there
+    if (self.config.standby_of) {
+        self.standby = replica_standby_new(self.config.standby_of);
+        if (!self.standby) {
+            printf("Unable to follow the primary at %s\n", self.config.standby_of);
+            zactor_destroy(&stats);
+            router_destroy(&self);
+            return 6;
+        }
+        printf("Standing by for the primary at %s\n", self.config.standby_of);
+        if (!router_standby(&self)) {
+            zactor_destroy(&stats);
+            router_destroy(&self);
+            return 0;
+        }
+        printf("Primary is gone, taking over\n");
+    }
 
-    // blocking
-    while (!zsys_interrupted) {
-        zmsg_t *msg = zmsg_recv(router);  
-        if (!msg) {
-            printf("Interrupted or error receiving message\n");
-            break;
-        }     
+    if (!self.config.standby_of && !router_bind(&self)) {
+        zactor_destroy(&stats);
+        router_destroy(&self);
+        return 1;
+    }
 
-        // messages must adhere to certain shape and size
-        size_t msg_size = zmsg_size(msg);
+    if (self.config.journal_directory) {
+        self.journal = journal_new(self.config.journal_directory);
+        if (!self.journal) {
+            printf("Unable to journal into %s\n", self.config.journal_directory);
+            zactor_destroy(&stats);
+            router_destroy(&self);
+            return 7;
+        }
+        printf("Journaling conversations into %s\n", self.config.journal_directory);
+    }
 
-        printf("received message size: %zu\n", msg_size);
+    if (self.config.replication_endpoint) {
+        self.replica = replica_primary_new(self.config.replication_endpoint);
+        if (!self.replica) {
+            printf("Unable to bind the replication socket to %s\n", self.config.replication_endpoint);
+            zactor_destroy(&stats);
+            router_destroy(&self);
+            return 6;
+        }
+        printf("Replicating to a standby on %s\n", self.config.replication_endpoint);
+        timer_wheel_add(&self.timers, &self.heartbeat, zclock_mono() + REPLICA_HEARTBEAT_MS, router_heartbeat, NULL);
+    }
 
-        // if msg size has size of a registration message (3):
-        // [sender id][registration key][user cert  ]
-        if (msg_size == 3) {
-            // size 2 msg received
-            // registration sender id
-            zframe_t *reg_id = zmsg_pop(msg);
-            zframe_print(reg_id, "registration id: ");
-
-            // registering user cert
-            zframe_t *reg_cert = zmsg_pop(msg);
-            zframe_print(reg_cert, "registration key: ");
-
-            // check if the user provided the correct registration key
-            char *reg_cert_str = zframe_strdup(reg_cert);
-            if (!reg_cert_str) {
-                printf("no key received\n");
-                // TODO:
-            }
+    // the socket is drained into per-sender queues which are then serviced with
+    // deficit round robin (see scheduler.h). the poller blocks while nothing is
+    // queued and only peeks at the socket while there is still work to forward.
+    zpoller_t *poller = zpoller_new(self.socket, NULL);
+    if (poller && self.admin) zpoller_add(poller, self.admin);
+    if (poller && self.cluster) zpoller_add(poller, self.cluster->socket);
+    if (poller && self.replica) zpoller_add(poller, self.replica->socket);
+    if (poller && pipe) zpoller_add(poller, pipe);
+    if (poller) zpoller_add(poller, self.watcher);
+    if (!poller) {
+        printf("Failed to set up the forwarding loop\n");
+        zactor_destroy(&stats);
+        router_destroy(&self);
+        return 4;
+    }
+    if (pipe) {
+        *started = true;
+        zsock_signal(pipe, 0);
+    }
+
+    // last, so the threads already running (libzmq's I/O threads, the ZAP workers,
+    // the watcher) keep the CPUs they were given. a thread takes its creator's
+    // mask when it's created, only threads started after this would get the
+    // forwarding loop's
+    if (!cpu_set_pin_thread(self.config.loop_cpus)) {
+        printf("Unable to pin the forwarding loop, continuing without\n");
+    }
 
-            printf("reg cert string: %s\n", reg_cert_str);
+    bool running = true;
+    bool history_pending = false;
+    bool history_blocked = false;
+    int64_t last_traffic = 0;           // zclock_usecs() of the last pass that had anything to do
+    zmsg_t *drained[DRAIN_MAX];         // what one pass took off the socket
+    while (running && !zsys_interrupted) {
+        // idle, the loop wakes up for the next timer (heartbeats, history streams
+        // going idle) or to try held messages again
+        int timeout = scheduler_pending(self.scheduler) || history_pending ? 0 : timer_wheel_timeout(&self.timers, zclock_mono());
+        if ((outbox_pending(self.outbox) || history_blocked) && (timeout < 0 || timeout > HOLD_RETRY_MS)) timeout = HOLD_RETRY_MS;
+        if (self.config.poll_mode == POLL_TIMED && timeout != 0) timeout = 1;
 
-            if (zcertstore_lookup(cert_store, reg_cert_str) == NULL) {
-                printf("false registration certificate\n");
+        // mid-burst the next message is usually a few microseconds away, spinning
+        // for it saves going to sleep and being woken up again (see PollMode)
+        bool ready = timeout != 0 && self.config.poll_mode == POLL_ADAPTIVE && router_spin(&self, last_traffic);
+        if (ready) {
+            metrics_count(thread_metrics, COUNTER_POLL_SPINS, 1);
+        } else {
+            if (timeout != 0) metrics_count(thread_metrics, COUNTER_POLL_WAITS, 1);
+            zpoller_wait(poller, timeout);
+            if (zpoller_terminated(poller)) {
+                printf("Interrupted or error receiving message\n");
                 break;
-            }            
+            }
+        }
+
+        // the embedding process only ever sends $TERM, from zactor_destroy
+        if (pipe && (zsock_events(pipe) & ZMQ_POLLIN)) {
+            char *command = zstr_recv(pipe);
+            bool terminate = !command || streq(command, "$TERM");
+            zstr_free(&command);
+            if (terminate) break;
+        }
 
-            // registration code here.
-            // add user's pub key to certstore
-            // break;
+        if (self.admin && (zsock_events(self.admin) & ZMQ_POLLIN)) {
+            handle_admin(&self);
+        }
+        if (zsock_events(self.watcher) & ZMQ_POLLIN) router_reload_done(&self);
 
-            zframe_t *user_cert = zmsg_pop(msg);
-            zframe_print(user_cert, "user's actual cert: ");
+        while (self.replica && (zsock_events(self.replica->socket) & ZMQ_POLLIN)) {
+            if (replica_handle(self.replica) == REPLICA_HELLO) router_replica_snapshot(&self);
+        }
 
-            char *user_cert_str = zframe_strdup(user_cert);
-            if (!user_cert_str) {
-                printf("no key received\n");
-            }
+        // registrations and revocations the watcher published since the last pass
+        router_sync_directory(&self);
 
-            // make a new certificate for the router to store as an accepted user
-            zcert_t *user_cert_pub = zcert_new_from((const unsigned char*)user_cert_str, NULL);
+        // drain up to DRAIN_MAX messages without blocking, then handle them as one
+        // batch. the busier the socket, the more messages share each pass's fixed
+        // costs (the poll, the auth read section, clock reads, the sends). with
+        // the queues backlogged the rest stays on the socket, and its HWM pushes
+        // back on the dealers
+        router_tick(&self);
+        timer_wheel_advance(&self.timers, self.now_mono, &self);
+        bool traffic = scheduler_pending(self.scheduler);
+        size_t drained_count = 0;
+        while (drained_count < DRAIN_MAX && !scheduler_backlogged(self.scheduler) &&
+               (zsock_events(self.socket) & ZMQ_POLLIN)) {
+            zmsg_t *msg = zmsg_recv(self.socket);
+            if (!msg) {
+                printf("Interrupted or error receiving message\n");
+                running = false;
+                break;
+            }
+            drained[drained_count++] = msg;
+        }
+        if (drained_count > 0) {
+            traffic = true;
+            metrics_count(thread_metrics, COUNTER_DRAIN_BATCHES, 1);
+            router_handle_batch(&self, drained, drained_count);
+        }
 
-            // get the username and format where to store the cert
-            char* username = zframe_strdup(reg_id);
-            size_t cert_buffer = strlen(username) + 18; // formatted text + '\0'
-            char* certificate_location = malloc(cert_buffer);
-            snprintf(certificate_location, cert_buffer, "keys_router/%s.cert", username);
+        // messages the other nodes routed here
+        for (int i = 0; self.cluster && i < CLUSTER_DRAIN_MAX && !scheduler_backlogged(self.scheduler) &&
+                        (zsock_events(self.cluster->socket) & ZMQ_POLLIN); i++) {
+            zmsg_t *msg = zmsg_recv(self.cluster->socket);
+            if (!msg) break;
+            traffic = true;
+            metrics_count(thread_metrics, COUNTER_BYTES_IN, zmsg_content_size(msg));
+            handle_cluster(&self, msg);
+        }
 
-            // save the cert to disc
-            zcert_save(user_cert_pub, certificate_location);
+        // what recipients couldn't take before goes ahead of anything new for them
+        size_t flushed = 0, flushed_bytes = 0;
+        if (outbox_pending(self.outbox)) {
+            outbox_flush(self.outbox, self.socket, &flushed, &flushed_bytes);
+            metrics_count(thread_metrics, COUNTER_MESSAGES_OUT, flushed);
+            metrics_count(thread_metrics, COUNTER_BYTES_OUT, flushed_bytes);
+        }
 
-            // free when no longer needed
-            free(username);
-            free(certificate_location);
+        // forward a bounded amount per iteration so the socket gets drained again
+        // one clock read per batch keeps the dwell histogram cheap
+        size_t forwarded = 0;
+        int64_t now = zclock_usecs();
+        QueuedMessage next;
+        while (forwarded < SERVICE_BUDGET && scheduler_next(self.scheduler, &next)) {
+            forwarded += next.size;
+            metrics_dwell(thread_metrics, now - next.enqueued);
 
-            // everything should be ok, send signal
-            zmsg_t *reply = zmsg_new_signal(0);
-            int signal = zmsg_send(&reply, reg_id);
-            if (signal != 0) {
-                printf("Unable to send the registration signal\n");
-                zmsg_destroy(&reply);
+            // bridges to other nodes don't block, a full one fails the send. a local
+            // recipient at its HWM gets the message held instead
+            OutboxResult result = OUTBOX_SENT;
+            if (next.destination) {
+                if (outbox_send_frames(&next.msg, next.destination) != 0) result = OUTBOX_FAILED;
+            } else {
+                result = outbox_send(self.outbox, self.socket, &next.msg);
             }
-        } 
-
-        // regular message size
-        if (msg_size == 4) {
-            // pop sender id
-            zframe_t *sender_id = zmsg_pop(msg); 
-            // printf("sender id: %s\n", zframe_strhex(sender_id));
-            zframe_print(sender_id, "sender id: ");
-
-            // add sender's public key's message frame
-            zframe_t *sender_pub_key = zmsg_pop(msg);
-            zframe_print(sender_pub_key, "sender pub key:");
-
-            // TODO: if sender_pub_key is not known by the router, stop here
-            char* sender_key_string = zframe_strdup(sender_pub_key);
-            zcert_t *sender_cert = zcertstore_lookup(cert_store, sender_key_string);
-            if (!sender_cert){
-                // sender cert is null n therefore not found
-                // skip this iteration and continue, cleanup
-                printf("Unknown sender\n");
-                free(sender_key_string);
-                zframe_destroy(&sender_pub_key);
-                zmsg_destroy(&msg);            
+            // sent, held or dropped, either way the standby shouldn't send it again
+            replica_add_done(self.replica, next.id);
+            if (result == OUTBOX_UNREACHABLE || result == OUTBOX_FAILED) {
+                if (result == OUTBOX_FAILED) router_log(LEVEL_ERROR, "Failed to send message\n");
+                metrics_drop(thread_metrics, result == OUTBOX_UNREACHABLE ? DROP_NOT_CONNECTED : DROP_SEND_FAILED);
+                // the send left the message whole, its recipient frame included
+                router_forget(&self, next.msg);
+                zmsg_destroy(&next.msg);
                 continue;
-            }      
-
-            // pop recipient id
-            zframe_t *rec_id = zmsg_pop(msg);
-            // printf("recipient id: %s\n", zframe_strhex(rec_id));
-            zframe_print(rec_id, "recipient id: ");
-
-            // pop msg content
-            zframe_t *message_data = zmsg_pop(msg);   
-            zframe_print(message_data, "cipher: ");
-            
-            // reply ... forward to recipient
-            zmsg_t *reply = zmsg_new();
-            zmsg_append(reply, &rec_id);                // ROUTING: destination frame
-            zmsg_append(reply, &sender_id);             // CONTENT: original sender ID (as body)
-            zmsg_append(reply, &message_data);          // CONTENT: message
-            int result = zmsg_send(&reply, router);     // resulting in 2 frames in the received message?
-            if (result != 0) {
-                printf("Failed to send message\n");
-                // zmsg_send destroys the message on success, but not on failure
-                zmsg_destroy(&reply);
             }
-
-            free(sender_key_string);
-            zframe_destroy(&sender_pub_key);
+            if (result != OUTBOX_SENT) continue;
+            metrics_count(thread_metrics, next.destination ? COUNTER_CLUSTER_OUT : COUNTER_MESSAGES_OUT, 1);
+            metrics_count(thread_metrics, COUNTER_BYTES_OUT, next.size);
         }
+
+        metrics_gauge(thread_metrics, GAUGE_QUEUED_MESSAGES, self.scheduler->pending);
+        metrics_gauge(thread_metrics, GAUGE_HELD_MESSAGES, self.outbox->held);
+        metrics_gauge(thread_metrics, GAUGE_HELD_BYTES, self.outbox->held_bytes);
+        metrics_gauge(thread_metrics, GAUGE_HELD_RECIPIENTS, zlist_size(self.outbox->backlogged));
+        metrics_gauge(thread_metrics, GAUGE_DEEPEST_HELD, outbox_pending(self.outbox) ? outbox_deepest(self.outbox) : 0);
+        metrics_gauge(thread_metrics, GAUGE_TIMERS, self.timers.count);
+
+        // history streams get what's left of the pass, as much as their credit allows
+        history_pending = self.journal && router_serve_history(&self, &history_blocked);
+
+        // everything this pass changed goes to the standby as one batch
+        replica_flush(self.replica);
+        if (traffic) last_traffic = zclock_usecs();
     }
-    // zpoller_destroy(&poller);
-    zsock_destroy(&router);
-    zactor_destroy(&auth);        
-    // zcert_destroy(&router_cert);
-    zcertstore_destroy(&cert_store);    
+    zactor_destroy(&stats);
+    zpoller_destroy(&poller);
+    router_destroy(&self);
 
     return 0;
 }
+
+#define ROUTER_ACTOR_ARGS 64
+
+void router_actor(zsock_t *pipe, void *args)
+{
+    char *copy = strdup(args ? (const char *)args : "");
+    char *argv[ROUTER_ACTOR_ARGS + 1] = { "router" };
+    int argc = 1;
+    char *saveptr = NULL;
+    for (char *next = copy ? strtok_r(copy, " ", &saveptr) : NULL; next && argc < ROUTER_ACTOR_ARGS;
+         next = strtok_r(NULL, " ", &saveptr)) {
+        argv[argc++] = next;
+    }
+
+    bool started = false;
+    int rc = copy ? router_run(argc, argv, pipe, &started) : 4;
+    // zactor_new is still waiting to hear back
+    if (!started) {
+        router_log(LEVEL_ERROR, "Embedded router failed to start (%d)\n", rc);
+        zsock_signal(pipe, (byte)rc);
+    }
+    free(copy);
+}
+
+#ifndef ROUTER_EMBEDDED
+// kill router if perpetually blocked: ps aux | grep router ----- kill -9 with associated ./router pid
+int main(int argc, char **argv)
+{
+    return router_run(argc, argv, NULL, NULL);
+}
+#endif
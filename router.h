@@ -0,0 +1,28 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <czmq.h>
+
+// embedded router
+//
+// router.c built with -DROUTER_EMBEDDED leaves out main, and the same router runs
+// as an actor in another process instead. args are ./router's command line
+// options separated by spaces:
+//
+//     zactor_t *router = zactor_new(router_actor, "--bind inproc://router --admin inproc://router-admin");
+//     ...
+//     zactor_destroy(&router);
+//
+// zactor_new returns once the router is bound and forwarding (or gave up, see its
+// log). bots and tests in the same process connect over inproc, which doesn't
+// go through the kernel at all. libzmq runs no security mechanism on inproc, so
+// there's no CURVE handshake there, but messages still carry a sender key the
+// router checks against its index. a process can embed one router: it binds the
+// ZAP endpoint, and the admin and stats endpoints need to differ from those of
+// any ./router on the same host. --io-threads and --io-cpus are left to the
+// embedding process, libzmq's threads are running before the actor starts: call
+// zsys_set_io_threads before making the first socket.
+
+void router_actor(zsock_t *pipe, void *args);
+
+#endif // ROUTER_H_
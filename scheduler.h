@@ -0,0 +1,280 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <czmq.h>
+#include <stdbool.h>
+#include <assert.h>
+
+// deficit round robin over per-sender queues
+//
+// every sender that has something queued sits in the active ring. when a sender
+// comes up it gets `quantum` bytes added to its deficit and may forward messages
+// for as long as the deficit covers the size of the message at the head of its
+// queue. a sender pushing 64k blobs therefore gets the same share of bytes as
+// everyone else instead of starving the small interactive messages behind it.
+//
+// control traffic (registration replies, acks, presence) skips all of that and
+// goes out first through the priority lane.
+//
+// the router drains its socket into these queues, so they're what bounds a
+// sender's backlog now rather than the socket's HWM. a sender may have up to
+// SCHEDULER_SENDER_MESSAGES messages or SCHEDULER_SENDER_BYTES queued, anything
+// past that is refused, and the router stops draining the socket altogether
+// while SCHEDULER_BACKLOG_BYTES are queued, which leaves the HWM to push back
+// on the dealers again. a sender's queue is freed once it's empty.
+
+// bytes each sender may forward per round, roughly one max sized chat message
+#define SCHEDULER_QUANTUM 1500
+
+// what one sender may have queued, about the socket's HWM worth of messages
+#define SCHEDULER_SENDER_MESSAGES 1000
+#define SCHEDULER_SENDER_BYTES (4 * 1024 * 1024)
+
+// all senders together, past it nothing more is read off the socket
+#define SCHEDULER_BACKLOG_BYTES (64 * 1024 * 1024)
+
+typedef struct {
+    zmsg_t *msg;          // ready to send, routing frame first
+    size_t size;          // content bytes, what the deficit is charged
+    int64_t enqueued;     // zclock_usecs() when it entered the router
+    void *destination;    // socket to send it on, NULL for the router's own
+    uint64_t id;          // replication id, 0 when it isn't replicated
+} QueuedMessage;
+
+typedef struct {
+    QueuedMessage *items;
+    size_t capacity;
+    size_t count;
+    size_t head;
+} MessageRing;
+
+typedef struct {
+    char *sender;
+    MessageRing queue;
+    size_t queued_bytes;
+    size_t deficit;
+    bool topped_up;       // quantum already added for the current turn
+    bool active;          // currently in the active ring
+} SenderQueue;
+
+typedef struct {
+    zhash_t *senders;     // sender id -> SenderQueue
+    zlist_t *active;      // senders with queued messages, in service order
+    MessageRing control;  // priority lane
+    size_t quantum;
+    size_t pending;       // messages across all queues
+    size_t queued_bytes;  // content bytes across all sender queues
+} Scheduler;
+
+static inline bool ring_push(MessageRing *ring, QueuedMessage item)
+{
+    if (ring->count == ring->capacity) {
+        size_t new_capacity = ring->capacity ? ring->capacity * 2 : 16;
+        QueuedMessage *items = malloc(new_capacity * sizeof(*items));
+        if (!items) return false;
+
+        // unwrap into the new buffer so head starts at 0 again
+        for (size_t i = 0; i < ring->count; i++) {
+            items[i] = ring->items[(ring->head + i) % ring->capacity];
+        }
+        free(ring->items);
+        ring->items = items;
+        ring->capacity = new_capacity;
+        ring->head = 0;
+    }
+    ring->items[(ring->head + ring->count) % ring->capacity] = item;
+    ring->count++;
+    return true;
+}
+
+static inline QueuedMessage *ring_peek(MessageRing *ring)
+{
+    if (ring->count == 0) return NULL;
+    return &ring->items[ring->head];
+}
+
+static inline QueuedMessage ring_pop(MessageRing *ring)
+{
+    assert(ring->count > 0);
+    QueuedMessage item = ring->items[ring->head];
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    return item;
+}
+
+static inline void ring_free(MessageRing *ring)
+{
+    while (ring->count > 0) {
+        QueuedMessage item = ring_pop(ring);
+        zmsg_destroy(&item.msg);
+    }
+    free(ring->items);
+    ring->items = NULL;
+    ring->capacity = 0;
+}
+
+static inline void sender_queue_free(void *data)
+{
+    SenderQueue *sq = (SenderQueue *)data;
+    ring_free(&sq->queue);
+    free(sq->sender);
+    free(sq);
+}
+
+static inline Scheduler *scheduler_new(size_t quantum)
+{
+    Scheduler *self = calloc(1, sizeof(Scheduler));
+    if (!self) return NULL;
+
+    self->senders = zhash_new();
+    self->active = zlist_new();
+    if (!self->senders || !self->active) {
+        zhash_destroy(&self->senders);
+        zlist_destroy(&self->active);
+        free(self);
+        return NULL;
+    }
+    self->quantum = quantum;
+    return self;
+}
+
+static inline void scheduler_destroy(Scheduler **self_p)
+{
+    Scheduler *self = *self_p;
+    if (!self) return;
+
+    // the hash owns the sender queues, the active list only borrows them
+    zlist_destroy(&self->active);
+    zhash_destroy(&self->senders);
+    ring_free(&self->control);
+    free(self);
+    *self_p = NULL;
+}
+
+static inline bool scheduler_pending(Scheduler *self)
+{
+    return self->pending > 0;
+}
+
+// enough queued that the router should leave the rest on the socket for now
+static inline bool scheduler_backlogged(Scheduler *self)
+{
+    return self->queued_bytes >= SCHEDULER_BACKLOG_BYTES;
+}
+
+// would a message of size bytes take sender past what it may have queued
+static inline bool scheduler_sender_full(Scheduler *self, const char *sender, size_t size)
+{
+    SenderQueue *sq = (SenderQueue *)zhash_lookup(self->senders, sender);
+    if (!sq) return false;
+    return sq->queue.count >= SCHEDULER_SENDER_MESSAGES || sq->queued_bytes + size > SCHEDULER_SENDER_BYTES;
+}
+
+static inline QueuedMessage queued_message(zmsg_t *msg)
+{
+    QueuedMessage item = {
+        .msg = msg,
+        .size = zmsg_content_size(msg),
+        .enqueued = zclock_usecs()
+    };
+    return item;
+}
+
+// queue a message for forwarding on behalf of sender, takes ownership of item.msg.
+// false when it couldn't be queued or sender is full, see scheduler_sender_full
+static inline bool scheduler_push_item(Scheduler *self, const char *sender, QueuedMessage item)
+{
+    if (scheduler_sender_full(self, sender, item.size)) return false;
+    SenderQueue *sq = (SenderQueue *)zhash_lookup(self->senders, sender);
+    if (!sq) {
+        sq = calloc(1, sizeof(SenderQueue));
+        if (!sq) return false;
+        sq->sender = strdup(sender);
+        zhash_insert(self->senders, sender, sq);
+        zhash_freefn(self->senders, sender, sender_queue_free);
+    }
+
+    if (!ring_push(&sq->queue, item)) return false;
+    sq->queued_bytes += item.size;
+    self->queued_bytes += item.size;
+    self->pending++;
+
+    if (!sq->active) {
+        sq->active = true;
+        sq->deficit = 0;
+        sq->topped_up = false;
+        zlist_append(self->active, sq);
+    }
+    return true;
+}
+
+static inline bool scheduler_push(Scheduler *self, const char *sender, zmsg_t *msg)
+{
+    return scheduler_push_item(self, sender, queued_message(msg));
+}
+
+// priority lane, always serviced before any sender queue
+static inline bool scheduler_push_control(Scheduler *self, zmsg_t *msg)
+{
+    if (!ring_push(&self->control, queued_message(msg))) return false;
+    self->pending++;
+    return true;
+}
+
+// every message in the sender queues, in no particular order. fn may change the
+// item but not take it
+static inline void scheduler_each(Scheduler *self, void (*fn)(void *context, const char *sender, QueuedMessage *item),
+                                  void *context)
+{
+    for (SenderQueue *sq = zhash_first(self->senders); sq; sq = zhash_next(self->senders)) {
+        for (size_t i = 0; i < sq->queue.count; i++) {
+            fn(context, sq->sender, &sq->queue.items[(sq->queue.head + i) % sq->queue.capacity]);
+        }
+    }
+}
+
+// hands out the next message to forward, false when everything is drained
+static inline bool scheduler_next(Scheduler *self, QueuedMessage *out)
+{
+    if (self->control.count > 0) {
+        *out = ring_pop(&self->control);
+        self->pending--;
+        return true;
+    }
+
+    for (;;) {
+        SenderQueue *sq = (SenderQueue *)zlist_first(self->active);
+        if (!sq) return false;
+
+        if (!sq->topped_up) {
+            sq->deficit += self->quantum;
+            sq->topped_up = true;
+        }
+
+        QueuedMessage *head = ring_peek(&sq->queue);
+        assert(head != NULL);
+
+        if (head->size <= sq->deficit) {
+            *out = ring_pop(&sq->queue);
+            sq->deficit -= out->size;
+            sq->queued_bytes -= out->size;
+            self->queued_bytes -= out->size;
+            self->pending--;
+
+            // an idle sender doesn't get to bank credit for later, and its queue
+            // goes: a router sees far more senders come and go than it has queued
+            if (sq->queue.count == 0) {
+                zlist_pop(self->active);
+                zhash_delete(self->senders, sq->sender);
+            }
+            return true;
+        }
+
+        // turn is over, keep the leftover deficit and go to the back of the ring
+        zlist_pop(self->active);
+        sq->topped_up = false;
+        zlist_append(self->active, sq);
+    }
+}
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,317 @@
+#ifndef SESSIONKEYS_H_
+#define SESSIONKEYS_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "delivery.h"
+
+// per-conversation session keys
+//
+// the CURVE keys every user already has are Curve25519 keys, so the secret half
+// of ours and the public half of a peer's give the same X25519 shared secret on
+// both ends without anything being exchanged. the key a message is encrypted
+// with is derived from that secret with HKDF-SHA256:
+//
+//     salt  epoch (u64)
+//     info  "chat session key" 0 sender 0 recipient
+//
+// so each direction of a conversation has its own keys, and the sender starts a
+// new epoch every SESSION_ROTATE_MESSAGES messages or SESSION_ROTATE_MS. epochs
+// start from a random number when the dealer starts. an encrypted content frame
+// carries the epoch and a random iv in front of the ciphertext and the tag after:
+//
+//     [epoch][iv (12)][AES-128-GCM ciphertext][tag (16)]
+//
+// the tag also covers the epoch, the sender and recipient names and the delivery
+// header's flags (see session_aad), so a frame replayed into another
+// conversation or with its compressed flag flipped doesn't decrypt. the rest of
+// a message's delivery header isn't covered, it's rewritten when the router
+// serves the message from its journal. frames the router never journals have
+// their header bound as well: a file chunk's transfer id and offset, an offer's
+// id and size, and a part's group, index and count, so chunks and parts can't be
+// swapped around or moved into another transfer or message.
+//
+// rotating epochs bounds how much is encrypted under one key, it isn't forward
+// secrecy: every key can be derived again from either side's long-term CURVE
+// secret, which is how old journaled messages are read.
+//
+// the shared secret, the current sending key and the last few receiving keys of
+// up to SESSION_KEY_CACHE peers are kept, least recently used first out. the
+// X25519 work is done once per peer for as long as it stays in the cache, a new
+// epoch is one HKDF. keys are derived again from the same inputs for journaled
+// messages (see journal.h) from epochs long gone.
+
+#define SESSION_KEY_SIZE        16
+#define SESSION_IV_SIZE         12
+#define SESSION_TAG_SIZE        16
+#define SESSION_ENVELOPE_SIZE   (8 + SESSION_IV_SIZE)
+#define SESSION_NAME_MAX        255                 // routing ids are at most that
+#define SESSION_BOUND_MAX       32                  // header bytes bound into the tag
+#define SESSION_AAD_MAX         (8 + 1 + 2 * (1 + SESSION_NAME_MAX) + SESSION_BOUND_MAX)
+#define SESSION_KEY_CACHE       64
+#define SESSION_RECEIVE_KEYS    4                   // epochs kept per peer for decrypting
+#define SESSION_ROTATE_MESSAGES 1000
+#define SESSION_ROTATE_MS       (10 * 60 * 1000)
+
+// the peer's 32 byte public key, false when it isn't known
+typedef bool (*SessionPublicKey)(void *context, const char *peer, uint8_t *public_key);
+
+typedef struct {
+    uint64_t epoch;
+    bool outgoing;              // we were the sender
+    uint8_t key[SESSION_KEY_SIZE];
+} SessionKey;
+
+typedef struct {
+    char *peer;
+    uint8_t shared[32];
+    SessionKey send;            // epoch 0 until the first message
+    uint64_t sent;              // messages under send's epoch
+    int64_t rotated;            // zclock_mono() when send was derived
+    SessionKey receive[SESSION_RECEIVE_KEYS];
+    size_t receive_next;        // the slot the next derived key replaces
+    uint64_t used;              // tick of the last use, for the LRU
+} SessionPeer;
+
+typedef struct {
+    char *name;                 // ours, sender or recipient in every info
+    uint8_t secret[32];
+    zhash_t *peers;             // peer -> SessionPeer
+    uint64_t tick;
+    uint64_t next_epoch;
+    SessionPublicKey lookup;
+    void *lookup_context;
+    uint64_t agreements;        // X25519 runs
+    uint64_t derivations;       // HKDF runs
+} SessionKeys;
+
+// what a content frame's tag covers besides the ciphertext: [epoch][flags]
+// [sender length][sender][recipient length][recipient][bound]. envelope is the
+// frame's start, bound the header bytes that go with it unchanged (it starts
+// with the header's type, so frames of different kinds never share one), none
+// for a message. false when a name or bound is too long
+static inline bool session_aad(uint8_t *aad, size_t *aad_len, const uint8_t *envelope, uint8_t flags,
+                               const char *sender, const char *recipient, const uint8_t *bound, size_t bound_len)
+{
+    size_t sender_len = sender ? strlen(sender) : 0;
+    size_t recipient_len = recipient ? strlen(recipient) : 0;
+    if (sender_len > SESSION_NAME_MAX || recipient_len > SESSION_NAME_MAX || bound_len > SESSION_BOUND_MAX) return false;
+    size_t n = 0;
+    memcpy(aad, envelope, 8);
+    n += 8;
+    aad[n++] = flags;
+    aad[n++] = (uint8_t)sender_len;
+    memcpy(aad + n, sender, sender_len);
+    n += sender_len;
+    aad[n++] = (uint8_t)recipient_len;
+    memcpy(aad + n, recipient, recipient_len);
+    n += recipient_len;
+    if (bound_len) memcpy(aad + n, bound, bound_len);
+    n += bound_len;
+    *aad_len = n;
+    return true;
+}
+
+static inline void session_peer_free(void *data)
+{
+    SessionPeer *peer = (SessionPeer *)data;
+    OPENSSL_cleanse(peer->shared, sizeof(peer->shared));
+    OPENSSL_cleanse(&peer->send, sizeof(peer->send));
+    OPENSSL_cleanse(peer->receive, sizeof(peer->receive));
+    free(peer->peer);
+    free(peer);
+}
+
+static inline SessionKeys *session_keys_new(SessionPublicKey lookup, void *lookup_context)
+{
+    SessionKeys *self = calloc(1, sizeof(SessionKeys));
+    if (!self) return NULL;
+    self->peers = zhash_new();
+    if (!self->peers || RAND_bytes((unsigned char *)&self->next_epoch, sizeof(self->next_epoch)) != 1) {
+        zhash_destroy(&self->peers);
+        free(self);
+        return NULL;
+    }
+    // 0 means "none yet" in a SessionPeer
+    if (self->next_epoch == 0) self->next_epoch = 1;
+    self->lookup = lookup;
+    self->lookup_context = lookup_context;
+    return self;
+}
+
+static inline void session_keys_destroy(SessionKeys **self_p)
+{
+    SessionKeys *self = *self_p;
+    if (!self) return;
+    zhash_destroy(&self->peers);
+    OPENSSL_cleanse(self->secret, sizeof(self->secret));
+    free(self->name);
+    free(self);
+    *self_p = NULL;
+}
+
+// who we are, the cache starts over when that changed (another user logged in)
+static inline bool session_keys_identity(SessionKeys *self, const char *name, const uint8_t *secret)
+{
+    if (!name || !secret) return false;
+    if (self->name && strcmp(self->name, name) == 0 && CRYPTO_memcmp(self->secret, secret, 32) == 0) return true;
+
+    zhash_destroy(&self->peers);
+    self->peers = zhash_new();
+    free(self->name);
+    self->name = strdup(name);
+    memcpy(self->secret, secret, 32);
+    return self->peers && self->name;
+}
+
+// peer's public key changed (see keydirectory.h), what was agreed on with the
+// old one goes and the next message starts over from a new agreement
+static inline void session_keys_forget(SessionKeys *self, const char *peer)
+{
+    zhash_delete(self->peers, peer);
+}
+
+static inline bool session_x25519(const uint8_t *secret, const uint8_t *public_key, uint8_t *shared)
+{
+    EVP_PKEY *ours = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, secret, 32);
+    EVP_PKEY *theirs = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, public_key, 32);
+    EVP_PKEY_CTX *ctx = ours ? EVP_PKEY_CTX_new(ours, NULL) : NULL;
+    size_t size = 32;
+    bool ok = ctx && theirs &&
+              EVP_PKEY_derive_init(ctx) == 1 &&
+              EVP_PKEY_derive_set_peer(ctx, theirs) == 1 &&
+              EVP_PKEY_derive(ctx, shared, &size) == 1 && size == 32;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(theirs);
+    EVP_PKEY_free(ours);
+    return ok;
+}
+
+static inline bool session_hkdf(const uint8_t *shared, uint64_t epoch, const char *sender, const char *recipient, uint8_t *key)
+{
+    uint8_t salt[8];
+    delivery_put_u64(salt, epoch);
+
+    // "chat session key" 0 sender 0 recipient, the 0s keep the names apart
+    static const char label[] = "chat session key";
+    size_t sender_len = strlen(sender), recipient_len = strlen(recipient);
+    size_t info_len = sizeof(label) + sender_len + 1 + recipient_len;
+    uint8_t *info = malloc(info_len);
+    if (!info) return false;
+    memcpy(info, label, sizeof(label));
+    memcpy(info + sizeof(label), sender, sender_len + 1);
+    memcpy(info + sizeof(label) + sender_len + 1, recipient, recipient_len);
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    size_t size = SESSION_KEY_SIZE;
+    bool ok = ctx &&
+              EVP_PKEY_derive_init(ctx) == 1 &&
+              EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, sizeof(salt)) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_key(ctx, shared, 32) == 1 &&
+              EVP_PKEY_CTX_add1_hkdf_info(ctx, info, (int)info_len) == 1 &&
+              EVP_PKEY_derive(ctx, key, &size) == 1 && size == SESSION_KEY_SIZE;
+    EVP_PKEY_CTX_free(ctx);
+    free(info);
+    return ok;
+}
+
+// the cache entry for peer, with the shared secret agreed on. NULL when there's
+// no public key for peer
+static inline SessionPeer *session_peer(SessionKeys *self, const char *peer)
+{
+    SessionPeer *entry = (SessionPeer *)zhash_lookup(self->peers, peer);
+    if (entry) {
+        entry->used = ++self->tick;
+        return entry;
+    }
+
+    uint8_t public_key[32];
+    if (!self->lookup || !self->lookup(self->lookup_context, peer, public_key)) return NULL;
+    entry = calloc(1, sizeof(SessionPeer));
+    if (!entry) return NULL;
+    entry->peer = strdup(peer);
+    if (!entry->peer || !session_x25519(self->secret, public_key, entry->shared)) {
+        session_peer_free(entry);
+        return NULL;
+    }
+    self->agreements++;
+
+    // full, the one used least recently goes
+    if (zhash_size(self->peers) >= SESSION_KEY_CACHE) {
+        SessionPeer *oldest = NULL;
+        for (SessionPeer *p = (SessionPeer *)zhash_first(self->peers); p; p = (SessionPeer *)zhash_next(self->peers)) {
+            if (!oldest || p->used < oldest->used) oldest = p;
+        }
+        if (oldest) zhash_delete(self->peers, oldest->peer);
+    }
+    entry->used = ++self->tick;
+    zhash_insert(self->peers, peer, entry);
+    zhash_freefn(self->peers, peer, session_peer_free);
+    return entry;
+}
+
+// the key for our next message to peer, a new epoch when the current one is used up
+static inline bool session_send_key(SessionKeys *self, const char *peer, uint64_t *epoch, uint8_t *key)
+{
+    if (!self->name) return false;
+    SessionPeer *entry = session_peer(self, peer);
+    if (!entry) return false;
+
+    int64_t now = zclock_mono();
+    if (entry->send.epoch == 0 || entry->sent >= SESSION_ROTATE_MESSAGES || now - entry->rotated >= SESSION_ROTATE_MS) {
+        uint64_t next = self->next_epoch++;
+        if (self->next_epoch == 0) self->next_epoch = 1;
+        if (!session_hkdf(entry->shared, next, self->name, peer, entry->send.key)) return false;
+        self->derivations++;
+        entry->send.epoch = next;
+        entry->send.outgoing = true;
+        entry->sent = 0;
+        entry->rotated = now;
+    }
+    entry->sent++;
+    *epoch = entry->send.epoch;
+    memcpy(key, entry->send.key, SESSION_KEY_SIZE);
+    return true;
+}
+
+// the key sender used for a message to recipient, one of them is us
+static inline bool session_key(SessionKeys *self, const char *sender, const char *recipient, uint64_t epoch, uint8_t *key)
+{
+    if (!self->name) return false;
+    bool outgoing = strcmp(sender, self->name) == 0;
+    SessionPeer *entry = session_peer(self, outgoing ? recipient : sender);
+    if (!entry) return false;
+
+    if (outgoing && entry->send.epoch == epoch) {
+        memcpy(key, entry->send.key, SESSION_KEY_SIZE);
+        return true;
+    }
+    for (size_t i = 0; i < SESSION_RECEIVE_KEYS; i++) {
+        SessionKey *cached = &entry->receive[i];
+        if (cached->epoch == epoch && cached->outgoing == outgoing) {
+            memcpy(key, cached->key, SESSION_KEY_SIZE);
+            return true;
+        }
+    }
+
+    SessionKey *slot = &entry->receive[entry->receive_next];
+    if (!session_hkdf(entry->shared, epoch, sender, recipient, slot->key)) {
+        slot->epoch = 0;
+        return false;
+    }
+    self->derivations++;
+    slot->epoch = epoch;
+    slot->outgoing = outgoing;
+    entry->receive_next = (entry->receive_next + 1) % SESSION_RECEIVE_KEYS;
+    memcpy(key, slot->key, SESSION_KEY_SIZE);
+    return true;
+}
+
+#endif // SESSIONKEYS_H_
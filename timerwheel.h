@@ -0,0 +1,251 @@
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+
+// hierarchical timing wheel
+//
+// timers for retransmits, idle streams and heartbeats, as many as there are
+// messages in flight. ticks are zclock_mono() milliseconds. there are
+// TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots, level l holding the
+// timers due within the current 256^(l+1) ticks, and a timer sits in the slot
+// its expiry falls in at the lowest level that reaches it:
+//
+//     level 0   1 ms per slot      the next 256 ms
+//     level 1   256 ms per slot    the next 65 s
+//     level 2   65 s per slot      the next 4.6 h
+//     level 3   4.6 h per slot     the next 49 days, past that an overflow list
+//
+// when the wheel gets to the start of a higher level slot, that slot's timers
+// are moved down to where they belong now (a timer is moved at most once per
+// level), and a level 0 slot holds exactly the timers due on its tick. adding
+// and cancelling a timer is linking it into or out of a slot's list. a bitmap
+// of the slots that hold anything gives the next tick there's work on, so the
+// wheel jumps straight there: a million timers waiting cost nothing until one
+// of them is due, and timer_wheel_timeout is what a poll loop waits for.
+//
+// timers are embedded in whatever they time, timer_owner gets back from one to
+// it. a zeroed Timer isn't armed. the wheel has lists pointing into itself and
+// mustn't move once initialized.
+
+#define TIMER_WHEEL_BITS        8
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      4
+#define TIMER_WHEEL_SPAN_BITS   (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)
+
+typedef struct TimerLink {
+    struct TimerLink *next;
+    struct TimerLink *prev;
+} TimerLink;
+
+typedef struct Timer Timer;
+
+// a timer that's due, context is what timer_wheel_advance was given. the timer
+// isn't armed any more and can be added again right here
+typedef void (*TimerFn)(void *context, Timer *timer);
+
+struct Timer {
+    TimerLink link;             // first, so a slot's list holds Timers. next is NULL while not armed
+    uint64_t expires;           // the tick it's due on
+    TimerFn fn;
+    void *data;                 // the owner's, the wheel doesn't look at it
+};
+
+#define timer_owner(timer, type, member) ((type *)((char *)(timer) - offsetof(type, member)))
+
+typedef struct {
+    uint64_t now;               // every tick up to here was handled
+    size_t count;               // armed timers
+    uint64_t expired;           // timers that came due so far
+    TimerLink slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS / 64];  // a slot's bit is cleared once it's seen empty
+    TimerLink overflow;         // due beyond what the levels reach
+} TimerWheel;
+
+static inline void timer_list_init(TimerLink *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline bool timer_list_empty(const TimerLink *list)
+{
+    return list->next == list;
+}
+
+static inline void timer_list_append(TimerLink *list, TimerLink *link)
+{
+    link->prev = list->prev;
+    link->next = list;
+    list->prev->next = link;
+    list->prev = link;
+}
+
+static inline void timer_list_unlink(TimerLink *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = NULL;
+    link->prev = NULL;
+}
+
+// every timer of from goes to the end of to, from is left empty
+static inline void timer_list_splice(TimerLink *to, TimerLink *from)
+{
+    if (timer_list_empty(from)) return;
+    from->next->prev = to->prev;
+    from->prev->next = to;
+    to->prev->next = from->next;
+    to->prev = from->prev;
+    timer_list_init(from);
+}
+
+static inline void timer_wheel_init(TimerWheel *self, int64_t now)
+{
+    memset(self, 0, sizeof(*self));
+    self->now = (uint64_t)now;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) timer_list_init(&self->slots[level][slot]);
+    }
+    timer_list_init(&self->overflow);
+}
+
+static inline bool timer_armed(const Timer *timer)
+{
+    return timer->link.next != NULL;
+}
+
+// into the slot of the lowest level whose current span has the expiry in it
+static inline void timer_wheel_place(TimerWheel *self, Timer *timer)
+{
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int above = TIMER_WHEEL_BITS * (level + 1);
+        if (timer->expires >> above != self->now >> above) continue;
+        size_t slot = (size_t)(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        timer_list_append(&self->slots[level][slot], &timer->link);
+        self->occupied[level][slot / 64] |= 1ULL << (slot % 64);
+        return;
+    }
+    timer_list_append(&self->overflow, &timer->link);
+}
+
+static inline void timer_wheel_cancel(TimerWheel *self, Timer *timer)
+{
+    if (!timer_armed(timer)) return;
+    timer_list_unlink(&timer->link);
+    self->count--;
+}
+
+// arms timer to call fn on tick at, one that's already armed is moved. a tick
+// the wheel has already handled is due on the next one
+static inline void timer_wheel_add(TimerWheel *self, Timer *timer, int64_t at, TimerFn fn, void *data)
+{
+    timer_wheel_cancel(self, timer);
+    timer->expires = at > 0 && (uint64_t)at > self->now ? (uint64_t)at : self->now + 1;
+    timer->fn = fn;
+    timer->data = data;
+    timer_wheel_place(self, timer);
+    self->count++;
+}
+
+// the next tick something happens on, a timer due or a slot to move down,
+// UINT64_MAX with nothing armed. the first level with anything after its
+// current slot has it, higher levels only start after the current span ends
+static inline uint64_t timer_wheel_next(TimerWheel *self)
+{
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        size_t current = (size_t)(self->now >> shift) & TIMER_WHEEL_MASK;
+        for (size_t word = current / 64; word < TIMER_WHEEL_SLOTS / 64; word++) {
+            uint64_t bits = self->occupied[level][word];
+            if (word == current / 64) bits &= current % 64 == 63 ? 0 : ~0ULL << (current % 64 + 1);
+            while (bits) {
+                size_t slot = word * 64 + (size_t)__builtin_ctzll(bits);
+                if (!timer_list_empty(&self->slots[level][slot])) {
+                    uint64_t span = self->now >> (shift + TIMER_WHEEL_BITS) << (shift + TIMER_WHEEL_BITS);
+                    return span + ((uint64_t)slot << shift);
+                }
+                // everything in it was cancelled
+                self->occupied[level][word] &= ~(1ULL << (slot % 64));
+                bits &= bits - 1;
+            }
+        }
+    }
+    if (timer_list_empty(&self->overflow)) return UINT64_MAX;
+    return ((self->now >> TIMER_WHEEL_SPAN_BITS) + 1) << TIMER_WHEEL_SPAN_BITS;
+}
+
+// the timers of list placed again from the current tick, each ends up a level lower
+static inline void timer_wheel_move_down(TimerWheel *self, TimerLink *list)
+{
+    TimerLink moving;
+    timer_list_init(&moving);
+    timer_list_splice(&moving, list);
+    while (!timer_list_empty(&moving)) {
+        TimerLink *link = moving.next;
+        timer_list_unlink(link);
+        timer_wheel_place(self, (Timer *)link);
+    }
+}
+
+// ms until something's due, for a poll timeout: 0 when it already is, -1 when
+// nothing's armed
+static inline int timer_wheel_timeout(TimerWheel *self, int64_t now)
+{
+    uint64_t next = timer_wheel_next(self);
+    if (next == UINT64_MAX) return -1;
+    if (now < 0 || next <= (uint64_t)now) return 0;
+    return next - (uint64_t)now > INT_MAX ? INT_MAX : (int)(next - (uint64_t)now);
+}
+
+// moves the wheel up to now, calling every timer that came due on the way with
+// context once they're all collected. returns how many there were
+static inline size_t timer_wheel_advance(TimerWheel *self, int64_t now, void *context)
+{
+    if (now < 0 || (uint64_t)now <= self->now) return 0;
+    TimerLink due;
+    timer_list_init(&due);
+
+    while (self->now < (uint64_t)now) {
+        uint64_t tick = timer_wheel_next(self);
+        if (tick > (uint64_t)now) {
+            self->now = (uint64_t)now;
+            break;
+        }
+        self->now = tick;
+
+        // the start of a higher level slot, from the top so that what moves down
+        // to a level whose slot starts here too moves on with it
+        if ((tick & ((1ULL << TIMER_WHEEL_SPAN_BITS) - 1)) == 0) timer_wheel_move_down(self, &self->overflow);
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = TIMER_WHEEL_BITS * level;
+            if (tick & ((1ULL << shift) - 1)) continue;
+            size_t slot = (size_t)(tick >> shift) & TIMER_WHEEL_MASK;
+            self->occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+            timer_wheel_move_down(self, &self->slots[level][slot]);
+        }
+
+        size_t slot = (size_t)tick & TIMER_WHEEL_MASK;
+        timer_list_splice(&due, &self->slots[0][slot]);
+        self->occupied[0][slot / 64] &= ~(1ULL << (slot % 64));
+    }
+
+    // a callback may cancel or add timers, those still in due included
+    size_t fired = 0;
+    while (!timer_list_empty(&due)) {
+        Timer *timer = (Timer *)due.next;
+        timer_list_unlink(&timer->link);
+        self->count--;
+        self->expired++;
+        fired++;
+        if (timer->fn) timer->fn(context, timer);
+    }
+    return fired;
+}
+
+#endif // TIMERWHEEL_H_
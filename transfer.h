@@ -0,0 +1,513 @@
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+
+#include <czmq.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "delivery.h"
+
+// file transfer between dealers
+//
+// the zguide's fileio pattern, over the router: the sender only offers the file,
+// the recipient pulls it one chunk at a time with fetch requests and never has
+// more than TRANSFER_CREDIT of them out. whatever the file size, a transfer holds
+// at most TRANSFER_CREDIT chunks in the router's queues, and a lost chunk is just
+// fetched again once its fetch times out.
+//
+//     offer  ['O'][id][size]                   content: encrypted file name
+//     fetch  ['F'][id][offset][length (u32)]   recipient -> sender, empty content
+//     chunk  ['K'][id][offset]                 content: the encrypted chunk
+//     done   ['X'][id][status (u32)]           recipient -> sender, 0 when complete
+//
+// ids are picked by the sender, the recipient keys transfers by sender and id.
+// the sender reads and encrypts a chunk when it's fetched, so nothing is read
+// ahead of what the recipient asked for, and a file that shrank in the meantime
+// ends the transfer instead of the sender. files land in TRANSFER_DIRECTORY
+// under the offered name.
+//
+// nothing is fetched before the user accepted the offer. until then it waits
+// among at most TRANSFER_OFFERS_MAX others, numbered for /accept and /decline.
+// an offer bigger than TRANSFER_MAX_SIZE is declined right away, one is only
+// accepted while fewer than TRANSFER_INCOMING_MAX files are coming in and the
+// disk has room for it and the rest of those, and a transfer nothing arrived
+// for in TRANSFER_IDLE_MS is given up on.
+
+#define TRANSFER_OFFER              'O'
+#define TRANSFER_FETCH              'F'
+#define TRANSFER_CHUNK              'K'
+#define TRANSFER_DONE               'X'
+#define TRANSFER_OFFER_SIZE         17
+#define TRANSFER_FETCH_SIZE         21
+#define TRANSFER_CHUNK_HEADER_SIZE  17
+#define TRANSFER_DONE_SIZE          13
+
+#define TRANSFER_CHUNK_SIZE         (64 * 1024)
+#define TRANSFER_CREDIT             8           // fetches in flight per transfer
+#define TRANSFER_FETCH_TIMEOUT_MS   2000
+#define TRANSFER_IDLE_MS            (60 * 1000) // an offer nobody fetches from is dropped
+#define TRANSFER_DIRECTORY          "downloads"
+#define TRANSFER_MAX_SIZE           (4ULL * 1024 * 1024 * 1024)
+#define TRANSFER_INCOMING_MAX       4
+#define TRANSFER_OFFERS_MAX         16
+#define TRANSFER_DISK_RESERVE       (256ULL * 1024 * 1024)    // left free on the disk after a transfer
+
+// status of a done frame
+#define TRANSFER_STATUS_COMPLETE    0
+#define TRANSFER_STATUS_FAILED      1
+#define TRANSFER_STATUS_DECLINED    2
+
+// why an offer can't be accepted
+typedef enum {
+    TRANSFER_ACCEPTED,
+    TRANSFER_TOO_MANY,          // TRANSFER_INCOMING_MAX already coming in
+    TRANSFER_NO_SPACE,
+    TRANSFER_UNWRITABLE,
+} TransferRefusal;
+
+typedef struct {
+    uint64_t id;
+    char *peer;
+    char *path;
+    int fd;
+    uint64_t size;
+    uint64_t sent;              // bytes sent, retransmits included
+    int64_t last_heard;         // zclock_mono() of the offer or the last fetch
+} TransferOut;
+
+typedef struct {
+    uint64_t offset;
+    int64_t deadline;           // zclock_mono() after which it's fetched again
+} TransferFetch;
+
+// an offer waiting for the user
+typedef struct {
+    uint32_t number;            // what /accept and /decline take
+    uint64_t id;
+    char *peer;
+    char *name;
+    uint64_t size;
+    int64_t offered;            // zclock_mono()
+} TransferOffer;
+
+typedef struct {
+    uint64_t id;
+    char *peer;
+    char *path;
+    int fd;
+    uint64_t size;
+    uint64_t next_offset;       // first byte not fetched yet
+    uint64_t received;
+    TransferFetch fetches[TRANSFER_CREDIT];
+    size_t fetch_count;
+    int64_t started;            // zclock_mono()
+    int64_t last_progress;      // zclock_mono() of the last chunk written
+    bool failed;                // a chunk couldn't be written or none came, the transfer is given up
+} TransferIn;
+
+typedef struct {
+    zhash_t *outgoing;          // id -> TransferOut
+    zhash_t *incoming;          // peer/id -> TransferIn
+    zlist_t *offers;            // TransferOffers waiting for the user, oldest first
+    uint8_t *chunk;             // TRANSFER_CHUNK_SIZE, what a fetch is read into
+    uint64_t next_id;
+    uint32_t next_offer;
+} Transfers;
+
+static inline void transfer_out_free(void *data)
+{
+    TransferOut *transfer = (TransferOut *)data;
+    if (transfer->fd != -1) close(transfer->fd);
+    free(transfer->peer);
+    free(transfer->path);
+    free(transfer);
+}
+
+static inline void transfer_in_free(void *data)
+{
+    TransferIn *transfer = (TransferIn *)data;
+    if (transfer->fd != -1) close(transfer->fd);
+    free(transfer->peer);
+    free(transfer->path);
+    free(transfer);
+}
+
+static inline void transfer_offer_free(TransferOffer *offer)
+{
+    if (!offer) return;
+    free(offer->peer);
+    free(offer->name);
+    free(offer);
+}
+
+static inline void transfers_destroy(Transfers **self_p)
+{
+    Transfers *self = *self_p;
+    if (!self) return;
+    zhash_destroy(&self->outgoing);
+    zhash_destroy(&self->incoming);
+    while (self->offers && zlist_size(self->offers) > 0) transfer_offer_free((TransferOffer *)zlist_pop(self->offers));
+    zlist_destroy(&self->offers);
+    free(self->chunk);
+    free(self);
+    *self_p = NULL;
+}
+
+static inline Transfers *transfers_new(uint64_t first_id)
+{
+    Transfers *self = calloc(1, sizeof(Transfers));
+    if (!self) return NULL;
+    self->outgoing = zhash_new();
+    self->incoming = zhash_new();
+    self->offers = zlist_new();
+    self->chunk = malloc(TRANSFER_CHUNK_SIZE);
+    self->next_id = first_id;
+    self->next_offer = 1;
+    if (!self->outgoing || !self->incoming || !self->offers || !self->chunk) {
+        transfers_destroy(&self);
+        return NULL;
+    }
+    return self;
+}
+
+static inline zframe_t *transfer_header(char type, uint64_t id, uint64_t value)
+{
+    return history_pair_header(type, id, value);
+}
+
+static inline zframe_t *transfer_fetch_header(uint64_t id, uint64_t offset, uint32_t length)
+{
+    uint8_t header[TRANSFER_FETCH_SIZE];
+    header[0] = TRANSFER_FETCH;
+    delivery_put_u64(header + 1, id);
+    delivery_put_u64(header + 9, offset);
+    delivery_put_u32(header + 17, length);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline zframe_t *transfer_done_header(uint64_t id, uint32_t status)
+{
+    uint8_t header[TRANSFER_DONE_SIZE];
+    header[0] = TRANSFER_DONE;
+    delivery_put_u64(header + 1, id);
+    delivery_put_u32(header + 9, status);
+    return zframe_new(header, sizeof(header));
+}
+
+static inline bool transfer_is_header(zframe_t *header)
+{
+    char type = delivery_header_type(header);
+    return type == TRANSFER_OFFER || type == TRANSFER_FETCH || type == TRANSFER_CHUNK || type == TRANSFER_DONE;
+}
+
+static inline char *transfer_in_key(const char *peer, uint64_t id)
+{
+    return zsys_sprintf("%s/%llu", peer, (unsigned long long)id);
+}
+
+// opens path for sending to peer, returns NULL when it can't be read
+static inline TransferOut *transfer_offer(Transfers *self, const char *peer, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    TransferOut *transfer = calloc(1, sizeof(TransferOut));
+    if (!transfer) {
+        close(fd);
+        return NULL;
+    }
+    transfer->fd = fd;
+    transfer->size = (uint64_t)st.st_size;
+    // read in order, once
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    transfer->id = self->next_id++;
+    transfer->peer = strdup(peer);
+    transfer->path = strdup(path);
+    transfer->last_heard = zclock_mono();
+    if (!transfer->peer || !transfer->path) {
+        transfer_out_free(transfer);
+        return NULL;
+    }
+
+    char key[24];
+    snprintf(key, sizeof(key), "%llu", (unsigned long long)transfer->id);
+    zhash_insert(self->outgoing, key, transfer);
+    zhash_freefn(self->outgoing, key, transfer_out_free);
+    return transfer;
+}
+
+// the slice of an outgoing transfer a fetch from peer asks for, read into the
+// chunk buffer, NULL when it isn't one of ours or asks for too much. *data is
+// NULL when the file doesn't have those bytes any more
+static inline TransferOut *transfer_fetched(Transfers *self, const char *peer, zframe_t *header,
+                                            const uint8_t **data, size_t *length, uint64_t *offset)
+{
+    if (zframe_size(header) != TRANSFER_FETCH_SIZE) return NULL;
+    const uint8_t *bytes = zframe_data(header);
+    char key[24];
+    snprintf(key, sizeof(key), "%llu", (unsigned long long)delivery_get_u64(bytes + 1));
+    TransferOut *transfer = (TransferOut *)zhash_lookup(self->outgoing, key);
+    if (!transfer || strcmp(transfer->peer, peer) != 0) return NULL;
+
+    *offset = delivery_get_u64(bytes + 9);
+    uint32_t wanted = delivery_get_u32(bytes + 17);
+    if (*offset > transfer->size || wanted > TRANSFER_CHUNK_SIZE) return NULL;
+    *length = transfer->size - *offset < wanted ? transfer->size - *offset : wanted;
+    ssize_t got = *length > 0 ? pread(transfer->fd, self->chunk, *length, (off_t)*offset) : 0;
+    *data = got == (ssize_t)*length ? self->chunk : NULL;
+    transfer->last_heard = zclock_mono();
+    transfer->sent += *length;
+    return transfer;
+}
+
+// an offer from peer, kept until the user decides. NULL when it's malformed,
+// a repeat, or there are TRANSFER_OFFERS_MAX waiting already
+static inline TransferOffer *transfer_offered(Transfers *self, const char *peer, zframe_t *header, const char *name)
+{
+    if (zframe_size(header) != TRANSFER_OFFER_SIZE || zlist_size(self->offers) >= TRANSFER_OFFERS_MAX) return NULL;
+    uint64_t id = delivery_get_u64(zframe_data(header) + 1);
+    for (TransferOffer *offer = (TransferOffer *)zlist_first(self->offers);
+         offer; offer = (TransferOffer *)zlist_next(self->offers)) {
+        if (offer->id == id && strcmp(offer->peer, peer) == 0) return NULL;
+    }
+
+    TransferOffer *offer = calloc(1, sizeof(TransferOffer));
+    if (!offer) return NULL;
+    offer->number = self->next_offer++;
+    offer->id = id;
+    offer->size = delivery_get_u64(zframe_data(header) + 9);
+    offer->peer = strdup(peer);
+    offer->name = strdup(name);
+    offer->offered = zclock_mono();
+    if (!offer->peer || !offer->name || zlist_append(self->offers, offer) != 0) {
+        transfer_offer_free(offer);
+        return NULL;
+    }
+    return offer;
+}
+
+// takes the offer the user gave the number of off the waiting ones, NULL when there isn't one
+static inline TransferOffer *transfer_take_offer(Transfers *self, uint32_t number)
+{
+    for (TransferOffer *offer = (TransferOffer *)zlist_first(self->offers);
+         offer; offer = (TransferOffer *)zlist_next(self->offers)) {
+        if (offer->number != number) continue;
+        zlist_remove(self->offers, offer);
+        return offer;
+    }
+    return NULL;
+}
+
+// whether the disk TRANSFER_DIRECTORY is on has room for size more bytes on top
+// of what the transfers coming in still need, and TRANSFER_DISK_RESERVE after
+static inline bool transfer_room_for(Transfers *self, uint64_t size)
+{
+    struct statvfs fs;
+    if (statvfs(TRANSFER_DIRECTORY, &fs) == -1) return false;
+    uint64_t needed = size + TRANSFER_DISK_RESERVE;
+    for (TransferIn *transfer = (TransferIn *)zhash_first(self->incoming);
+         transfer; transfer = (TransferIn *)zhash_next(self->incoming)) {
+        needed += transfer->size - transfer->received;
+    }
+    return (uint64_t)fs.f_bavail * fs.f_frsize >= needed;
+}
+
+// the file an accepted offer will be written to, in TRANSFER_DIRECTORY. the name is
+// cut down to its last component and never replaces an existing file. the offer
+// is the caller's either way
+static inline TransferIn *transfer_accept(Transfers *self, const TransferOffer *offer, TransferRefusal *refusal)
+{
+    const char *peer = offer->peer;
+    uint64_t id = offer->id;
+    uint64_t size = offer->size;
+    const char *name = offer->name;
+    *refusal = TRANSFER_UNWRITABLE;
+    if (size > TRANSFER_MAX_SIZE) return NULL;
+    if (zhash_size(self->incoming) >= TRANSFER_INCOMING_MAX) {
+        *refusal = TRANSFER_TOO_MANY;
+        return NULL;
+    }
+
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) base = "file";
+    if (mkdir(TRANSFER_DIRECTORY, 0700) == -1 && errno != EEXIST) return NULL;
+    if (!transfer_room_for(self, size)) {
+        *refusal = TRANSFER_NO_SPACE;
+        return NULL;
+    }
+
+    TransferIn *transfer = calloc(1, sizeof(TransferIn));
+    if (!transfer) return NULL;
+    transfer->fd = -1;
+    for (int attempt = 0; attempt < 100 && transfer->fd == -1; attempt++) {
+        free(transfer->path);
+        transfer->path = attempt == 0 ? zsys_sprintf("%s/%s", TRANSFER_DIRECTORY, base)
+                                      : zsys_sprintf("%s/%s.%d", TRANSFER_DIRECTORY, base, attempt);
+        if (!transfer->path) break;
+        transfer->fd = open(transfer->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (transfer->fd == -1 && errno != EEXIST) break;
+    }
+    transfer->id = id;
+    transfer->peer = strdup(peer);
+    transfer->size = size;
+    transfer->started = zclock_mono();
+    transfer->last_progress = transfer->started;
+    if (transfer->fd == -1 || !transfer->peer) {
+        transfer_in_free(transfer);
+        return NULL;
+    }
+
+    char *key = transfer_in_key(peer, id);
+    if (!key || zhash_insert(self->incoming, key, transfer) != 0) {
+        // offered twice
+        if (transfer->path) remove(transfer->path);
+        transfer_in_free(transfer);
+        zstr_free(&key);
+        return NULL;
+    }
+    zhash_freefn(self->incoming, key, transfer_in_free);
+    zstr_free(&key);
+    *refusal = TRANSFER_ACCEPTED;
+    return transfer;
+}
+
+static inline TransferIn *transfer_incoming(Transfers *self, const char *peer, zframe_t *header)
+{
+    if (zframe_size(header) < 9) return NULL;
+    char *key = transfer_in_key(peer, delivery_get_u64(zframe_data(header) + 1));
+    TransferIn *transfer = key ? (TransferIn *)zhash_lookup(self->incoming, key) : NULL;
+    zstr_free(&key);
+    return transfer;
+}
+
+static inline uint32_t transfer_chunk_length(const TransferIn *transfer, uint64_t offset)
+{
+    uint64_t left = transfer->size - offset;
+    return left < TRANSFER_CHUNK_SIZE ? (uint32_t)left : TRANSFER_CHUNK_SIZE;
+}
+
+// fetches what the credit allows: the ones that timed out again, then new ones
+static inline void transfer_fetch(TransferIn *transfer, DeliverySend send, void *context)
+{
+    int64_t now = zclock_mono();
+    for (size_t i = 0; i < transfer->fetch_count; i++) {
+        TransferFetch *fetch = &transfer->fetches[i];
+        if (fetch->deadline > now) continue;
+        zframe_t *header = transfer_fetch_header(transfer->id, fetch->offset, transfer_chunk_length(transfer, fetch->offset));
+        if (send(context, transfer->peer, NULL, header)) fetch->deadline = now + TRANSFER_FETCH_TIMEOUT_MS;
+    }
+    while (transfer->fetch_count < TRANSFER_CREDIT && transfer->next_offset < transfer->size) {
+        uint64_t offset = transfer->next_offset;
+        zframe_t *header = transfer_fetch_header(transfer->id, offset, transfer_chunk_length(transfer, offset));
+        if (!send(context, transfer->peer, NULL, header)) break;
+        transfer->fetches[transfer->fetch_count++] = (TransferFetch){ offset, now + TRANSFER_FETCH_TIMEOUT_MS };
+        transfer->next_offset += transfer_chunk_length(transfer, offset);
+    }
+}
+
+// writes a chunk that was fetched, false for one that wasn't (or a repeat) and
+// when writing it failed
+static inline bool transfer_write(TransferIn *transfer, zframe_t *header, const uint8_t *data, size_t length)
+{
+    if (zframe_size(header) != TRANSFER_CHUNK_HEADER_SIZE) return false;
+    uint64_t offset = delivery_get_u64(zframe_data(header) + 9);
+    for (size_t i = 0; i < transfer->fetch_count; i++) {
+        if (transfer->fetches[i].offset != offset) continue;
+        if (length != transfer_chunk_length(transfer, offset)) return false;
+        if (pwrite(transfer->fd, data, length, (off_t)offset) != (ssize_t)length) {
+            transfer->failed = true;
+            return false;
+        }
+        transfer->fetches[i] = transfer->fetches[--transfer->fetch_count];
+        transfer->received += length;
+        transfer->last_progress = zclock_mono();
+        return true;
+    }
+    return false;
+}
+
+static inline bool transfer_complete(const TransferIn *transfer)
+{
+    return transfer->received == transfer->size;
+}
+
+static inline void transfer_finish(Transfers *self, TransferIn *transfer)
+{
+    char *key = transfer_in_key(transfer->peer, transfer->id);
+    if (key) zhash_delete(self->incoming, key);
+    zstr_free(&key);
+}
+
+// a done frame from peer, the sender's side of it can go
+static inline TransferOut *transfer_done(Transfers *self, const char *peer, zframe_t *header)
+{
+    if (zframe_size(header) != TRANSFER_DONE_SIZE) return NULL;
+    char key[24];
+    snprintf(key, sizeof(key), "%llu", (unsigned long long)delivery_get_u64(zframe_data(header) + 1));
+    TransferOut *transfer = (TransferOut *)zhash_lookup(self->outgoing, key);
+    return transfer && strcmp(transfer->peer, peer) == 0 ? transfer : NULL;
+}
+
+static inline void transfer_forget(Transfers *self, TransferOut *transfer)
+{
+    char key[24];
+    snprintf(key, sizeof(key), "%llu", (unsigned long long)transfer->id);
+    zhash_delete(self->outgoing, key);
+}
+
+// an incoming transfer that was given up on, for the caller to finish
+static inline TransferIn *transfers_failed(Transfers *self)
+{
+    for (TransferIn *transfer = (TransferIn *)zhash_first(self->incoming);
+         transfer; transfer = (TransferIn *)zhash_next(self->incoming)) {
+        if (transfer->failed) return transfer;
+    }
+    return NULL;
+}
+
+// fetches that timed out on every incoming transfer, transfers and offers nothing
+// happened to for too long
+static inline void transfers_tick(Transfers *self, DeliverySend send, void *context)
+{
+    int64_t now = zclock_mono();
+    for (TransferIn *transfer = (TransferIn *)zhash_first(self->incoming);
+         transfer; transfer = (TransferIn *)zhash_next(self->incoming)) {
+        // the sender went away, or its file changed under it
+        if (now - transfer->last_progress > TRANSFER_IDLE_MS) transfer->failed = true;
+        if (!transfer->failed) transfer_fetch(transfer, send, context);
+    }
+
+    // the sender has forgotten these by now
+    TransferOffer *offer = (TransferOffer *)zlist_first(self->offers);
+    while (offer && now - offer->offered > TRANSFER_IDLE_MS) {
+        zlist_remove(self->offers, offer);
+        transfer_offer_free(offer);
+        offer = (TransferOffer *)zlist_first(self->offers);
+    }
+
+    zlist_t *idle = zlist_new();
+    for (TransferOut *transfer = (TransferOut *)zhash_first(self->outgoing);
+         idle && transfer; transfer = (TransferOut *)zhash_next(self->outgoing)) {
+        if (now - transfer->last_heard > TRANSFER_IDLE_MS) zlist_append(idle, transfer);
+    }
+    for (TransferOut *transfer = idle ? (TransferOut *)zlist_pop(idle) : NULL;
+         transfer; transfer = (TransferOut *)zlist_pop(idle)) {
+        printf("%s never finished fetching %s\n", transfer->peer, transfer->path);
+        transfer_forget(self, transfer);
+    }
+    zlist_destroy(&idle);
+}
+
+#endif // TRANSFER_H_
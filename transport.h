@@ -0,0 +1,86 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <czmq.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// picking a transport
+//
+// the router binds a comma separated list of endpoints, by default tcp for
+// everyone and ipc for dealers on the same machine. a dealer names the ways it
+// can reach one router with | between them,
+//
+//     ipc://router.sock|tcp://localhost:5555
+//
+// and connects with the fastest one that's there: inproc (a router embedded in
+// the same process, see router.h), then ipc when its socket file exists, then
+// tcp. ipc skips the loopback TCP stack, inproc skips the kernel altogether.
+// libzmq unlinks whatever is at an ipc path before it binds there, so a socket
+// file mustn't share a name with anything in the directory: ipc://router would
+// delete the router binary.
+// only one of the alternatives is connected, the router takes a single
+// connection per identity.
+
+typedef enum {
+    TRANSPORT_INPROC,
+    TRANSPORT_IPC,
+    TRANSPORT_TCP,
+    TRANSPORT_OTHER
+} Transport;
+
+static inline Transport transport_of(const char *endpoint)
+{
+    if (strncmp(endpoint, "inproc://", 9) == 0) return TRANSPORT_INPROC;
+    if (strncmp(endpoint, "ipc://", 6) == 0) return TRANSPORT_IPC;
+    if (strncmp(endpoint, "tcp://", 6) == 0) return TRANSPORT_TCP;
+    return TRANSPORT_OTHER;
+}
+
+// whether connecting to endpoint can reach anything. an ipc endpoint has to take
+// a connection right now, a router that crashed leaves its socket file behind
+// (abstract @names are tried the same way). a tcp one is only known once the
+// connection is up
+static inline bool transport_available(const char *endpoint)
+{
+    if (transport_of(endpoint) != TRANSPORT_IPC) return true;
+    const char *path = endpoint + 6;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, path, length);
+    if (path[0] == '@') address.sun_path[0] = '\0';
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return false;
+    bool reachable = connect(fd, (struct sockaddr *)&address,
+                             (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length)) == 0;
+    close(fd);
+    return reachable;
+}
+
+// the fastest of the | separated alternatives that's available, or the last one
+// when none looks like it is. a fresh string, NULL when out of memory
+static inline char *transport_choose(const char *alternatives)
+{
+    char *copy = strdup(alternatives);
+    if (!copy) return NULL;
+
+    const char *best = NULL;
+    const char *last = NULL;
+    char *saveptr = NULL;
+    for (char *next = strtok_r(copy, "|", &saveptr); next; next = strtok_r(NULL, "|", &saveptr)) {
+        last = next;
+        if (!transport_available(next)) continue;
+        if (!best || transport_of(next) < transport_of(best)) best = next;
+    }
+    char *chosen = strdup(best ? best : last ? last : "");
+    free(copy);
+    return chosen;
+}
+
+#endif // TRANSPORT_H_
@@ -0,0 +1,219 @@
+#ifndef ZAP_H_
+#define ZAP_H_
+
+#include <czmq.h>
+#include <stdbool.h>
+
+#include "authindex.h"
+#include "metrics.h"
+#include "cluster.h"
+#include "affinity.h"
+
+// ZAP handler (RFC 27) backed by the auth index
+//
+// libzmq asks inproc://zeromq.zap.01 whether a CURVE client may connect. zauth
+// answers those one at a time from a single actor and checks a directory backed
+// store, so a reconnect storm after a restart queues up behind it. here a ROUTER
+// takes the requests and a DEALER spreads them over a pool of REP workers (the
+// zguide multithreaded server), and every worker checks the client key against
+// the lock-free auth index.
+
+#define ZAP_ENDPOINT         "inproc://zeromq.zap.01"
+#define ZAP_WORKERS_ENDPOINT "inproc://zap-workers"
+#define ZAP_MAX_WORKERS      8
+
+typedef struct ZapHandler ZapHandler;
+
+typedef struct {
+    ZapHandler *handler;
+    zactor_t *actor;
+    AuthReader *reader;         // slots are kept for reuse when the pool shrinks and grows
+    Metrics *metrics;
+} ZapWorker;
+
+struct ZapHandler {
+    AuthDomain *domain;
+    uint8_t cluster_key[AUTH_KEY_SIZE]; // the only key allowed on cluster bridges
+    bool cluster_enabled;               // set before the cluster socket binds
+    zactor_t *proxy;
+    ZapWorker workers[ZAP_MAX_WORKERS];
+    size_t worker_count;
+    CpuSet cpus;                        // workers run on these, 0 for anywhere
+};
+
+// [version][request id][domain][address][identity][mechanism][credentials...]
+// -> [version][request id][status code][status text][user id][metadata]
+static inline zmsg_t *zap_handle_request(ZapWorker *worker, zmsg_t *request)
+{
+    char *version = zmsg_popstr(request);
+    zframe_t *request_id = zmsg_pop(request);
+    char *domain = zmsg_popstr(request);
+    char *address = zmsg_popstr(request);
+    char *identity = zmsg_popstr(request);
+    char *mechanism = zmsg_popstr(request);
+    zframe_t *credentials = zmsg_pop(request);
+
+    const char *status = "400";
+    const char *text = "Malformed request";
+    char user_id[AUTH_NAME_SIZE] = "";
+
+    if (version && streq(version, "1.0") && request_id && mechanism) {
+        if (streq(mechanism, "CURVE") && domain && streq(domain, CLUSTER_ZAP_DOMAIN)) {
+            // other routers of the cluster, never users
+            text = "Not a cluster node";
+            ZapHandler *handler = worker->handler;
+            if (handler->cluster_enabled && credentials && zframe_size(credentials) == AUTH_KEY_SIZE &&
+                memcmp(zframe_data(credentials), handler->cluster_key, AUTH_KEY_SIZE) == 0) {
+                status = "200";
+                text = "OK";
+                snprintf(user_id, sizeof(user_id), "cluster");
+            }
+        } else if (streq(mechanism, "CURVE")) {
+            text = "Unknown key";
+            if (credentials && zframe_size(credentials) == AUTH_KEY_SIZE) {
+                const AuthIndex *index = auth_read_begin(worker->handler->domain, worker->reader);
+                const char *name = index ? auth_index_lookup(index, zframe_data(credentials)) : NULL;
+                if (name) {
+                    status = "200";
+                    text = "OK";
+                    snprintf(user_id, sizeof(user_id), "%s", name);
+                }
+                auth_read_end(worker->reader);
+            }
+        } else if (streq(mechanism, "NULL")) {
+            // local sockets without security (admin, stats) are not our business
+            status = "200";
+            text = "OK";
+        } else {
+            text = "Mechanism not supported";
+        }
+    }
+
+    if (!streq(status, "200")) {
+        metrics_count(thread_metrics, COUNTER_AUTH_FAILURES, 1);
+    }
+
+    zmsg_t *reply = zmsg_new();
+    zmsg_addstr(reply, "1.0");
+    if (request_id) {
+        zmsg_append(reply, &request_id);
+    } else {
+        zmsg_addstr(reply, "");
+    }
+    zmsg_addstr(reply, status);
+    zmsg_addstr(reply, text);
+    zmsg_addstr(reply, user_id);
+    zmsg_addmem(reply, NULL, 0);
+
+    zstr_free(&version);
+    zstr_free(&domain);
+    zstr_free(&address);
+    zstr_free(&identity);
+    zstr_free(&mechanism);
+    zframe_destroy(&credentials);
+    return reply;
+}
+
+static inline void zap_worker(zsock_t *pipe, void *args)
+{
+    ZapWorker *worker = (ZapWorker *)args;
+
+    // the slot belongs to whichever worker holds this position in the pool
+    if (!worker->metrics) {
+        worker->metrics = metrics_register("zap");
+    }
+    thread_metrics = worker->metrics;
+    cpu_set_pin_thread(worker->handler->cpus);
+
+    zsock_t *rep = zsock_new(ZMQ_REP);
+    if (!rep || zsock_connect(rep, ZAP_WORKERS_ENDPOINT) == -1) {
+        zsock_destroy(&rep);
+        zsock_signal(pipe, 1);
+        return;
+    }
+    zsock_signal(pipe, 0);
+
+    zpoller_t *poller = zpoller_new(pipe, rep, NULL);
+    while (true) {
+        void *which = zpoller_wait(poller, -1);
+        if (!which || which == pipe) break;
+
+        zmsg_t *request = zmsg_recv(rep);
+        if (!request) break;
+        zmsg_t *reply = zap_handle_request(worker, request);
+        zmsg_destroy(&request);
+        if (zmsg_send(&reply, rep) != 0) zmsg_destroy(&reply);
+    }
+    zpoller_destroy(&poller);
+    zsock_destroy(&rep);
+}
+
+// grows or shrinks the pool, returns the number of workers actually running
+static inline size_t zap_set_workers(ZapHandler *self, size_t count)
+{
+    if (count < 1) count = 1;
+    if (count > ZAP_MAX_WORKERS) count = ZAP_MAX_WORKERS;
+
+    while (self->worker_count > count) {
+        ZapWorker *worker = &self->workers[--self->worker_count];
+        zactor_destroy(&worker->actor);
+    }
+
+    while (self->worker_count < count) {
+        ZapWorker *worker = &self->workers[self->worker_count];
+        worker->handler = self;
+        if (!worker->reader) worker->reader = auth_reader_register(self->domain);
+        if (!worker->reader) break;
+        worker->actor = zactor_new(zap_worker, worker);
+        if (!worker->actor) break;
+        self->worker_count++;
+    }
+    return self->worker_count;
+}
+
+static inline void zap_allow_cluster(ZapHandler *self, const uint8_t *key)
+{
+    memcpy(self->cluster_key, key, AUTH_KEY_SIZE);
+    self->cluster_enabled = true;
+}
+
+// has to exist before any CURVE socket binds, libzmq only looks for the handler then
+static inline ZapHandler *zap_handler_new(AuthDomain *domain, size_t workers, CpuSet cpus)
+{
+    ZapHandler *self = calloc(1, sizeof(ZapHandler));
+    if (!self) return NULL;
+    self->domain = domain;
+    self->cpus = cpus;
+
+    self->proxy = zactor_new(zproxy, NULL);
+    if (!self->proxy) {
+        free(self);
+        return NULL;
+    }
+    zstr_sendx(self->proxy, "FRONTEND", "ROUTER", ZAP_ENDPOINT, NULL);
+    zsock_wait(self->proxy);
+    zstr_sendx(self->proxy, "BACKEND", "DEALER", ZAP_WORKERS_ENDPOINT, NULL);
+    zsock_wait(self->proxy);
+
+    if (zap_set_workers(self, workers) == 0) {
+        zactor_destroy(&self->proxy);
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+static inline void zap_handler_destroy(ZapHandler **self_p)
+{
+    ZapHandler *self = *self_p;
+    if (!self) return;
+
+    while (self->worker_count > 0) {
+        zactor_destroy(&self->workers[--self->worker_count].actor);
+    }
+    zactor_destroy(&self->proxy);
+    free(self);
+    *self_p = NULL;
+}
+
+#endif // ZAP_H_